@@ -0,0 +1,121 @@
+// decode every file of a directory with jpeg_decode_batch(), on all CPUs by default, and report the failures and the
+// throughput. files are read and decoded in groups, so that memory does not grow with the size of the directory
+#include "jpeg_decode.h"
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GROUP_SIZE 256
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static uint8_t *read_file(const char *filename, size_t *size) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long n_bytes = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *data = n_bytes > 0 ? malloc(n_bytes) : NULL;
+  *size = data != NULL ? fread(data, 1, n_bytes, f) : 0;
+  fclose(f);
+  return data;
+}
+
+int main(int argc, char *argv[]) {
+  int n_threads = 0, scale = 1, n_reps = 1, usage = argc == 1;
+  const char *dir_name = NULL;
+  for (int i = 1; i < argc && !usage; i++) {
+    const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (value != NULL && strcmp(arg, "--threads") == 0)
+      n_threads = atoi(value);
+    else if (value != NULL && strcmp(arg, "--scale") == 0)
+      scale = atoi(value);
+    else if (value != NULL && strcmp(arg, "--reps") == 0)
+      n_reps = atoi(value) > 1 ? atoi(value) : 1;
+    else if (dir_name == NULL && arg[0] != '-') {
+      dir_name = arg;
+      continue;
+    } else
+      usage = 1;
+    i++;
+  }
+  if (usage || dir_name == NULL || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) {
+    fprintf(stderr,
+            "Usage: %s dir [--threads N] [--scale 1|2|4|8] [--reps N]\n"
+            "\n"
+            "Decodes every file in dir, in groups of %d, with a pool of --threads threads (default: all CPUs).\n"
+            "Each group is decoded --reps times (default 1). Only decoding is timed, not reading the files.\n",
+            argv[0], GROUP_SIZE);
+    return 1;
+  }
+
+  DIR *dir = opendir(dir_name);
+  JpegDecoderPool *pool = jpeg_decoder_pool_create(n_threads);
+  if (dir == NULL || pool == NULL) {
+    fprintf(stderr, "Failed to open %s\n", dir_name);
+    return 1;
+  }
+  for (int i = 0; i < jpeg_decoder_pool_num_threads(pool); i++)
+    jpeg_decoder_set_scale(jpeg_decoder_pool_get_decoder(pool, i), scale);
+
+  static JpegBatchItem items[GROUP_SIZE];
+  static char filenames[GROUP_SIZE][1024];
+  long n_images = 0, n_failed = 0;
+  double n_pixels = 0, total_ms = 0;
+  for (bool done = false; !done;) {
+    // read the next group
+    int n_items = 0;
+    struct dirent *entry;
+    while (n_items < GROUP_SIZE && (entry = readdir(dir)) != NULL) {
+      JpegBatchItem *item = &items[n_items];
+      snprintf(filenames[n_items], sizeof(filenames[n_items]), "%s/%s", dir_name, entry->d_name);
+      memset(item, 0, sizeof(*item));
+      if (entry->d_name[0] == '.' || (item->data = read_file(filenames[n_items], &item->size)) == NULL)
+        continue;
+      JpegInfo info;
+      if (jpeg_probe(item->data, item->size, &info) == JPEG_OK) {
+        size_t n_bytes = jpeg_probe_output(&info, scale, &item->output);
+        item->output.planes[0] = malloc(n_bytes);
+        if (item->output.planes[0] == NULL)
+          item->output.sizes[0] = 0;
+      }
+      n_items++;
+    }
+    done = n_items < GROUP_SIZE;
+
+    for (int rep = 0; rep < n_reps; rep++) {
+      double start_ms = now_ms();
+      jpeg_decode_batch(pool, items, n_items);
+      total_ms += now_ms() - start_ms;
+    }
+
+    for (int i = 0; i < n_items; i++) {
+      JpegBatchItem *item = &items[i];
+      if (item->status == JPEG_OK)
+        n_pixels += (double)item->output.widths[0] * item->output.heights[0] * n_reps;
+      else {
+        printf("%s: %s\n", filenames[i], item->error_message);
+        n_failed++;
+      }
+      free((void *)item->data);
+      free(item->output.planes[0]);
+    }
+    n_images += n_items;
+  }
+
+  printf("%ld images, %ld failed, %d threads, %.1f ms, %.1f images/s, %.1f MP/s\n", n_images, n_failed,
+         jpeg_decoder_pool_num_threads(pool), total_ms, n_images * n_reps / total_ms * 1e3,
+         n_pixels / total_ms * 1e-3);
+  closedir(dir);
+  jpeg_decoder_pool_destroy(pool);
+  return n_failed != 0;
+}
@@ -0,0 +1,348 @@
+// decode speed benchmark. the corpus is synthesized and encoded in memory, so it runs offline and is the same on every
+// machine: gray, 4:4:4, 4:2:2 and 4:2:0, with and without restart markers, at several sizes and quality levels
+#include "jpeg_decode.h"
+#include "jpeg_encode.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE 8
+#define CDIV(x, y) (((x) + (y)-1) / (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)
+
+static double now_ms() {
+  struct timespec ts;
+#ifdef _WIN32
+  timespec_get(&ts, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+// a photo-like test image: smooth gradients, a texture that gets stronger to the right and sharp-edged tiles, so that
+// blocks have a realistic mix of sparse and dense coefficients
+static uint8_t *synthesize_image(int width, int height, int n_channels) {
+  uint8_t *image = malloc((size_t)width * height * n_channels);
+  uint32_t state = 12345;
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      float u = (float)x / width, v = (float)y / height;
+      float rgb[3] = {
+          40 + 150 * u + 30 * sinf(v * 9 + u * 4),
+          60 + 120 * v + 25 * sinf(u * 13),
+          180 - 100 * u * v + 20 * sinf((u + v) * 20),
+      };
+      if ((x / 97 + y / 61) % 5 == 0)
+        for (int c = 0; c < 3; c++)
+          rgb[c] = 255 - rgb[c] * 0.5f;
+
+      state = state * 1664525 + 1013904223; // LCG
+      float noise = ((int)(state >> 24) - 128) * u * 0.4f;
+
+      uint8_t *pixel = image + ((size_t)y * width + x) * n_channels;
+      if (n_channels == 1)
+        pixel[0] = CLAMP(0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2] + noise, 0, 255);
+      else
+        for (int c = 0; c < 3; c++)
+          pixel[c] = CLAMP(rgb[c] + noise, 0, 255);
+    }
+  return image;
+}
+
+typedef struct Case {
+  char name[64];
+  uint8_t *data;
+  size_t size;
+  int width, height, n_channels;
+  long n_mcus;
+  double median_ms, p99_ms;
+  double stage_ns[5]; // per MCU, with --stages. see STAGES
+} Case;
+
+static const char *STAGES[5] = {"huffman", "idct", "upsample", "color", "output"};
+// names of JpegPixelFormat values for --format
+static const char *FORMATS[] = {"native", "rgb", "bgr", "rgba", "bgra", "gray", "planar"};
+
+static int parse_format(const char *name) {
+  for (int i = 0; i < (int)(sizeof(FORMATS) / sizeof(FORMATS[0])); i++)
+    if (strcmp(name, FORMATS[i]) == 0)
+      return i;
+  return -1;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// median of the baseline case with this name, or -1
+static double find_baseline(const char *json, const char *name) {
+  char key[80];
+  snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+  const char *p = strstr(json, key);
+  if (p == NULL || (p = strstr(p, "\"median_ms\":")) == NULL)
+    return -1;
+  return strtod(p + strlen("\"median_ms\":"), NULL);
+}
+
+static char *read_file(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  data[fread(data, 1, size, f)] = 0;
+  fclose(f);
+  return data;
+}
+
+int main(int argc, char *argv[]) {
+  int min_reps = 10, n_threads = 1, stages = 0, coefs = 0, speculative = 0, format = JPEG_PIXEL_NATIVE;
+  double min_time_ms = 200, threshold = 5;
+  const char *filter = NULL, *json_filename = NULL, *baseline_filename = NULL, *save_dir = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i], *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (value != NULL && strcmp(arg, "--reps") == 0)
+      min_reps = MAX(atoi(value), 1);
+    else if (value != NULL && strcmp(arg, "--time") == 0)
+      min_time_ms = atof(value) * 1e3;
+    else if (value != NULL && strcmp(arg, "--threads") == 0)
+      n_threads = atoi(value);
+    else if (value != NULL && strcmp(arg, "--filter") == 0)
+      filter = value;
+    else if (value != NULL && strcmp(arg, "--json") == 0)
+      json_filename = value;
+    else if (value != NULL && strcmp(arg, "--baseline") == 0)
+      baseline_filename = value;
+    else if (value != NULL && strcmp(arg, "--threshold") == 0)
+      threshold = atof(value);
+    else if (value != NULL && strcmp(arg, "--save") == 0)
+      save_dir = value;
+    else if (value != NULL && strcmp(arg, "--format") == 0 && parse_format(value) >= 0)
+      format = parse_format(value);
+    else if (strcmp(arg, "--stages") == 0) {
+      stages = 1;
+      continue;
+    } else if (strcmp(arg, "--coefs") == 0) {
+      coefs = 1;
+      continue;
+    } else if (strcmp(arg, "--speculative") == 0) {
+      speculative = 1;
+      continue;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--reps N] [--time seconds] [--threads N] [--filter substring] [--json out.json]\n"
+              "          [--baseline in.json] [--threshold percent] [--save corpus_dir] [--stages]\n"
+              "          [--coefs] [--format native|rgb|bgr|rgba|bgra|gray|planar] [--speculative]\n"
+              "\n"
+              "Each case is decoded until it has run at least --reps times (default 10) and --time seconds\n"
+              "(default 0.2), after one warmup decode. With --baseline, cases whose median is more than\n"
+              "--threshold percent (default 5) slower than the baseline are reported, and the exit status is 1.\n"
+              "--stages also reports the ns/MCU of each decode stage, from the decoder's stage timers.\n"
+              "--coefs only decodes to quantized DCT coefficients, with jpeg_decoder_decode_coefficients().\n"
+              "--format decodes to that pixel format with jpeg_decoder_decode_to(). gray skips the chroma IDCT, and\n"
+              "planar skips upsampling and color conversion.\n"
+              "--speculative splits scans without restart markers into chunks that are entropy-decoded in\n"
+              "parallel, see jpeg_decoder_set_speculative(). it needs --threads 2 or more.\n",
+              argv[0]);
+      return 1;
+    }
+    i++;
+  }
+
+  char *baseline = NULL;
+  if (baseline_filename != NULL && (baseline = read_file(baseline_filename)) == NULL) {
+    fprintf(stderr, "Failed to read %s\n", baseline_filename);
+    return 1;
+  }
+
+  static const struct {
+    const char *name;
+    int n_channels, h_sampling, v_sampling;
+    JpegSubsampling subsampling;
+  } layouts[] = {
+      {"gray", 1, 1, 1, JPEG_SUBSAMPLING_444},
+      {"444", 3, 1, 1, JPEG_SUBSAMPLING_444},
+      {"422", 3, 2, 1, JPEG_SUBSAMPLING_422},
+      {"420", 3, 2, 2, JPEG_SUBSAMPLING_420},
+  };
+  static const int sizes[][2] = {{333, 250}, {1280, 720}, {1920, 1080}};
+  static const int qualities[] = {50, 75, 95};
+
+  int max_cases = 4 * 3 * 3 * 2, n_cases = 0;
+  Case *cases = calloc(max_cases, sizeof(Case));
+  uint8_t *images[2][3] = {{NULL}};
+  JpegEncoder *encoder = jpeg_encoder_create();
+  for (size_t l = 0; l < 4; l++)
+    for (size_t s = 0; s < 3; s++)
+      for (size_t q = 0; q < 3; q++)
+        for (int restart = 0; restart < 2; restart++) {
+          Case *c = &cases[n_cases];
+          c->width = sizes[s][0];
+          c->height = sizes[s][1];
+          c->n_channels = layouts[l].n_channels;
+          snprintf(c->name, sizeof(c->name), "%s_q%d%s_%dx%d", layouts[l].name, qualities[q], restart ? "_rst" : "",
+                   c->width, c->height);
+          if (filter != NULL && strstr(c->name, filter) == NULL)
+            continue;
+
+          uint8_t **image = &images[c->n_channels == 3][s];
+          if (*image == NULL)
+            *image = synthesize_image(c->width, c->height, c->n_channels);
+          int mcu_width = BLOCK_SIZE * layouts[l].h_sampling, mcu_height = BLOCK_SIZE * layouts[l].v_sampling;
+          int nx_mcu = CDIV(c->width, mcu_width);
+          c->n_mcus = (long)nx_mcu * CDIV(c->height, mcu_height);
+          // one restart interval per MCU row, a common choice of encoders that write them
+          jpeg_encoder_set_quality(encoder, qualities[q]);
+          jpeg_encoder_set_subsampling(encoder, layouts[l].subsampling);
+          jpeg_encoder_set_restart_interval(encoder, restart ? nx_mcu : 0);
+          if (jpeg_encoder_encode(encoder, *image, c->width, c->height, c->n_channels, &c->data, &c->size) != JPEG_OK) {
+            fprintf(stderr, "Failed to encode %s: %s\n", c->name, jpeg_encoder_error(encoder));
+            return 1;
+          }
+          n_cases++;
+
+          if (save_dir != NULL) {
+            char filename[1024];
+            snprintf(filename, sizeof(filename), "%s/%s.jpg", save_dir, c->name);
+            FILE *f = fopen(filename, "wb");
+            if (f == NULL || fwrite(c->data, 1, c->size, f) != c->size) {
+              fprintf(stderr, "Failed to write %s\n", filename);
+              return 1;
+            }
+            fclose(f);
+          }
+        }
+  for (int i = 0; i < 2; i++)
+    for (int s = 0; s < 3; s++)
+      free(images[i][s]);
+  jpeg_encoder_destroy(encoder);
+
+  JpegDecoder *decoder = jpeg_decoder_create();
+  jpeg_decoder_set_num_threads(decoder, n_threads);
+  jpeg_decoder_set_speculative(decoder, speculative);
+  jpeg_decoder_set_stats_timing(decoder, stages);
+  // room for RGBA, or 3 planes for planar output
+  size_t plane_size = (size_t)1920 * 1080;
+  uint8_t *out = malloc(plane_size * 4);
+  double *times = NULL, log_mpix_sum = 0;
+  int n_regressions = 0;
+
+  printf("%-26s %8s %8s %10s %9s %9s", "case", "KB", "MP/s", "ns/MCU", "median ms", "p99 ms");
+  for (int k = 0; stages && k < 5; k++)
+    printf(" %8s", STAGES[k]);
+  printf("%s\n", baseline ? " vs baseline" : "");
+  for (int i = 0; i < n_cases; i++) {
+    Case *c = &cases[i];
+    int width, height, n_channels, n_reps = 0, capacity = 0;
+    double start = now_ms();
+    for (int rep = -1; rep < min_reps || now_ms() - start < min_time_ms; rep++) {
+      double t0 = now_ms();
+      JpegStatus status;
+      if (coefs) {
+        JpegCoefficients coefficients;
+        status = jpeg_decoder_decode_coefficients(decoder, c->data, c->size, &coefficients);
+        width = coefficients.width;
+        height = coefficients.height;
+        n_channels = coefficients.n_components;
+      } else if (format != JPEG_PIXEL_NATIVE) {
+        JpegOutput output = {format, {out, out + plane_size, out + plane_size * 2}, {0}, {plane_size * 4}};
+        if (format == JPEG_PIXEL_YCBCR_PLANAR)
+          output.sizes[0] = output.sizes[1] = output.sizes[2] = plane_size;
+        status = jpeg_decoder_decode_to(decoder, c->data, c->size, &output);
+        width = output.widths[0];
+        height = output.heights[0];
+        n_channels = c->n_channels;
+      } else
+        status = jpeg_decoder_decode_into(decoder, c->data, c->size, out, plane_size * 3, &width, &height, &n_channels);
+      double t1 = now_ms();
+      if (status != JPEG_OK || width != c->width || height != c->height || n_channels != c->n_channels) {
+        fprintf(stderr, "Failed to decode %s: %s\n", c->name, jpeg_decoder_error(decoder));
+        return 1;
+      }
+      if (rep < 0) { // warmup
+        start = now_ms();
+        continue;
+      }
+      if (n_reps == capacity) {
+        capacity = MAX(capacity * 2, 64);
+        times = realloc(times, capacity * sizeof(double));
+      }
+      times[n_reps++] = t1 - t0;
+
+      JpegStats stats;
+      jpeg_decoder_get_stats(decoder, &stats);
+      uint64_t stage_ns[5] = {stats.huffman_ns, stats.idct_ns, stats.upsample_ns, stats.color_ns, stats.output_ns};
+      for (int k = 0; k < 5; k++)
+        c->stage_ns[k] += (double)stage_ns[k] / c->n_mcus;
+    }
+    for (int k = 0; k < 5; k++)
+      c->stage_ns[k] /= n_reps;
+
+    qsort(times, n_reps, sizeof(double), compare_double);
+    c->median_ms = n_reps % 2 ? times[n_reps / 2] : (times[n_reps / 2 - 1] + times[n_reps / 2]) / 2;
+    c->p99_ms = times[(int)ceil(n_reps * 0.99) - 1];
+    double mpix_per_s = c->width * c->height / (c->median_ms * 1e3);
+    log_mpix_sum += log(mpix_per_s);
+
+    printf("%-26s %8.1f %8.1f %10.1f %9.3f %9.3f", c->name, c->size / 1024.0, mpix_per_s,
+           c->median_ms * 1e6 / c->n_mcus, c->median_ms, c->p99_ms);
+    for (int k = 0; stages && k < 5; k++)
+      printf(" %8.1f", c->stage_ns[k]);
+    if (baseline != NULL) {
+      double baseline_ms = find_baseline(baseline, c->name);
+      if (baseline_ms > 0) {
+        double change = (c->median_ms / baseline_ms - 1) * 100;
+        printf(" %+6.1f%%%s", change, change > threshold ? " REGRESSION" : "");
+        n_regressions += change > threshold;
+      } else
+        printf("    new");
+    }
+    printf("\n");
+  }
+  if (n_cases > 0)
+    printf("geometric mean %.1f MP/s over %d cases\n", exp(log_mpix_sum / n_cases), n_cases);
+  if (baseline != NULL)
+    printf("%d cases more than %.1f%% slower than %s\n", n_regressions, threshold, baseline_filename);
+
+  if (json_filename != NULL) {
+    FILE *f = fopen(json_filename, "w");
+    if (f == NULL) {
+      fprintf(stderr, "Failed to open %s to write\n", json_filename);
+      return 1;
+    }
+    // one case per line, which is what find_baseline() expects
+    fprintf(f, "{\n  \"threads\": %d,\n  \"cases\": [\n", n_threads);
+    for (int i = 0; i < n_cases; i++) {
+      Case *c = &cases[i];
+      fprintf(f,
+              "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"bytes\": %zu, \"mcus\": %ld, \"median_ms\": %.4f, "
+              "\"p99_ms\": %.4f, \"mpix_per_s\": %.2f, \"ns_per_mcu\": %.1f",
+              c->name, c->width, c->height, c->size, c->n_mcus, c->median_ms, c->p99_ms,
+              c->width * c->height / (c->median_ms * 1e3), c->median_ms * 1e6 / c->n_mcus);
+      for (int k = 0; stages && k < 5; k++)
+        fprintf(f, ", \"%s_ns_per_mcu\": %.1f", STAGES[k], c->stage_ns[k]);
+      fprintf(f, "}%s\n", i + 1 < n_cases ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+  }
+
+  for (int i = 0; i < n_cases; i++)
+    free(cases[i].data);
+  free(cases);
+  free(times);
+  free(out);
+  free(baseline);
+  jpeg_decoder_destroy(decoder);
+  return n_regressions > 0;
+}
@@ -0,0 +1,114 @@
+// definitions shared by the decoder and the encoder. internal, not part of the API
+#ifndef JPEG_COMMON_H
+#define JPEG_COMMON_H
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define JPEG_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define JPEG_AVX2 // selected at runtime
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef JPEG_SSE2
+#define INTERLEAVE(a, b, bits)                                                                                         \
+  {                                                                                                                    \
+    __m128i tmp = a;                                                                                                   \
+    a = _mm_unpacklo_epi##bits(a, b);                                                                                  \
+    b = _mm_unpackhi_epi##bits(tmp, b);                                                                                \
+  }
+
+// 8x8 16-bit transpose of row0..row7
+#define TRANSPOSE_8X8()                                                                                                \
+  INTERLEAVE(row0, row4, 16)                                                                                           \
+  INTERLEAVE(row1, row5, 16)                                                                                           \
+  INTERLEAVE(row2, row6, 16)                                                                                           \
+  INTERLEAVE(row3, row7, 16)                                                                                           \
+  INTERLEAVE(row0, row2, 16)                                                                                           \
+  INTERLEAVE(row1, row3, 16)                                                                                           \
+  INTERLEAVE(row4, row6, 16)                                                                                           \
+  INTERLEAVE(row5, row7, 16)                                                                                           \
+  INTERLEAVE(row0, row1, 16)                                                                                           \
+  INTERLEAVE(row2, row3, 16)                                                                                           \
+  INTERLEAVE(row4, row5, 16)                                                                                           \
+  INTERLEAVE(row6, row7, 16)
+#endif
+
+#define BLOCK_SIZE 8
+#define CDIV(x, y) (((x) + (y)-1) / (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)
+
+enum MARKER {
+  // ITU-T.81 F.1.2.2.3
+  EOB = 0x00,
+  ZRL = 0xF0,
+
+  // ITU-T.81 Table B.1
+  TEM = 0x01,
+  SOF0 = 0xC0,
+  SOF1 = 0xC1,
+  SOF2 = 0xC2,
+  SOF3 = 0xC3,
+
+  DHT = 0xC4,
+  SOF5 = 0xC5,
+  SOF6 = 0xC6,
+  SOF7 = 0xC7,
+
+  JPG = 0xC8,
+  SOF9 = 0xC9,
+  SOF10 = 0xCA,
+  SOF11 = 0xCB,
+
+  DAC = 0xCC,
+  SOF13 = 0xCD,
+  SOF14 = 0xCE,
+  SOF15 = 0xCF,
+
+  RST0 = 0xD0,
+  RST1 = 0xD1,
+  RST2 = 0xD2,
+  RST3 = 0xD3,
+  RST4 = 0xD4,
+  RST5 = 0xD5,
+  RST6 = 0xD6,
+  RST7 = 0xD7,
+
+  SOI = 0xD8,
+  EOI = 0xD9,
+  SOS = 0xDA,
+  DQT = 0xDB,
+  DNL = 0xDC,
+  DRI = 0xDD,
+  DHP = 0xDE,
+  EXP = 0xDF,
+
+  APP0 = 0xE0,
+  COM = 0xFE,
+};
+
+// ITU T.81 Figure A.6
+static const uint8_t ZIG_ZAG[BLOCK_SIZE][BLOCK_SIZE] = {
+    { 0,  1,  5,  6, 14, 15, 27, 28}, //
+    { 2,  4,  7, 13, 16, 26, 29, 42}, //
+    { 3,  8, 12, 17, 25, 30, 41, 43}, //
+    { 9, 11, 18, 24, 31, 40, 44, 53}, //
+    {10, 19, 23, 32, 39, 45, 52, 54}, //
+    {20, 22, 33, 38, 46, 51, 55, 60}, //
+    {21, 34, 37, 47, 50, 56, 59, 61}, //
+    {35, 36, 48, 49, 57, 58, 62, 63},
+};
+
+// ZIG_ZAG index -> natural order index
+static const uint8_t DE_ZIG_ZAG[BLOCK_SIZE * BLOCK_SIZE] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5, //
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28, //
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51, //
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63, //
+};
+
+#endif
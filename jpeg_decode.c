@@ -1,43 +1,79 @@
 #include "jpeg_decode.h"
+#include "jpeg_common.h"
 #include <math.h>
 #include <setjmp.h>
-#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static int DEBUG_PRINT = 0;
-
-void jpeg_enable_debug_print() { DEBUG_PRINT = 1; }
-void jpeg_disable_debug_print() { DEBUG_PRINT = 0; }
-
-#define PRINT(...)                                                                                                     \
-  if (DEBUG_PRINT)                                                                                                     \
+#ifdef _WIN32
+#define JPEG_NO_THREADS
+#endif
+
+#ifndef JPEG_NO_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
+
+#ifndef JPEG_NO_STATS
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64)
+#include <intrin.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define PRINT(decoder, ...)                                                                                            \
+  if ((decoder)->debug_print)                                                                                          \
     printf(__VA_ARGS__);
 
-#define BLOCK_SIZE 8
 #define MAX_HUFFMAN_CODE_LENGTH 16
+#define HUFFMAN_LOOKAHEAD 9
+#define MAX_HUFFMAN_CODES 256
 #define MAX_COMPONENTS 3
+#define ARENA_ALIGN 64
 
-#define ASSERT(condition, ...)                                                                                         \
-  if (!(condition)) {                                                                                                  \
-    fprintf(stderr, "Line %d: ", __LINE__);                                                                            \
-    fprintf(stderr, __VA_ARGS__);                                                                                      \
-    fprintf(stderr, "\n");                                                                                             \
-    raise(SIGABRT);                                                                                                    \
-  }
+// serialized seek index, little-endian. see build_index()
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 56
+#define INDEX_CHECKPOINT_SIZE 36
 
-#define _MALLOC(ptr, size)                                                                                             \
-  ptr = malloc(size);                                                                                                  \
-  ASSERT(ptr != NULL, "Failed to allocate memory");
+// MCU rows of coefficients between the two threads of decode_scan_pipelined()
+#define PIPELINE_MCU_ROWS 8
 
-#define _FREAD(buffer, size, count, stream)                                                                            \
-  {                                                                                                                    \
-    size_t n_elems = fread(buffer, size, count, stream);                                                               \
-    ASSERT(n_elems == count, "Failed to read data. Perhaps EOF?");                                                     \
-  }
+// a thread that waits for another one yields this many times before it sleeps on a condition variable
+#define SPIN_ROUNDS 64
+
+// images of at least this many pixels are split into tasks for the other threads of a JpegDecoderPool
+#define POOL_SPLIT_PIXELS (1 << 20)
+
+// decode_scan_speculative(): bytes of entropy-coded data per chunk at least, and MCUs at the start of each chunk that
+// the chunk before it can line up with
+#define SPECULATIVE_MIN_CHUNK 16384
+#define SPECULATIVE_SYNC_MCUS 1024
+
+// on failure, decoding stops and jpeg_decoder_decode() returns status. see jpeg_fail()
+#define ASSERT(decoder, condition, status, ...)                                                                        \
+  if (!(condition))                                                                                                    \
+    jpeg_fail(decoder, status, __LINE__, __VA_ARGS__);
+
+#define _MALLOC(decoder, ptr, size)                                                                                    \
+  ptr = malloc(size);                                                                                                  \
+  ASSERT(decoder, ptr != NULL, JPEG_ERROR_OUT_OF_MEMORY, "Failed to allocate memory");
 
 #define _FREE(ptr)                                                                                                     \
   if (ptr != NULL) {                                                                                                   \
@@ -45,245 +81,908 @@ void jpeg_disable_debug_print() { DEBUG_PRINT = 0; }
     ptr = NULL;                                                                                                        \
   }
 
-#define PRINT_LIST(prefix, ptr, length, fmt)                                                                           \
+#define PRINT_LIST(decoder, prefix, ptr, length, fmt)                                                                  \
   {                                                                                                                    \
-    PRINT(prefix);                                                                                                     \
+    PRINT(decoder, prefix);                                                                                            \
     for (int _i = 0; _i < (length); _i++)                                                                              \
-      PRINT(fmt, (ptr)[_i]);                                                                                           \
-    PRINT("\n");                                                                                                       \
-  }
-
-#define CDIV(x, y) (((x) + (y)-1) / (y))
-#define MAX(x, y) (((x) > (y)) ? (x) : (y))
-#define MIN(x, y) (((x) < (y)) ? (x) : (y))
-#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)
-
-enum MARKER {
-  // ITU-T.81 F.1.2.2.3
-  EOB = 0x00,
-  ZRL = 0xF0,
-
-  // ITU-T.81 Table B.1
-  TEM = 0x01,
-  SOF0 = 0xC0,
-  SOF1 = 0xC1,
-  SOF2 = 0xC2,
-  SOF3 = 0xC3,
-
-  DHT = 0xC4,
-  SOF5 = 0xC5,
-  SOF6 = 0xC6,
-  SOF7 = 0xC7,
-
-  JPG = 0xC8,
-  SOF9 = 0xC9,
-  SOF10 = 0xCA,
-  SOF11 = 0xCB,
-
-  DAC = 0xCC,
-  SOF13 = 0xCD,
-  SOF14 = 0xCE,
-  SOF15 = 0xCF,
-
-  RST0 = 0xD0,
-  RST1 = 0xD1,
-  RST2 = 0xD2,
-  RST3 = 0xD3,
-  RST4 = 0xD4,
-  RST5 = 0xD5,
-  RST6 = 0xD6,
-  RST7 = 0xD7,
-
-  SOI = 0xD8,
-  EOI = 0xD9,
-  SOS = 0xDA,
-  DQT = 0xDB,
-  DNL = 0xDC,
-  DRI = 0xDD,
-  DHP = 0xDE,
-  EXP = 0xDF,
-
-  APP0 = 0xE0,
-  COM = 0xFE,
-};
+      PRINT(decoder, fmt, (ptr)[_i]);                                                                                  \
+    PRINT(decoder, "\n");                                                                                              \
+  }
+
+// counters and stage timers of JpegStats. stage timers add up ticks of read_ticks(), see finish_stats()
+#ifndef JPEG_NO_STATS
+#define STATS_ADD(decoder, field, value) (decoder)->stats.field += (value);
+#define STATS_START(decoder) ((decoder)->stats_timing ? read_ticks() : 0)
+#define STATS_STOP(decoder, field, start)                                                                              \
+  if ((decoder)->stats_timing)                                                                                         \
+    (decoder)->stats.field += read_ticks() - (start);
+#else
+#define STATS_ADD(decoder, field, value)
+#define STATS_START(decoder) 0
+#define STATS_STOP(decoder, field, start) (void)(start);
+#endif
 
 typedef struct HuffmanTable {
-  uint8_t *huffsize;
-  uint16_t *huffcode;
-  uint8_t *huffval;
+  int n_codes; // 0 if the table is not defined
+  uint8_t huffval[MAX_HUFFMAN_CODES];
   uint16_t mincode[16];
   int32_t maxcode[16];
   uint8_t valptr[16];
+  uint16_t lookup[1 << HUFFMAN_LOOKAHEAD]; // (code length << 8) | value. 0 means code is longer than lookahead
 } HuffmanTable;
 
+// reader for entropy-coded segments. bits are left-aligned in a 64-bit buffer
+typedef struct BitReader {
+  const uint8_t *ptr; // next byte to read. stays at the 0xFF of a marker once it is found
+  const uint8_t *end;
+  uint64_t bits;
+  int n_bits;
+  uint8_t marker; // marker that stopped the reader. 0 if none
+} BitReader;
+
+typedef void (*IDCTFunction)(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride);
+
+// IDCT kernels for where the nonzero coefficients are: DC only, top-left 2x2, top-left 4x4 or anywhere
+enum { IDCT_DC, IDCT_2X2, IDCT_4X4, IDCT_FULL, N_IDCT_KERNELS };
+
+// what decode_image() produces
+typedef enum DecodeMode { DECODE_PIXELS, DECODE_COEFS, DECODE_INDEX } DecodeMode;
+
+// decode MCUs [mcu_start, mcu_end) of the current scan. see select_decode_mcus()
+typedef void (*DecodeMCUsFunction)(JpegDecoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds,
+                                   int mcu_start, int mcu_end);
+
 typedef struct Component {
   int x_sampling;
   int y_sampling;
   int q_table_id;
+  uint8_t *plane; // decoded samples, see allocate_planes()
+  int stride;
+  bool fancy; // upsampled with a triangle filter, see upsample_row_fancy()
+  int16_t *coefs;     // progressive, multi_scan or coefs_only: quantized coefficients of all blocks, in natural order
+  int blocks_per_row; // of coefs, including the blocks of partial MCUs
+  bool coefs_set;     // every block of coefs is set. see decode_scan_coefs()
 } Component;
 
-typedef struct Decoder {
+// bump allocator for buffers that live until the end of an image, such as component planes.
+// it is kept across images, so that decoding similar images does not allocate
+typedef struct Arena {
+  void *raw; // from malloc()
+  uint8_t *buffer;
+  size_t capacity;
+  size_t used;
+  size_t peak;    // bytes requested since the last reset
+  void *overflow; // blocks allocated when buffer is full. freed on reset
+} Arena;
+
+typedef struct JpegDecoder {
+  // kept across images
+  int debug_print;
+  int n_threads;
+  int scale;         // output is 1/scale of the frame size
+  IDCTFunction idct[N_IDCT_KERNELS]; // produce (BLOCK_SIZE / scale) x (BLOCK_SIZE / scale) samples per block
+  int crop[4];       // x, y, width, height. width 0 to decode everything
+  int fancy_upsampling;
+  int stats_timing;
+  int speculative;           // jpeg_decoder_set_speculative()
+  const uint8_t *seek_index; // jpeg_decoder_set_index(). not owned
+  size_t seek_index_size;
+  int index_spacing; // MCUs between checkpoints of jpeg_decoder_build_index()
+  struct PoolWorker *pool_worker; // when the decoder belongs to a JpegDecoderPool. see run_workers()
+  Arena arena;
+  char error_message[256];
+
+  // the rest is cleared for each image. see decode_image()
+  JpegStatus status;
+  JpegStats stats;    // stage times are in ticks until finish_stats()
+  jmp_buf error_jmp;  // see jpeg_fail()
+  JpegOutput *output; // caller-provided buffers, or NULL
+  JpegRowCallback row_callback; // streaming when not NULL. image then holds one MCU row
+  void *row_user_data;
+  bool coefs_only; // jpeg_decoder_decode_coefficients(). scans are only entropy-decoded, to component->coefs
+  bool index_only; // jpeg_decoder_build_index(). the first scan is only entropy-decoded, to checkpoints in index
+  uint8_t *index;  // from malloc()
+  size_t index_size;
+  const uint8_t *file_data; // all of the data, to match the seek index against
+  size_t file_size;
+
   uint8_t encoding;
   uint16_t restart_interval;
-  uint16_t q_tables[4][BLOCK_SIZE * BLOCK_SIZE];
+  uint16_t q_tables[4][BLOCK_SIZE * BLOCK_SIZE]; // natural order
   HuffmanTable h_tables[2][4];
   Component components[MAX_COMPONENTS];
   int min_component;
   int max_x_sampling;
   int max_y_sampling;
+  int nx_mcu; // of the current scan
+  int ny_mcu;
+  int n_plane_mcu_rows; // number of MCU rows held by component planes
+  int n_coef_mcu_rows;  // and by component->coefs. a ring when pipelined, see decode_scan_pipelined()
+  int mcu_x0;           // MCUs [mcu_x0, mcu_x1) x [mcu_y0, mcu_y1) of the current scan overlap the output
+  int mcu_x1;
+  int mcu_y0;
+  int mcu_y1;
+  DecodeMCUsFunction decode_mcus; // for the layout of the current scan
   int dc_preds[MAX_COMPONENTS];
-  uint8_t *image;
+  const uint8_t *checkpoints; // of the seek index, if it matches the current scan. see find_checkpoints()
+  int n_checkpoints;
+  const uint8_t *scan_data; // start of the entropy-coded data of the current scan
+  struct PipelinedScan *pipeline; // see decode_mcus_pipelined()
+  int eobrun; // progressive only: remaining blocks of an end-of-band run. G.1.2.2
+  bool multi_scan; // baseline, with scans of some of the components. decoded like progressive, see handle_sos()
+  long idct_counts[N_IDCT_KERNELS]; // blocks decoded by each kernel
+  uint8_t *upsampled[MAX_COMPONENTS]; // a row of each component at full resolution
+  int16_t *colsum;                    // scratch row of upsample_row_fancy()
+  bool fancy_x;                       // some component is upsampled with a triangle filter horizontally
+  bool fancy_y;                       // or vertically. then MCU rows need their neighbors for color conversion
+  uint8_t *image;         // the output, or its first plane
+  int image_y;            // output row at the start of image. only changes when streaming
+  int stride;             // bytes per row of image
+  int pixel_size;         // bytes per pixel of image. 1 for planar output
+  JpegPixelFormat format; // of the output. JPEG_PIXEL_NATIVE is resolved at SOF, see setup_output()
+  bool luma_only;         // a color image to JPEG_PIXEL_GRAY: chroma blocks are only entropy-decoded
+  int frame_width; // before scaling
+  int frame_height;
+  int block_size; // output samples per block side. BLOCK_SIZE / scale
+  int crop_x;     // position of the output in the scaled frame
+  int crop_y;
   int width;
   int height;
   int n_channels;
 } Decoder;
 
 static uint16_t read_be_16(const uint8_t *buffer) { return (buffer[0] << 8) | buffer[1]; }
+static uint64_t read_be_64(const uint8_t *buffer) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value = (value << 8) | buffer[i];
+  return value;
+}
+static uint64_t read_le(const uint8_t *buffer, int n_bytes) {
+  uint64_t value = 0;
+  for (int i = n_bytes - 1; i >= 0; i--)
+    value = (value << 8) | buffer[i];
+  return value;
+}
+static void write_le(uint8_t *buffer, uint64_t value, int n_bytes) {
+  for (int i = 0; i < n_bytes; i++)
+    buffer[i] = value >> (i * 8);
+}
 static uint8_t upper_half(uint8_t x) { return x >> 4; }
 static uint8_t lower_half(uint8_t x) { return x & 0xF; }
 
-static void handle_app0(const uint8_t *buffer, uint16_t buflen);
+#ifndef JPEG_NO_STATS
+static uint64_t now_ns() {
+  struct timespec ts;
+#ifdef _WIN32
+  timespec_get(&ts, TIME_UTC);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the cycle counter where there is one, which is much cheaper to read than the clock
+static inline uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+#endif
+
+static void jpeg_fail(Decoder *decoder, JpegStatus status, int line, const char *format, ...);
+static void *arena_alloc(Decoder *decoder, size_t size);
+static void arena_reset(Arena *arena);
+static JpegStatus decode_image(Decoder *decoder, const uint8_t *data, size_t size, JpegOutput *output,
+                               JpegRowCallback callback, void *user_data, DecodeMode mode, int *width, int *height,
+                               int *n_channels);
+static void decode_jpeg_data(Decoder *decoder, const uint8_t *data, size_t size);
+#ifndef JPEG_NO_STATS
+static void finish_stats(Decoder *decoder, uint64_t ns, uint64_t ticks);
+#endif
+static uint8_t *read_stream(FILE *f, size_t *size);
+static int read_exif_orientation(const uint8_t *buffer, uint16_t buflen);
+static int pixel_size_of(JpegPixelFormat format);
+
+static void handle_app0(Decoder *decoder, const uint8_t *buffer, uint16_t buflen);
 static void handle_dqt(Decoder *decoder, const uint8_t *buffer, uint16_t buflen);
 static void handle_dht(Decoder *decoder, const uint8_t *buffer, uint16_t buflen);
-static void handle_sof0(Decoder *decoder, const uint8_t *buffer, uint16_t buflen);
-static void handle_sos(Decoder *decoder, const uint8_t *buffer, uint16_t buflen, FILE *f);
-
-static void decode_block_sof0(Decoder *decoder, FILE *f, uint8_t block[BLOCK_SIZE][BLOCK_SIZE], int, int, int);
-
-static void idct_2d_(double *);
-static void ycbcr_to_rgb_(uint8_t *);
-
-static jmp_buf RST_JMP_BUF;
-
-// ITU T.81 Figure A.6
-static const uint8_t ZIG_ZAG[BLOCK_SIZE][BLOCK_SIZE] = {
-    { 0,  1,  5,  6, 14, 15, 27, 28}, //
-    { 2,  4,  7, 13, 16, 26, 29, 42}, //
-    { 3,  8, 12, 17, 25, 30, 41, 43}, //
-    { 9, 11, 18, 24, 31, 40, 44, 53}, //
-    {10, 19, 23, 32, 39, 45, 52, 54}, //
-    {20, 22, 33, 38, 46, 51, 55, 60}, //
-    {21, 34, 37, 47, 50, 56, 59, 61}, //
-    {35, 36, 48, 49, 57, 58, 62, 63},
-};
-
-static const double DCT_TABLE[] = {
-    0.5000000000000000,  0.4903926402016152,  0.4619397662556434,  0.4157348061512726,  //
-    0.3535533905932738,  0.2777851165098011,  0.1913417161825449,  0.0975451610080642,  //
-    0.0000000000000000,  -0.0975451610080641, -0.1913417161825449, -0.2777851165098010, //
-    -0.3535533905932737, -0.4157348061512727, -0.4619397662556434, -0.4903926402016152, //
-    -0.5000000000000000, -0.4903926402016152, -0.4619397662556434, -0.4157348061512726, //
-    -0.3535533905932738, -0.2777851165098011, -0.1913417161825449, -0.0975451610080642, //
-    -0.0000000000000000, 0.0975451610080641,  0.1913417161825449,  0.2777851165098010,  //
-    0.3535533905932737,  0.4157348061512727,  0.4619397662556434,  0.4903926402016152,  //
-};
+static void handle_sof(Decoder *decoder, uint8_t marker, const uint8_t *buffer, uint16_t buflen);
+static void setup_output(Decoder *decoder);
+static size_t handle_sos(Decoder *decoder, const uint8_t *buffer, uint16_t buflen, const uint8_t *data, size_t size);
+
+static void setup_mcus(Decoder *decoder, int n_components);
+static void decode_mcu_rows(Decoder *decoder, const uint8_t *payload, BitReader *br, int n_components, int mcu_start,
+                            int mcu_end);
+static void allocate_mcu_rows(Decoder *decoder, int n_components);
+static void allocate_planes(Decoder *decoder, int n_mcu_rows);
+static void allocate_upsampled(Decoder *decoder);
+static void allocate_coefs(Decoder *decoder, bool zero);
+static DecodeMCUsFunction select_decode_mcus(Decoder *decoder, const uint8_t *payload);
+static void decode_mcus(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int, int);
+static void decode_mcus_gray(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int, int);
+static void decode_mcus_444(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int, int);
+static void decode_mcus_422(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int, int);
+static void decode_mcus_420(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int, int);
+static size_t decode_scan_parallel(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size);
+static size_t decode_scan_pipelined(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size);
+static size_t decode_scan_speculative(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size);
+static int find_restart_intervals(const uint8_t *data, size_t size, size_t *offsets, int max_intervals,
+                                  size_t *scan_size);
+static size_t build_index(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size);
+static void write_checkpoint(uint8_t *out, int mcu_idx, const BitReader *br, const uint8_t *data, const int *dc_preds);
+static size_t find_checkpoints(Decoder *decoder, const uint8_t *data, size_t size);
+static void seek_checkpoint(Decoder *decoder, BitReader *br, int *mcu_idx, int target);
+static uint64_t hash_bytes(const uint8_t *data, size_t size);
+static void decode_block_sof0(Decoder *decoder, BitReader *br, uint8_t *out, int stride, int, int, int, int *dc_pred);
+static int decode_block_coefs(Decoder *decoder, BitReader *br, int16_t *block, int, int, int *dc_pred);
+static void skip_block_sof0(Decoder *decoder, BitReader *br, int dc_table_id, int ac_table_id, int *dc_pred);
+#ifndef JPEG_NO_THREADS
+static void skip_mcu(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds);
+static uint64_t bit_position(const BitReader *br, const uint8_t *data);
+static void seek_bit_position(BitReader *br, const uint8_t *data, uint64_t position);
+static void run_pool_tasks(struct PoolWorker *self, void *(*worker)(void *), void *arg, int n_tasks);
+#endif
+static void decode_batch_item(struct PoolWorker *worker, JpegBatchItem *item);
+static void handle_restart(Decoder *decoder, BitReader *br, int interval_idx);
+
+static size_t decode_scan_coefs(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size);
+static void decode_dc_first(Decoder *decoder, BitReader *br, int16_t *block, int dc_table_id, int al, int *dc_pred);
+static void decode_ac_first(Decoder *decoder, BitReader *br, int16_t *block, int ac_table_id, int ss, int se, int al);
+static void decode_ac_refine(Decoder *decoder, BitReader *br, int16_t *block, int ac_table_id, int ss, int se, int al);
+static void finish_progressive(Decoder *decoder);
+static void decode_mcus_coefs(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int, int);
+static void idct_block(Decoder *decoder, const int16_t *block, int last, int component_id, uint8_t *out, int stride);
+
+static void select_idct(IDCTFunction *idct, int scale);
+static void color_convert_mcu_row(Decoder *decoder, int mcu_y);
+static void copy_planes_mcu_row(Decoder *decoder, int mcu_y);
+static void emit_rows(Decoder *decoder, int mcu_y, int mcu_height);
+static void upsample_row(const uint8_t *in, uint8_t *out, int width, int factor);
+static void upsample_row_fancy(Decoder *decoder, Component *component, int y, int x_start, int width, uint8_t *out);
+static void ycbcr_to_rgb_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out, int width,
+                             JpegPixelFormat format);
+static void gray_to_pixels(const uint8_t *in, uint8_t *out, int width, int pixel_size);
+
+JpegDecoder *jpeg_decoder_create() {
+  Decoder *decoder = calloc(1, sizeof(Decoder));
+  if (decoder == NULL)
+    return NULL;
+  decoder->n_threads = 1;
+  decoder->scale = 1;
+  decoder->fancy_upsampling = 1;
+  select_idct(decoder->idct, 1);
+  return decoder;
+}
 
-uint8_t *decode_jpeg(FILE *f, int *width, int *height, int *n_channels) {
-  uint8_t marker[2];
+void jpeg_decoder_destroy(JpegDecoder *decoder) {
+  if (decoder == NULL)
+    return;
+  decoder->arena.peak = 0;
+  arena_reset(&decoder->arena);
+  free(decoder->arena.raw);
+  free(decoder);
+}
+
+void jpeg_decoder_set_debug_print(JpegDecoder *decoder, int enable) { decoder->debug_print = enable; }
+
+int jpeg_decoder_set_scale(JpegDecoder *decoder, int scale) {
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+    return -1;
+  decoder->scale = scale;
+  select_idct(decoder->idct, scale);
+  return 0;
+}
+
+void jpeg_decoder_set_fancy_upsampling(JpegDecoder *decoder, int enable) { decoder->fancy_upsampling = enable; }
+void jpeg_decoder_set_stats_timing(JpegDecoder *decoder, int enable) { decoder->stats_timing = enable; }
+void jpeg_decoder_set_speculative(JpegDecoder *decoder, int enable) { decoder->speculative = enable; }
+
+int jpeg_decoder_set_crop(JpegDecoder *decoder, int x, int y, int width, int height) {
+  if (x < 0 || y < 0)
+    return -1;
+  decoder->crop[0] = x;
+  decoder->crop[1] = y;
+  decoder->crop[2] = width > 0 && height > 0 ? width : 0;
+  decoder->crop[3] = width > 0 && height > 0 ? height : 0;
+  return 0;
+}
+
+void jpeg_decoder_set_index(JpegDecoder *decoder, const uint8_t *index, size_t index_size) {
+  decoder->seek_index = index;
+  decoder->seek_index_size = index != NULL ? index_size : 0;
+}
+
+void jpeg_decoder_set_num_threads(JpegDecoder *decoder, int n_threads) {
+#ifdef JPEG_NO_THREADS
+  n_threads = 1;
+#else
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  decoder->n_threads = MAX(n_threads, 1);
+}
+
+const char *jpeg_decoder_error(const JpegDecoder *decoder) { return decoder->error_message; }
+
+int jpeg_decoder_get_stats(const JpegDecoder *decoder, JpegStats *stats) {
+#ifdef JPEG_NO_STATS
+  memset(stats, 0, sizeof(JpegStats));
+  return -1;
+#else
+  *stats = decoder->stats;
+  return 0;
+#endif
+}
+
+// record the error and go back to jpeg_decoder_decode(). must be called from the thread that called setjmp()
+void jpeg_fail(Decoder *decoder, JpegStatus status, int line, const char *format, ...) {
+  int n = snprintf(decoder->error_message, sizeof(decoder->error_message), "Line %d: ", line);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(decoder->error_message + n, sizeof(decoder->error_message) - n, format, args);
+  va_end(args);
+  decoder->status = status;
+  longjmp(decoder->error_jmp, 1);
+}
+
+// memory is only released by arena_reset(). allocations are rounded up to cache lines
+void *arena_alloc(Decoder *decoder, size_t size) {
+  Arena *arena = &decoder->arena;
+  size = CDIV(size, ARENA_ALIGN) * ARENA_ALIGN;
+  arena->peak += size;
+  if (arena->used + size <= arena->capacity) {
+    void *ptr = arena->buffer + arena->used;
+    arena->used += size;
+    return ptr;
+  }
+
+  // does not fit. use a separate block until the next reset, which grows the buffer to the peak usage
+  void **block = malloc(ARENA_ALIGN + size);
+  ASSERT(decoder, block != NULL, JPEG_ERROR_OUT_OF_MEMORY, "Failed to allocate memory");
+  *block = arena->overflow;
+  arena->overflow = block;
+  return (uint8_t *)block + ARENA_ALIGN;
+}
+
+void arena_reset(Arena *arena) {
+  while (arena->overflow != NULL) {
+    void *next = *(void **)arena->overflow;
+    free(arena->overflow);
+    arena->overflow = next;
+  }
+
+  if (arena->peak > arena->capacity) {
+    free(arena->raw);
+    arena->raw = malloc(arena->peak + ARENA_ALIGN - 1);
+    arena->capacity = arena->raw != NULL ? arena->peak : 0;
+    arena->buffer = (uint8_t *)(((uintptr_t)arena->raw + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+  }
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+JpegStatus jpeg_decoder_decode(JpegDecoder *decoder, const uint8_t *data, size_t size, uint8_t **image, int *width,
+                               int *height, int *n_channels) {
+  *image = NULL;
+  JpegStatus status = decode_image(decoder, data, size, NULL, NULL, NULL, DECODE_PIXELS, width, height, n_channels);
+  if (status == JPEG_OK)
+    *image = decoder->image;
+  return status;
+}
+
+JpegStatus jpeg_decoder_decode_into(JpegDecoder *decoder, const uint8_t *data, size_t size, uint8_t *out,
+                                    size_t out_size, int *width, int *height, int *n_channels) {
+  JpegOutput output = {JPEG_PIXEL_NATIVE, {out}, {0}, {out_size}};
+  return decode_image(decoder, data, size, &output, NULL, NULL, DECODE_PIXELS, width, height, n_channels);
+}
+
+JpegStatus jpeg_decoder_decode_to(JpegDecoder *decoder, const uint8_t *data, size_t size, JpegOutput *output) {
+  output->n_planes = 0;
+  memset(output->widths, 0, sizeof(output->widths));
+  memset(output->heights, 0, sizeof(output->heights));
+  return decode_image(decoder, data, size, output, NULL, NULL, DECODE_PIXELS, NULL, NULL, NULL);
+}
+
+JpegStatus jpeg_decoder_decode_rows(JpegDecoder *decoder, const uint8_t *data, size_t size, JpegRowCallback callback,
+                                    void *user_data, int *width, int *height, int *n_channels) {
+  return decode_image(decoder, data, size, NULL, callback, user_data, DECODE_PIXELS, width, height, n_channels);
+}
+
+JpegStatus jpeg_decoder_decode_coefficients(JpegDecoder *decoder, const uint8_t *data, size_t size,
+                                            JpegCoefficients *coefficients) {
+  memset(coefficients, 0, sizeof(*coefficients));
+  JpegStatus status = decode_image(decoder, data, size, NULL, NULL, NULL, DECODE_COEFS, NULL, NULL, NULL);
+  if (status != JPEG_OK)
+    return status;
+
+  coefficients->width = decoder->frame_width;
+  coefficients->height = decoder->frame_height;
+  coefficients->n_components = decoder->n_channels;
+  int ny_mcu = CDIV(decoder->frame_height, BLOCK_SIZE * decoder->max_y_sampling);
+  for (int i = 0; i < decoder->n_channels; i++) {
+    Component *component = &decoder->components[i];
+    JpegComponentCoefficients *out = &coefficients->components[i];
+    out->coefs = component->coefs;
+    out->blocks_per_row = component->blocks_per_row;
+    out->blocks_per_column = ny_mcu * component->y_sampling;
+    if (!component->coefs_set) // no scan of this component
+      memset(component->coefs, 0,
+             (size_t)out->blocks_per_row * out->blocks_per_column * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+    // A.1.1
+    out->width = CDIV(decoder->frame_width * component->x_sampling, decoder->max_x_sampling);
+    out->height = CDIV(decoder->frame_height * component->y_sampling, decoder->max_y_sampling);
+    out->x_sampling = component->x_sampling;
+    out->y_sampling = component->y_sampling;
+    memcpy(out->q_table, decoder->q_tables[component->q_table_id], sizeof(out->q_table));
+  }
+  return JPEG_OK;
+}
+
+JpegStatus jpeg_decoder_build_index(JpegDecoder *decoder, const uint8_t *data, size_t size, int checkpoint_mcus,
+                                    uint8_t **index, size_t *index_size) {
+  *index = NULL;
+  *index_size = 0;
+  decoder->index_spacing = checkpoint_mcus > 0 ? checkpoint_mcus : 256;
+  JpegStatus status = decode_image(decoder, data, size, NULL, NULL, NULL, DECODE_INDEX, NULL, NULL, NULL);
+  if (status == JPEG_OK) {
+    *index = decoder->index;
+    *index_size = decoder->index_size;
+    decoder->index = NULL;
+  }
+  return status;
+}
+
+// decode to output if it is not NULL, to callback if it is not NULL, only to coefficients or a seek index with those
+// modes, otherwise to a new buffer in decoder->image
+JpegStatus decode_image(Decoder *decoder, const uint8_t *data, size_t size, JpegOutput *output,
+                        JpegRowCallback callback, void *user_data, DecodeMode mode, int *width, int *height,
+                        int *n_channels) {
+  // keep settings and the arena, reset the rest
+  memset((uint8_t *)decoder + offsetof(Decoder, status), 0, sizeof(Decoder) - offsetof(Decoder, status));
+  arena_reset(&decoder->arena);
+  decoder->output = output;
+  decoder->row_callback = callback;
+  decoder->row_user_data = user_data;
+  decoder->coefs_only = mode == DECODE_COEFS;
+  decoder->index_only = mode == DECODE_INDEX;
+  decoder->file_data = data;
+  decoder->file_size = size;
+#ifndef JPEG_NO_STATS
+  uint64_t start_ns = now_ns(), start_ticks = read_ticks();
+#endif
+
+  if (setjmp(decoder->error_jmp)) {
+    if (decoder->output == NULL && decoder->row_callback == NULL)
+      _FREE(decoder->image);
+    _FREE(decoder->index);
+  } else {
+    decode_jpeg_data(decoder, data, size);
+    decoder->status = JPEG_OK;
+  }
+#ifndef JPEG_NO_STATS
+  finish_stats(decoder, now_ns() - start_ns, read_ticks() - start_ticks);
+#endif
+
+  if (width != NULL)
+    *width = decoder->width;
+  if (height != NULL)
+    *height = decoder->height;
+  if (n_channels != NULL)
+    *n_channels = decoder->n_channels;
+  return decoder->status;
+}
+
+void decode_jpeg_data(Decoder *decoder, const uint8_t *data, size_t size) {
+  const uint8_t *marker;
   uint16_t buflen;
-  uint8_t *buffer = NULL;
-  Decoder decoder = {0};
+  const uint8_t *buffer;
 
+  size_t offset = 0;
   bool finished = false;
   while (!finished) {
-    _FREAD(marker, 1, 2, f);
-    PRINT("%X%X ", marker[0], marker[1]);
+    ASSERT(decoder, offset + 2 <= size, JPEG_ERROR_TRUNCATED, "Failed to read data. Perhaps EOF?");
+    marker = data + offset;
+    offset += 2;
+    PRINT(decoder, "%X%X ", marker[0], marker[1]);
 
-    ASSERT(marker[0] == 0xFF, "Not a marker");
+    ASSERT(decoder, marker[0] == 0xFF, JPEG_ERROR_CORRUPT, "Not a marker");
 
+    // segment payloads are parsed in place
     if (marker[1] == TEM || marker[1] == SOI || marker[1] == EOI || (marker[1] >= RST0 && marker[1] <= RST7)) {
       buflen = 0;
+      buffer = NULL;
     } else {
-      _FREAD(&buflen, 1, 2, f);
-      buflen = read_be_16((uint8_t *)&buflen) - 2;
-
-      // TODO: re-use payload buffer
-      _MALLOC(buffer, buflen);
-      _FREAD(buffer, 1, buflen, f);
+      ASSERT(decoder, offset + 2 <= size, JPEG_ERROR_TRUNCATED, "Failed to read data. Perhaps EOF?");
+      buflen = read_be_16(data + offset);
+      ASSERT(decoder, buflen >= 2, JPEG_ERROR_CORRUPT, "Invalid segment length");
+      buflen -= 2;
+      ASSERT(decoder, offset + 2 + buflen <= size, JPEG_ERROR_TRUNCATED, "Failed to read data. Perhaps EOF?");
+      buffer = data + offset + 2;
+      offset += 2 + buflen;
     }
 
     switch (marker[1]) {
     case SOI:
-      PRINT("SOI");
+      PRINT(decoder, "SOI");
       break;
 
     case APP0:
-      handle_app0(buffer, buflen);
+      handle_app0(decoder, buffer, buflen);
       break;
 
     case DQT:
-      handle_dqt(&decoder, buffer, buflen);
+      handle_dqt(decoder, buffer, buflen);
       break;
 
     case DHT:
-      handle_dht(&decoder, buffer, buflen);
+      handle_dht(decoder, buffer, buflen);
       break;
 
     case SOF0:
-      handle_sof0(&decoder, buffer, buflen);
+    case SOF2:
+      handle_sof(decoder, marker[1], buffer, buflen);
+      break;
+
+    // extended sequential, lossless, hierarchical and arithmetic frames, which jpeg_probe() rejects too. Table B.1
+    case SOF1:
+    case SOF3:
+    case SOF5:
+    case SOF6:
+    case SOF7:
+    case SOF9:
+    case SOF10:
+    case SOF11:
+    case SOF13:
+    case SOF14:
+    case SOF15:
+      ASSERT(decoder, false, JPEG_ERROR_UNSUPPORTED, "Only baseline and progressive Huffman are supported, not SOF%d",
+             marker[1] - SOF0);
       break;
 
     case SOS:
-      handle_sos(&decoder, buffer, buflen, f);
+      offset += handle_sos(decoder, buffer, buflen, data + offset, size - offset);
       break;
 
     case DRI:
-      PRINT("DRI (length = %d)\n", buflen);
-      ASSERT(buflen >= 2, "Payload not long enough");
-      decoder.restart_interval = read_be_16(buffer);
-      PRINT("  restart interval = %d\n", decoder.restart_interval);
+      PRINT(decoder, "DRI (length = %d)\n", buflen);
+      ASSERT(decoder, buflen >= 2, JPEG_ERROR_CORRUPT, "Payload not long enough");
+      decoder->restart_interval = read_be_16(buffer);
+      PRINT(decoder, "  restart interval = %d\n", decoder->restart_interval);
       break;
 
     case EOI:
-      PRINT("EOI\n");
+      PRINT(decoder, "EOI\n");
+      if ((decoder->encoding == SOF2 || decoder->multi_scan) && decoder->image != NULL)
+        finish_progressive(decoder);
+      PRINT(decoder, "IDCT kernels: dc = %ld, 2x2 = %ld, 4x4 = %ld, full = %ld\n", decoder->idct_counts[IDCT_DC],
+            decoder->idct_counts[IDCT_2X2], decoder->idct_counts[IDCT_4X4], decoder->idct_counts[IDCT_FULL]);
       finished = true;
       break;
 
     default:
       if ((APP0 < marker[1]) && (marker[1] <= APP0 + 15)) {
-        PRINT("APP%d (length = %d)\n", marker[1] - APP0, buflen);
-        PRINT("  identifier = %.*s\n", buflen, buffer);
+        PRINT(decoder, "APP%d (length = %d)\n", marker[1] - APP0, buflen);
+        PRINT(decoder, "  identifier = %.*s\n", buflen, buffer);
       } else
-        PRINT("Unknown marker (length = %d)\n", buflen);
+        PRINT(decoder, "Unknown marker (length = %d)\n", buflen);
       break;
     }
 
-    _FREE(buffer);
-    PRINT("\n");
+    STATS_ADD(decoder, marker_bytes[marker[1]], data + offset - marker);
+    PRINT(decoder, "\n");
+  }
+  ASSERT(decoder, decoder->encoding != 0, JPEG_ERROR_CORRUPT, "No image");
+  ASSERT(decoder, !decoder->index_only || decoder->index != NULL, JPEG_ERROR_CORRUPT, "No scan");
+}
+
+#ifndef JPEG_NO_STATS
+// stage timers add up ticks, which are converted to ns with the rate over the whole decode
+void finish_stats(Decoder *decoder, uint64_t ns, uint64_t ticks) {
+  JpegStats *stats = &decoder->stats;
+  stats->total_ns = ns;
+  for (int i = 0; i < N_IDCT_KERNELS; i++)
+    stats->idct_blocks[i] = decoder->idct_counts[i];
+
+  // the IDCT is timed inside of the MCU loops, which are timed as entropy decoding
+  stats->huffman_ns -= MIN(stats->huffman_ns, stats->idct_ns);
+  double ns_per_tick = ticks > 0 ? (double)ns / ticks : 0;
+  uint64_t *times[] = {&stats->huffman_ns, &stats->idct_ns, &stats->upsample_ns, &stats->color_ns, &stats->output_ns};
+  for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); i++)
+    *times[i] = *times[i] * ns_per_tick;
+}
+#endif
+
+JpegStatus jpeg_decoder_decode_file(JpegDecoder *decoder, const char *filename, uint8_t **image, int *width,
+                                    int *height, int *n_channels) {
+  *image = NULL;
+#ifdef _WIN32
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    snprintf(decoder->error_message, sizeof(decoder->error_message), "Failed to open %s", filename);
+    return JPEG_ERROR_IO;
+  }
+  size_t size;
+  uint8_t *data = read_stream(f, &size);
+  fclose(f);
+  if (data == NULL) {
+    snprintf(decoder->error_message, sizeof(decoder->error_message), "Failed to read %s", filename);
+    return JPEG_ERROR_IO;
+  }
+  JpegStatus status = jpeg_decoder_decode(decoder, data, size, image, width, height, n_channels);
+  free(data);
+  return status;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    snprintf(decoder->error_message, sizeof(decoder->error_message), "Failed to open %s", filename);
+    return JPEG_ERROR_IO;
   }
 
-  // TODO: free decoder
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    snprintf(decoder->error_message, sizeof(decoder->error_message), "Failed to read %s", filename);
+    return JPEG_ERROR_IO;
+  }
 
-  if (width != NULL)
-    *width = decoder.width;
-  if (height != NULL)
-    *height = decoder.height;
-  if (n_channels != NULL)
-    *n_channels = decoder.n_channels;
-  return decoder.image;
+  JpegStatus status = jpeg_decoder_decode(decoder, data, st.st_size, image, width, height, n_channels);
+  munmap(data, st.st_size);
+  return status;
+#endif
+}
+
+// read the whole stream. returns NULL on failure
+static uint8_t *read_stream(FILE *f, size_t *size) {
+  size_t capacity = 1 << 16;
+  uint8_t *data = malloc(capacity);
+  *size = 0;
+  for (size_t n_read; data != NULL && (n_read = fread(data + *size, 1, capacity - *size, f)) > 0;) {
+    *size += n_read;
+    if (*size == capacity) {
+      capacity *= 2;
+      uint8_t *new_data = realloc(data, capacity);
+      if (new_data == NULL)
+        free(data);
+      data = new_data;
+    }
+  }
+  if (data != NULL && ferror(f))
+    _FREE(data);
+  return data;
+}
+
+uint8_t *decode_jpeg_mem(const uint8_t *data, size_t size, int *width, int *height, int *n_channels) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  if (decoder == NULL)
+    return NULL;
+  uint8_t *image;
+  jpeg_decoder_decode(decoder, data, size, &image, width, height, n_channels);
+  jpeg_decoder_destroy(decoder);
+  return image;
+}
+
+uint8_t *decode_jpeg(FILE *f, int *width, int *height, int *n_channels) {
+  size_t size;
+  uint8_t *data = read_stream(f, &size);
+  if (data == NULL)
+    return NULL;
+  uint8_t *image = decode_jpeg_mem(data, size, width, height, n_channels);
+  free(data);
+  return image;
+}
+
+uint8_t *decode_jpeg_file(const char *filename, int *width, int *height, int *n_channels) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  if (decoder == NULL)
+    return NULL;
+  uint8_t *image;
+  jpeg_decoder_decode_file(decoder, filename, &image, width, height, n_channels);
+  jpeg_decoder_destroy(decoder);
+  return image;
+}
+
+JpegStatus jpeg_probe(const uint8_t *data, size_t size, JpegInfo *info) {
+  memset(info, 0, sizeof(*info));
+  info->orientation = 1;
+  if (size < 2 || data[0] != 0xFF || data[1] != SOI)
+    return JPEG_ERROR_CORRUPT;
+
+  // same segment layout as decode_jpeg_data(). B.1.1.4
+  JpegStatus status = JPEG_OK;
+  bool has_frame = false, has_orientation = false;
+  for (size_t offset = 2;; offset += 2) {
+    if (offset + 2 > size)
+      return JPEG_ERROR_TRUNCATED;
+    const uint8_t *marker = data + offset;
+    if (marker[0] != 0xFF)
+      return JPEG_ERROR_CORRUPT;
+    if (marker[1] == SOS) {
+      info->header_size = offset;
+      return has_frame ? status : JPEG_ERROR_CORRUPT;
+    }
+    if (marker[1] == EOI)
+      return JPEG_ERROR_CORRUPT;
+    if (marker[1] == TEM || marker[1] == SOI || (marker[1] >= RST0 && marker[1] <= RST7))
+      continue;
+
+    if (offset + 4 > size)
+      return JPEG_ERROR_TRUNCATED;
+    uint16_t length = read_be_16(marker + 2);
+    if (length < 2)
+      return JPEG_ERROR_CORRUPT;
+    if (offset + 2 + length > size)
+      return JPEG_ERROR_TRUNCATED;
+    const uint8_t *buffer = marker + 4;
+    uint16_t buflen = length - 2;
+    offset += length;
+
+    // SOFn. Table B.1
+    if (marker[1] >= SOF0 && marker[1] <= SOF15 && marker[1] != DHT && marker[1] != JPG && marker[1] != DAC) {
+      if (has_frame || buflen < 6)
+        return JPEG_ERROR_CORRUPT;
+      has_frame = true;
+      info->height = read_be_16(buffer + 1);
+      info->width = read_be_16(buffer + 3);
+      info->n_components = buffer[5];
+      if (buflen < 6 + info->n_components * 3)
+        return JPEG_ERROR_CORRUPT;
+      int min_component = 255;
+      for (int i = 0; i < info->n_components; i++)
+        min_component = MIN(min_component, buffer[6 + i * 3]);
+      bool consecutive_ids = true;
+      for (int i = 0; i < MIN(info->n_components, 3); i++) {
+        consecutive_ids &= buffer[6 + i * 3] - min_component < info->n_components;
+        info->x_sampling[i] = upper_half(buffer[7 + i * 3]);
+        info->y_sampling[i] = lower_half(buffer[7 + i * 3]);
+        if (info->x_sampling[i] < 1 || info->x_sampling[i] > 4 || info->y_sampling[i] < 1 || info->y_sampling[i] > 4)
+          return JPEG_ERROR_CORRUPT;
+      }
+      info->progressive = marker[1] == SOF2 || marker[1] == SOF6 || marker[1] == SOF10 || marker[1] == SOF14;
+      // what handle_sof() accepts
+      if ((marker[1] != SOF0 && marker[1] != SOF2) || buffer[0] != 8 || info->width == 0 || info->height == 0 ||
+          (info->n_components != 1 && info->n_components != 3) || !consecutive_ids)
+        status = JPEG_ERROR_UNSUPPORTED;
+    } else if (marker[1] == DRI && buflen >= 2) {
+      info->restart_interval = read_be_16(buffer);
+    } else if (marker[1] == APP0 + 1 && !has_orientation) {
+      int orientation = read_exif_orientation(buffer, buflen);
+      has_orientation = orientation > 0;
+      info->orientation = has_orientation ? orientation : 1;
+    }
+  }
+}
+
+JpegStatus jpeg_probe_file(const char *filename, JpegInfo *info) {
+  memset(info, 0, sizeof(*info));
+#ifdef _WIN32
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    return JPEG_ERROR_IO;
+  size_t size;
+  uint8_t *data = read_stream(f, &size);
+  fclose(f);
+  if (data == NULL)
+    return JPEG_ERROR_IO;
+  JpegStatus status = jpeg_probe(data, size, info);
+  free(data);
+  return status;
+#else
+  // only the pages of the headers are read
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return JPEG_ERROR_IO;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return JPEG_ERROR_IO;
+  JpegStatus status = jpeg_probe(data, st.st_size, info);
+  munmap(data, st.st_size);
+  return status;
+#endif
+}
+
+size_t jpeg_probe_output(const JpegInfo *info, int scale, JpegOutput *output) {
+  output->n_planes = 0;
+  JpegPixelFormat format = output->format;
+  if (format == JPEG_PIXEL_NATIVE)
+    format = info->n_components == 1 ? JPEG_PIXEL_GRAY : JPEG_PIXEL_RGB;
+  if (format < JPEG_PIXEL_RGB || format > JPEG_PIXEL_YCBCR_PLANAR)
+    return 0;
+  if ((info->n_components != 1 && info->n_components != 3) || (scale != 1 && scale != 2 && scale != 4 && scale != 8))
+    return 0;
+
+  int max_x_sampling = 1, max_y_sampling = 1;
+  for (int i = 0; i < info->n_components; i++) {
+    max_x_sampling = MAX(max_x_sampling, info->x_sampling[i]);
+    max_y_sampling = MAX(max_y_sampling, info->y_sampling[i]);
+  }
+  // see setup_output()
+  bool planar = format == JPEG_PIXEL_YCBCR_PLANAR;
+  size_t total = 0;
+  for (int i = 0; i < (planar ? info->n_components : 1); i++) {
+    int x_sampling = planar ? info->x_sampling[i] : max_x_sampling;
+    int y_sampling = planar ? info->y_sampling[i] : max_y_sampling;
+    output->widths[i] = CDIV(info->width * x_sampling, max_x_sampling * scale);
+    output->heights[i] = CDIV(info->height * y_sampling, max_y_sampling * scale);
+    int row_size = output->widths[i] * pixel_size_of(format);
+    if (output->strides[i] == 0)
+      output->strides[i] = row_size;
+    if (output->strides[i] < row_size)
+      return 0;
+    output->sizes[i] = (size_t)output->strides[i] * (output->heights[i] - 1) + row_size;
+    total += output->sizes[i];
+  }
+  output->n_planes = planar ? info->n_components : 1;
+  return total;
+}
+
+// the orientation tag of IFD0 in an Exif APP1 payload, 1 to 8. 0 if there is none. Exif 2.3 4.5 and 4.6.4
+int read_exif_orientation(const uint8_t *buffer, uint16_t buflen) {
+  if (buflen < 6 + 8 || memcmp(buffer, "Exif\0\0", 6) != 0)
+    return 0;
+  const uint8_t *tiff = buffer + 6;
+  size_t tiff_size = buflen - 6;
+  bool big_endian = tiff[0] == 'M' && tiff[1] == 'M';
+  if (!big_endian && !(tiff[0] == 'I' && tiff[1] == 'I'))
+    return 0;
+#define READ_16(p) (big_endian ? ((p)[0] << 8) | (p)[1] : ((p)[1] << 8) | (p)[0])
+#define READ_32(p) (((uint32_t)READ_16((p) + (big_endian ? 0 : 2)) << 16) | READ_16((p) + (big_endian ? 2 : 0)))
+
+  // bounds are checked by subtracting from tiff_size, so that a huge offset cannot wrap around
+  size_t ifd = READ_32(tiff + 4);
+  if (ifd > tiff_size - 2)
+    return 0;
+  size_t n_entries = MIN((size_t)READ_16(tiff + ifd), (tiff_size - ifd - 2) / 12);
+  for (size_t i = 0; i < n_entries; i++) {
+    const uint8_t *entry = tiff + ifd + 2 + i * 12;
+    int value = READ_16(entry + 8);
+    if (READ_16(entry) == 0x0112) // SHORT, so the value is in the first 2 bytes of the value field
+      return READ_16(entry + 2) == 3 && value >= 1 && value <= 8 ? value : 0;
+  }
+  return 0;
+#undef READ_16
+#undef READ_32
+}
+
+// bytes per pixel. planar output has 1 byte per sample in each plane
+int pixel_size_of(JpegPixelFormat format) {
+  if (format == JPEG_PIXEL_RGB || format == JPEG_PIXEL_BGR)
+    return 3;
+  if (format == JPEG_PIXEL_RGBA || format == JPEG_PIXEL_BGRA)
+    return 4;
+  return 1;
 }
 
 // JFIF i.e. JPEG Part 5
-void handle_app0(const uint8_t *buffer, uint16_t buflen) {
-  PRINT("APP0 (length = %d)\n", buflen);
-  PRINT("  identifier = %.5s\n", buffer); // either JFIF or JFXX
-
-  if (strcmp((const char *)buffer, "JFIF") == 0) {
-    ASSERT(buflen >= 14, "Payload is too short");
-    PRINT("  version = %d.%d\n", buffer[5], buffer[6]);
-    PRINT("  units = %d\n", buffer[7]);
-    PRINT("  density = (%d, %d)\n", read_be_16(buffer + 8), read_be_16(buffer + 10));
-    PRINT("  thumbnail = (%d, %d)\n", buffer[12], buffer[13]);
-  } else if (strcmp((const char *)buffer, "JFXX") == 0) {
-    PRINT("  extension_code = %X\n", buffer[5]);
+void handle_app0(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
+  PRINT(decoder, "APP0 (length = %d)\n", buflen);
+  PRINT(decoder, "  identifier = %.5s\n", buffer); // either JFIF or JFXX
+
+  if (buflen >= 5 && memcmp(buffer, "JFIF", 5) == 0) {
+    ASSERT(decoder, buflen >= 14, JPEG_ERROR_CORRUPT, "Payload is too short");
+    PRINT(decoder, "  version = %d.%d\n", buffer[5], buffer[6]);
+    PRINT(decoder, "  units = %d\n", buffer[7]);
+    PRINT(decoder, "  density = (%d, %d)\n", read_be_16(buffer + 8), read_be_16(buffer + 10));
+    PRINT(decoder, "  thumbnail = (%d, %d)\n", buffer[12], buffer[13]);
+  } else if (buflen >= 6 && memcmp(buffer, "JFXX", 5) == 0) {
+    PRINT(decoder, "  extension_code = %X\n", buffer[5]);
   } else
-    PRINT("  Invalid identifier\n");
+    PRINT(decoder, "  Invalid identifier\n");
 }
 
 // ITU-T.81 B.2.4.1
 // there can be multiple quantization tables within 1 DQT segment
 void handle_dqt(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
-  PRINT("DQT (length = %d)\n", buflen);
+  PRINT(decoder, "DQT (length = %d)\n", buflen);
 
   int offset = 0;
   while (offset < buflen) {
@@ -291,23 +990,23 @@ void handle_dqt(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
     uint8_t identifier = lower_half(buffer[offset]);
     int table_size = 1 + BLOCK_SIZE * BLOCK_SIZE * (precision + 1);
 
-    PRINT("  precision = %d (%d-bit), identifier = %d\n", precision, (precision + 1) * 8, identifier);
-    ASSERT(buflen >= offset + table_size, "Payload is too short");
+    PRINT(decoder, "  precision = %d (%d-bit), identifier = %d\n", precision, (precision + 1) * 8, identifier);
+    ASSERT(decoder, precision <= 1 && identifier < 4, JPEG_ERROR_CORRUPT, "Invalid quantization table");
+    ASSERT(decoder, buflen >= offset + table_size, JPEG_ERROR_CORRUPT, "Payload is too short");
 
+    // store in natural order so that dequantization can be done inside the IDCT
     uint16_t *q_table = decoder->q_tables[identifier];
-    if (precision) {
-      for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
-        q_table[i] = read_be_16(buffer + offset + 1 + i * 2);
-    } else {
-      for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
-        q_table[i] = buffer[offset + 1 + i];
-    }
+    for (int i = 0; i < BLOCK_SIZE; i++)
+      for (int j = 0; j < BLOCK_SIZE; j++) {
+        int k = ZIG_ZAG[i][j];
+        q_table[i * BLOCK_SIZE + j] = precision ? read_be_16(buffer + offset + 1 + k * 2) : buffer[offset + 1 + k];
+      }
 
     for (int i = 0; i < BLOCK_SIZE; i++) {
-      PRINT("  ");
+      PRINT(decoder, "  ");
       for (int j = 0; j < BLOCK_SIZE; j++)
-        PRINT(" %3d", q_table[ZIG_ZAG[i][j]]);
-      PRINT("\n");
+        PRINT(decoder, " %3d", q_table[i * BLOCK_SIZE + j]);
+      PRINT(decoder, "\n");
     }
 
     offset += table_size;
@@ -317,14 +1016,15 @@ void handle_dqt(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
 // ITU-T.81 B.2.4.2
 // there can be multiple huffman tables within 1 DHT segment
 void handle_dht(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
-  PRINT("DHT (length = %d)\n", buflen);
+  PRINT(decoder, "DHT (length = %d)\n", buflen);
 
   int offset = 0;
   while (offset < buflen) {
     uint8_t class = upper_half(buffer[offset]);
     uint8_t identifier = lower_half(buffer[offset]);
-    PRINT("  class = %d (%s), identifier = %d\n", class, class ? "AC" : "DC", identifier);
-    ASSERT(buflen >= offset + 1 + MAX_HUFFMAN_CODE_LENGTH, "Payload is too short");
+    PRINT(decoder, "  class = %d (%s), identifier = %d\n", class, class ? "AC" : "DC", identifier);
+    ASSERT(decoder, class < 2 && identifier < 4, JPEG_ERROR_CORRUPT, "Invalid Huffman table");
+    ASSERT(decoder, buflen >= offset + 1 + MAX_HUFFMAN_CODE_LENGTH, JPEG_ERROR_CORRUPT, "Payload is too short");
 
     // ITU-T.81 Annex C: create Huffman table
     HuffmanTable *h_table = &decoder->h_tables[class][identifier];
@@ -332,18 +1032,23 @@ void handle_dht(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
     for (int i = 0; i < MAX_HUFFMAN_CODE_LENGTH; i++)
       n_codes += buffer[offset + 1 + i];
     int table_size = 1 + MAX_HUFFMAN_CODE_LENGTH + n_codes;
-    ASSERT(buflen >= offset + table_size, "Payload is too short");
+    ASSERT(decoder, buflen >= offset + table_size, JPEG_ERROR_CORRUPT, "Payload is too short");
+    ASSERT(decoder, n_codes <= MAX_HUFFMAN_CODES, JPEG_ERROR_CORRUPT, "Too many Huffman codes");
+    h_table->n_codes = n_codes;
 
-    _MALLOC(h_table->huffsize, n_codes * sizeof(*h_table->huffsize));
-    _MALLOC(h_table->huffcode, n_codes * sizeof(*h_table->huffcode));
-    _MALLOC(h_table->huffval, n_codes * sizeof(*h_table->huffval));
+    // only needed to build the table
+    uint8_t huffsize[MAX_HUFFMAN_CODES];
+    uint16_t huffcode[MAX_HUFFMAN_CODES];
 
     // Figure C.1 and C.2
     for (int i = 0, k = 0, code = 0; i < MAX_HUFFMAN_CODE_LENGTH; i++) {
       for (int j = 0; j < buffer[offset + 1 + i]; j++, k++, code++) {
-        h_table->huffsize[k] = i;
-        h_table->huffcode[k] = code;
+        ASSERT(decoder, code < (1 << (i + 1)), JPEG_ERROR_CORRUPT, "Too many Huffman codes of length %d", i + 1);
+        huffsize[k] = i;
+        huffcode[k] = code;
         h_table->huffval[k] = buffer[offset + 1 + MAX_HUFFMAN_CODE_LENGTH + k];
+        // F.1.2.1.1: DC values are bit lengths of the difference
+        ASSERT(decoder, class == 1 || h_table->huffval[k] <= 16, JPEG_ERROR_CORRUPT, "Invalid DC Huffman value");
       }
       code = code << 1;
     }
@@ -352,47 +1057,60 @@ void handle_dht(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
     for (int i = 0, j = 0; i < MAX_HUFFMAN_CODE_LENGTH; i++)
       if (buffer[offset + 1 + i]) {
         h_table->valptr[i] = j;
-        h_table->mincode[i] = h_table->huffcode[j];
-        h_table->maxcode[i] = h_table->huffcode[j + buffer[offset + 1 + i] - 1];
+        h_table->mincode[i] = huffcode[j];
+        h_table->maxcode[i] = huffcode[j + buffer[offset + 1 + i] - 1];
         j += buffer[offset + 1 + i];
       } else
         h_table->maxcode[i] = -1;
 
-    PRINT("  n_codes = %d\n", n_codes);
-    PRINT_LIST("  BITS     =", buffer + offset + 1, MAX_HUFFMAN_CODE_LENGTH, " %3d");
-    PRINT_LIST("  HUFFSIZE =", h_table->huffsize, n_codes, " %3d");
-    PRINT_LIST("  HUFFCODE =", h_table->huffcode, n_codes, " %3d");
-    PRINT_LIST("  HUFFVAL  =", h_table->huffval, n_codes, " %3d");
-    PRINT("\n");
-    PRINT_LIST("  MINCODE  =", h_table->mincode, MAX_HUFFMAN_CODE_LENGTH, " %3d");
-    PRINT_LIST("  MAXCODE  =", h_table->maxcode, MAX_HUFFMAN_CODE_LENGTH, " %3d");
-    PRINT_LIST("  VALPTR   =", h_table->valptr, MAX_HUFFMAN_CODE_LENGTH, " %3d");
-    PRINT("\n");
+    // lookahead table: every HUFFMAN_LOOKAHEAD-bit sequence that starts with a short code maps to that code
+    memset(h_table->lookup, 0, sizeof(h_table->lookup));
+    for (int k = 0; k < n_codes; k++) {
+      int length = huffsize[k] + 1;
+      if (length > HUFFMAN_LOOKAHEAD)
+        break;
+      int shift = HUFFMAN_LOOKAHEAD - length;
+      for (int i = 0; i < (1 << shift); i++)
+        h_table->lookup[(huffcode[k] << shift) | i] = (length << 8) | h_table->huffval[k];
+    }
+
+    PRINT(decoder, "  n_codes = %d\n", n_codes);
+    PRINT_LIST(decoder, "  BITS     =", buffer + offset + 1, MAX_HUFFMAN_CODE_LENGTH, " %3d");
+    PRINT_LIST(decoder, "  HUFFSIZE =", huffsize, n_codes, " %3d");
+    PRINT_LIST(decoder, "  HUFFCODE =", huffcode, n_codes, " %3d");
+    PRINT_LIST(decoder, "  HUFFVAL  =", h_table->huffval, n_codes, " %3d");
+    PRINT(decoder, "\n");
+    PRINT_LIST(decoder, "  MINCODE  =", h_table->mincode, MAX_HUFFMAN_CODE_LENGTH, " %3d");
+    PRINT_LIST(decoder, "  MAXCODE  =", h_table->maxcode, MAX_HUFFMAN_CODE_LENGTH, " %3d");
+    PRINT_LIST(decoder, "  VALPTR   =", h_table->valptr, MAX_HUFFMAN_CODE_LENGTH, " %3d");
+    PRINT(decoder, "\n");
 
     offset += table_size;
   }
 }
 
-void handle_sof0(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
-  PRINT("SOF0 (length = %d)\n", buflen);
-
-  decoder->encoding = SOF0;
+// SOF0 (baseline) or SOF2 (progressive, Huffman coding)
+void handle_sof(Decoder *decoder, uint8_t marker, const uint8_t *buffer, uint16_t buflen) {
+  PRINT(decoder, "SOF%d (length = %d)\n", marker - SOF0, buflen);
 
   // Table B.2
-  ASSERT(buflen >= 6, "Payload is too short");
+  ASSERT(decoder, decoder->encoding == 0, JPEG_ERROR_CORRUPT, "Multiple frames");
+  decoder->encoding = marker;
+  ASSERT(decoder, buflen >= 6, JPEG_ERROR_CORRUPT, "Payload is too short");
   uint8_t precision = buffer[0];
-  decoder->height = read_be_16(buffer + 1);
-  decoder->width = read_be_16(buffer + 3);
+  decoder->frame_height = read_be_16(buffer + 1);
+  decoder->frame_width = read_be_16(buffer + 3);
   decoder->n_channels = buffer[5];
 
-  PRINT("  encoding = Baseline DCT\n");
-  PRINT("  precision = %d-bit\n", precision);
-  PRINT("  image dimension = (%d, %d)\n", decoder->width, decoder->height);
+  PRINT(decoder, "  encoding = %s\n", marker == SOF0 ? "Baseline DCT" : "Progressive DCT");
+  PRINT(decoder, "  precision = %d-bit\n", precision);
+  PRINT(decoder, "  image dimension = (%d, %d)\n", decoder->frame_width, decoder->frame_height);
 
-  ASSERT(precision == 8, "Only 8-bit image is supported");
-  ASSERT((buffer[5] == 1) || (buffer[5] == 3), "Only 1 or 3 channels are supported");
-  ASSERT(buflen >= 6 + decoder->n_channels * 3, "Payload is too short");
-  _MALLOC(decoder->image, decoder->height * decoder->width * decoder->n_channels);
+  ASSERT(decoder, precision == 8, JPEG_ERROR_UNSUPPORTED, "Only 8-bit image is supported");
+  ASSERT(decoder, decoder->frame_width > 0 && decoder->frame_height > 0, JPEG_ERROR_UNSUPPORTED,
+         "Image dimension is not defined");
+  ASSERT(decoder, (buffer[5] == 1) || (buffer[5] == 3), JPEG_ERROR_UNSUPPORTED, "Only 1 or 3 channels are supported");
+  ASSERT(decoder, buflen >= 6 + decoder->n_channels * 3, JPEG_ERROR_CORRUPT, "Payload is too short");
 
   // we need to do this since component_id is not consistent. it can be 1, 2, 3 or 0, 1, 2
   decoder->min_component = buffer[6];
@@ -403,7 +1121,10 @@ void handle_sof0(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
   decoder->max_y_sampling = 0;
   for (int i = 0; i < decoder->n_channels; i++) {
     uint8_t component_id = buffer[6 + i * 3];
+    ASSERT(decoder, component_id - decoder->min_component < decoder->n_channels, JPEG_ERROR_UNSUPPORTED,
+           "Unsupported component_id %d", component_id);
     Component *component = &decoder->components[component_id - decoder->min_component];
+    ASSERT(decoder, component->x_sampling == 0, JPEG_ERROR_CORRUPT, "Duplicate component_id");
     component->x_sampling = upper_half(buffer[7 + i * 3]);
     component->y_sampling = lower_half(buffer[7 + i * 3]);
     component->q_table_id = buffer[8 + i * 3];
@@ -411,264 +1132,2806 @@ void handle_sof0(Decoder *decoder, const uint8_t *buffer, uint16_t buflen) {
     decoder->max_x_sampling = MAX(decoder->max_x_sampling, component->x_sampling);
     decoder->max_y_sampling = MAX(decoder->max_y_sampling, component->y_sampling);
 
-    PRINT("  component %d: sampling_factor = (%d, %d) q_table_id = %d\n", component_id, component->x_sampling,
+    PRINT(decoder, "  component %d: sampling_factor = (%d, %d) q_table_id = %d\n", component_id, component->x_sampling,
           component->y_sampling, component->q_table_id);
+    ASSERT(decoder, 1 <= component->x_sampling && component->x_sampling <= 4, JPEG_ERROR_CORRUPT,
+           "Invalid sampling factor");
+    ASSERT(decoder, 1 <= component->y_sampling && component->y_sampling <= 4, JPEG_ERROR_CORRUPT,
+           "Invalid sampling factor");
+    ASSERT(decoder, component->q_table_id < 4, JPEG_ERROR_CORRUPT, "Invalid q_table_id");
+  }
+
+  // progressive scans refine coefficients of the whole image. samples are only produced at EOI.
+  // with coefs_only, the coefficients are the output, and the rest is not needed
+  if (decoder->encoding == SOF2 || decoder->coefs_only)
+    allocate_coefs(decoder, decoder->encoding == SOF2);
+  if (decoder->coefs_only)
+    return;
+  // the seek index only needs the MCU grid, and nothing is output
+  if (decoder->index_only) {
+    ASSERT(decoder, decoder->encoding == SOF0, JPEG_ERROR_UNSUPPORTED, "Seek index needs a baseline JPEG");
+    decoder->block_size = BLOCK_SIZE;
+    return;
+  }
+
+  // scaled decoding. each block is reduced by the IDCT
+  decoder->block_size = BLOCK_SIZE / decoder->scale;
+  decoder->width = CDIV(decoder->frame_width, decoder->scale);
+  decoder->height = CDIV(decoder->frame_height, decoder->scale);
+
+  // the output buffer only holds the crop rectangle
+  if (decoder->crop[2]) {
+    ASSERT(decoder, decoder->crop[0] < decoder->width && decoder->crop[1] < decoder->height,
+           JPEG_ERROR_INVALID_ARGUMENT, "Crop rectangle is outside of the image");
+    decoder->crop_x = decoder->crop[0];
+    decoder->crop_y = decoder->crop[1];
+    decoder->width = MIN(decoder->crop[2], decoder->width - decoder->crop_x);
+    decoder->height = MIN(decoder->crop[3], decoder->height - decoder->crop_y);
+  }
+  if (decoder->scale > 1 || decoder->crop[2])
+    PRINT(decoder, "  output = (%d, %d) at (%d, %d)\n", decoder->width, decoder->height, decoder->crop_x,
+          decoder->crop_y);
+
+  setup_output(decoder);
+
+  // triangle filter for 2x chroma subsampling, like libjpeg's fancy upsampling. others use nearest neighbor.
+  // planar output is not upsampled, and luma-only output does not use chroma
+  for (int i = 0; i < decoder->n_channels; i++) {
+    Component *component = &decoder->components[i];
+    int x_factor = decoder->max_x_sampling / component->x_sampling;
+    int y_factor = decoder->max_y_sampling / component->y_sampling;
+    component->fancy = decoder->fancy_upsampling && decoder->format != JPEG_PIXEL_YCBCR_PLANAR &&
+                       !(decoder->luma_only && i > 0) && x_factor * component->x_sampling == decoder->max_x_sampling &&
+                       y_factor * component->y_sampling == decoder->max_y_sampling && x_factor <= 2 &&
+                       y_factor <= 2 && x_factor * y_factor > 1;
+    decoder->fancy_x |= component->fancy && x_factor == 2;
+    decoder->fancy_y |= component->fancy && y_factor == 2;
+  }
+}
+
+// check the output buffers against the image size, or allocate the image. output->n_planes, widths and heights are
+// set first, so that the caller can see what is needed when the buffers are too small
+void setup_output(Decoder *decoder) {
+  JpegOutput *output = decoder->output;
+  JpegPixelFormat format = output != NULL ? output->format : JPEG_PIXEL_NATIVE;
+  if (format == JPEG_PIXEL_NATIVE)
+    format = decoder->n_channels == 1 ? JPEG_PIXEL_GRAY : JPEG_PIXEL_RGB;
+  ASSERT(decoder, JPEG_PIXEL_RGB <= format && format <= JPEG_PIXEL_YCBCR_PLANAR, JPEG_ERROR_INVALID_ARGUMENT,
+         "Invalid pixel format %d", format);
+  decoder->format = format;
+  decoder->pixel_size = pixel_size_of(format);
+  decoder->luma_only = decoder->n_channels == 3 && format == JPEG_PIXEL_GRAY;
+  decoder->stride = decoder->width * decoder->pixel_size;
+
+  if (decoder->row_callback != NULL) {
+    // the tallest MCU row of any scan
+    int mcu_height = decoder->block_size * decoder->max_y_sampling;
+    decoder->image = arena_alloc(decoder, (size_t)mcu_height * decoder->stride);
+    return;
+  }
+  if (output == NULL) {
+    _MALLOC(decoder, decoder->image, (size_t)decoder->height * decoder->stride);
+    return;
+  }
+
+  bool planar = format == JPEG_PIXEL_YCBCR_PLANAR;
+  ASSERT(decoder, !planar || !decoder->crop[2], JPEG_ERROR_INVALID_ARGUMENT, "Planar output cannot be cropped");
+  output->n_planes = planar ? decoder->n_channels : 1;
+  for (int i = 0; i < output->n_planes; i++) {
+    Component *component = &decoder->components[i];
+    if (planar) {
+      // A.1.1, at the output scale
+      output->widths[i] = CDIV(decoder->frame_width * component->x_sampling, decoder->max_x_sampling * decoder->scale);
+      output->heights[i] =
+          CDIV(decoder->frame_height * component->y_sampling, decoder->max_y_sampling * decoder->scale);
+    } else {
+      output->widths[i] = decoder->width;
+      output->heights[i] = decoder->height;
+    }
+  }
+  for (int i = 0; i < output->n_planes; i++) {
+    int row_size = output->widths[i] * decoder->pixel_size;
+    if (output->strides[i] == 0)
+      output->strides[i] = row_size;
+    ASSERT(decoder, output->strides[i] >= row_size, JPEG_ERROR_INVALID_ARGUMENT, "Stride of plane %d is too small", i);
+    size_t plane_size = (size_t)output->strides[i] * (output->heights[i] - 1) + row_size;
+    ASSERT(decoder, output->sizes[i] >= plane_size, JPEG_ERROR_BUFFER_TOO_SMALL,
+           "Output buffer is too small. %zu bytes are needed", plane_size);
+    ASSERT(decoder, output->planes[i] != NULL, JPEG_ERROR_INVALID_ARGUMENT, "Plane %d is NULL", i);
   }
+  decoder->image = output->planes[0];
+  decoder->stride = output->strides[0];
 }
 
-void handle_sos(Decoder *decoder, const uint8_t *payload, uint16_t length, FILE *f) {
-  PRINT("SOS\n");
+// returns the number of bytes of entropy-coded data, which is where the next marker starts
+size_t handle_sos(Decoder *decoder, const uint8_t *payload, uint16_t length, const uint8_t *data, size_t size) {
+  PRINT(decoder, "SOS\n");
+  STATS_ADD(decoder, scans, 1);
 
-  ASSERT(decoder->encoding == SOF0, "Only Baseline JPEG is support");
+  ASSERT(decoder, decoder->encoding == SOF0 || decoder->encoding == SOF2, JPEG_ERROR_CORRUPT, "SOS before SOF");
+  ASSERT(decoder, length >= 1, JPEG_ERROR_CORRUPT, "Payload is too short");
 
   uint8_t n_components = payload[0];
-  PRINT("  n_components in scan = %d\n", n_components);
-  ASSERT(n_components <= decoder->n_channels, "Scan contains more channels than declared in SOF");
+  PRINT(decoder, "  n_components in scan = %d\n", n_components);
+  ASSERT(decoder, 1 <= n_components && n_components <= decoder->n_channels, JPEG_ERROR_CORRUPT,
+         "Scan contains more channels than declared in SOF");
+  ASSERT(decoder, length >= 4 + n_components * 2, JPEG_ERROR_CORRUPT, "Payload is too short");
+
+  // spectral selection and successive approximation. G.1.1.1
+  int ss = payload[1 + n_components * 2];
+  int se = payload[2 + n_components * 2];
+  int ah = upper_half(payload[3 + n_components * 2]);
+  int al = lower_half(payload[3 + n_components * 2]);
+  PRINT(decoder, "  ss = %d\n", ss);
+  PRINT(decoder, "  se = %d\n", se);
+  PRINT(decoder, "  ah = %d\n", ah);
+  PRINT(decoder, "  al = %d\n", al);
+  bool progressive = decoder->encoding == SOF2;
 
   for (int i = 0; i < n_components; i++) {
-    PRINT("  component %d: DC coding table = %d  AC coding table = %d\n", payload[1 + i * 2],
+    PRINT(decoder, "  component %d: DC coding table = %d  AC coding table = %d\n", payload[1 + i * 2],
           upper_half(payload[2 + i * 2]), lower_half(payload[2 + i * 2]));
-    ASSERT(payload[1 + i * 2] - decoder->min_component < decoder->n_channels, "Encounter invalid component_id");
+    int component_id = payload[1 + i * 2] - decoder->min_component;
+    ASSERT(decoder, 0 <= component_id && component_id < decoder->n_channels, JPEG_ERROR_CORRUPT,
+           "Encounter invalid component_id");
+    int dc_table_id = upper_half(payload[2 + i * 2]);
+    int ac_table_id = lower_half(payload[2 + i * 2]);
+    // progressive scans only use the tables they need
+    if (!progressive || (ss == 0 && ah == 0))
+      ASSERT(decoder, dc_table_id < 4 && decoder->h_tables[0][dc_table_id].n_codes, JPEG_ERROR_CORRUPT,
+             "DC Huffman table %d is not defined", dc_table_id);
+    if (!progressive || ss > 0)
+      ASSERT(decoder, ac_table_id < 4 && decoder->h_tables[1][ac_table_id].n_codes, JPEG_ERROR_CORRUPT,
+             "AC Huffman table %d is not defined", ac_table_id);
+  }
+
+  if (decoder->index_only)
+    return build_index(decoder, payload, data, size);
+
+  // a baseline scan without all components only has part of the samples of each MCU, so the scans are kept as
+  // coefficients like progressive ones until EOI. A.2.2
+  if (!progressive && !decoder->coefs_only && !decoder->multi_scan && n_components < decoder->n_channels) {
+    PRINT(decoder, "  non-interleaved: keep the coefficients until EOI\n");
+    allocate_coefs(decoder, true);
+    decoder->multi_scan = true;
+  }
+  if (progressive || decoder->coefs_only || decoder->multi_scan)
+    return decode_scan_coefs(decoder, payload, data, size);
+
+  setup_mcus(decoder, n_components);
+  int n_mcus = decoder->nx_mcu * decoder->ny_mcu;
+  for (int i = 0; i < MAX_COMPONENTS; i++)
+    decoder->dc_preds[i] = 0;
+  decoder->decode_mcus = select_decode_mcus(decoder, payload);
+
+  // crops start at the checkpoints of a seek index, which replaces the search for restart markers
+  size_t indexed_size = 0;
+  if (decoder->seek_index != NULL && decoder->crop[2] && n_components == decoder->n_channels)
+    indexed_size = find_checkpoints(decoder, data, size);
+
+  // restart intervals can be decoded independently
+  if (decoder->n_threads > 1 && decoder->restart_interval && n_mcus > decoder->restart_interval &&
+      decoder->row_callback == NULL && !indexed_size) {
+    size_t scan_size = decode_scan_parallel(decoder, payload, data, size);
+    if (scan_size)
+      return scan_size;
+    PRINT(decoder, "  restart markers are not as expected. decode serially\n");
+  }
+
+  // without restart markers, chunks of the scan can still be entropy-decoded in parallel once they synchronize
+  if (decoder->speculative && decoder->n_threads > 1 && !decoder->restart_interval &&
+      n_components == decoder->n_channels && decoder->row_callback == NULL && !indexed_size) {
+    size_t scan_size = decode_scan_speculative(decoder, payload, data, size);
+    if (scan_size)
+      return scan_size;
+  }
+
+  // otherwise entropy decoding overlaps with the IDCT and color conversion of the MCU rows before
+  if (decoder->n_threads > 1 && n_components == decoder->n_channels && decoder->row_callback == NULL &&
+      !indexed_size) {
+    size_t scan_size = decode_scan_pipelined(decoder, payload, data, size);
+    if (scan_size)
+      return scan_size;
+  }
+
+  // decoding stops after the last MCU of the output
+  BitReader br = {data, data + size};
+  int mcu_start = 0;
+  int mcu_end = (decoder->mcu_y1 - 1) * decoder->nx_mcu + decoder->mcu_x1;
+
+  if (indexed_size) {
+    seek_checkpoint(decoder, &br, &mcu_start, decoder->mcu_y0 * decoder->nx_mcu + decoder->mcu_x0);
+    allocate_mcu_rows(decoder, n_components);
+    decode_mcu_rows(decoder, payload, &br, n_components, mcu_start, mcu_end);
+    return indexed_size;
   }
 
-  // not used by Baseline DCT
-  PRINT("  ss = %d\n", payload[1 + n_components * 2]);
-  PRINT("  se = %d\n", payload[2 + n_components * 2]);
-  PRINT("  ah = %d\n", upper_half(payload[3 + n_components * 2]));
-  PRINT("  al = %d\n", lower_half(payload[3 + n_components * 2]));
+  // with restart markers, intervals before the output are skipped without decoding
+  int first_interval = decoder->restart_interval ? decoder->mcu_y0 * decoder->nx_mcu / decoder->restart_interval : 0;
+  if (first_interval > 0) {
+    int n_intervals = CDIV(n_mcus, decoder->restart_interval);
+    size_t *offsets = arena_alloc(decoder, n_intervals * sizeof(size_t));
+    size_t scan_size;
+    if (find_restart_intervals(data, size, offsets, n_intervals, &scan_size) == n_intervals) {
+      PRINT(decoder, "  skip %d restart intervals\n", first_interval);
+      br.ptr = data + offsets[first_interval] - 2; // at the RSTm marker, which decode_mcus() consumes
+      mcu_start = first_interval * decoder->restart_interval;
+    }
+  }
+
+  allocate_mcu_rows(decoder, n_components);
+  decode_mcu_rows(decoder, payload, &br, n_components, mcu_start, mcu_end);
+
+  size_t scan_size = br.ptr - data;
+  if (mcu_end < n_mcus) {
+    size_t remaining;
+    find_restart_intervals(br.ptr, size - scan_size, NULL, 0, &remaining);
+    scan_size += remaining;
+  }
+  return scan_size;
+}
 
+// the MCU grid of a scan with n_components, and the MCUs that overlap the output
+void setup_mcus(Decoder *decoder, int n_components) {
   if (n_components == 1) {
-    // Non-interleaved order. A.2.2
-    int component_id = payload[1] - decoder->min_component;
-    ASSERT(component_id < decoder->n_channels, "Encounter invalid component_id");
-    int dc_table_id = upper_half(payload[2]);
-    int ac_table_id = lower_half(payload[2]);
+    // Non-interleaved order. A.2.2. sampling factors do not matter for a single component. the scans of some of the
+    // components of an image go to decode_scan_coefs() instead
+    decoder->nx_mcu = CDIV(decoder->frame_width, BLOCK_SIZE);
+    decoder->ny_mcu = CDIV(decoder->frame_height, BLOCK_SIZE);
+  } else {
+    // Interleaved order. A.2.3
+    // calculate number of MCUs based on chroma-subsampling
+    decoder->nx_mcu = CDIV(decoder->frame_width, BLOCK_SIZE * decoder->max_x_sampling);
+    decoder->ny_mcu = CDIV(decoder->frame_height, BLOCK_SIZE * decoder->max_y_sampling);
+  }
 
-    decoder->dc_preds[component_id] = 0;
+  // MCUs outside of these are only entropy-decoded
+  int mcu_width = decoder->block_size * (n_components == 1 ? 1 : decoder->max_x_sampling);
+  int mcu_height = decoder->block_size * (n_components == 1 ? 1 : decoder->max_y_sampling);
+  decoder->mcu_x0 = decoder->crop_x / mcu_width;
+  decoder->mcu_x1 = CDIV(decoder->crop_x + decoder->width, mcu_width);
+  decoder->mcu_y0 = decoder->crop_y / mcu_height;
+  decoder->mcu_y1 = CDIV(decoder->crop_y + decoder->height, mcu_height);
+
+  // the triangle filter needs chroma samples next to the output
+  if (n_components > 1 && decoder->fancy_x) {
+    decoder->mcu_x0 = MAX(decoder->mcu_x0 - 1, 0);
+    decoder->mcu_x1 = MIN(decoder->mcu_x1 + 1, decoder->nx_mcu);
+  }
+  if (n_components > 1 && decoder->fancy_y) {
+    decoder->mcu_y0 = MAX(decoder->mcu_y0 - 1, 0);
+    decoder->mcu_y1 = MIN(decoder->mcu_y1 + 1, decoder->ny_mcu);
+  }
+}
 
-    // TODO: take into account sampling factor
-    int nx_blocks = CDIV(decoder->width, BLOCK_SIZE);
-    int ny_blocks = CDIV(decoder->height, BLOCK_SIZE);
+// decode MCUs [mcu_start, mcu_end) with decoder->decode_mcus, and produce the output rows one MCU row at a time
+// with vertical fancy upsampling, an MCU row is converted after the next one is decoded
+static inline int mcu_row_delay(const Decoder *decoder, int n_components) {
+  return n_components > 1 && decoder->fancy_y ? 1 : 0;
+}
 
-    int interval_idx = 0;
+// the planes and rows of decode_mcu_rows(), allocated beforehand so that it does not longjmp for memory
+void allocate_mcu_rows(Decoder *decoder, int n_components) {
+  // blocks are decoded into one plane per component, which holds a row of MCUs.
+  // full-resolution rows are produced from the planes for color conversion.
+  // with a delay, the planes hold the MCU rows above and below too
+  if (n_components > 1) {
+    allocate_planes(decoder, 1 + mcu_row_delay(decoder, n_components) * 2);
+    allocate_upsampled(decoder);
+  }
+}
 
-    for (int mcu_idx = 0; mcu_idx < ny_blocks * nx_blocks;) {
-      uint8_t block_u8[BLOCK_SIZE][BLOCK_SIZE];
-      if (!setjmp(RST_JMP_BUF)) {
-        // normal flow. decode_block may encounter RSTx marker
-        decode_block_sof0(decoder, f, block_u8, dc_table_id, ac_table_id, component_id);
-
-        // place mcu to image buffer
-        int mcu_y = mcu_idx / nx_blocks;
-        int mcu_x = mcu_idx % nx_blocks;
-        for (int j = 0; j < MIN(BLOCK_SIZE, decoder->height - mcu_y * BLOCK_SIZE); j++) {
-          int row_idx = mcu_y * BLOCK_SIZE + j;
-          for (int i = 0; i < MIN(BLOCK_SIZE, decoder->width - mcu_x * BLOCK_SIZE); i++) {
-            int col_idx = mcu_x * BLOCK_SIZE + i;
-            decoder->image[(row_idx * decoder->width + col_idx) * decoder->n_channels + component_id] = block_u8[j][i];
-          }
-        }
-        mcu_idx++;
-      } else {
-        // encounter restart interval (E.2.4)
-        // ignore current MCU, reset decoder state, move to the next interval
-        // NOTE: we don't check for consecutive restart markers
-        decoder->dc_preds[component_id] = 0;
-        mcu_idx = (++interval_idx) * decoder->restart_interval;
+// see allocate_mcu_rows() for the buffers it needs
+void decode_mcu_rows(Decoder *decoder, const uint8_t *payload, BitReader *br, int n_components, int mcu_start,
+                     int mcu_end) {
+  int mcu_height = decoder->block_size * (n_components == 1 ? 1 : decoder->max_y_sampling);
+  int delay = mcu_row_delay(decoder, n_components);
+
+  int mcu_idx = mcu_start; // next MCU to decode
+  for (int mcu_y = mcu_start / decoder->nx_mcu; mcu_y < decoder->mcu_y1 + delay; mcu_y++) {
+    int out_mcu_y = mcu_y - delay;
+
+    // when streaming, image only holds the MCU row being output
+    if (decoder->row_callback != NULL)
+      decoder->image_y = MAX(out_mcu_y * mcu_height - decoder->crop_y, 0);
+
+    if (mcu_y < decoder->mcu_y1) {
+      int row_end = MIN(mcu_end, (mcu_y + 1) * decoder->nx_mcu);
+      // with a seek index, each row starts at the checkpoint closest to the output, and stops at its end
+      if (decoder->checkpoints != NULL) {
+        seek_checkpoint(decoder, br, &mcu_idx, mcu_y * decoder->nx_mcu + decoder->mcu_x0);
+        row_end = MIN(row_end, mcu_y * decoder->nx_mcu + decoder->mcu_x1);
       }
+      uint64_t start = STATS_START(decoder);
+      decoder->decode_mcus(decoder, payload, br, decoder->dc_preds, mcu_idx, row_end);
+      if (br != NULL) // otherwise the coefficients are already decoded, and idct_block() times the IDCT
+        STATS_STOP(decoder, huffman_ns, start);
+      mcu_idx = MAX(mcu_idx, row_end);
+    }
+    if (out_mcu_y < decoder->mcu_y0)
+      continue;
+    if (n_components > 1)
+      color_convert_mcu_row(decoder, out_mcu_y);
+    if (decoder->row_callback != NULL) {
+      uint64_t start = STATS_START(decoder);
+      emit_rows(decoder, out_mcu_y, mcu_height);
+      STATS_STOP(decoder, output_ns, start);
     }
-    return;
   }
+}
 
-  // Interleaved order. A.2.3
-  // calculate number of MCUs based on chroma-subsampling
-  // TODO: handle restart markers for 3-channel
-  int mcu_width = BLOCK_SIZE * decoder->max_x_sampling;
-  int mcu_height = BLOCK_SIZE * decoder->max_y_sampling;
-  int nx_mcu = CDIV(decoder->width, mcu_width);
-  int ny_mcu = CDIV(decoder->height, mcu_height);
+// component planes hold n_mcu_rows rows of MCUs. MCU row mcu_y is at mcu_y % n_mcu_rows
+void allocate_planes(Decoder *decoder, int n_mcu_rows) {
+  decoder->n_plane_mcu_rows = n_mcu_rows;
+  for (int i = 0; i < decoder->n_channels; i++) {
+    Component *component = &decoder->components[i];
+    component->stride = decoder->nx_mcu * component->x_sampling * decoder->block_size;
+    component->plane =
+        arena_alloc(decoder, (size_t)component->stride * component->y_sampling * decoder->block_size * n_mcu_rows);
+  }
+}
 
-  for (int i = 0; i < MAX_COMPONENTS; i++)
-    decoder->dc_preds[i] = 0;
-  uint8_t *mcu;
-  _MALLOC(mcu, mcu_width * mcu_height * n_components);
-
-  for (int mcu_y = 0; mcu_y < ny_mcu; mcu_y++)
-    for (int mcu_x = 0; mcu_x < nx_mcu; mcu_x++) {
-      for (int c = 0; c < n_components; c++) {
-        int component_id = payload[1 + c * 2] - decoder->min_component;
-        int dc_table_id = upper_half(payload[2 + c * 2]);
-        int ac_table_id = lower_half(payload[2 + c * 2]);
-        Component *component = &decoder->components[component_id];
-
-        for (int y = 0; y < component->y_sampling; y++)
-          for (int x = 0; x < component->x_sampling; x++) {
-            uint8_t block_u8[BLOCK_SIZE][BLOCK_SIZE];
-            decode_block_sof0(decoder, f, block_u8, dc_table_id, ac_table_id, component_id);
-
-            // place to mcu. A.2.3 and JFIF p.4
-            // NOTE: assume order in the scan is YCbCr
-            // TODO: use better upsampling algorithm e.g. bilinear
-            int n_repeat_y = decoder->max_y_sampling / component->y_sampling;
-            int n_repeat_x = decoder->max_x_sampling / component->x_sampling;
-            for (int j = 0; j < BLOCK_SIZE * n_repeat_y; j++) {
-              int row_idx = y * BLOCK_SIZE + j;
-              for (int i = 0; i < BLOCK_SIZE * n_repeat_x; i++) {
-                int col_idx = x * BLOCK_SIZE + i;
-                mcu[(row_idx * mcu_width + col_idx) * n_components + c] = block_u8[j / n_repeat_y][i / n_repeat_x];
-              }
-            }
-          }
-      }
+// rows have room for SIMD loops to go past the end
+void allocate_upsampled(Decoder *decoder) {
+  int width = decoder->nx_mcu * decoder->block_size * decoder->max_x_sampling;
+  for (int i = 0; i < decoder->n_channels; i++)
+    decoder->upsampled[i] = arena_alloc(decoder, width + 16);
+  decoder->colsum = arena_alloc(decoder, (width + 32) * sizeof(int16_t));
+}
 
-      for (int j = 0; j < MIN(mcu_height, decoder->height - mcu_y * mcu_height); j++) {
-        int row_idx = mcu_y * mcu_height + j;
-        for (int i = 0; i < MIN(mcu_width, decoder->width - mcu_x * mcu_width); i++) {
-          int col_idx = mcu_x * mcu_width + i;
-          ycbcr_to_rgb_(mcu + (j * mcu_width + i) * n_components);
-          for (int c = 0; c < n_components; c++) {
-            int component_id = payload[1 + c * 2] - decoder->min_component;
-            decoder->image[(row_idx * decoder->width + col_idx) * decoder->n_channels + component_id] =
-                mcu[(j * mcu_width + i) * n_components + c];
-          }
-        }
-      }
+// coefficients of the whole image, in MCU layout. zeroed ones are all set, for scans that only refine them
+void allocate_coefs(Decoder *decoder, bool zero) {
+  int nx_mcu = CDIV(decoder->frame_width, BLOCK_SIZE * decoder->max_x_sampling);
+  int ny_mcu = CDIV(decoder->frame_height, BLOCK_SIZE * decoder->max_y_sampling);
+  decoder->n_coef_mcu_rows = ny_mcu;
+  for (int i = 0; i < decoder->n_channels; i++) {
+    Component *component = &decoder->components[i];
+    component->blocks_per_row = nx_mcu * component->x_sampling;
+    size_t n_coefs = (size_t)component->blocks_per_row * ny_mcu * component->y_sampling * BLOCK_SIZE * BLOCK_SIZE;
+    component->coefs = arena_alloc(decoder, n_coefs * sizeof(int16_t));
+    if (zero) {
+      memset(component->coefs, 0, n_coefs * sizeof(int16_t));
+      component->coefs_set = true;
     }
+  }
 }
 
-// Figure F.12
-int32_t extend(uint16_t value, uint16_t n_bits) {
-  return value < (1 << (n_bits - 1)) ? value + (-1 << n_bits) + 1 : value;
+// specialized MCU loops for the common layouts: grayscale, and Y/Cb/Cr in one scan with 1x1 chroma.
+// decode_mcus() handles everything else
+DecodeMCUsFunction select_decode_mcus(Decoder *decoder, const uint8_t *payload) {
+  uint8_t n_components = payload[0];
+  if (n_components == 1)
+    return decoder->n_channels == 1 ? decode_mcus_gray : decode_mcus;
+  if (n_components != 3)
+    return decode_mcus;
+
+  Component *components[3];
+  for (int c = 0; c < 3; c++)
+    components[c] = &decoder->components[payload[1 + c * 2] - decoder->min_component];
+  for (int c = 1; c < 3; c++)
+    if (components[c]->x_sampling != 1 || components[c]->y_sampling != 1)
+      return decode_mcus;
+
+  int x_sampling = components[0]->x_sampling;
+  int y_sampling = components[0]->y_sampling;
+  if (x_sampling == 1 && y_sampling == 1)
+    return decode_mcus_444;
+  if (x_sampling == 2 && y_sampling == 1)
+    return decode_mcus_422;
+  if (x_sampling == 2 && y_sampling == 2)
+    return decode_mcus_420;
+  return decode_mcus;
 }
 
-// Figure F.18
-uint8_t nextbit(FILE *f) {
-  // impure function
-  static uint8_t CNT = 0, B;
+// decode MCUs [mcu_start, mcu_end) of the current scan. dc_preds are the DC predictors of each component
+void decode_mcus(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start, int mcu_end) {
+  uint8_t n_components = payload[0];
+
+  for (int mcu_idx = mcu_start; mcu_idx < mcu_end; mcu_idx++) {
+    if (decoder->restart_interval && mcu_idx && mcu_idx % decoder->restart_interval == 0) {
+      handle_restart(decoder, br, mcu_idx / decoder->restart_interval - 1);
+      for (int i = 0; i < MAX_COMPONENTS; i++)
+        dc_preds[i] = 0;
+    }
 
-  if (CNT == 0) {
-    _FREAD(&B, 1, 1, f);
-    CNT = 8;
+    int mcu_y = mcu_idx / decoder->nx_mcu;
+    int mcu_x = mcu_idx % decoder->nx_mcu;
+    bool skip = mcu_x < decoder->mcu_x0 || mcu_x >= decoder->mcu_x1 || mcu_y < decoder->mcu_y0 ||
+                mcu_y >= decoder->mcu_y1;
+
+    if (n_components == 1) {
+      int component_id = payload[1] - decoder->min_component;
+      int dc_table_id = upper_half(payload[2]);
+      int ac_table_id = lower_half(payload[2]);
+      int *dc_pred = &dc_preds[component_id];
+      if (skip || (decoder->luma_only && component_id > 0)) {
+        skip_block_sof0(decoder, br, dc_table_id, ac_table_id, dc_pred);
+        continue;
+      }
 
-    // potential marker. need to read next byte
-    // if next byte is 0x00, ignore this byte (byte stuffing: ITU T.81 F.1.2.3)
-    if (B == 0xFF) {
-      uint8_t B2;
-      _FREAD(&B2, 1, 1, f);
+      // position in the output. can be negative at the edges of the crop rectangle
+      int block_size = decoder->block_size;
+      int x = mcu_x * block_size - decoder->crop_x;
+      int y = mcu_y * block_size - decoder->crop_y;
 
-      if (B2 != 0) {
-        if ((RST0 <= B2) && (B2 <= RST7)) {
-          PRINT("Encounter RST%d marker\n", B2 - RST0);
-          CNT = 0;
-          longjmp(RST_JMP_BUF, 1);
-        } else if (B2 == DNL) {
-          ASSERT(false, "DNL marker. Not implemented");
-        } else {
-          ASSERT(false, "Found marker %X in scan. Decode error?", B2);
-        }
+      uint8_t block_u8[BLOCK_SIZE][BLOCK_SIZE];
+      decode_block_sof0(decoder, br, &block_u8[0][0], BLOCK_SIZE, dc_table_id, ac_table_id, component_id, dc_pred);
+
+      // place mcu to image buffer. planar output has a plane per component, at its own resolution
+      uint8_t *image = decoder->image;
+      int stride = decoder->stride;
+      int pixel_size = decoder->pixel_size;
+      int width = decoder->width;
+      int height = decoder->height;
+      int offset = component_id;
+      if (decoder->format == JPEG_PIXEL_YCBCR_PLANAR) {
+        image = decoder->output->planes[component_id];
+        stride = decoder->output->strides[component_id];
+        width = decoder->output->widths[component_id];
+        height = decoder->output->heights[component_id];
+        offset = 0;
+      } else if (decoder->format == JPEG_PIXEL_BGR || decoder->format == JPEG_PIXEL_BGRA) {
+        offset = 2 - component_id;
       }
+      for (int j = MAX(0, -y); j < MIN(block_size, height - y); j++)
+        for (int i = MAX(0, -x); i < MIN(block_size, width - x); i++)
+          image[(y + j - decoder->image_y) * stride + (x + i) * pixel_size + offset] = block_u8[j][i];
+      continue;
     }
-  }
 
-  uint8_t BIT = B >> 7;
-  CNT--;
-  B = B << 1;
-  return BIT;
+    for (int c = 0; c < n_components; c++) {
+      int component_id = payload[1 + c * 2] - decoder->min_component;
+      int dc_table_id = upper_half(payload[2 + c * 2]);
+      int ac_table_id = lower_half(payload[2 + c * 2]);
+      Component *component = &decoder->components[component_id];
+
+      int block_size = decoder->block_size;
+      int block_height = component->y_sampling * block_size;
+      // there are no planes when building a seek index
+      uint8_t *plane =
+          skip ? NULL : component->plane + (mcu_y % decoder->n_plane_mcu_rows) * block_height * component->stride;
+
+      for (int y = 0; y < component->y_sampling; y++)
+        for (int x = 0; x < component->x_sampling; x++) {
+          if (skip || (decoder->luma_only && component_id > 0)) {
+            skip_block_sof0(decoder, br, dc_table_id, ac_table_id, &dc_preds[component_id]);
+            continue;
+          }
+          // A.2.3
+          int col_idx = (mcu_x * component->x_sampling + x) * block_size;
+          uint8_t *out = plane + y * block_size * component->stride + col_idx;
+          decode_block_sof0(decoder, br, out, component->stride, dc_table_id, ac_table_id, component_id,
+                            &dc_preds[component_id]);
+        }
+    }
+  }
 }
 
-// Figure F.17
-uint16_t receive(FILE *f, uint16_t n_bits) {
-  uint16_t V = 0;
-  for (int i = 0; i < n_bits; i++)
-    V = (V << 1) + nextbit(f);
-  return V;
-}
+// a single-component scan of a grayscale image. blocks go straight to the image, except at the edges
+void decode_mcus_gray(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start,
+                      int mcu_end) {
+  int component_id = payload[1] - decoder->min_component;
+  int dc_table_id = upper_half(payload[2]);
+  int ac_table_id = lower_half(payload[2]);
+  int *dc_pred = &dc_preds[component_id];
+  int block_size = decoder->block_size;
+  int width = decoder->width;
+  int height = decoder->height;
+  int stride = decoder->stride;
+  int pixel_size = decoder->pixel_size;
+
+  for (int mcu_idx = mcu_start; mcu_idx < mcu_end; mcu_idx++) {
+    if (decoder->restart_interval && mcu_idx && mcu_idx % decoder->restart_interval == 0) {
+      handle_restart(decoder, br, mcu_idx / decoder->restart_interval - 1);
+      *dc_pred = 0;
+    }
 
-// Figure F.16
-uint16_t decode(FILE *f, HuffmanTable *h_table) {
-  int i = 0;
-  uint16_t CODE = nextbit(f);
+    int mcu_y = mcu_idx / decoder->nx_mcu;
+    int mcu_x = mcu_idx % decoder->nx_mcu;
+    if (mcu_x < decoder->mcu_x0 || mcu_x >= decoder->mcu_x1 || mcu_y < decoder->mcu_y0 || mcu_y >= decoder->mcu_y1) {
+      skip_block_sof0(decoder, br, dc_table_id, ac_table_id, dc_pred);
+      continue;
+    }
 
-  for (; CODE > h_table->maxcode[i]; i++)
-    CODE = (CODE << 1) + nextbit(f);
+    int x = mcu_x * block_size - decoder->crop_x;
+    int y = mcu_y * block_size - decoder->crop_y;
+    if (pixel_size == 1 && x >= 0 && y >= 0 && x + block_size <= width && y + block_size <= height) {
+      uint8_t *out = decoder->image + (y - decoder->image_y) * stride + x;
+      decode_block_sof0(decoder, br, out, stride, dc_table_id, ac_table_id, component_id, dc_pred);
+      continue;
+    }
 
-  return h_table->huffval[h_table->valptr[i] + CODE - h_table->mincode[i]];
+    // edges, and RGB(A) output
+    uint8_t block_u8[BLOCK_SIZE][BLOCK_SIZE];
+    decode_block_sof0(decoder, br, &block_u8[0][0], BLOCK_SIZE, dc_table_id, ac_table_id, component_id, dc_pred);
+    for (int j = MAX(0, -y); j < MIN(block_size, height - y); j++)
+      gray_to_pixels(&block_u8[j][MAX(0, -x)],
+                     decoder->image + (y + j - decoder->image_y) * stride + (x + MAX(0, -x)) * pixel_size,
+                     MIN(block_size, width - x) - MAX(0, -x), pixel_size);
+  }
 }
 
-void decode_block_sof0(Decoder *decoder, FILE *f, uint8_t block_u8[BLOCK_SIZE][BLOCK_SIZE], int dc_table_id,
-                       int ac_table_id, int component_id) {
-  HuffmanTable *dc_table = &decoder->h_tables[0][dc_table_id];
-  HuffmanTable *ac_table = &decoder->h_tables[1][ac_table_id];
-  uint16_t *q_table = decoder->q_tables[decoder->components[component_id].q_table_id];
+// Y/Cb/Cr in one scan, with x_sampling x y_sampling luma blocks and one block of each chroma component per MCU.
+// inlined with constant sampling factors, so the block loops are unrolled. the scan header is only read once per call
+static inline void decode_mcus_ycbcr(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds,
+                                     int mcu_start, int mcu_end, int x_sampling, int y_sampling) {
+  int component_ids[3], dc_table_ids[3], ac_table_ids[3], strides[3];
+  uint8_t *planes[3];
+  int block_size = decoder->block_size;
+  for (int c = 0; c < 3; c++) {
+    component_ids[c] = payload[1 + c * 2] - decoder->min_component;
+    dc_table_ids[c] = upper_half(payload[2 + c * 2]);
+    ac_table_ids[c] = lower_half(payload[2 + c * 2]);
+    strides[c] = decoder->components[component_ids[c]].stride;
+    planes[c] = decoder->components[component_ids[c]].plane;
+  }
 
-  // NOTE: block can be negative, dequantized value can be out-of-range
-  int16_t block[BLOCK_SIZE * BLOCK_SIZE] = {0};
-  double block_f64[BLOCK_SIZE][BLOCK_SIZE];
+  for (int mcu_idx = mcu_start; mcu_idx < mcu_end; mcu_idx++) {
+    if (decoder->restart_interval && mcu_idx && mcu_idx % decoder->restart_interval == 0) {
+      handle_restart(decoder, br, mcu_idx / decoder->restart_interval - 1);
+      for (int c = 0; c < 3; c++)
+        dc_preds[component_ids[c]] = 0;
+    }
 
-  // decode DC: F.2.2.1
-  uint16_t n_bits = decode(f, dc_table);
-  uint16_t value = receive(f, n_bits);
-  int32_t diff = extend(value, n_bits);
+    int mcu_y = mcu_idx / decoder->nx_mcu;
+    int mcu_x = mcu_idx % decoder->nx_mcu;
+    if (mcu_x < decoder->mcu_x0 || mcu_x >= decoder->mcu_x1 || mcu_y < decoder->mcu_y0 || mcu_y >= decoder->mcu_y1) {
+      for (int i = 0; i < x_sampling * y_sampling; i++)
+        skip_block_sof0(decoder, br, dc_table_ids[0], ac_table_ids[0], &dc_preds[component_ids[0]]);
+      for (int c = 1; c < 3; c++)
+        skip_block_sof0(decoder, br, dc_table_ids[c], ac_table_ids[c], &dc_preds[component_ids[c]]);
+      continue;
+    }
 
-  decoder->dc_preds[component_id] += diff;
-  block[0] = decoder->dc_preds[component_id] * q_table[0];
+    // A.2.3
+    int plane_row = mcu_y % decoder->n_plane_mcu_rows * block_size;
+    uint8_t *luma = planes[0] + (size_t)plane_row * y_sampling * strides[0] + mcu_x * x_sampling * block_size;
+    for (int y = 0; y < y_sampling; y++)
+      for (int x = 0; x < x_sampling; x++)
+        decode_block_sof0(decoder, br, luma + y * block_size * strides[0] + x * block_size, strides[0],
+                          dc_table_ids[0], ac_table_ids[0], component_ids[0], &dc_preds[component_ids[0]]);
+    for (int c = 1; c < 3; c++) {
+      if (decoder->luma_only && component_ids[c] > 0)
+        skip_block_sof0(decoder, br, dc_table_ids[c], ac_table_ids[c], &dc_preds[component_ids[c]]);
+      else
+        decode_block_sof0(decoder, br, planes[c] + (size_t)plane_row * strides[c] + mcu_x * block_size, strides[c],
+                          dc_table_ids[c], ac_table_ids[c], component_ids[c], &dc_preds[component_ids[c]]);
+    }
+  }
+}
 
-  // decode AC: F.2.2.2
-  for (int k = 1; k < BLOCK_SIZE * BLOCK_SIZE;) {
-    uint16_t rs = decode(f, ac_table);
-    if (rs == ZRL)
-      k += 16;
-    else if (rs == EOB)
+void decode_mcus_444(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start,
+                     int mcu_end) {
+  decode_mcus_ycbcr(decoder, payload, br, dc_preds, mcu_start, mcu_end, 1, 1);
+}
+void decode_mcus_422(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start,
+                     int mcu_end) {
+  decode_mcus_ycbcr(decoder, payload, br, dc_preds, mcu_start, mcu_end, 2, 1);
+}
+void decode_mcus_420(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start,
+                     int mcu_end) {
+  decode_mcus_ycbcr(decoder, payload, br, dc_preds, mcu_start, mcu_end, 2, 2);
+}
+
+// locate the restart intervals of a scan. B.2.1 and E.2.4
+// returns the number of intervals found, and the size of the entropy-coded data.
+// offsets can be NULL to only find the size
+int find_restart_intervals(const uint8_t *data, size_t size, size_t *offsets, int max_intervals, size_t *scan_size) {
+  int n_intervals = 1;
+  if (offsets != NULL)
+    offsets[0] = 0;
+  *scan_size = size;
+  if (size < 2)
+    return n_intervals;
+
+  const uint8_t *last = data + size - 1; // a marker needs 2 bytes
+  for (const uint8_t *ptr = data; ptr < last && (ptr = memchr(ptr, 0xFF, last - ptr)) != NULL; ptr++) {
+    uint8_t byte2 = ptr[1];
+    if (byte2 == 0 || byte2 == 0xFF) // stuffed byte or fill byte
+      continue;
+    if (byte2 < RST0 || byte2 > RST7) {
+      *scan_size = ptr - data;
       break;
-    else {
-      int rrrr = upper_half(rs);
-      int ssss = lower_half(rs);
-      k += rrrr;
-      ASSERT(k < BLOCK_SIZE * BLOCK_SIZE, "Encounter invalid code");
-      value = receive(f, ssss);
-      block[k] = extend(value, ssss) * q_table[k];
-      k += 1;
     }
+    if (offsets != NULL) {
+      if (n_intervals == max_intervals)
+        return -1;
+      offsets[n_intervals] = ptr + 2 - data;
+    }
+    n_intervals++;
+    ptr++;
+  }
+  return n_intervals;
+}
+
+// jpeg_decoder_build_index(): a checkpoint every index_spacing MCUs of the first scan, in decoder->index. the output is
+// empty, so the MCUs in between are only entropy-decoded. the index is a header followed by the checkpoints:
+//   "JIDX", version, size of the file, offset and size of the entropy-coded data, hash of the headers, nx_mcu, ny_mcu,
+//   number of checkpoints, MCUs between them
+// see write_checkpoint() for the layout of each checkpoint
+size_t build_index(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size) {
+  size_t scan_size;
+  if (decoder->index != NULL) {
+    find_restart_intervals(data, size, NULL, 0, &scan_size);
+    return scan_size;
+  }
+  ASSERT(decoder, payload[0] == decoder->n_channels, JPEG_ERROR_UNSUPPORTED,
+         "Seek index needs all components in the first scan");
+  setup_mcus(decoder, payload[0]);
+  decoder->decode_mcus = select_decode_mcus(decoder, payload);
+  int n_mcus = decoder->nx_mcu * decoder->ny_mcu;
+  int restart_interval = decoder->restart_interval;
+  int spacing = decoder->index_spacing;
+
+  // with restart markers, checkpoints are at the start of intervals, which are found without entropy decoding
+  size_t *offsets = NULL;
+  if (restart_interval) {
+    spacing = CDIV(spacing, restart_interval) * restart_interval;
+    int n_intervals = CDIV(n_mcus, restart_interval);
+    offsets = arena_alloc(decoder, n_intervals * sizeof(size_t));
+    if (find_restart_intervals(data, size, offsets, n_intervals, &scan_size) != n_intervals)
+      offsets = NULL;
   }
 
-  // undo zig-zag
-  for (int i = 0; i < BLOCK_SIZE; i++)
-    for (int j = 0; j < BLOCK_SIZE; j++)
-      block_f64[i][j] = block[ZIG_ZAG[i][j]];
+  int n_checkpoints = CDIV(n_mcus, spacing);
+  decoder->index_size = INDEX_HEADER_SIZE + (size_t)n_checkpoints * INDEX_CHECKPOINT_SIZE;
+  _MALLOC(decoder, decoder->index, decoder->index_size);
+  BitReader br = {data, data + size};
+  for (int i = 0; i < n_checkpoints; i++) {
+    int mcu_idx = i * spacing;
+    uint8_t *checkpoint = decoder->index + INDEX_HEADER_SIZE + (size_t)i * INDEX_CHECKPOINT_SIZE;
+    if (offsets != NULL) {
+      // at the RSTm marker, which decode_mcus() consumes, with DC predictors reset
+      BitReader interval = {data + (mcu_idx ? offsets[mcu_idx / restart_interval] - 2 : 0)};
+      int dc_preds[MAX_COMPONENTS] = {0};
+      write_checkpoint(checkpoint, mcu_idx, &interval, data, dc_preds);
+      continue;
+    }
+    write_checkpoint(checkpoint, mcu_idx, &br, data, decoder->dc_preds);
+    uint64_t start = STATS_START(decoder);
+    decoder->decode_mcus(decoder, payload, &br, decoder->dc_preds, mcu_idx, MIN(mcu_idx + spacing, n_mcus));
+    STATS_STOP(decoder, huffman_ns, start);
+  }
+  if (offsets == NULL)
+    scan_size = br.ptr - data;
+  PRINT(decoder, "  seek index: %d checkpoints, %d MCUs apart\n", n_checkpoints, spacing);
+
+  uint8_t *header = decoder->index;
+  size_t scan_offset = data - decoder->file_data;
+  memcpy(header, "JIDX", 4);
+  write_le(header + 4, INDEX_VERSION, 4);
+  write_le(header + 8, decoder->file_size, 8);
+  write_le(header + 16, scan_offset, 8);
+  write_le(header + 24, scan_size, 8);
+  write_le(header + 32, hash_bytes(decoder->file_data, scan_offset), 8);
+  write_le(header + 40, decoder->nx_mcu, 4);
+  write_le(header + 44, decoder->ny_mcu, 4);
+  write_le(header + 48, n_checkpoints, 4);
+  write_le(header + 52, spacing, 4);
+  return scan_size;
+}
 
-  idct_2d_((double *)block_f64);
+// the state before MCU mcu_idx: MCU index, offset of br->ptr from data, bits, n_bits, marker, 2 bytes of padding and
+// the DC predictors
+void write_checkpoint(uint8_t *out, int mcu_idx, const BitReader *br, const uint8_t *data, const int *dc_preds) {
+  write_le(out, mcu_idx, 4);
+  write_le(out + 4, br->ptr - data, 8);
+  write_le(out + 12, br->bits, 8);
+  out[20] = br->n_bits;
+  out[21] = br->marker;
+  write_le(out + 22, 0, 2);
+  for (int i = 0; i < MAX_COMPONENTS; i++)
+    write_le(out + 24 + i * 4, (uint32_t)dc_preds[i], 4);
+}
 
-  // level shift and rounding. A.3.1
-  for (int i = 0; i < BLOCK_SIZE; i++)
-    for (int j = 0; j < BLOCK_SIZE; j++)
-      block_u8[i][j] = CLAMP(round(block_f64[i][j]) + 128, 0, 255);
+// use the checkpoints of the seek index if it was built for this image and scan.
+// returns the size of the entropy-coded data, or 0 if the index does not match
+size_t find_checkpoints(Decoder *decoder, const uint8_t *data, size_t size) {
+  const uint8_t *index = decoder->seek_index;
+  if (decoder->seek_index_size < INDEX_HEADER_SIZE || memcmp(index, "JIDX", 4) != 0 ||
+      read_le(index + 4, 4) != INDEX_VERSION) {
+    PRINT(decoder, "  not a seek index\n");
+    return 0;
+  }
+  size_t scan_offset = data - decoder->file_data;
+  size_t scan_size = read_le(index + 24, 8);
+  uint64_t n_checkpoints = read_le(index + 48, 4);
+  if (read_le(index + 8, 8) != decoder->file_size || read_le(index + 16, 8) != scan_offset || scan_size == 0 ||
+      scan_size > size || read_le(index + 40, 4) != (uint64_t)decoder->nx_mcu ||
+      read_le(index + 44, 4) != (uint64_t)decoder->ny_mcu || n_checkpoints == 0 ||
+      (decoder->seek_index_size - INDEX_HEADER_SIZE) / INDEX_CHECKPOINT_SIZE < n_checkpoints ||
+      read_le(index + 32, 8) != hash_bytes(decoder->file_data, scan_offset)) {
+    PRINT(decoder, "  seek index is for another image\n");
+    return 0;
+  }
+  decoder->checkpoints = index + INDEX_HEADER_SIZE;
+  decoder->n_checkpoints = n_checkpoints;
+  decoder->scan_data = data;
+  PRINT(decoder, "  seek index: %d checkpoints\n", decoder->n_checkpoints);
+  return scan_size;
 }
 
-void idct_1d(double *x, double *out, size_t offset, size_t stride) {
-  for (int k = 0; k < BLOCK_SIZE; k++) {
-    double result = x[offset] * 0.3535533905932738; // 1/sqrt(8)
-    for (int n = 1; n < BLOCK_SIZE; n++)
-      result += x[offset + n * stride] * DCT_TABLE[((2 * k + 1) * n) % 32];
-    out[offset + k * stride] = result;
+// move br to the last checkpoint at or before MCU target, if it is after *mcu_idx
+void seek_checkpoint(Decoder *decoder, BitReader *br, int *mcu_idx, int target) {
+  // the first checkpoint after target
+  int lo = 0, hi = decoder->n_checkpoints;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((int64_t)read_le(decoder->checkpoints + (size_t)mid * INDEX_CHECKPOINT_SIZE, 4) <= target)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  if (lo == 0)
+    return;
+
+  // an index that was tampered with can give wrong pixels, but no access outside of the scan
+  const uint8_t *checkpoint = decoder->checkpoints + (size_t)(lo - 1) * INDEX_CHECKPOINT_SIZE;
+  int64_t checkpoint_mcu = read_le(checkpoint, 4);
+  uint64_t offset = read_le(checkpoint + 4, 8);
+  int n_bits = checkpoint[20];
+  uint8_t marker = checkpoint[21];
+  if (checkpoint_mcu <= *mcu_idx || offset + (marker ? 2 : 0) > (uint64_t)(br->end - decoder->scan_data) ||
+      n_bits > 64)
+    return;
+  br->ptr = decoder->scan_data + offset;
+  br->bits = read_le(checkpoint + 12, 8);
+  br->n_bits = n_bits;
+  br->marker = marker;
+  for (int i = 0; i < MAX_COMPONENTS; i++)
+    decoder->dc_preds[i] = CLAMP((int32_t)read_le(checkpoint + 24 + i * 4, 4), -65536, 65536);
+  *mcu_idx = checkpoint_mcu;
 }
 
-void idct_2d_(double *x) {
-  double temp[BLOCK_SIZE][BLOCK_SIZE];
-  for (int i = 0; i < BLOCK_SIZE; i++)
-    idct_1d(x, (double *)temp, i * BLOCK_SIZE, 1); // row-wise
-  for (int j = 0; j < BLOCK_SIZE; j++)
-    idct_1d((double *)temp, x, j, BLOCK_SIZE); // column-wise
-}
-
-// JFIF p.3
-void ycbcr_to_rgb_(uint8_t *x) {
-  // clang-format off
-  float r = x[0]                           + 1.402f   * (x[2] - 128);
-  float g = x[0] - 0.34414f * (x[1] - 128) - 0.71414f * (x[2] - 128);
-  float b = x[0] + 1.772f   * (x[1] - 128);
-  // clang-format on
-  x[0] = CLAMP(round(r), 0, 255);
-  x[1] = CLAMP(round(g), 0, 255);
-  x[2] = CLAMP(round(b), 0, 255);
+// FNV-1a
+uint64_t hash_bytes(const uint8_t *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ data[i]) * 0x100000001b3;
+  return hash;
+}
+
+#ifndef JPEG_NO_THREADS
+
+// a part of a scan without restart markers, see decode_scan_speculative()
+typedef struct SpeculativeChunk {
+  size_t start;                    // byte where speculative decoding starts
+  size_t end;                      // and where the next chunk starts
+  uint64_t *positions;             // of the first MCUs decoded from start, see bit_position()
+  int (*dc_preds)[MAX_COMPONENTS]; // DC predictors at these MCUs, from 0 at start
+  int n_positions;
+  int n_mcus;     // MCUs decoded from start, up to the first one at or after end
+  BitReader exit; // before that MCU
+  int exit_dc_preds[MAX_COMPONENTS];
+  // set by the chunk before, when it reaches positions[sync_idx] n_extra MCUs after its exit, with its DC predictors at
+  // sync_dc_preds. -1 if it does not
+  int sync_idx;
+  int n_extra;
+  int sync_dc_preds[MAX_COMPONENTS];
+  // MCUs from mcu_start on are decoded from position, with the DC predictors of the whole scan up to there
+  int mcu_start;
+  uint64_t position;
+  int mcu_dc_preds[MAX_COMPONENTS];
+} SpeculativeChunk;
+
+typedef struct ParallelScan {
+  Decoder *decoder;
+  const uint8_t *payload;
+  const uint8_t *data;
+  const size_t *offsets;          // where each restart interval starts
+  const SpeculativeChunk *chunks; // or the chunks of decode_scan_speculative(), which are the intervals then
+  int n_intervals;
+  size_t scan_size;
+  int first_interval; // intervals [first_interval, last_interval) overlap the output
+  int last_interval;
+  int mcu_end;
+  int intervals_per_task;
+  atomic_int next_task;
+  atomic_int next_mcu_row;
+  uint8_t *(*upsampled)[MAX_COMPONENTS]; // for each thread
+  int16_t **colsum;
+  atomic_int next_thread;
+  atomic_int failed; // set by the first worker that fails. other workers stop early
+  atomic_long idct_counts[N_IDCT_KERNELS];
+  JpegStats *worker_stats; // of each worker that finished. see save_worker_stats()
+  atomic_int n_worker_stats;
+  JpegStatus status;
+  char error_message[256];
+} ParallelScan;
+
+// each worker uses its own copy of the decoder. tables and buffers are shared, but errors longjmp to the worker
+static void report_worker_error(ParallelScan *scan, const Decoder *decoder) {
+  int expected = 0;
+  if (atomic_compare_exchange_strong(&scan->failed, &expected, 1)) {
+    scan->status = decoder->status;
+    memcpy(scan->error_message, decoder->error_message, sizeof(scan->error_message));
+  }
+}
+
+// workers count into their copy of the decoder, and the main thread adds them up after the workers finish
+static void save_worker_stats(ParallelScan *scan, const Decoder *decoder) {
+  scan->worker_stats[atomic_fetch_add(&scan->n_worker_stats, 1)] = decoder->stats;
+}
+
+// all fields of JpegStats are uint64_t
+static void add_stats(JpegStats *sum, const JpegStats *stats) {
+  uint64_t *dst = (uint64_t *)sum;
+  const uint64_t *src = (const uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(JpegStats) / sizeof(uint64_t); i++)
+    dst[i] += src[i];
+}
+
+static void *decode_intervals_worker(void *arg) {
+  ParallelScan *scan = arg;
+  Decoder worker_decoder = *scan->decoder;
+  Decoder *decoder = &worker_decoder;
+  if (setjmp(decoder->error_jmp)) {
+    report_worker_error(scan, decoder);
+    return NULL;
+  }
+  memset(decoder->idct_counts, 0, sizeof(decoder->idct_counts));
+  memset(&decoder->stats, 0, sizeof(decoder->stats));
+
+  while (!atomic_load(&scan->failed)) {
+    int first = scan->first_interval + atomic_fetch_add(&scan->next_task, 1) * scan->intervals_per_task;
+    if (first >= scan->last_interval)
+      break;
+    int last = MIN(first + scan->intervals_per_task, scan->last_interval);
+
+    BitReader br = {scan->data, scan->data + scan->scan_size};
+    int dc_preds[MAX_COMPONENTS] = {0};
+    int mcu_start, mcu_end;
+    if (scan->chunks != NULL) {
+      // chunks start anywhere in a byte, with the DC predictors of the chunks before them
+      const SpeculativeChunk *chunk = &scan->chunks[first];
+      seek_bit_position(&br, scan->data, chunk->position);
+      memcpy(dc_preds, chunk->mcu_dc_preds, sizeof(dc_preds));
+      mcu_start = chunk->mcu_start;
+      mcu_end = last < scan->n_intervals ? scan->chunks[last].mcu_start : scan->mcu_end;
+      STATS_ADD(decoder, speculative_chunks, last - first);
+    } else {
+      // start at the RSTm marker in front of the first interval, so that decode_mcus() consumes it as usual
+      br.ptr = scan->data + (first ? scan->offsets[first] - 2 : 0);
+      br.end = scan->data + (last < scan->n_intervals ? scan->offsets[last] - 2 : scan->scan_size);
+      mcu_start = first * decoder->restart_interval;
+      mcu_end = last * decoder->restart_interval;
+      STATS_ADD(decoder, parallel_intervals, last - first);
+    }
+    mcu_end = MIN(mcu_end, scan->mcu_end);
+    uint64_t start_ticks = STATS_START(decoder);
+    decoder->decode_mcus(decoder, scan->payload, &br, dc_preds, mcu_start, mcu_end);
+    STATS_STOP(decoder, huffman_ns, start_ticks);
+  }
+  for (int i = 0; i < N_IDCT_KERNELS; i++)
+    atomic_fetch_add(&scan->idct_counts[i], decoder->idct_counts[i]);
+  save_worker_stats(scan, decoder);
+  return NULL;
+}
+
+static void *color_convert_worker(void *arg) {
+  ParallelScan *scan = arg;
+  Decoder worker_decoder = *scan->decoder;
+  Decoder *decoder = &worker_decoder;
+  if (setjmp(decoder->error_jmp)) {
+    report_worker_error(scan, decoder);
+    return NULL;
+  }
+
+  int thread_idx = atomic_fetch_add(&scan->next_thread, 1);
+  memcpy(decoder->upsampled, scan->upsampled[thread_idx], sizeof(decoder->upsampled));
+  decoder->colsum = scan->colsum[thread_idx];
+  memset(&decoder->stats, 0, sizeof(decoder->stats));
+  for (int mcu_y; (mcu_y = atomic_fetch_add(&scan->next_mcu_row, 1)) < decoder->mcu_y1;)
+    color_convert_mcu_row(decoder, mcu_y);
+  save_worker_stats(scan, decoder);
+  return NULL;
+}
+
+// run worker on up to n_threads threads, including the calling thread.
+// workers take tasks from a shared counter, so fewer threads only make it slower
+static void run_workers(Decoder *decoder, void *(*worker)(void *), void *arg, int n_threads) {
+  if (decoder->pool_worker != NULL) {
+    run_pool_tasks(decoder->pool_worker, worker, arg, n_threads);
+    return;
+  }
+  pthread_t *threads = arena_alloc(decoder, n_threads * sizeof(pthread_t));
+  int n_created = 0;
+  while (n_created < n_threads - 1 && pthread_create(&threads[n_created], NULL, worker, arg) == 0)
+    n_created++;
+  worker(arg);
+  for (int i = 0; i < n_created; i++)
+    pthread_join(threads[i], NULL);
+}
+
+// a single-producer single-consumer queue of MCU rows: the entropy thread decodes rows into a ring of
+// PIPELINE_MCU_ROWS rows of coefficients, and the calling thread runs the IDCT and color conversion on them. each
+// counter is written by one thread only
+typedef struct PipelinedScan {
+  Decoder worker; // copy of the decoder for the entropy thread, made before the calling thread changes it
+  const uint8_t *payload;
+  const uint8_t *data;
+  size_t size;
+  int mcu_end;
+  pthread_t thread; // of the entropy decoding
+  atomic_int n_decoded; // MCU rows [mcu_y0, n_decoded) are in the ring. advanced by the entropy thread
+  atomic_int n_done;    // and the IDCT of rows before n_done is done, so their slots can be reused
+  atomic_int failed;    // set by the entropy thread
+  atomic_int stopped;   // set by the calling thread when it fails
+  pthread_mutex_t lock; // and changed, for a thread that waits for the other one after SPIN_ROUNDS
+  pthread_cond_t changed;
+  size_t scan_size;
+  JpegStats worker_stats;
+  JpegStatus status;
+  char error_message[256];
+} PipelinedScan;
+
+// until *counter > value or *flag is set. the other thread is usually about to get there, so spin a little first
+static void wait_for_counter(PipelinedScan *scan, atomic_int *counter, int value, atomic_int *flag) {
+  for (int i = 0; i < SPIN_ROUNDS; i++) {
+    if (atomic_load_explicit(counter, memory_order_acquire) > value || atomic_load(flag))
+      return;
+    sched_yield();
+  }
+  pthread_mutex_lock(&scan->lock);
+  while (atomic_load_explicit(counter, memory_order_acquire) <= value && !atomic_load(flag))
+    pthread_cond_wait(&scan->changed, &scan->lock);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+// set a counter or flag of wait_for_counter(). taking the lock makes sure that a thread about to sleep sees it
+static void store_and_wake(PipelinedScan *scan, atomic_int *counter, int value) {
+  atomic_store_explicit(counter, value, memory_order_release);
+  pthread_mutex_lock(&scan->lock);
+  pthread_cond_broadcast(&scan->changed);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+// input side: the quantized coefficients of MCUs [mcu_start, mcu_end) go to the ring in component->coefs. MCUs
+// outside of the output are only entropy-decoded
+static void decode_mcus_to_ring(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start,
+                                int mcu_end) {
+  uint8_t n_components = payload[0];
+
+  for (int mcu_idx = mcu_start; mcu_idx < mcu_end; mcu_idx++) {
+    if (decoder->restart_interval && mcu_idx && mcu_idx % decoder->restart_interval == 0) {
+      handle_restart(decoder, br, mcu_idx / decoder->restart_interval - 1);
+      for (int i = 0; i < MAX_COMPONENTS; i++)
+        dc_preds[i] = 0;
+    }
+
+    int mcu_y = mcu_idx / decoder->nx_mcu;
+    int mcu_x = mcu_idx % decoder->nx_mcu;
+    bool skip = mcu_x < decoder->mcu_x0 || mcu_x >= decoder->mcu_x1 || mcu_y < decoder->mcu_y0 ||
+                mcu_y >= decoder->mcu_y1;
+
+    for (int c = 0; c < n_components; c++) {
+      int component_id = payload[1 + c * 2] - decoder->min_component;
+      int dc_table_id = upper_half(payload[2 + c * 2]);
+      int ac_table_id = lower_half(payload[2 + c * 2]);
+      Component *component = &decoder->components[component_id];
+      int x_sampling = n_components == 1 ? 1 : component->x_sampling;
+      int y_sampling = n_components == 1 ? 1 : component->y_sampling;
+
+      for (int y = 0; y < y_sampling; y++)
+        for (int x = 0; x < x_sampling; x++) {
+          if (skip || (decoder->luma_only && component_id > 0)) {
+            skip_block_sof0(decoder, br, dc_table_id, ac_table_id, &dc_preds[component_id]);
+            continue;
+          }
+          int coef_y = mcu_y % decoder->n_coef_mcu_rows * y_sampling + y;
+          int16_t *block = component->coefs + ((size_t)coef_y * component->blocks_per_row + mcu_x * x_sampling + x) *
+                                                  BLOCK_SIZE * BLOCK_SIZE;
+          memset(block, 0, BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+          decode_block_coefs(decoder, br, block, dc_table_id, ac_table_id, &dc_preds[component_id]);
+        }
+    }
+  }
+}
+
+static void *decode_entropy_worker(void *arg) {
+  PipelinedScan *scan = arg;
+  Decoder *decoder = &scan->worker;
+  if (setjmp(decoder->error_jmp)) {
+    scan->status = decoder->status;
+    memcpy(scan->error_message, decoder->error_message, sizeof(scan->error_message));
+    store_and_wake(scan, &scan->failed, 1);
+    return NULL;
+  }
+  memset(&decoder->stats, 0, sizeof(decoder->stats));
+
+  BitReader br = {scan->data, scan->data + scan->size};
+  uint64_t start = STATS_START(decoder);
+  for (int mcu_y = 0; mcu_y < decoder->mcu_y1; mcu_y++) {
+    // wait for a free slot
+    wait_for_counter(scan, &scan->n_done, mcu_y - decoder->n_coef_mcu_rows, &scan->stopped);
+    if (atomic_load(&scan->stopped))
+      return NULL;
+    int row_end = MIN(scan->mcu_end, (mcu_y + 1) * decoder->nx_mcu);
+    decode_mcus_to_ring(decoder, scan->payload, &br, decoder->dc_preds, mcu_y * decoder->nx_mcu, row_end);
+    if (mcu_y >= decoder->mcu_y0)
+      store_and_wake(scan, &scan->n_decoded, mcu_y + 1);
+  }
+  STATS_STOP(decoder, huffman_ns, start);
+
+  scan->scan_size = br.ptr - scan->data;
+  if (scan->mcu_end < decoder->nx_mcu * decoder->ny_mcu) {
+    size_t remaining;
+    find_restart_intervals(br.ptr, scan->size - scan->scan_size, NULL, 0, &remaining);
+    scan->scan_size += remaining;
+  }
+  scan->worker_stats = decoder->stats;
+  return NULL;
+}
+
+// output side, called by decode_mcu_rows() on the calling thread: wait for the MCU row to be entropy-decoded, then
+// IDCT it from the ring
+static void decode_mcus_pipelined(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds,
+                                  int mcu_start, int mcu_end) {
+  PipelinedScan *scan = decoder->pipeline;
+  int mcu_y = mcu_start / decoder->nx_mcu;
+  wait_for_counter(scan, &scan->n_decoded, mcu_y, &scan->failed);
+  if (atomic_load_explicit(&scan->n_decoded, memory_order_acquire) <= mcu_y) {
+    decoder->status = scan->status;
+    memcpy(decoder->error_message, scan->error_message, sizeof(decoder->error_message));
+    longjmp(decoder->error_jmp, 1);
+  }
+  decode_mcus_coefs(decoder, payload, br, dc_preds, mcu_start, mcu_end);
+  store_and_wake(scan, &scan->n_done, mcu_y + 1);
+}
+
+// the first two passes of decode_scan_speculative(), over all chunks
+typedef struct SpeculativeScan {
+  Decoder *decoder;
+  const uint8_t *payload;
+  const uint8_t *data;
+  size_t scan_size;
+  SpeculativeChunk *chunks;
+  int n_chunks;
+  atomic_int next_chunk;
+} SpeculativeScan;
+
+// decode a chunk from its start as if an MCU started there, and keep where its first MCUs start
+static void speculate_chunk(Decoder *decoder, SpeculativeScan *scan, SpeculativeChunk *chunk) {
+  // an invalid code means that no MCU starts there. try again from the next byte, except in the first chunk, which
+  // does start at an MCU
+  if (setjmp(decoder->error_jmp)) {
+    chunk->n_positions = 0;
+    if (chunk == scan->chunks)
+      return;
+    chunk->start++;
+    if (scan->data[chunk->start - 1] == 0xFF) // not at the 0x00 of a stuffed 0xFF00
+      chunk->start++;
+    if (chunk->start >= chunk->end)
+      return;
+  }
+
+  BitReader br = {scan->data + chunk->start, scan->data + scan->scan_size};
+  int dc_preds[MAX_COMPONENTS] = {0};
+  chunk->n_positions = 0;
+  chunk->n_mcus = 0;
+  // positions are not valid at the end of the data, which only the last chunk reaches
+  while (!br.marker && br.ptr < br.end) {
+    uint64_t position = bit_position(&br, scan->data);
+    if (position >= chunk->end * 8)
+      break;
+    if (chunk->n_positions < SPECULATIVE_SYNC_MCUS) {
+      chunk->positions[chunk->n_positions] = position;
+      memcpy(chunk->dc_preds[chunk->n_positions], dc_preds, sizeof(dc_preds));
+      chunk->n_positions++;
+    }
+    skip_mcu(decoder, scan->payload, &br, dc_preds);
+    chunk->n_mcus++;
+  }
+  chunk->exit = br;
+  memcpy(chunk->exit_dc_preds, dc_preds, sizeof(dc_preds));
+}
+
+// continue decoding chunk into the next one, until an MCU starts where one of the first MCUs of the next chunk did.
+// from there on, both decode the same
+static void sync_chunk(Decoder *decoder, SpeculativeScan *scan, const SpeculativeChunk *chunk, SpeculativeChunk *next) {
+  next->sync_idx = -1;
+  if (chunk->n_positions == 0)
+    return;
+  if (setjmp(decoder->error_jmp))
+    return;
+
+  BitReader br = chunk->exit;
+  int dc_preds[MAX_COMPONENTS];
+  memcpy(dc_preds, chunk->exit_dc_preds, sizeof(dc_preds));
+  int i = 0;
+  for (int n_extra = 0; !br.marker && br.ptr < br.end && i < next->n_positions; n_extra++) {
+    uint64_t position = bit_position(&br, scan->data);
+    while (i < next->n_positions && next->positions[i] < position)
+      i++;
+    if (i < next->n_positions && next->positions[i] == position) {
+      next->sync_idx = i;
+      next->n_extra = n_extra;
+      memcpy(next->sync_dc_preds, dc_preds, sizeof(dc_preds));
+      return;
+    }
+    skip_mcu(decoder, scan->payload, &br, dc_preds);
+  }
+}
+
+static void *speculate_worker(void *arg) {
+  SpeculativeScan *scan = arg;
+  Decoder worker_decoder = *scan->decoder;
+  for (int i; (i = atomic_fetch_add(&scan->next_chunk, 1)) < scan->n_chunks;)
+    speculate_chunk(&worker_decoder, scan, &scan->chunks[i]);
+  return NULL;
+}
+
+static void *sync_worker(void *arg) {
+  SpeculativeScan *scan = arg;
+  Decoder worker_decoder = *scan->decoder;
+  for (int i; (i = atomic_fetch_add(&scan->next_chunk, 1)) < scan->n_chunks - 1;)
+    sync_chunk(&worker_decoder, scan, &scan->chunks[i], &scan->chunks[i + 1]);
+  return NULL;
+}
+
+// decode intervals [first_interval, last_interval) of scan, which the caller sets up, on decoder->n_threads threads,
+// then color-convert the output MCU rows on as many
+static void decode_intervals(Decoder *decoder, ParallelScan *scan) {
+  // a few tasks per thread for load balancing
+  int n_decoded = scan->last_interval - scan->first_interval;
+  scan->intervals_per_task = CDIV(n_decoded, decoder->n_threads * 4);
+  atomic_init(&scan->next_task, 0);
+  atomic_init(&scan->next_mcu_row, decoder->mcu_y0);
+  atomic_init(&scan->next_thread, 0);
+  atomic_init(&scan->failed, 0);
+  for (int i = 0; i < N_IDCT_KERNELS; i++)
+    atomic_init(&scan->idct_counts[i], 0);
+  scan->worker_stats = arena_alloc(decoder, decoder->n_threads * 2 * sizeof(JpegStats)); // decode and color workers
+  atomic_init(&scan->n_worker_stats, 0);
+  int n_threads = MIN(decoder->n_threads, CDIV(n_decoded, scan->intervals_per_task));
+
+  if (scan->payload[0] == 1)
+    run_workers(decoder, decode_intervals_worker, scan, n_threads);
+  else {
+    // the output MCU rows are kept in the planes, then color conversion runs on all of them
+    int n_mcu_rows = decoder->mcu_y1 - decoder->mcu_y0;
+    allocate_planes(decoder, n_mcu_rows);
+    run_workers(decoder, decode_intervals_worker, scan, n_threads);
+
+    n_threads = MIN(decoder->n_threads, n_mcu_rows);
+    scan->upsampled = arena_alloc(decoder, n_threads * sizeof(*scan->upsampled));
+    scan->colsum = arena_alloc(decoder, n_threads * sizeof(*scan->colsum));
+    for (int i = 0; i < n_threads; i++) {
+      allocate_upsampled(decoder);
+      memcpy(scan->upsampled[i], decoder->upsampled, sizeof(decoder->upsampled));
+      scan->colsum[i] = decoder->colsum;
+    }
+    if (!atomic_load(&scan->failed))
+      run_workers(decoder, color_convert_worker, scan, n_threads);
+  }
+
+  if (atomic_load(&scan->failed)) {
+    decoder->status = scan->status;
+    memcpy(decoder->error_message, scan->error_message, sizeof(decoder->error_message));
+    longjmp(decoder->error_jmp, 1);
+  }
+  for (int i = 0; i < N_IDCT_KERNELS; i++)
+    decoder->idct_counts[i] += atomic_load(&scan->idct_counts[i]);
+  for (int i = 0; i < atomic_load(&scan->n_worker_stats); i++)
+    add_stats(&decoder->stats, &scan->worker_stats[i]);
+}
+#endif
+
+// decode restart intervals on decoder->n_threads threads. each thread keeps its own DC predictors.
+// returns the size of the entropy-coded data, or 0 if restart markers are missing
+size_t decode_scan_parallel(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size) {
+#ifdef JPEG_NO_THREADS
+  return 0;
+#else
+  int n_mcus = decoder->nx_mcu * decoder->ny_mcu;
+  int n_intervals = CDIV(n_mcus, decoder->restart_interval);
+
+  size_t *offsets = arena_alloc(decoder, n_intervals * sizeof(size_t));
+  size_t scan_size;
+  if (find_restart_intervals(data, size, offsets, n_intervals, &scan_size) != n_intervals)
+    return 0;
+
+  // intervals outside of the output are not decoded at all
+  ParallelScan scan = {decoder, payload, data, offsets, NULL, n_intervals, scan_size};
+  scan.mcu_end = (decoder->mcu_y1 - 1) * decoder->nx_mcu + decoder->mcu_x1;
+  scan.first_interval = decoder->mcu_y0 * decoder->nx_mcu / decoder->restart_interval;
+  scan.last_interval = CDIV(scan.mcu_end, decoder->restart_interval);
+  PRINT(decoder, "  decode %d of %d restart intervals with %d threads\n", scan.last_interval - scan.first_interval,
+        n_intervals, decoder->n_threads);
+  decode_intervals(decoder, &scan);
+  return scan_size;
+#endif
+}
+
+// entropy decoding on another thread, one MCU row ahead of the IDCT and color conversion on this one, for scans
+// without restart markers. the slower of the two sets the speed. returns the size of the entropy-coded data, or 0 if
+// there is no second thread
+size_t decode_scan_pipelined(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size) {
+#ifdef JPEG_NO_THREADS
+  return 0;
+#else
+  // the entropy thread must run at the same time, which a pool cannot promise, and on another CPU
+  if (decoder->mcu_y1 - decoder->mcu_y0 < 2 || decoder->pool_worker != NULL || sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    return 0;
+
+  // coefficients of a few MCU rows, in the same layout as for progressive JPEGs
+  decoder->n_coef_mcu_rows = PIPELINE_MCU_ROWS;
+  for (int c = 0; c < decoder->n_channels; c++) {
+    Component *component = &decoder->components[c];
+    int x_sampling = decoder->n_channels == 1 ? 1 : component->x_sampling;
+    int y_sampling = decoder->n_channels == 1 ? 1 : component->y_sampling;
+    component->blocks_per_row = decoder->nx_mcu * x_sampling;
+    component->coefs = arena_alloc(decoder, (size_t)component->blocks_per_row * y_sampling * PIPELINE_MCU_ROWS *
+                                                BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+  }
+
+  // nothing may longjmp between pthread_create() and pthread_join() but the calling thread's errors below
+  allocate_mcu_rows(decoder, payload[0]);
+
+  PipelinedScan scan = {*decoder, payload, data, size};
+  scan.mcu_end = (decoder->mcu_y1 - 1) * decoder->nx_mcu + decoder->mcu_x1;
+  atomic_init(&scan.n_decoded, decoder->mcu_y0);
+  atomic_init(&scan.n_done, decoder->mcu_y0);
+  atomic_init(&scan.failed, 0);
+  atomic_init(&scan.stopped, 0);
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.changed, NULL);
+  if (pthread_create(&scan.thread, NULL, decode_entropy_worker, &scan) != 0) {
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.changed);
+    return 0;
+  }
+  PRINT(decoder, "  entropy decoding on a second thread\n");
+
+  // on an error of either thread, the entropy thread is stopped and joined before the error goes on to the caller,
+  // since it uses scan on this stack frame
+  jmp_buf error_jmp;
+  memcpy(error_jmp, decoder->error_jmp, sizeof(jmp_buf));
+  if (setjmp(decoder->error_jmp)) {
+    store_and_wake(&scan, &scan.stopped, 1);
+    pthread_join(scan.thread, NULL);
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.changed);
+    decoder->pipeline = NULL;
+    memcpy(decoder->error_jmp, error_jmp, sizeof(jmp_buf));
+    longjmp(decoder->error_jmp, 1);
+  }
+  decoder->pipeline = &scan;
+  decoder->decode_mcus = decode_mcus_pipelined;
+  decode_mcu_rows(decoder, payload, NULL, payload[0], decoder->mcu_y0 * decoder->nx_mcu, scan.mcu_end);
+  pthread_join(scan.thread, NULL);
+  pthread_mutex_destroy(&scan.lock);
+  pthread_cond_destroy(&scan.changed);
+  decoder->pipeline = NULL;
+  memcpy(decoder->error_jmp, error_jmp, sizeof(jmp_buf));
+  add_stats(&decoder->stats, &scan.worker_stats);
+  return scan.scan_size;
+#endif
+}
+
+// parallel entropy decoding of a scan without restart markers. Huffman codes can only be read in order, but they
+// synchronize by themselves: decoding from a wrong bit soon reaches the start of a code, and then of an MCU, that
+// decoding from the right bit reaches too. from there on, both decode the same. so the scan is split into chunks at
+// arbitrary bytes, and
+//   1. each chunk is decoded from its start as if an MCU started there, keeping where its first MCUs start
+//   2. each chunk continues into the next one until it reaches one of those MCUs, where the next chunk becomes right
+//   3. from the first chunk, which does start at an MCU, the MCU index and DC predictors where each chunk becomes
+//      right are added up
+//   4. the chunks are decoded again from there, like restart intervals
+// returns the size of the entropy-coded data, or 0 if some chunk does not synchronize
+size_t decode_scan_speculative(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size) {
+#ifdef JPEG_NO_THREADS
+  return 0;
+#else
+  size_t scan_size;
+  find_restart_intervals(data, size, NULL, 0, &scan_size);
+  int n_chunks = MIN((size_t)decoder->n_threads * 4, scan_size / SPECULATIVE_MIN_CHUNK);
+  if (n_chunks < 2)
+    return 0;
+
+  SpeculativeChunk *chunks = arena_alloc(decoder, n_chunks * sizeof(SpeculativeChunk));
+  for (int i = 0; i < n_chunks; i++) {
+    SpeculativeChunk *chunk = &chunks[i];
+    chunk->start = scan_size * i / n_chunks;
+    if (chunk->start && data[chunk->start - 1] == 0xFF) // not at the 0x00 of a stuffed 0xFF00
+      chunk->start++;
+    chunk->end = scan_size * (i + 1) / n_chunks;
+    chunk->positions = arena_alloc(decoder, SPECULATIVE_SYNC_MCUS * sizeof(*chunk->positions));
+    chunk->dc_preds = arena_alloc(decoder, SPECULATIVE_SYNC_MCUS * sizeof(*chunk->dc_preds));
+  }
+
+  uint64_t start = STATS_START(decoder);
+  SpeculativeScan speculation = {decoder, payload, data, scan_size, chunks, n_chunks};
+  atomic_init(&speculation.next_chunk, 0);
+  run_workers(decoder, speculate_worker, &speculation, MIN(decoder->n_threads, n_chunks));
+  atomic_store(&speculation.next_chunk, 0);
+  run_workers(decoder, sync_worker, &speculation, MIN(decoder->n_threads, n_chunks - 1));
+  STATS_STOP(decoder, huffman_ns, start);
+
+  int n_mcus = decoder->nx_mcu * decoder->ny_mcu;
+  int mcu_idx = 0;
+  int dc_preds[MAX_COMPONENTS] = {0};
+  chunks[0].sync_idx = 0;
+  for (int i = 0; i < n_chunks; i++) {
+    SpeculativeChunk *chunk = &chunks[i];
+    if (chunk->sync_idx < 0 || chunk->n_positions == 0) {
+      PRINT(decoder, "  speculative chunk %d of %d does not synchronize\n", i, n_chunks);
+      return 0;
+    }
+    if (mcu_idx >= n_mcus) { // the MCUs end before this chunk
+      n_chunks = i;
+      break;
+    }
+    chunk->mcu_start = mcu_idx;
+    chunk->position = chunk->positions[chunk->sync_idx];
+    memcpy(chunk->mcu_dc_preds, dc_preds, sizeof(dc_preds));
+    if (i + 1 < n_chunks && chunk[1].sync_idx >= 0) {
+      mcu_idx += chunk->n_mcus - chunk->sync_idx + chunk[1].n_extra;
+      for (int c = 0; c < MAX_COMPONENTS; c++)
+        dc_preds[c] += chunk[1].sync_dc_preds[c] - chunk->dc_preds[chunk->sync_idx][c];
+    }
+  }
+
+  // the chunks that overlap the output
+  ParallelScan scan = {decoder, payload, data, NULL, chunks, n_chunks, scan_size};
+  scan.mcu_end = (decoder->mcu_y1 - 1) * decoder->nx_mcu + decoder->mcu_x1;
+  int mcu_start = decoder->mcu_y0 * decoder->nx_mcu;
+  while (scan.first_interval + 1 < n_chunks && chunks[scan.first_interval + 1].mcu_start <= mcu_start)
+    scan.first_interval++;
+  scan.last_interval = scan.first_interval + 1;
+  while (scan.last_interval < n_chunks && chunks[scan.last_interval].mcu_start < scan.mcu_end)
+    scan.last_interval++;
+  PRINT(decoder, "  decode %d of %d speculative chunks with %d threads\n", scan.last_interval - scan.first_interval,
+        n_chunks, decoder->n_threads);
+  decode_intervals(decoder, &scan);
+  return scan_size;
+#endif
+}
+
+#ifndef JPEG_NO_THREADS
+typedef struct PoolTask {
+  void *(*worker)(void *); // a worker of run_workers(), or NULL to decode a batch item
+  void *arg;               // its argument, or the JpegBatchItem
+  atomic_int *n_pending;   // decremented when the task is done
+} PoolTask;
+#endif
+
+// a thread of a JpegDecoderPool. its deque of tasks is pushed and popped at the back by the thread itself, and stolen
+// from at the front by the others, so that they take whole images before the sub-tasks of an image being decoded
+typedef struct PoolWorker {
+  struct JpegDecoderPool *pool;
+  JpegDecoder *decoder;
+#ifndef JPEG_NO_THREADS
+  pthread_t thread;
+  pthread_mutex_t lock; // of the deque
+  PoolTask *tasks;      // [front, back) are queued
+  int capacity;
+  int front;
+  int back;
+#endif
+} PoolWorker;
+
+typedef struct JpegDecoderPool {
+  int n_threads;
+  PoolWorker *workers; // workers[0] is the thread that calls jpeg_decode_batch()
+#ifndef JPEG_NO_THREADS
+  pthread_mutex_t lock;   // of batch_id and shutdown
+  pthread_cond_t start;   // a batch starts, or the pool is destroyed
+  pthread_cond_t changed; // a task is pushed or done, for threads that wait after SPIN_ROUNDS. see wait_for_task()
+  int batch_id;
+  bool shutdown;
+  atomic_int n_pending; // items of the current batch that are not done
+#endif
+} DecoderPool;
+
+// only images of POOL_SPLIT_PIXELS or more are split into tasks for the other threads. for smaller ones, there are
+// enough other images to keep them busy
+void decode_batch_item(PoolWorker *worker, JpegBatchItem *item) {
+  JpegDecoder *decoder = worker->decoder;
+  JpegInfo info;
+  bool large = jpeg_probe(item->data, item->size, &info) == JPEG_OK &&
+               (int64_t)info.width * info.height >= POOL_SPLIT_PIXELS;
+  decoder->n_threads = large ? worker->pool->n_threads : 1;
+  item->status = jpeg_decoder_decode_to(decoder, item->data, item->size, &item->output);
+  const char *message = item->status != JPEG_OK ? decoder->error_message : "";
+  snprintf(item->error_message, sizeof(item->error_message), "%s", message);
+}
+
+#ifndef JPEG_NO_THREADS
+// taking the lock makes sure that a thread in wait_for_task() either sees the change or is woken up by it
+static void wake_waiting_threads(DecoderPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static bool push_task(PoolWorker *worker, PoolTask task) {
+  pthread_mutex_lock(&worker->lock);
+  bool pushed = worker->back < worker->capacity;
+  if (pushed)
+    worker->tasks[worker->back++] = task;
+  pthread_mutex_unlock(&worker->lock);
+  if (pushed)
+    wake_waiting_threads(worker->pool);
+  return pushed;
+}
+
+// the task at the back of the deque, if there is one and n_pending is NULL or its counter
+static bool pop_task(PoolWorker *worker, const atomic_int *n_pending, PoolTask *task) {
+  pthread_mutex_lock(&worker->lock);
+  bool popped = worker->back > worker->front &&
+                (n_pending == NULL || worker->tasks[worker->back - 1].n_pending == n_pending);
+  if (popped)
+    *task = worker->tasks[--worker->back];
+  if (worker->back == worker->front)
+    worker->front = worker->back = 0;
+  pthread_mutex_unlock(&worker->lock);
+  return popped;
+}
+
+// the task at the front of the deque of another thread, starting from the next one
+static bool steal_task(PoolWorker *worker, PoolTask *task) {
+  DecoderPool *pool = worker->pool;
+  int self = worker - pool->workers;
+  for (int i = 1; i < pool->n_threads; i++) {
+    PoolWorker *victim = &pool->workers[(self + i) % pool->n_threads];
+    pthread_mutex_lock(&victim->lock);
+    bool stolen = victim->back > victim->front;
+    if (stolen)
+      *task = victim->tasks[victim->front++];
+    if (victim->back == victim->front)
+      victim->front = victim->back = 0;
+    pthread_mutex_unlock(&victim->lock);
+    if (stolen)
+      return true;
+  }
+  return false;
+}
+
+static void run_task(PoolWorker *worker, const PoolTask *task) {
+  if (task->worker != NULL)
+    task->worker(task->arg);
+  else
+    decode_batch_item(worker, task->arg);
+  atomic_fetch_sub(task->n_pending, 1);
+  wake_waiting_threads(worker->pool);
+}
+
+// sleep until a task is pushed or done, unless *n_pending is 0 already or, for a thread that steals, a deque has a task
+static void wait_for_task(DecoderPool *pool, const atomic_int *n_pending, bool steal) {
+  pthread_mutex_lock(&pool->lock);
+  bool queued = false;
+  for (int i = 0; steal && !queued && i < pool->n_threads; i++) {
+    PoolWorker *worker = &pool->workers[i];
+    pthread_mutex_lock(&worker->lock);
+    queued = worker->back > worker->front;
+    pthread_mutex_unlock(&worker->lock);
+  }
+  if (atomic_load(n_pending) > 0 && !queued)
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// take tasks from the own deque, or steal them, until the batch is done. with nothing to take, yield SPIN_ROUNDS times,
+// then sleep
+static void work_on_batch(PoolWorker *worker) {
+  DecoderPool *pool = worker->pool;
+  PoolTask task;
+  for (int n_idle = 0; atomic_load(&pool->n_pending) > 0;) {
+    if (pop_task(worker, NULL, &task) || steal_task(worker, &task)) {
+      run_task(worker, &task);
+      n_idle = 0;
+    } else if (++n_idle < SPIN_ROUNDS)
+      sched_yield();
+    else
+      wait_for_task(pool, &pool->n_pending, true);
+  }
+}
+
+static void *pool_thread(void *arg) {
+  PoolWorker *worker = arg;
+  DecoderPool *pool = worker->pool;
+  int batch_id = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown && pool->batch_id == batch_id)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    bool shutdown = pool->shutdown;
+    batch_id = pool->batch_id;
+    pthread_mutex_unlock(&pool->lock);
+    if (shutdown)
+      return NULL;
+    work_on_batch(worker);
+  }
+}
+
+// run_workers() in a pool: up to n_tasks - 1 copies of worker go to the back of the deque, for idle threads to steal,
+// and the calling thread runs worker too. like all workers of run_workers(), they take work from a shared counter, so
+// the copies that are not stolen by then have nothing left to do and are taken back
+void run_pool_tasks(PoolWorker *self, void *(*worker)(void *), void *arg, int n_tasks) {
+  atomic_int n_pending;
+  atomic_init(&n_pending, 0);
+  for (int i = 0; i < n_tasks - 1; i++) {
+    atomic_fetch_add(&n_pending, 1);
+    if (!push_task(self, (PoolTask){worker, arg, &n_pending})) {
+      atomic_fetch_sub(&n_pending, 1);
+      break;
+    }
+  }
+  worker(arg);
+
+  // arg must outlive the copies that other threads took
+  PoolTask task;
+  for (int n_idle = 0; atomic_load(&n_pending) > 0;) {
+    if (pop_task(self, &n_pending, &task))
+      atomic_fetch_sub(&n_pending, 1);
+    else if (++n_idle < SPIN_ROUNDS)
+      sched_yield();
+    else
+      wait_for_task(self->pool, &n_pending, false);
+  }
+}
+#endif
+
+JpegDecoderPool *jpeg_decoder_pool_create(int n_threads) {
+#ifdef JPEG_NO_THREADS
+  n_threads = 1;
+#else
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  n_threads = MAX(n_threads, 1);
+#endif
+  DecoderPool *pool = calloc(1, sizeof(DecoderPool));
+  if (pool == NULL)
+    return NULL;
+  pool->workers = calloc(n_threads, sizeof(PoolWorker));
+  if (pool->workers == NULL) {
+    free(pool);
+    return NULL;
+  }
+  for (int i = 0; i < n_threads; i++) {
+    PoolWorker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->decoder = jpeg_decoder_create();
+    if (worker->decoder == NULL) {
+      for (int j = 0; j < i; j++)
+        jpeg_decoder_destroy(pool->workers[j].decoder);
+      free(pool->workers);
+      free(pool);
+      return NULL;
+    }
+    worker->decoder->pool_worker = worker;
+  }
+  pool->n_threads = n_threads;
+
+#ifndef JPEG_NO_THREADS
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->changed, NULL);
+  atomic_init(&pool->n_pending, 0);
+  for (int i = 0; i < n_threads; i++)
+    pthread_mutex_init(&pool->workers[i].lock, NULL);
+  // fewer threads if some cannot be started
+  int n_created = 1;
+  while (n_created < n_threads && pthread_create(&pool->workers[n_created].thread, NULL, pool_thread,
+                                                 &pool->workers[n_created]) == 0)
+    n_created++;
+  for (int i = n_created; i < n_threads; i++) {
+    jpeg_decoder_destroy(pool->workers[i].decoder);
+    pthread_mutex_destroy(&pool->workers[i].lock);
+  }
+  pool->n_threads = n_created;
+#endif
+  return pool;
+}
+
+void jpeg_decoder_pool_destroy(JpegDecoderPool *pool) {
+  if (pool == NULL)
+    return;
+#ifndef JPEG_NO_THREADS
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1; i < pool->n_threads; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->changed);
+#endif
+  for (int i = 0; i < pool->n_threads; i++) {
+    jpeg_decoder_destroy(pool->workers[i].decoder);
+#ifndef JPEG_NO_THREADS
+    pthread_mutex_destroy(&pool->workers[i].lock);
+    free(pool->workers[i].tasks);
+#endif
+  }
+  free(pool->workers);
+  free(pool);
+}
+
+int jpeg_decoder_pool_num_threads(const JpegDecoderPool *pool) { return pool->n_threads; }
+
+JpegDecoder *jpeg_decoder_pool_get_decoder(JpegDecoderPool *pool, int i) {
+  return 0 <= i && i < pool->n_threads ? pool->workers[i].decoder : NULL;
+}
+
+int jpeg_decode_batch(JpegDecoderPool *pool, JpegBatchItem *items, int n_items) {
+#ifdef JPEG_NO_THREADS
+  for (int i = 0; i < n_items; i++)
+    decode_batch_item(&pool->workers[0], &items[i]);
+#else
+  // images go to the deques in turn. each deque also needs room for the sub-tasks of one image
+  int capacity = CDIV(n_items, pool->n_threads) + pool->n_threads;
+  for (int i = 0; i < pool->n_threads; i++) {
+    PoolWorker *worker = &pool->workers[i];
+    pthread_mutex_lock(&worker->lock);
+    if (worker->capacity < capacity) {
+      PoolTask *tasks = realloc(worker->tasks, capacity * sizeof(PoolTask));
+      if (tasks != NULL) {
+        worker->tasks = tasks;
+        worker->capacity = capacity;
+      }
+    }
+    pthread_mutex_unlock(&worker->lock);
+  }
+  atomic_store(&pool->n_pending, n_items);
+  for (int i = 0; i < n_items; i++)
+    if (!push_task(&pool->workers[i % pool->n_threads], (PoolTask){NULL, &items[i], &pool->n_pending})) {
+      items[i].status = JPEG_ERROR_OUT_OF_MEMORY;
+      snprintf(items[i].error_message, sizeof(items[i].error_message), "Out of memory for the tasks of the batch");
+      atomic_fetch_sub(&pool->n_pending, 1);
+    }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->batch_id++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  work_on_batch(&pool->workers[0]);
+#endif
+
+  int n_failed = 0;
+  for (int i = 0; i < n_items; i++)
+    n_failed += items[i].status != JPEG_OK;
+  return n_failed;
+}
+
+// fill the bit buffer to more than 56 bits. byte stuffing (F.1.2.3) is removed here.
+// once a marker is found, it is kept in br->marker and zeros are fed instead
+static void fill_bits(BitReader *br) {
+  // fast path: no 0xFF in the next 8 bytes, so they can be copied as is
+  if (!br->marker && br->end - br->ptr >= 8) {
+    uint64_t value = read_be_64(br->ptr);
+    uint64_t inverted = ~value;
+    if (((inverted - 0x0101010101010101) & ~inverted & 0x8080808080808080) == 0) {
+      int n_bytes = (64 - br->n_bits) / 8;
+      br->bits |= (value >> br->n_bits) & (~0ULL << (64 - br->n_bits - n_bytes * 8));
+      br->n_bits += n_bytes * 8;
+      br->ptr += n_bytes;
+      return;
+    }
+  }
+
+  while (br->n_bits <= 56) {
+    uint8_t byte = 0;
+    while (!br->marker && br->ptr < br->end) {
+      if (*br->ptr != 0xFF) {
+        byte = *br->ptr++;
+        break;
+      }
+
+      // 0xFF00 is a stuffed 0xFF. 0xFFFF is a fill byte (B.1.1.2). otherwise it's a marker
+      uint8_t byte2 = br->ptr + 1 < br->end ? br->ptr[1] : EOI;
+      if (byte2 == 0) {
+        byte = 0xFF;
+        br->ptr += 2;
+        break;
+      }
+      if (byte2 == 0xFF)
+        br->ptr++;
+      else
+        br->marker = byte2;
+    }
+    br->bits |= (uint64_t)byte << (56 - br->n_bits);
+    br->n_bits += 8;
+  }
+}
+
+// F.2.2.4. n_bits can be 0
+static uint32_t receive(BitReader *br, int n_bits) {
+  if (br->n_bits < n_bits)
+    fill_bits(br);
+
+  uint32_t value = (br->bits >> 1) >> (63 - n_bits);
+  br->bits <<= n_bits;
+  br->n_bits -= n_bits;
+  return value;
+}
+
+// Figure F.17 and F.12 combined. n_bits can be 0
+static int32_t receive_extend(BitReader *br, int n_bits) {
+  if (br->n_bits < n_bits)
+    fill_bits(br);
+
+  // shift twice since shifting by 64 is undefined
+  int32_t value = (br->bits >> 1) >> (63 - n_bits);
+  int32_t positive_mask = (int32_t)(br->bits >> 63) - 1; // 0 if the leading bit is 1
+  br->bits <<= n_bits;
+  br->n_bits -= n_bits;
+  return value + (positive_mask & (int32_t)((~0U << n_bits) + 1));
+}
+
+// Figure F.16, with a lookahead table for codes not longer than HUFFMAN_LOOKAHEAD bits
+static uint8_t decode(Decoder *decoder, BitReader *br, const HuffmanTable *h_table) {
+  if (br->n_bits < 32)
+    fill_bits(br);
+
+  uint16_t entry = h_table->lookup[br->bits >> (64 - HUFFMAN_LOOKAHEAD)];
+  if (entry) {
+    br->bits <<= entry >> 8;
+    br->n_bits -= entry >> 8;
+    return entry & 0xFF;
+  }
+
+  // slow path
+  STATS_ADD(decoder, huffman_slow_path, 1);
+  for (int i = HUFFMAN_LOOKAHEAD; i < MAX_HUFFMAN_CODE_LENGTH; i++) {
+    int32_t code = br->bits >> (63 - i);
+    if (code <= h_table->maxcode[i]) {
+      br->bits <<= i + 1;
+      br->n_bits -= i + 1;
+      return h_table->huffval[h_table->valptr[i] + code - h_table->mincode[i]];
+    }
+  }
+  ASSERT(decoder, false, JPEG_ERROR_CORRUPT, "Encounter invalid Huffman code");
+  return 0;
+}
+
+// E.2.4: discard the remaining bits of the current interval and consume the expected RSTm marker
+void handle_restart(Decoder *decoder, BitReader *br, int interval_idx) {
+  while (!br->marker && br->ptr < br->end) {
+    br->n_bits = 0;
+    fill_bits(br);
+  }
+  br->bits = 0;
+  br->n_bits = 0;
+
+  PRINT(decoder, "Encounter RST%d marker\n", br->marker - RST0);
+  STATS_ADD(decoder, restart_markers, 1);
+  ASSERT(decoder, br->marker == RST0 + interval_idx % 8, JPEG_ERROR_CORRUPT, "Expect RST%d marker, found %X",
+         interval_idx % 8, br->marker);
+  br->ptr += 2;
+  br->marker = 0;
+}
+
+void decode_block_sof0(Decoder *decoder, BitReader *br, uint8_t *out, int stride, int dc_table_id, int ac_table_id,
+                       int component_id, int *dc_pred) {
+  // quantized coefficients in natural order
+  int16_t block[BLOCK_SIZE * BLOCK_SIZE] = {0};
+  int last = decode_block_coefs(decoder, br, block, dc_table_id, ac_table_id, dc_pred);
+  idct_block(decoder, block, last, component_id, out, stride);
+}
+
+// the quantized coefficients of a block, in natural order. block must be zeroed.
+// returns the zig-zag index of the last nonzero coefficient
+static inline int decode_block_coefs(Decoder *decoder, BitReader *br, int16_t *block, int dc_table_id,
+                                     int ac_table_id, int *dc_pred) {
+  HuffmanTable *dc_table = &decoder->h_tables[0][dc_table_id];
+  HuffmanTable *ac_table = &decoder->h_tables[1][ac_table_id];
+  int last = 0;
+
+  // decode DC: F.2.2.1
+  int32_t diff = receive_extend(br, decode(decoder, br, dc_table));
+
+  *dc_pred += diff;
+  block[0] = *dc_pred;
+
+  // decode AC: F.2.2.2
+  for (int k = 1; k < BLOCK_SIZE * BLOCK_SIZE;) {
+    uint8_t rs = decode(decoder, br, ac_table);
+    if (rs == ZRL)
+      k += 16;
+    else if (rs == EOB)
+      break;
+    else {
+      int rrrr = upper_half(rs);
+      int ssss = lower_half(rs);
+      k += rrrr;
+      ASSERT(decoder, k < BLOCK_SIZE * BLOCK_SIZE, JPEG_ERROR_CORRUPT, "Encounter invalid code");
+      block[DE_ZIG_ZAG[k]] = receive_extend(br, ssss);
+      last = k;
+      k += 1;
+    }
+  }
+  return last;
+}
+
+// dequantize and IDCT with the kernel for where the nonzero coefficients are. last is the zig-zag index of the last one
+static inline void idct_block(Decoder *decoder, const int16_t *block, int last, int component_id, uint8_t *out,
+                              int stride) {
+  // zig-zag indices up to 2 are in the top-left 2x2, and up to 9 in the top-left 4x4
+  int kernel = last == 0 ? IDCT_DC : last <= 2 ? IDCT_2X2 : last <= 9 ? IDCT_4X4 : IDCT_FULL;
+  decoder->idct_counts[kernel]++;
+  const uint16_t *q_table = decoder->q_tables[decoder->components[component_id].q_table_id];
+#ifndef JPEG_NO_STATS
+  // reading the clock for every block costs about as much as a sparse IDCT, so only 1 in 16 blocks of each kernel is
+  // timed
+  if (decoder->stats_timing && decoder->idct_counts[kernel] % 16 == 1) {
+    uint64_t start = read_ticks();
+    decoder->idct[kernel](block, q_table, out, stride);
+    decoder->stats.idct_ns += (read_ticks() - start) * 16;
+    return;
+  }
+#endif
+  decoder->idct[kernel](block, q_table, out, stride);
+}
+
+// same as decode_block_sof0(), without dequantization and IDCT. for blocks outside of the output
+void skip_block_sof0(Decoder *decoder, BitReader *br, int dc_table_id, int ac_table_id, int *dc_pred) {
+  STATS_ADD(decoder, skipped_blocks, 1);
+  HuffmanTable *ac_table = &decoder->h_tables[1][ac_table_id];
+  *dc_pred += receive_extend(br, decode(decoder, br, &decoder->h_tables[0][dc_table_id]));
+
+  for (int k = 1; k < BLOCK_SIZE * BLOCK_SIZE;) {
+    uint8_t rs = decode(decoder, br, ac_table);
+    if (rs == ZRL)
+      k += 16;
+    else if (rs == EOB)
+      break;
+    else {
+      k += upper_half(rs);
+      ASSERT(decoder, k < BLOCK_SIZE * BLOCK_SIZE, JPEG_ERROR_CORRUPT, "Encounter invalid code");
+      receive_extend(br, lower_half(rs));
+      k += 1;
+    }
+  }
+}
+
+#ifndef JPEG_NO_THREADS
+// for decode_scan_speculative(): entropy-decode one MCU of the current scan without storing it
+void skip_mcu(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds) {
+  uint8_t n_components = payload[0];
+  for (int c = 0; c < n_components; c++) {
+    int component_id = payload[1 + c * 2] - decoder->min_component;
+    Component *component = &decoder->components[component_id];
+    int n_blocks = n_components == 1 ? 1 : component->x_sampling * component->y_sampling;
+    for (int i = 0; i < n_blocks; i++)
+      skip_block_sof0(decoder, br, upper_half(payload[2 + c * 2]), lower_half(payload[2 + c * 2]),
+                      &dc_preds[component_id]);
+  }
+}
+
+// the next bit to read, in bits from data, where a stuffed 0xFF00 is the 0xFF alone. readers at the same bit of the
+// data get the same position, however many bytes they have buffered. not valid once a marker is found
+uint64_t bit_position(const BitReader *br, const uint8_t *data) {
+  const uint8_t *ptr = br->ptr;
+  for (int i = 0; i < (br->n_bits + 7) / 8; i++) {
+    ptr--;
+    if (ptr > data && ptr[0] == 0 && ptr[-1] == 0xFF)
+      ptr--;
+  }
+  return (uint64_t)(ptr - data) * 8 + (8 - br->n_bits % 8) % 8;
+}
+
+// move br to a position from bit_position()
+void seek_bit_position(BitReader *br, const uint8_t *data, uint64_t position) {
+  br->ptr = data + position / 8;
+  br->bits = 0;
+  br->n_bits = 0;
+  br->marker = 0;
+  receive(br, position % 8);
+}
+#endif
+
+// G.1.2: a progressive scan refines the coefficients of one or more components, which are kept until EOI.
+// DC scans can be interleaved. AC scans have a single component.
+// with coefs_only or multi_scan, baseline scans are decoded here too, each block in full
+size_t decode_scan_coefs(Decoder *decoder, const uint8_t *payload, const uint8_t *data, size_t size) {
+  uint8_t n_components = payload[0];
+  int ss = payload[1 + n_components * 2];
+  int se = payload[2 + n_components * 2];
+  int ah = upper_half(payload[3 + n_components * 2]);
+  int al = lower_half(payload[3 + n_components * 2]);
+  bool progressive = decoder->encoding == SOF2;
+  if (progressive) {
+    ASSERT(decoder, ss == 0 ? se == 0 : n_components == 1 && ss <= se && se < BLOCK_SIZE * BLOCK_SIZE,
+           JPEG_ERROR_CORRUPT, "Invalid spectral selection %d-%d", ss, se);
+    ASSERT(decoder, ah <= 13 && al <= 13, JPEG_ERROR_CORRUPT, "Invalid successive approximation");
+  }
+
+  // a non-interleaved scan only covers the blocks of its component. A.2.2
+  int nx_mcu, ny_mcu;
+  if (n_components == 1) {
+    Component *component = &decoder->components[payload[1] - decoder->min_component];
+    nx_mcu = CDIV(decoder->frame_width * component->x_sampling, BLOCK_SIZE * decoder->max_x_sampling);
+    ny_mcu = CDIV(decoder->frame_height * component->y_sampling, BLOCK_SIZE * decoder->max_y_sampling);
+  } else {
+    nx_mcu = CDIV(decoder->frame_width, BLOCK_SIZE * decoder->max_x_sampling);
+    ny_mcu = CDIV(decoder->frame_height, BLOCK_SIZE * decoder->max_y_sampling);
+  }
+
+  // a non-interleaved scan leaves out the padding blocks of partial MCUs
+  for (int c = 0; c < n_components && !progressive; c++) {
+    Component *component = &decoder->components[payload[1 + c * 2] - decoder->min_component];
+    int blocks_per_column = CDIV(decoder->frame_height, BLOCK_SIZE * decoder->max_y_sampling) * component->y_sampling;
+    if (!component->coefs_set && n_components == 1 &&
+        (nx_mcu < component->blocks_per_row || ny_mcu < blocks_per_column))
+      memset(component->coefs, 0,
+             (size_t)component->blocks_per_row * blocks_per_column * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+  }
+
+  BitReader br = {data, data + size};
+  decoder->eobrun = 0;
+  for (int i = 0; i < MAX_COMPONENTS; i++)
+    decoder->dc_preds[i] = 0;
+  uint64_t start = STATS_START(decoder);
+
+  for (int mcu_idx = 0; mcu_idx < nx_mcu * ny_mcu; mcu_idx++) {
+    if (decoder->restart_interval && mcu_idx && mcu_idx % decoder->restart_interval == 0) {
+      handle_restart(decoder, &br, mcu_idx / decoder->restart_interval - 1);
+      decoder->eobrun = 0;
+      for (int i = 0; i < MAX_COMPONENTS; i++)
+        decoder->dc_preds[i] = 0;
+    }
+
+    int mcu_y = mcu_idx / nx_mcu;
+    int mcu_x = mcu_idx % nx_mcu;
+    for (int c = 0; c < n_components; c++) {
+      int component_id = payload[1 + c * 2] - decoder->min_component;
+      int dc_table_id = upper_half(payload[2 + c * 2]);
+      int ac_table_id = lower_half(payload[2 + c * 2]);
+      Component *component = &decoder->components[component_id];
+      int x_sampling = n_components == 1 ? 1 : component->x_sampling;
+      int y_sampling = n_components == 1 ? 1 : component->y_sampling;
+
+      for (int y = 0; y < y_sampling; y++)
+        for (int x = 0; x < x_sampling; x++) {
+          size_t block_idx = (size_t)(mcu_y * y_sampling + y) * component->blocks_per_row + mcu_x * x_sampling + x;
+          int16_t *block = component->coefs + block_idx * BLOCK_SIZE * BLOCK_SIZE;
+          if (!progressive) {
+            memset(block, 0, BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t));
+            decode_block_coefs(decoder, &br, block, dc_table_id, ac_table_id, &decoder->dc_preds[component_id]);
+          }
+          else if (ss == 0 && ah == 0)
+            decode_dc_first(decoder, &br, block, dc_table_id, al, &decoder->dc_preds[component_id]);
+          else if (ss == 0)
+            block[0] |= receive(&br, 1) << al; // G.1.2.1
+          else if (ah == 0)
+            decode_ac_first(decoder, &br, block, ac_table_id, ss, se, al);
+          else
+            decode_ac_refine(decoder, &br, block, ac_table_id, ss, se, al);
+        }
+    }
+  }
+
+  STATS_STOP(decoder, huffman_ns, start);
+  for (int c = 0; c < n_components; c++)
+    decoder->components[payload[1 + c * 2] - decoder->min_component].coefs_set = true;
+
+  // padding bits up to the next marker
+  size_t scan_size;
+  find_restart_intervals(br.ptr, data + size - br.ptr, NULL, 0, &scan_size);
+  return br.ptr - data + scan_size;
+}
+
+// G.1.2.1
+void decode_dc_first(Decoder *decoder, BitReader *br, int16_t *block, int dc_table_id, int al, int *dc_pred) {
+  *dc_pred += receive_extend(br, decode(decoder, br, &decoder->h_tables[0][dc_table_id]));
+  block[0] = *dc_pred * (1 << al);
+}
+
+// G.1.2.2. an EOBn code ends this block and the next EOBRUN - 1 blocks of the band
+void decode_ac_first(Decoder *decoder, BitReader *br, int16_t *block, int ac_table_id, int ss, int se, int al) {
+  if (decoder->eobrun > 0) {
+    decoder->eobrun--;
+    return;
+  }
+
+  HuffmanTable *ac_table = &decoder->h_tables[1][ac_table_id];
+  for (int k = ss; k <= se; k++) {
+    uint8_t rs = decode(decoder, br, ac_table);
+    int rrrr = upper_half(rs);
+    int ssss = lower_half(rs);
+    if (ssss == 0) {
+      if (rrrr < 15) {
+        decoder->eobrun = (1 << rrrr) - 1 + receive(br, rrrr);
+        break;
+      }
+      k += 15; // ZRL
+      continue;
+    }
+    k += rrrr;
+    ASSERT(decoder, k <= se, JPEG_ERROR_CORRUPT, "Encounter invalid code");
+    block[DE_ZIG_ZAG[k]] = receive_extend(br, ssss) * (1 << al);
+  }
+}
+
+// G.1.2.3. each coefficient that is already nonzero gets a correction bit. zero coefficients are skipped by runs,
+// and the new coefficients are +-1 at this bit position
+void decode_ac_refine(Decoder *decoder, BitReader *br, int16_t *block, int ac_table_id, int ss, int se, int al) {
+  HuffmanTable *ac_table = &decoder->h_tables[1][ac_table_id];
+  int p1 = 1 << al;
+  int m1 = -p1;
+  int k = ss;
+
+  if (decoder->eobrun == 0) {
+    for (; k <= se; k++) {
+      uint8_t rs = decode(decoder, br, ac_table);
+      int rrrr = upper_half(rs);
+      int ssss = lower_half(rs);
+      int value = 0;
+      if (ssss != 0) {
+        ASSERT(decoder, ssss == 1, JPEG_ERROR_CORRUPT, "Encounter invalid code");
+        value = receive(br, 1) ? p1 : m1;
+      } else if (rrrr < 15) {
+        // the rest of this block is refined below
+        decoder->eobrun = (1 << rrrr) + receive(br, rrrr);
+        break;
+      }
+
+      // skip rrrr zero coefficients (16 for ZRL), refining the nonzero ones on the way
+      for (; k <= se; k++) {
+        int16_t *coef = &block[DE_ZIG_ZAG[k]];
+        if (*coef != 0) {
+          if (receive(br, 1) && (*coef & p1) == 0)
+            *coef += *coef >= 0 ? p1 : m1;
+        } else if (rrrr-- == 0)
+          break;
+      }
+      if (value != 0) {
+        ASSERT(decoder, k <= se, JPEG_ERROR_CORRUPT, "Encounter invalid code");
+        block[DE_ZIG_ZAG[k]] = value;
+      }
+    }
+  }
+
+  if (decoder->eobrun > 0) {
+    for (; k <= se; k++) {
+      int16_t *coef = &block[DE_ZIG_ZAG[k]];
+      if (*coef != 0 && receive(br, 1) && (*coef & p1) == 0)
+        *coef += *coef >= 0 ? p1 : m1;
+    }
+    decoder->eobrun--;
+  }
+}
+
+// IDCT and color conversion of the whole image, once all scans are decoded. for progressive and multi_scan images
+void finish_progressive(Decoder *decoder) {
+  setup_mcus(decoder, decoder->n_channels);
+  decoder->decode_mcus = decode_mcus_coefs;
+  int mcu_end = (decoder->mcu_y1 - 1) * decoder->nx_mcu + decoder->mcu_x1;
+  allocate_mcu_rows(decoder, decoder->n_channels);
+  decode_mcu_rows(decoder, NULL, NULL, decoder->n_channels, decoder->mcu_y0 * decoder->nx_mcu, mcu_end);
+}
+
+// the output of progressive JPEGs: IDCT of the MCUs [mcu_start, mcu_end) from the coefficients, to the component
+// planes, or straight to the image for grayscale
+void decode_mcus_coefs(Decoder *decoder, const uint8_t *payload, BitReader *br, int *dc_preds, int mcu_start,
+                       int mcu_end) {
+  int block_size = decoder->block_size;
+
+  for (int mcu_idx = mcu_start; mcu_idx < mcu_end; mcu_idx++) {
+    int mcu_y = mcu_idx / decoder->nx_mcu;
+    int mcu_x = mcu_idx % decoder->nx_mcu;
+    if (mcu_x < decoder->mcu_x0 || mcu_x >= decoder->mcu_x1)
+      continue;
+
+    // luma-only output does not need the IDCT of chroma blocks
+    for (int c = 0; c < (decoder->luma_only ? 1 : decoder->n_channels); c++) {
+      Component *component = &decoder->components[c];
+      int x_sampling = decoder->n_channels == 1 ? 1 : component->x_sampling;
+      int y_sampling = decoder->n_channels == 1 ? 1 : component->y_sampling;
+
+      for (int y = 0; y < y_sampling; y++)
+        for (int x = 0; x < x_sampling; x++) {
+          int block_x = mcu_x * x_sampling + x;
+          int block_y = mcu_y * y_sampling + y;
+          int coef_y = mcu_y % decoder->n_coef_mcu_rows * y_sampling + y;
+          const int16_t *block =
+              component->coefs + ((size_t)coef_y * component->blocks_per_row + block_x) * BLOCK_SIZE * BLOCK_SIZE;
+          int last = BLOCK_SIZE * BLOCK_SIZE - 1;
+          while (last > 0 && block[DE_ZIG_ZAG[last]] == 0)
+            last--;
+
+          if (decoder->n_channels > 1) {
+            uint8_t *out = component->plane +
+                           ((mcu_y % decoder->n_plane_mcu_rows) * y_sampling + y) * block_size * component->stride +
+                           block_x * block_size;
+            idct_block(decoder, block, last, c, out, component->stride);
+            continue;
+          }
+
+          // grayscale: same as decode_mcus_gray()
+          int out_x = block_x * block_size - decoder->crop_x;
+          int out_y = block_y * block_size - decoder->crop_y;
+          if (decoder->pixel_size == 1 && out_x >= 0 && out_y >= 0 && out_x + block_size <= decoder->width &&
+              out_y + block_size <= decoder->height) {
+            uint8_t *out = decoder->image + (out_y - decoder->image_y) * decoder->stride + out_x;
+            idct_block(decoder, block, last, c, out, decoder->stride);
+            continue;
+          }
+          uint8_t block_u8[BLOCK_SIZE][BLOCK_SIZE];
+          idct_block(decoder, block, last, c, &block_u8[0][0], BLOCK_SIZE);
+          for (int j = MAX(0, -out_y); j < MIN(block_size, decoder->height - out_y); j++)
+            gray_to_pixels(&block_u8[j][MAX(0, -out_x)],
+                           decoder->image + (out_y + j - decoder->image_y) * decoder->stride +
+                               (out_x + MAX(0, -out_x)) * decoder->pixel_size,
+                           MIN(block_size, decoder->width - out_x) - MAX(0, -out_x), decoder->pixel_size);
+        }
+    }
+  }
+}
+
+// ITU-T.81 A.3.3. integer IDCT using the LLM factorization (same as libjpeg's jidctint.c), with 12-bit constants.
+// coefficients are in natural order and are dequantized as they are loaded. output is level-shifted and clamped.
+#define FIX(x) ((int32_t)((x)*4096 + 0.5))
+
+static inline void idct_1d_int(int32_t out[BLOCK_SIZE], int32_t s0, int32_t s1, int32_t s2, int32_t s3, int32_t s4,
+                               int32_t s5, int32_t s6, int32_t s7) {
+  // even part
+  int32_t p1 = (s2 + s6) * FIX(0.5411961);
+  int32_t t2 = p1 + s6 * FIX(-1.847759065);
+  int32_t t3 = p1 + s2 * FIX(0.765366865);
+  int32_t t0 = (s0 + s4) * 4096;
+  int32_t t1 = (s0 - s4) * 4096;
+  int32_t x0 = t0 + t3, x3 = t0 - t3;
+  int32_t x1 = t1 + t2, x2 = t1 - t2;
+
+  // odd part
+  int32_t p3 = s7 + s3, p4 = s5 + s1;
+  int32_t p5 = (p3 + p4) * FIX(1.175875602);
+  int32_t q1 = p5 + (s7 + s1) * FIX(-0.899976223);
+  int32_t q2 = p5 + (s5 + s3) * FIX(-2.562915447);
+  p3 *= FIX(-1.961570560);
+  p4 *= FIX(-0.390180644);
+  int32_t y0 = s7 * FIX(0.298631336) + q1 + p3;
+  int32_t y1 = s5 * FIX(2.053119869) + q2 + p4;
+  int32_t y2 = s3 * FIX(3.072711026) + q2 + p3;
+  int32_t y3 = s1 * FIX(1.501321110) + q1 + p4;
+
+  out[0] = x0 + y3;
+  out[7] = x0 - y3;
+  out[1] = x1 + y2;
+  out[6] = x1 - y2;
+  out[2] = x2 + y1;
+  out[5] = x2 - y1;
+  out[3] = x3 + y0;
+  out[4] = x3 - y0;
+}
+
+static void idct_block_scalar(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  int32_t temp[BLOCK_SIZE * BLOCK_SIZE];
+  int32_t values[BLOCK_SIZE];
+
+  // column-wise. keep 2 extra bits of precision
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    const int16_t *c = coefs + i;
+    const uint16_t *q = q_table + i;
+    if (!(c[8] | c[16] | c[24] | c[32] | c[40] | c[48] | c[56])) {
+      for (int j = 0; j < BLOCK_SIZE; j++)
+        temp[j * BLOCK_SIZE + i] = c[0] * q[0] * 4;
+      continue;
+    }
+    idct_1d_int(values, c[0] * q[0], c[8] * q[8], c[16] * q[16], c[24] * q[24], c[32] * q[32], c[40] * q[40],
+                c[48] * q[48], c[56] * q[56]);
+    for (int j = 0; j < BLOCK_SIZE; j++)
+      temp[j * BLOCK_SIZE + i] = (values[j] + (1 << 9)) >> 10;
+  }
+
+  // row-wise. remove 12-bit constants, 2 extra bits and 1/8 scale (3 bits) of the 2D IDCT. level shift. A.3.1
+  for (int j = 0; j < BLOCK_SIZE; j++) {
+    const int32_t *t = temp + j * BLOCK_SIZE;
+    idct_1d_int(values, t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7]);
+    for (int i = 0; i < BLOCK_SIZE; i++)
+      out[j * stride + i] = CLAMP((values[i] + (1 << 16) + (128 << 17)) >> 17, 0, 255);
+  }
+}
+
+// kernels for sparse blocks. same arithmetic as idct_block_scalar(), with the zero coefficients left out
+static void idct_block_dc(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  uint8_t value = CLAMP(((coefs[0] * q_table[0] + 4) >> 3) + 128, 0, 255);
+  for (int j = 0; j < BLOCK_SIZE; j++)
+    memset(out + j * stride, value, BLOCK_SIZE);
+}
+
+// coefficients are in the top-left size x size, for size = 2 or 4. inlined for each size, so the zero terms are
+// optimized away
+static inline void idct_block_sparse(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride,
+                                     int size) {
+  int32_t temp[BLOCK_SIZE * 4]; // the other columns are zero
+  int32_t values[BLOCK_SIZE];
+
+  for (int i = 0; i < size; i++) {
+    const int16_t *c = coefs + i;
+    const uint16_t *q = q_table + i;
+    int32_t s2 = size > 2 ? c[16] * q[16] : 0;
+    int32_t s3 = size > 2 ? c[24] * q[24] : 0;
+    idct_1d_int(values, c[0] * q[0], c[8] * q[8], s2, s3, 0, 0, 0, 0);
+    for (int j = 0; j < BLOCK_SIZE; j++)
+      temp[j * 4 + i] = (values[j] + (1 << 9)) >> 10;
+  }
+
+  for (int j = 0; j < BLOCK_SIZE; j++) {
+    const int32_t *t = temp + j * 4;
+    idct_1d_int(values, t[0], t[1], size > 2 ? t[2] : 0, size > 2 ? t[3] : 0, 0, 0, 0, 0);
+    for (int i = 0; i < BLOCK_SIZE; i++)
+      out[j * stride + i] = CLAMP((values[i] + (1 << 16) + (128 << 17)) >> 17, 0, 255);
+  }
+}
+
+static void idct_block_sparse_2x2(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  idct_block_sparse(coefs, q_table, out, stride, 2);
+}
+
+static void idct_block_sparse_4x4(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  idct_block_sparse(coefs, q_table, out, stride, 4);
+}
+
+// reduced IDCTs for scaled decoding. an N x N output samples the 8x8 IDCT at the centers of (8/N) x (8/N) pixel
+// groups, which is an N-point IDCT of the lowest N x N coefficients with the same normalization
+static void idct_block_4x4(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  int32_t temp[4 * 4];
+
+  // column-wise. keep 2 extra bits of precision
+  for (int i = 0; i < 4; i++) {
+    int32_t s0 = coefs[i] * q_table[i], s1 = coefs[8 + i] * q_table[8 + i];
+    int32_t s2 = coefs[16 + i] * q_table[16 + i], s3 = coefs[24 + i] * q_table[24 + i];
+    int32_t e0 = (s0 + s2) * FIX(0.707106781), e1 = (s0 - s2) * FIX(0.707106781);
+    int32_t o0 = s1 * FIX(0.923879533) + s3 * FIX(0.382683432);
+    int32_t o1 = s1 * FIX(0.382683432) - s3 * FIX(0.923879533);
+    temp[0 * 4 + i] = (e0 + o0 + (1 << 9)) >> 10;
+    temp[1 * 4 + i] = (e1 + o1 + (1 << 9)) >> 10;
+    temp[2 * 4 + i] = (e1 - o1 + (1 << 9)) >> 10;
+    temp[3 * 4 + i] = (e0 - o0 + (1 << 9)) >> 10;
+  }
+
+  // row-wise. remove 12-bit constants, 2 extra bits and 1/4 scale (2 bits) of the 2D IDCT. level shift
+  for (int j = 0; j < 4; j++) {
+    const int32_t *t = temp + j * 4;
+    int32_t e0 = (t[0] + t[2]) * FIX(0.707106781), e1 = (t[0] - t[2]) * FIX(0.707106781);
+    int32_t o0 = t[1] * FIX(0.923879533) + t[3] * FIX(0.382683432);
+    int32_t o1 = t[1] * FIX(0.382683432) - t[3] * FIX(0.923879533);
+    int32_t bias = (1 << 15) + (128 << 16);
+    out[j * stride + 0] = CLAMP((e0 + o0 + bias) >> 16, 0, 255);
+    out[j * stride + 1] = CLAMP((e1 + o1 + bias) >> 16, 0, 255);
+    out[j * stride + 2] = CLAMP((e1 - o1 + bias) >> 16, 0, 255);
+    out[j * stride + 3] = CLAMP((e0 - o0 + bias) >> 16, 0, 255);
+  }
+}
+
+static void idct_block_2x2(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  // cos(pi/4) in each direction and 1/4 scale of the 2D IDCT give 1/8
+  int32_t s00 = coefs[0] * q_table[0], s01 = coefs[1] * q_table[1];
+  int32_t s10 = coefs[8] * q_table[8], s11 = coefs[9] * q_table[9];
+  int32_t bias = 4 + (128 << 3);
+  out[0] = CLAMP((s00 + s01 + s10 + s11 + bias) >> 3, 0, 255);
+  out[1] = CLAMP((s00 - s01 + s10 - s11 + bias) >> 3, 0, 255);
+  out[stride + 0] = CLAMP((s00 + s01 - s10 - s11 + bias) >> 3, 0, 255);
+  out[stride + 1] = CLAMP((s00 - s01 - s10 + s11 + bias) >> 3, 0, 255);
+}
+
+// idct_block_4x4() of a DC-only block
+static void idct_block_4x4_dc(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  int32_t t = (coefs[0] * q_table[0] * FIX(0.707106781) + (1 << 9)) >> 10;
+  uint8_t value = CLAMP((t * FIX(0.707106781) + (1 << 15) + (128 << 16)) >> 16, 0, 255);
+  for (int j = 0; j < 4; j++)
+    memset(out + j * stride, value, 4);
+}
+
+// the average of the block
+static void idct_block_1x1(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  out[0] = CLAMP((coefs[0] * q_table[0] + 4 + (128 << 3)) >> 3, 0, 255);
+}
+
+#ifdef JPEG_SSE2
+// same arithmetic as idct_block_scalar() on 16-bit rows, so results are identical for valid inputs.
+// multiply-adds use interleaved pairs: out = x * c[even] + y * c[odd]
+#define IDCT_CONST(x, y) _mm_setr_epi16((x), (y), (x), (y), (x), (y), (x), (y))
+
+#define IDCT_ROT(out0, out1, x, y, c0, c1)                                                                             \
+  __m128i out0##_lo_in = _mm_unpacklo_epi16((x), (y));                                                                 \
+  __m128i out0##_hi_in = _mm_unpackhi_epi16((x), (y));                                                                 \
+  __m128i out0##_l = _mm_madd_epi16(out0##_lo_in, c0);                                                                 \
+  __m128i out0##_h = _mm_madd_epi16(out0##_hi_in, c0);                                                                 \
+  __m128i out1##_l = _mm_madd_epi16(out0##_lo_in, c1);                                                                 \
+  __m128i out1##_h = _mm_madd_epi16(out0##_hi_in, c1);
+
+// 16-bit to 32-bit, multiplied by 4096
+#define IDCT_WIDEN(out, in)                                                                                            \
+  __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4);                                  \
+  __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4);
+
+#define IDCT_ADD(out, a, b)                                                                                            \
+  __m128i out##_l = _mm_add_epi32(a##_l, b##_l);                                                                       \
+  __m128i out##_h = _mm_add_epi32(a##_h, b##_h);
+
+#define IDCT_SUB(out, a, b)                                                                                            \
+  __m128i out##_l = _mm_sub_epi32(a##_l, b##_l);                                                                       \
+  __m128i out##_h = _mm_sub_epi32(a##_h, b##_h);
+
+#define IDCT_BUTTERFLY(out0, out1, a, b, bias, shift)                                                                  \
+  {                                                                                                                    \
+    __m128i biased_l = _mm_add_epi32(a##_l, bias);                                                                     \
+    __m128i biased_h = _mm_add_epi32(a##_h, bias);                                                                     \
+    IDCT_ADD(sum, biased, b)                                                                                           \
+    IDCT_SUB(dif, biased, b)                                                                                           \
+    out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, shift), _mm_srai_epi32(sum_h, shift));                                \
+    out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, shift), _mm_srai_epi32(dif_h, shift));                                \
+  }
+
+#define IDCT_PASS(bias, shift)                                                                                         \
+  {                                                                                                                    \
+    IDCT_ROT(t2, t3, row2, row6, rot0_0, rot0_1)                                                                       \
+    __m128i sum04 = _mm_add_epi16(row0, row4);                                                                         \
+    __m128i dif04 = _mm_sub_epi16(row0, row4);                                                                         \
+    IDCT_WIDEN(t0, sum04)                                                                                              \
+    IDCT_WIDEN(t1, dif04)                                                                                              \
+    IDCT_ADD(x0, t0, t3)                                                                                               \
+    IDCT_SUB(x3, t0, t3)                                                                                               \
+    IDCT_ADD(x1, t1, t2)                                                                                               \
+    IDCT_SUB(x2, t1, t2)                                                                                               \
+                                                                                                                       \
+    IDCT_ROT(y0a, y2a, row7, row3, rot2_0, rot2_1)                                                                     \
+    IDCT_ROT(y1a, y3a, row5, row1, rot3_0, rot3_1)                                                                     \
+    __m128i sum17 = _mm_add_epi16(row1, row7);                                                                         \
+    __m128i sum35 = _mm_add_epi16(row3, row5);                                                                         \
+    IDCT_ROT(q1, q2, sum17, sum35, rot1_0, rot1_1)                                                                     \
+    IDCT_ADD(y0, y0a, q1)                                                                                              \
+    IDCT_ADD(y1, y1a, q2)                                                                                              \
+    IDCT_ADD(y2, y2a, q2)                                                                                              \
+    IDCT_ADD(y3, y3a, q1)                                                                                              \
+    IDCT_BUTTERFLY(row0, row7, x0, y3, bias, shift)                                                                    \
+    IDCT_BUTTERFLY(row1, row6, x1, y2, bias, shift)                                                                    \
+    IDCT_BUTTERFLY(row2, row5, x2, y1, bias, shift)                                                                    \
+    IDCT_BUTTERFLY(row3, row4, x3, y0, bias, shift)                                                                    \
+  }
+
+#define IDCT_LOAD_ROW(i)                                                                                               \
+  _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)(coefs + (i)*BLOCK_SIZE)),                                          \
+                  _mm_loadu_si128((const __m128i *)(q_table + (i)*BLOCK_SIZE)))
+
+// dequantize while loading
+#define IDCT_LOAD_ROWS()                                                                                               \
+  __m128i row0 = IDCT_LOAD_ROW(0), row1 = IDCT_LOAD_ROW(1), row2 = IDCT_LOAD_ROW(2), row3 = IDCT_LOAD_ROW(3);          \
+  __m128i row4 = IDCT_LOAD_ROW(4), row5 = IDCT_LOAD_ROW(5), row6 = IDCT_LOAD_ROW(6), row7 = IDCT_LOAD_ROW(7);
+
+// saturate to uint8, transpose back and store
+#define IDCT_STORE(out, stride)                                                                                        \
+  {                                                                                                                    \
+    __m128i p0 = _mm_packus_epi16(row0, row1);                                                                         \
+    __m128i p1 = _mm_packus_epi16(row2, row3);                                                                         \
+    __m128i p2 = _mm_packus_epi16(row4, row5);                                                                         \
+    __m128i p3 = _mm_packus_epi16(row6, row7);                                                                         \
+    INTERLEAVE(p0, p2, 8)                                                                                              \
+    INTERLEAVE(p1, p3, 8)                                                                                              \
+    INTERLEAVE(p0, p1, 8)                                                                                              \
+    INTERLEAVE(p2, p3, 8)                                                                                              \
+    INTERLEAVE(p0, p2, 8)                                                                                              \
+    INTERLEAVE(p1, p3, 8)                                                                                              \
+    _mm_storel_epi64((__m128i *)(out + 0 * stride), p0);                                                               \
+    _mm_storel_epi64((__m128i *)(out + 1 * stride), _mm_shuffle_epi32(p0, 0x4E));                                      \
+    _mm_storel_epi64((__m128i *)(out + 2 * stride), p2);                                                               \
+    _mm_storel_epi64((__m128i *)(out + 3 * stride), _mm_shuffle_epi32(p2, 0x4E));                                      \
+    _mm_storel_epi64((__m128i *)(out + 4 * stride), p1);                                                               \
+    _mm_storel_epi64((__m128i *)(out + 5 * stride), _mm_shuffle_epi32(p1, 0x4E));                                      \
+    _mm_storel_epi64((__m128i *)(out + 6 * stride), p3);                                                               \
+    _mm_storel_epi64((__m128i *)(out + 7 * stride), _mm_shuffle_epi32(p3, 0x4E));                                      \
+  }
+
+#define IDCT_ROTATIONS(type, set_const)                                                                                \
+  const type rot0_0 = set_const(FIX(0.5411961), FIX(0.5411961) + FIX(-1.847759065));                               \
+  const type rot0_1 = set_const(FIX(0.5411961) + FIX(0.765366865), FIX(0.5411961));                                 \
+  const type rot1_0 = set_const(FIX(1.175875602) + FIX(-0.899976223), FIX(1.175875602));                            \
+  const type rot1_1 = set_const(FIX(1.175875602), FIX(1.175875602) + FIX(-2.562915447));                            \
+  const type rot2_0 = set_const(FIX(-1.961570560) + FIX(0.298631336), FIX(-1.961570560));                           \
+  const type rot2_1 = set_const(FIX(-1.961570560), FIX(-1.961570560) + FIX(3.072711026));                           \
+  const type rot3_0 = set_const(FIX(-0.390180644) + FIX(2.053119869), FIX(-0.390180644));                           \
+  const type rot3_1 = set_const(FIX(-0.390180644), FIX(-0.390180644) + FIX(1.501321110));
+
+static void idct_block_sse2(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {
+  IDCT_ROTATIONS(__m128i, IDCT_CONST)
+  const __m128i bias_0 = _mm_set1_epi32(1 << 9);
+  const __m128i bias_1 = _mm_set1_epi32((1 << 16) + (128 << 17));
+
+  IDCT_LOAD_ROWS()
+  IDCT_PASS(bias_0, 10) // column-wise
+  TRANSPOSE_8X8()
+  IDCT_PASS(bias_1, 17) // row-wise
+  IDCT_STORE(out, stride)
+}
+
+// for blocks with coefficients in the top-left n_rows x n_rows. zero rows are constants, so their terms are optimized
+// away. after the column-wise pass, columns beyond n_rows are still zero, so are the rows after the transpose
+#define IDCT_SPARSE(name, attr, IDCT_PASS, type, set_const, set1, n_rows)                                              \
+  static attr void name(const int16_t *coefs, const uint16_t *q_table, uint8_t *out, int stride) {                  \
+    IDCT_ROTATIONS(type, set_const)                                                                                    \
+    const type bias_0 = set1(1 << 9);                                                                                  \
+    const type bias_1 = set1((1 << 16) + (128 << 17));                                                                 \
+    const __m128i zero = _mm_setzero_si128();                                                                          \
+                                                                                                                       \
+    __m128i row0 = IDCT_LOAD_ROW(0), row1 = IDCT_LOAD_ROW(1);                                                          \
+    __m128i row2 = n_rows > 2 ? IDCT_LOAD_ROW(2) : zero, row3 = n_rows > 2 ? IDCT_LOAD_ROW(3) : zero;                 \
+    __m128i row4 = zero, row5 = zero, row6 = zero, row7 = zero;                                                        \
+    IDCT_PASS(bias_0, 10)                                                                                              \
+    TRANSPOSE_8X8()                                                                                                   \
+    if (n_rows == 2)                                                                                                   \
+      row2 = row3 = zero;                                                                                              \
+    row4 = row5 = row6 = row7 = zero;                                                                                  \
+    IDCT_PASS(bias_1, 17)                                                                                              \
+    IDCT_STORE(out, stride)                                                                                            \
+  }
+
+IDCT_SPARSE(idct_block_sse2_2x2, , IDCT_PASS, __m128i, IDCT_CONST, _mm_set1_epi32, 2)
+IDCT_SPARSE(idct_block_sse2_4x4, , IDCT_PASS, __m128i, IDCT_CONST, _mm_set1_epi32, 4)
+#endif
+
+#ifdef JPEG_AVX2
+// AVX2 version of idct_block_sse2(). rows are still 8x 16-bit, but all 32-bit math covers a full row at once
+#define IDCT_ROT_256(out0, out1, x, y, c0, c1)                                                                         \
+  __m256i out0##_in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x), (y))),                   \
+                                              _mm_unpackhi_epi16((x), (y)), 1);                                        \
+  __m256i out0 = _mm256_madd_epi16(out0##_in, c0);                                                                     \
+  __m256i out1 = _mm256_madd_epi16(out0##_in, c1);
+
+#define IDCT_BUTTERFLY_256(out0, out1, a, b, bias, shift)                                                              \
+  {                                                                                                                    \
+    __m256i biased = _mm256_add_epi32(a, bias);                                                                        \
+    __m256i sum = _mm256_srai_epi32(_mm256_add_epi32(biased, b), shift);                                               \
+    __m256i dif = _mm256_srai_epi32(_mm256_sub_epi32(biased, b), shift);                                               \
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, dif), 0xD8);                                     \
+    out0 = _mm256_castsi256_si128(packed);                                                                             \
+    out1 = _mm256_extracti128_si256(packed, 1);                                                                        \
+  }
+
+#define IDCT_PASS_256(bias, shift)                                                                                     \
+  {                                                                                                                    \
+    IDCT_ROT_256(t2, t3, row2, row6, rot0_0, rot0_1)                                                                   \
+    __m256i t0 = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm_add_epi16(row0, row4)), 12);                              \
+    __m256i t1 = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm_sub_epi16(row0, row4)), 12);                              \
+    __m256i x0 = _mm256_add_epi32(t0, t3), x3 = _mm256_sub_epi32(t0, t3);                                              \
+    __m256i x1 = _mm256_add_epi32(t1, t2), x2 = _mm256_sub_epi32(t1, t2);                                              \
+                                                                                                                       \
+    IDCT_ROT_256(y0a, y2a, row7, row3, rot2_0, rot2_1)                                                                 \
+    IDCT_ROT_256(y1a, y3a, row5, row1, rot3_0, rot3_1)                                                                 \
+    __m128i sum17 = _mm_add_epi16(row1, row7);                                                                         \
+    __m128i sum35 = _mm_add_epi16(row3, row5);                                                                         \
+    IDCT_ROT_256(q1, q2, sum17, sum35, rot1_0, rot1_1)                                                                 \
+    __m256i y0 = _mm256_add_epi32(y0a, q1), y1 = _mm256_add_epi32(y1a, q2);                                            \
+    __m256i y2 = _mm256_add_epi32(y2a, q2), y3 = _mm256_add_epi32(y3a, q1);                                            \
+    IDCT_BUTTERFLY_256(row0, row7, x0, y3, bias, shift)                                                                \
+    IDCT_BUTTERFLY_256(row1, row6, x1, y2, bias, shift)                                                                \
+    IDCT_BUTTERFLY_256(row2, row5, x2, y1, bias, shift)                                                                \
+    IDCT_BUTTERFLY_256(row3, row4, x3, y0, bias, shift)                                                                \
+  }
+
+#define IDCT_CONST_256(x, y) _mm256_set1_epi32((uint16_t)(x) | ((uint32_t)(y) << 16))
+
+static __attribute__((target("avx2"))) void idct_block_avx2(const int16_t *coefs, const uint16_t *q_table,
+                                                            uint8_t *out, int stride) {
+  IDCT_ROTATIONS(__m256i, IDCT_CONST_256)
+  const __m256i bias_0 = _mm256_set1_epi32(1 << 9);
+  const __m256i bias_1 = _mm256_set1_epi32((1 << 16) + (128 << 17));
+
+  IDCT_LOAD_ROWS()
+  IDCT_PASS_256(bias_0, 10) // column-wise
+  TRANSPOSE_8X8()
+  IDCT_PASS_256(bias_1, 17) // row-wise
+  IDCT_STORE(out, stride)
+}
+
+IDCT_SPARSE(idct_block_avx2_2x2, __attribute__((target("avx2"))), IDCT_PASS_256, __m256i, IDCT_CONST_256,
+            _mm256_set1_epi32, 2)
+IDCT_SPARSE(idct_block_avx2_4x4, __attribute__((target("avx2"))), IDCT_PASS_256, __m256i, IDCT_CONST_256,
+            _mm256_set1_epi32, 4)
+#endif
+
+static void select_idct(IDCTFunction *idct, int scale) {
+  if (scale == 1) {
+    idct[IDCT_DC] = idct_block_dc;
+    idct[IDCT_2X2] = idct_block_sparse_2x2;
+    idct[IDCT_4X4] = idct_block_sparse_4x4;
+    idct[IDCT_FULL] = idct_block_scalar;
+#ifdef JPEG_SSE2
+    idct[IDCT_2X2] = idct_block_sse2_2x2;
+    idct[IDCT_4X4] = idct_block_sse2_4x4;
+    idct[IDCT_FULL] = idct_block_sse2;
+#endif
+#ifdef JPEG_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+      idct[IDCT_2X2] = idct_block_avx2_2x2;
+      idct[IDCT_4X4] = idct_block_avx2_4x4;
+      idct[IDCT_FULL] = idct_block_avx2;
+    }
+#endif
+    return;
+  }
+
+  // reduced IDCTs only use the top-left coefficients, so fewer kernels are needed
+  IDCTFunction reduced = scale == 2 ? idct_block_4x4 : scale == 4 ? idct_block_2x2 : idct_block_1x1;
+  for (int i = 0; i < N_IDCT_KERNELS; i++)
+    idct[i] = reduced;
+  if (scale == 2)
+    idct[IDCT_DC] = idct_block_4x4_dc;
+}
+
+// produce output rows from the component planes and write them to the image
+void color_convert_mcu_row(Decoder *decoder, int mcu_y) {
+  if (decoder->format == JPEG_PIXEL_YCBCR_PLANAR) {
+    copy_planes_mcu_row(decoder, mcu_y);
+    return;
+  }
+
+  int mcu_width = decoder->block_size * decoder->max_x_sampling;
+  int mcu_height = decoder->block_size * decoder->max_y_sampling;
+
+  // only the part inside the crop rectangle. planes are decoded from MCU column mcu_x0
+  int x_start = decoder->mcu_x0 * mcu_width;
+  int x_offset = decoder->crop_x - x_start;
+  int j_start = MAX(0, decoder->crop_y - mcu_y * mcu_height);
+  int j_end = MIN(mcu_height, decoder->crop_y + decoder->height - mcu_y * mcu_height);
+
+  for (int j = j_start; j < j_end; j++) {
+    const uint8_t *rows[MAX_COMPONENTS];
+    uint64_t start = STATS_START(decoder);
+
+    // nearest neighbor upsampling, unless fancy. A.2.3 and JFIF p.4
+    int n_components = decoder->luma_only ? 1 : decoder->n_channels;
+    for (int c = 0; c < n_components; c++) {
+      Component *component = &decoder->components[c];
+      if (component->fancy) {
+        upsample_row_fancy(decoder, component, mcu_y * mcu_height + j, x_start, x_offset + decoder->width,
+                           decoder->upsampled[c]);
+        rows[c] = decoder->upsampled[c] + x_offset;
+        continue;
+      }
+
+      int row_idx = (mcu_y % decoder->n_plane_mcu_rows) * component->y_sampling * decoder->block_size +
+                    j * component->y_sampling / decoder->max_y_sampling;
+      const uint8_t *row = component->plane + row_idx * component->stride +
+                           decoder->mcu_x0 * component->x_sampling * decoder->block_size;
+      if (component->x_sampling == decoder->max_x_sampling)
+        rows[c] = row + x_offset;
+      else {
+        upsample_row(row, decoder->upsampled[c], x_offset + decoder->width,
+                     decoder->max_x_sampling / component->x_sampling);
+        rows[c] = decoder->upsampled[c] + x_offset;
+      }
+    }
+
+    STATS_STOP(decoder, upsample_ns, start);
+
+    int out_y = mcu_y * mcu_height + j - decoder->crop_y;
+    uint8_t *out = decoder->image + (size_t)(out_y - decoder->image_y) * decoder->stride;
+    start = STATS_START(decoder);
+    if (n_components == 3) {
+      ycbcr_to_rgb_row(rows[0], rows[1], rows[2], out, decoder->width, decoder->format);
+      STATS_STOP(decoder, color_ns, start);
+    } else {
+      gray_to_pixels(rows[0], out, decoder->width, decoder->pixel_size);
+      STATS_STOP(decoder, output_ns, start);
+    }
+  }
+}
+
+// planar output: the component planes of an MCU row are copied as they are, with no upsampling or color conversion
+void copy_planes_mcu_row(Decoder *decoder, int mcu_y) {
+  uint64_t start = STATS_START(decoder);
+  JpegOutput *output = decoder->output;
+  for (int c = 0; c < decoder->n_channels; c++) {
+    Component *component = &decoder->components[c];
+    int mcu_height = component->y_sampling * decoder->block_size;
+    const uint8_t *plane = component->plane + (mcu_y % decoder->n_plane_mcu_rows) * mcu_height * component->stride;
+    int y = mcu_y * mcu_height;
+    for (int j = 0; j < MIN(mcu_height, output->heights[c] - y); j++)
+      memcpy(output->planes[c] + (size_t)(y + j) * output->strides[c], plane + j * component->stride,
+             output->widths[c]);
+  }
+  STATS_STOP(decoder, output_ns, start);
+}
+
+// hand the output rows of an MCU row to the streaming callback
+void emit_rows(Decoder *decoder, int mcu_y, int mcu_height) {
+  int y_start = MAX(mcu_y * mcu_height - decoder->crop_y, 0);
+  int y_end = MIN((mcu_y + 1) * mcu_height - decoder->crop_y, decoder->height);
+  if (y_start >= y_end) // MCU rows around the crop rectangle are only decoded for upsampling
+    return;
+  const uint8_t *rows = decoder->image + (size_t)(y_start - decoder->image_y) * decoder->stride;
+  decoder->row_callback(decoder->row_user_data, rows, y_start, y_end - y_start, decoder->width, decoder->n_channels);
+}
+
+void upsample_row(const uint8_t *in, uint8_t *out, int width, int factor) {
+  if (factor == 2) {
+    for (int i = 0; i < CDIV(width, 2); i++)
+      out[i * 2] = out[i * 2 + 1] = in[i];
+  } else {
+    for (int i = 0; i < width; i++)
+      out[i] = in[i / factor];
+  }
+}
+
+// 2x upsampling of row y (at full resolution) with a triangle filter: each output sample is 3/4 of the nearest
+// input sample and 1/4 of the next nearest, in each upsampled direction. the vertical pass produces colsum, which is
+// 4x the value when upsampling vertically. samples past the edges of the component are replicated.
+// same results as libjpeg's fancy upsampling, including its rounding biases
+void upsample_row_fancy(Decoder *decoder, Component *component, int y, int x_start, int width, uint8_t *out) {
+  int x_factor = decoder->max_x_sampling / component->x_sampling;
+  int y_factor = decoder->max_y_sampling / component->y_sampling;
+  int in_width = CDIV(decoder->frame_width * component->x_sampling, decoder->max_x_sampling * decoder->scale);
+  int in_height = CDIV(decoder->frame_height * component->y_sampling, decoder->max_y_sampling * decoder->scale);
+
+  // rows of the component are in the ring of planes. see allocate_planes()
+  int mcu_rows_height = component->y_sampling * decoder->block_size;
+  int row = y / y_factor;
+  int other_row = y_factor == 1 ? row : CLAMP(y % 2 ? row + 1 : row - 1, 0, in_height - 1);
+  const uint8_t *near = component->plane + ((row / mcu_rows_height) % decoder->n_plane_mcu_rows * mcu_rows_height +
+                                            row % mcu_rows_height) * component->stride;
+  const uint8_t *far = component->plane + ((other_row / mcu_rows_height) % decoder->n_plane_mcu_rows *
+                                           mcu_rows_height + other_row % mcu_rows_height) * component->stride;
+
+  // input columns [start - 1, end + 1) are needed. colsum[0] is column start - 1
+  int start = x_start / x_factor;
+  int end = (x_start + width - 1) / x_factor + 1;
+  int i0 = MAX(start - 1, 0);
+  int i1 = MIN(end + 1, in_width);
+  int16_t *colsum = decoder->colsum - (start - 1);
+  int i = i0;
+#ifdef JPEG_SSE2
+  for (; i + 8 <= i1; i += 8) {
+    __m128i n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(near + i)), _mm_setzero_si128());
+    __m128i f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(far + i)), _mm_setzero_si128());
+    __m128i sum = y_factor == 1 ? n : _mm_add_epi16(_mm_add_epi16(n, n), _mm_add_epi16(n, f));
+    _mm_storeu_si128((__m128i *)(colsum + i), sum);
+  }
+#endif
+  for (; i < i1; i++)
+    colsum[i] = y_factor == 1 ? near[i] : near[i] * 3 + far[i];
+  for (i = start - 1; i < i0; i++)
+    colsum[i] = colsum[i0];
+  for (i = i1; i < end + 1; i++)
+    colsum[i] = colsum[i1 - 1];
+
+  out -= x_start;
+  if (x_factor == 1) {
+    for (i = start; i < end; i++)
+      out[i] = (colsum[i] + (y % 2 ? 2 : 1)) >> 2;
+    return;
+  }
+
+  int shift = y_factor == 1 ? 2 : 4;
+  int even_bias = y_factor == 1 ? 1 : 8;
+  int odd_bias = y_factor == 1 ? 2 : 7;
+  i = start;
+#ifdef JPEG_SSE2
+  for (; i + 8 <= end; i += 8) {
+    __m128i center = _mm_loadu_si128((const __m128i *)(colsum + i));
+    __m128i left = _mm_loadu_si128((const __m128i *)(colsum + i - 1));
+    __m128i right = _mm_loadu_si128((const __m128i *)(colsum + i + 1));
+    __m128i center3 = _mm_add_epi16(_mm_add_epi16(center, center), center);
+    __m128i even = _mm_add_epi16(_mm_add_epi16(center3, left), _mm_set1_epi16(even_bias));
+    __m128i odd = _mm_add_epi16(_mm_add_epi16(center3, right), _mm_set1_epi16(odd_bias));
+    even = _mm_srl_epi16(even, _mm_cvtsi32_si128(shift));
+    odd = _mm_srl_epi16(odd, _mm_cvtsi32_si128(shift));
+    __m128i packed = _mm_packus_epi16(_mm_unpacklo_epi16(even, odd), _mm_unpackhi_epi16(even, odd));
+    _mm_storeu_si128((__m128i *)(out + i * 2), packed);
+  }
+#endif
+  for (; i < end; i++) {
+    out[i * 2] = (colsum[i] * 3 + colsum[i - 1] + even_bias) >> shift;
+    out[i * 2 + 1] = (colsum[i] * 3 + colsum[i + 1] + odd_bias) >> shift;
+  }
+}
+
+// JFIF p.3, in 14-bit fixed point so that the SIMD version can use 16-bit multiplies
+#define FIX_14(x) ((int32_t)((x)*16384 + 0.5))
+
+#ifdef JPEG_SSE2
+// 4 pixels of 32-bit RGBx to 12 bytes of RGB
+static inline __m128i pack_rgb(__m128i rgbx) {
+  const __m128i low_rgb = _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF);
+  const __m128i low_6_bytes = _mm_set_epi32(0, 0, 0xFFFF, -1);
+  __m128i pairs = _mm_or_si128(_mm_and_si128(rgbx, low_rgb), _mm_andnot_si128(low_rgb, _mm_srli_epi64(rgbx, 8)));
+  return _mm_or_si128(_mm_and_si128(pairs, low_6_bytes), _mm_andnot_si128(low_6_bytes, _mm_srli_si128(pairs, 2)));
+}
+
+// 16 pixels of separate R, G and B to RGB, or to RGBA with opaque alpha when pixel_size is 4
+static inline void store_pixels(uint8_t *out, __m128i r, __m128i g, __m128i b, int pixel_size) {
+  // interleave to RGBx, then drop x unless it is alpha
+  __m128i x = pixel_size == 4 ? _mm_set1_epi8(-1) : _mm_setzero_si128();
+  __m128i rg_lo = _mm_unpacklo_epi8(r, g), rg_hi = _mm_unpackhi_epi8(r, g);
+  __m128i bx_lo = _mm_unpacklo_epi8(b, x), bx_hi = _mm_unpackhi_epi8(b, x);
+  __m128i p0 = _mm_unpacklo_epi16(rg_lo, bx_lo), p1 = _mm_unpackhi_epi16(rg_lo, bx_lo);
+  __m128i p2 = _mm_unpacklo_epi16(rg_hi, bx_hi), p3 = _mm_unpackhi_epi16(rg_hi, bx_hi);
+  if (pixel_size == 4) {
+    _mm_storeu_si128((__m128i *)out, p0);
+    _mm_storeu_si128((__m128i *)(out + 16), p1);
+    _mm_storeu_si128((__m128i *)(out + 32), p2);
+    _mm_storeu_si128((__m128i *)(out + 48), p3);
+    return;
+  }
+  p0 = pack_rgb(p0);
+  p1 = pack_rgb(p1);
+  p2 = pack_rgb(p2);
+  p3 = pack_rgb(p3);
+  _mm_storeu_si128((__m128i *)out, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+  _mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+  _mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+}
+
+// one color channel of 8 pixels: (luma + cb * c_cb + cr * c_cr) >> 14
+static inline __m128i ycbcr_channel(__m128i luma_lo, __m128i luma_hi, __m128i chroma_lo, __m128i chroma_hi,
+                                    __m128i c) {
+  __m128i lo = _mm_srai_epi32(_mm_add_epi32(luma_lo, _mm_madd_epi16(chroma_lo, c)), 14);
+  __m128i hi = _mm_srai_epi32(_mm_add_epi32(luma_hi, _mm_madd_epi16(chroma_hi, c)), 14);
+  return _mm_packs_epi32(lo, hi);
+}
+#endif
+
+// one row of RGB, BGR, RGBA or BGRA pixels
+void ycbcr_to_rgb_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out, int width,
+                      JpegPixelFormat format) {
+  bool bgr = format == JPEG_PIXEL_BGR || format == JPEG_PIXEL_BGRA;
+  int pixel_size = pixel_size_of(format);
+  int i = 0;
+#ifdef JPEG_SSE2
+  const __m128i c_r = _mm_set1_epi32((uint16_t)0 | ((uint32_t)FIX_14(1.402) << 16));
+  const __m128i c_g = _mm_set1_epi32((uint16_t)-FIX_14(0.34414) | ((uint32_t)-FIX_14(0.71414) << 16));
+  const __m128i c_b = _mm_set1_epi32((uint16_t)FIX_14(1.772));
+  const __m128i offset = _mm_set1_epi16(128);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= width; i += 16) {
+    __m128i rgb[3]; // 16 pixels of each channel
+    for (int half = 0; half < 2; half++) {
+      __m128i y8 = _mm_loadl_epi64((const __m128i *)(y + i + half * 8));
+      __m128i b = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cb + i + half * 8)), zero), offset);
+      __m128i r = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(cr + i + half * 8)), zero), offset);
+      __m128i y16 = _mm_unpacklo_epi8(y8, zero);
+      __m128i luma_lo = _mm_add_epi32(_mm_slli_epi32(_mm_unpacklo_epi16(y16, zero), 14), _mm_set1_epi32(1 << 13));
+      __m128i luma_hi = _mm_add_epi32(_mm_slli_epi32(_mm_unpackhi_epi16(y16, zero), 14), _mm_set1_epi32(1 << 13));
+      __m128i br_lo = _mm_unpacklo_epi16(b, r);
+      __m128i br_hi = _mm_unpackhi_epi16(b, r);
+      __m128i channels[3] = {
+          ycbcr_channel(luma_lo, luma_hi, br_lo, br_hi, c_r),
+          ycbcr_channel(luma_lo, luma_hi, br_lo, br_hi, c_g),
+          ycbcr_channel(luma_lo, luma_hi, br_lo, br_hi, c_b),
+      };
+      for (int c = 0; c < 3; c++)
+        rgb[c] = half ? _mm_packus_epi16(rgb[c], channels[c]) : channels[c];
+    }
+    store_pixels(out + i * pixel_size, rgb[bgr ? 2 : 0], rgb[1], rgb[bgr ? 0 : 2], pixel_size);
+  }
+#endif
+  for (; i < width; i++) {
+    int32_t luma = (y[i] << 14) + (1 << 13); // includes rounding
+    int32_t b = cb[i] - 128;
+    int32_t r = cr[i] - 128;
+    uint8_t *pixel = out + i * pixel_size;
+    // clang-format off
+    pixel[bgr ? 2 : 0] = CLAMP((luma                        + FIX_14(1.402)   * r) >> 14, 0, 255);
+    pixel[1]           = CLAMP((luma - FIX_14(0.34414) * b - FIX_14(0.71414) * r) >> 14, 0, 255);
+    pixel[bgr ? 0 : 2] = CLAMP((luma + FIX_14(1.772)   * b                      ) >> 14, 0, 255);
+    // clang-format on
+    if (pixel_size == 4)
+      pixel[3] = 255;
+  }
+}
+
+// a row of gray samples to pixels of pixel_size bytes: gray, RGB or BGR, or RGBA or BGRA with opaque alpha
+void gray_to_pixels(const uint8_t *in, uint8_t *out, int width, int pixel_size) {
+  if (pixel_size == 1) {
+    memcpy(out, in, width);
+    return;
+  }
+  int i = 0;
+#ifdef JPEG_SSE2
+  for (; i + 16 <= width; i += 16) {
+    __m128i gray = _mm_loadu_si128((const __m128i *)(in + i));
+    store_pixels(out + i * pixel_size, gray, gray, gray, pixel_size);
+  }
+#endif
+  for (; i < width; i++) {
+    out[i * pixel_size] = out[i * pixel_size + 1] = out[i * pixel_size + 2] = in[i];
+    if (pixel_size == 4)
+      out[i * pixel_size + 3] = 255;
+  }
 }
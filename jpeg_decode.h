@@ -1,6 +1,201 @@
+#ifndef JPEG_DECODE_H
+#define JPEG_DECODE_H
 #include <stdint.h>
 #include <stdio.h>
 
-void jpeg_enable_debug_print();
-void jpeg_disable_debug_print();
+typedef enum JpegStatus {
+  JPEG_OK = 0,
+  JPEG_ERROR_IO,            // failed to open or read the input
+  JPEG_ERROR_OUT_OF_MEMORY, //
+  JPEG_ERROR_TRUNCATED,     // data ends before EOI
+  JPEG_ERROR_CORRUPT,       // invalid markers, tables or entropy-coded data
+  JPEG_ERROR_UNSUPPORTED,   // valid JPEG that this decoder does not handle e.g. arithmetic coding
+  JPEG_ERROR_BUFFER_TOO_SMALL,
+  JPEG_ERROR_INVALID_ARGUMENT, // settings do not fit the image e.g. crop rectangle outside of it
+} JpegStatus;
+
+// a decoder holds all decoding state, so different decoders can be used on different threads at the same time.
+// reuse a decoder for many images: its scratch memory is kept and only grows when a larger image comes
+typedef struct JpegDecoder JpegDecoder;
+
+JpegDecoder *jpeg_decoder_create(); // NULL if out of memory
+void jpeg_decoder_destroy(JpegDecoder *decoder);
+void jpeg_decoder_set_debug_print(JpegDecoder *decoder, int enable);
+void jpeg_decoder_set_num_threads(JpegDecoder *decoder, int n_threads); // <= 0 to use all CPUs. default is 1
+// experimental: with 2 or more threads, scans without restart markers are split at arbitrary byte offsets and each
+// part is Huffman-decoded from its start in parallel, until it lines up with the part before it. decoding falls back to
+// one entropy-decoding thread when they do not line up. default is off
+void jpeg_decoder_set_speculative(JpegDecoder *decoder, int enable);
+// decode at 1/scale of the full size, for scale = 1, 2, 4 or 8. reduced IDCTs are used, so smaller scales are faster.
+// output dimensions are rounded up. returns -1 for other values
+int jpeg_decoder_set_scale(JpegDecoder *decoder, int scale);
+// upsample 2x subsampled chroma (e.g. 4:2:0) with a triangle filter instead of repeating samples. default is on
+void jpeg_decoder_set_fancy_upsampling(JpegDecoder *decoder, int enable);
+// decode only a rectangle of the (scaled) image. the output is width x height, and the rest of the image is only
+// entropy-decoded as far as needed. the rectangle is clipped to the image. width or height <= 0 to decode everything.
+// returns -1 if x or y is negative
+int jpeg_decoder_set_crop(JpegDecoder *decoder, int x, int y, int width, int height);
+
+// on success, *image is allocated with malloc() and owned by the caller. otherwise *image is NULL
+JpegStatus jpeg_decoder_decode(JpegDecoder *decoder, const uint8_t *data, size_t size, uint8_t **image, int *width,
+                               int *height, int *n_channels);
+// decode to a caller-provided buffer, which needs width * height * n_channels bytes. with this, decoding does not
+// allocate once the decoder has seen an image of similar size. width, height and n_channels are set even on failure,
+// so on JPEG_ERROR_BUFFER_TOO_SMALL the caller can grow the buffer and try again
+JpegStatus jpeg_decoder_decode_into(JpegDecoder *decoder, const uint8_t *data, size_t size, uint8_t *out,
+                                    size_t out_size, int *width, int *height, int *n_channels);
+// pixel formats of jpeg_decoder_decode_to()
+typedef enum JpegPixelFormat {
+  JPEG_PIXEL_NATIVE, // RGB for color images, gray for grayscale ones, like jpeg_decoder_decode()
+  JPEG_PIXEL_RGB,    // grayscale images are replicated to all channels
+  JPEG_PIXEL_BGR,    //
+  JPEG_PIXEL_RGBA,   // alpha is 255
+  JPEG_PIXEL_BGRA,   //
+  JPEG_PIXEL_GRAY,   // luma only. chroma blocks are entropy-decoded, but not transformed
+  // the Y, Cb and Cr planes as they are coded, e.g. I420 for 4:2:0 JPEGs, with no upsampling or color conversion.
+  // plane i is CDIV(width * h_i, h_max) x CDIV(height * v_i, v_max) for sampling factors h and v. no cropping
+  JPEG_PIXEL_YCBCR_PLANAR,
+} JpegPixelFormat;
+
+// where jpeg_decoder_decode_to() writes. planar output uses planes[0..2], others only planes[0]
+typedef struct JpegOutput {
+  JpegPixelFormat format;
+  uint8_t *planes[3];
+  int strides[3];   // bytes from the start of a row to the next. 0 for packed rows, then set to the row size
+  size_t sizes[3];  // bytes at planes[i], checked before anything is written
+  int n_planes;     // the rest is set by the decoder, even on failure, so that buffers can be allocated for a retry:
+  int widths[3];    // size of each plane in pixels. planes[0] is the image size
+  int heights[3];   //
+} JpegOutput;
+
+// decode to caller-provided buffers, in the format and row stride of output. scale and crop apply as usual
+JpegStatus jpeg_decoder_decode_to(JpegDecoder *decoder, const uint8_t *data, size_t size, JpegOutput *output);
+
+// streaming: each MCU row is handed to callback as soon as it is color-converted, instead of returning the whole image.
+// rows holds n_rows scanlines of width * n_channels bytes, starting at row y, and is only valid during the call.
+// memory use is about one MCU row, regardless of image height, plus the coefficients of progressive JPEGs and of
+// baseline JPEGs with a scan per component. decoding is always single-threaded
+typedef void (*JpegRowCallback)(void *user_data, const uint8_t *rows, int y, int n_rows, int width, int n_channels);
+JpegStatus jpeg_decoder_decode_rows(JpegDecoder *decoder, const uint8_t *data, size_t size, JpegRowCallback callback,
+                                    void *user_data, int *width, int *height, int *n_channels);
+JpegStatus jpeg_decoder_decode_file(JpegDecoder *decoder, const char *filename, uint8_t **image, int *width,
+                                    int *height, int *n_channels); // memory-mapped when possible
+const char *jpeg_decoder_error(const JpegDecoder *decoder);        // message of the last failure
+
+// quantized DCT coefficients of one component, as they are coded in the file
+typedef struct JpegComponentCoefficients {
+  const int16_t *coefs;  // blocks_per_row x blocks_per_column blocks. 64 coefficients per block, in natural order
+  int blocks_per_row;    // including the padding blocks of partial MCUs at the right and bottom edges
+  int blocks_per_column; //
+  int width;             // samples of this component, without padding
+  int height;            //
+  int x_sampling;        // sampling factors from SOF
+  int y_sampling;        //
+  uint16_t q_table[64];  // natural order. coefs[i] * q_table[i] is the dequantized coefficient
+} JpegComponentCoefficients;
+
+typedef struct JpegCoefficients {
+  int width; // of the image
+  int height;
+  int n_components; // 1 or 3, in the order of SOF
+  JpegComponentCoefficients components[3];
+} JpegCoefficients;
+
+// stop after entropy decoding: no dequantization, IDCT, upsampling or color conversion. baseline and progressive
+// JPEGs give the same layout. coefs point into the decoder's scratch memory, valid until the next decode with the
+// same decoder. scale, crop and threads are ignored
+JpegStatus jpeg_decoder_decode_coefficients(JpegDecoder *decoder, const uint8_t *data, size_t size,
+                                            JpegCoefficients *coefficients);
+
+// what jpeg_probe() finds in the headers
+typedef struct JpegInfo {
+  int width; // of the frame
+  int height;
+  int n_components;
+  int x_sampling[3];    // sampling factors, in the order of SOF
+  int y_sampling[3];    //
+  int progressive;      // SOF2, or another progressive SOFn. baseline otherwise
+  int restart_interval; // from DRI before the first scan. 0 if none
+  int orientation;      // Exif orientation, 1 to 8. 1 (rows top to bottom) if there is none. decoding ignores it
+  size_t header_size;   // bytes before the first SOS marker
+} JpegInfo;
+
+// parse the headers up to the first SOS: SOFn, DRI and the orientation in an Exif APP1 segment. other segments are
+// skipped by their length and nothing is allocated, so the cost does not depend on the size of the entropy-coded data.
+// info is filled as far as the headers go. returns JPEG_ERROR_UNSUPPORTED for frames that jpeg_decoder_decode() does
+// not handle e.g. 12-bit or arithmetic-coded
+JpegStatus jpeg_probe(const uint8_t *data, size_t size, JpegInfo *info);
+JpegStatus jpeg_probe_file(const char *filename, JpegInfo *info); // memory-mapped when possible
+// set n_planes, widths, heights and sizes of output for output->format at 1/scale, like jpeg_decoder_decode_to() would,
+// with no cropping. strides that are 0 are set to the row size. returns the total bytes, or 0 for an invalid format or
+// scale
+size_t jpeg_probe_output(const JpegInfo *info, int scale, JpegOutput *output);
+
+// seek index for repeated crops of a large baseline JPEG. without one, every crop entropy-decodes the scan from the top
+// down to the crop. the index holds a checkpoint every checkpoint_mcus MCUs (<= 0 for 256): the position in the
+// entropy-coded data, down to the bit, and the DC predictors. with restart markers, checkpoints are at the start of
+// intervals and are found without entropy decoding. the index is a few bytes per checkpoint and can be saved next to
+// the image. on success, *index is allocated with malloc() and owned by the caller. the first scan must contain all
+// components
+JpegStatus jpeg_decoder_build_index(JpegDecoder *decoder, const uint8_t *data, size_t size, int checkpoint_mcus,
+                                    uint8_t **index, size_t *index_size);
+// use an index from jpeg_decoder_build_index() for cropped decodes: each MCU row of the crop starts at the last
+// checkpoint before it, and the rest of the scan is not searched for markers. index is not copied and must stay valid
+// until it is replaced or set to NULL. an index of another image is ignored. decodes that use it are single-threaded
+void jpeg_decoder_set_index(JpegDecoder *decoder, const uint8_t *index, size_t index_size);
+
+// batch decoding of many images: a pool of threads, started once, each with a decoder that is reused for every image it
+// decodes. images are spread over the threads, and a thread that runs out steals images from the others. images of
+// 1 MP or more are also split into restart intervals, speculative chunks and bands of MCU rows for color conversion,
+// which idle threads steal too
+typedef struct JpegDecoderPool JpegDecoderPool;
+
+typedef struct JpegBatchItem {
+  const uint8_t *data;
+  size_t size;
+  JpegOutput output;       // where the image goes, as for jpeg_decoder_decode_to()
+  JpegStatus status;       // set by jpeg_decode_batch()
+  char error_message[256]; // on failure
+} JpegBatchItem;
+
+JpegDecoderPool *jpeg_decoder_pool_create(int n_threads); // <= 0 to use all CPUs. NULL if out of memory
+void jpeg_decoder_pool_destroy(JpegDecoderPool *pool);
+int jpeg_decoder_pool_num_threads(const JpegDecoderPool *pool);
+// the decoder of thread i, to change its settings e.g. scale or crop. the pool sets its number of threads for each
+// image, and owns it
+JpegDecoder *jpeg_decoder_pool_get_decoder(JpegDecoderPool *pool, int i);
+// decode all items on the threads of pool, including the calling one. a failing image only sets its own status.
+// returns the number of images that failed. one batch at a time per pool
+int jpeg_decode_batch(JpegDecoderPool *pool, JpegBatchItem *items, int n_items);
+
+// counters and stage timers of the last decode, to see where decode time goes. all fields are uint64_t.
+// stage times are summed over threads, so with threads they can add up to more than total_ns
+typedef struct JpegStats {
+  uint64_t total_ns;           // the whole decode call
+  uint64_t huffman_ns;         // entropy decoding. stage times need jpeg_decoder_set_stats_timing()
+  uint64_t idct_ns;            // dequantization and IDCT
+  uint64_t upsample_ns;        // chroma upsampling
+  uint64_t color_ns;           // color conversion, which stores the pixels to the output as it goes
+  uint64_t output_ns;          // other stores to the output: grayscale rows, and the streaming callback
+  uint64_t marker_bytes[256];  // bytes of each marker type, including the marker. SOS includes the entropy-coded data
+  uint64_t scans;
+  uint64_t restart_markers;    // RSTn markers decoded through
+  uint64_t parallel_intervals; // restart intervals decoded on worker threads
+  uint64_t speculative_chunks; // chunks of a scan without restart markers decoded on worker threads
+  uint64_t idct_blocks[4];     // blocks per IDCT kernel: DC only, top-left 2x2, top-left 4x4, full
+  uint64_t skipped_blocks;     // only entropy-decoded, since they are outside of the crop rectangle
+  uint64_t huffman_slow_path;  // Huffman codes longer than the lookahead table
+} JpegStats;
+
+// time the decode stages. this reads the cycle counter per MCU row, and around the IDCT of 1 in 16 blocks, which costs
+// a few percent of decode speed. default is off
+void jpeg_decoder_set_stats_timing(JpegDecoder *decoder, int enable);
+// stats of the last decode, successful or not. returns -1 if the library is built with JPEG_NO_STATS
+int jpeg_decoder_get_stats(const JpegDecoder *decoder, JpegStats *stats);
+
+// convenience functions with a temporary decoder. return NULL on failure
 uint8_t *decode_jpeg(FILE *, int *width, int *height, int *n_channels);
+uint8_t *decode_jpeg_mem(const uint8_t *data, size_t size, int *width, int *height, int *n_channels);
+uint8_t *decode_jpeg_file(const char *filename, int *width, int *height, int *n_channels);
+
+#endif
@@ -0,0 +1,1380 @@
+#include "jpeg_encode.h"
+#include "jpeg_common.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define MAX_BLOCKS_IN_MCU 6 // 4:2:0 has 4 luma blocks and 2 chroma blocks
+// entropy-coded bytes of a block are at most a DC value of 11 bits and 63 AC values of 10 bits, each after a code of
+// up to 16 bits, with every byte stuffed
+#define MAX_BLOCK_BYTES (2 * CDIV((16 + 11) + 63 * (16 + 10), 8))
+#define MAX_SCANS 64
+// correction bits of AC refinement waiting for an end-of-band run to be coded. the run is coded before they overflow
+#define MAX_CORRECTIONS 1000
+
+// ITU-T.81 Table K.1 and K.2
+static const uint8_t Q_TABLES[2][BLOCK_SIZE * BLOCK_SIZE] = {
+    {
+        16, 11, 10, 16,  24,  40,  51,  61, //
+        12, 12, 14, 19,  26,  58,  60,  55, //
+        14, 13, 16, 24,  40,  57,  69,  56, //
+        14, 17, 22, 29,  51,  87,  80,  62, //
+        18, 22, 37, 56,  68, 109, 103,  77, //
+        24, 35, 55, 64,  81, 104, 113,  92, //
+        49, 64, 78, 87, 103, 121, 120, 101, //
+        72, 92, 95, 98, 112, 100, 103,  99, //
+    },
+    {
+        17, 18, 24, 47, 99, 99, 99, 99, //
+        18, 21, 26, 66, 99, 99, 99, 99, //
+        24, 26, 56, 99, 99, 99, 99, 99, //
+        47, 66, 99, 99, 99, 99, 99, 99, //
+        99, 99, 99, 99, 99, 99, 99, 99, //
+        99, 99, 99, 99, 99, 99, 99, 99, //
+        99, 99, 99, 99, 99, 99, 99, 99, //
+        99, 99, 99, 99, 99, 99, 99, 99, //
+    },
+};
+
+// ITU-T.81 Table K.3 to K.6. luma DC, luma AC, chroma DC, chroma AC
+static const uint8_t HUFFMAN_BITS[4][16] = {
+    {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+    {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 125},
+    {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+    {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 119},
+};
+static const uint8_t HUFFMAN_DC_VALUES[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t HUFFMAN_AC_VALUES[2][162] = {
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, //
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, //
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, //
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, //
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, //
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, //
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, //
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, //
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, //
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, //
+        0xf9, 0xfa,
+    },
+    {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, //
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, //
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, //
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, //
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, //
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, //
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, //
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, //
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, //
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, //
+        0xf9, 0xfa,
+    },
+};
+
+// libjpeg's jpeg_simple_progression(): DC with its lowest bit left out, the low AC coefficients of luma and all of
+// chroma with 2 and 1 bits left out, then the rest of luma, and refinements down to the last bit
+static const JpegScan PROGRESSIVE_SCANS_GRAY[6] = {
+    {1, {0}, 0, 0, 0, 1}, {1, {0}, 1, 5, 0, 2}, {1, {0}, 6, 63, 0, 2},
+    {1, {0}, 1, 63, 2, 1}, {1, {0}, 0, 0, 1, 0}, {1, {0}, 1, 63, 1, 0},
+};
+static const JpegScan PROGRESSIVE_SCANS_COLOR[10] = {
+    {3, {0, 1, 2}, 0, 0, 0, 1}, {1, {0}, 1, 5, 0, 2},  {1, {2}, 1, 63, 0, 1}, {1, {1}, 1, 63, 0, 1},
+    {1, {0}, 6, 63, 0, 2},      {1, {0}, 1, 63, 2, 1}, {3, {0, 1, 2}, 0, 0, 1, 0}, {1, {2}, 1, 63, 1, 0},
+    {1, {1}, 1, 63, 1, 0},      {1, {0}, 1, 63, 1, 0},
+};
+
+// DHT contents and the derived code of each symbol
+typedef struct HuffmanCode {
+  uint8_t bits[16]; // number of codes of each length
+  uint8_t values[256];
+  uint16_t codes[256];
+  uint8_t lengths[256]; // 0 for symbols without a code
+} HuffmanCode;
+
+// division by 8 * q with rounding, as a multiplication by a reciprocal. see set_divisors(). natural order
+typedef struct Divisors {
+  uint16_t reciprocal[BLOCK_SIZE * BLOCK_SIZE];
+  uint16_t correction[BLOCK_SIZE * BLOCK_SIZE];
+  uint16_t scale[BLOCK_SIZE * BLOCK_SIZE];
+} Divisors;
+
+// bits are collected in a 64-bit word, which is written at once unless it has a 0xFF byte
+typedef struct BitWriter {
+  uint8_t *ptr;
+  uint64_t bits; // the lowest 64 - n_free bits are pending
+  int n_free;
+} BitWriter;
+
+// 8 x 8 samples -> 8 times the DCT coefficients, in natural order
+typedef void (*FDCTFunction)(const uint8_t *in, int stride, int16_t *out);
+
+typedef struct JpegEncoder {
+  // kept across images
+  int quality;
+  JpegSubsampling subsampling;
+  int optimize_huffman;
+  int restart_interval;
+  int progressive;
+  JpegScan scans[MAX_SCANS]; // jpeg_encoder_set_scans()
+  int n_scans;
+  FDCTFunction fdct;
+  uint8_t *planes; // one MCU row of each component at full resolution, then of the subsampled chroma
+  size_t planes_capacity;
+  int16_t *coefs; // quantized blocks in zig-zag order, in coding order. one MCU row, or all for a second pass
+  size_t coefs_capacity;
+  char error_message[256];
+
+  // set for each image
+  int width;
+  int height;
+  int n_channels;
+  const JpegScan *image_scans; // the scans of this image, or NULL for one scan with all components
+  int n_image_scans;
+  bool progressive_frame; // SOF2, for scans that are not all sequential
+  int h_sampling; // of luma. chroma is always 1x1
+  int v_sampling;
+  int nx_mcu;
+  int ny_mcu;
+  int blocks_per_mcu;
+  int block_components[MAX_BLOCKS_IN_MCU];
+  uint8_t *component_planes[3]; // one MCU row, padded to whole MCUs
+  int plane_widths[3];
+  uint8_t q_tables[2][BLOCK_SIZE * BLOCK_SIZE]; // natural order
+  Divisors divisors[2];
+  HuffmanCode h_codes[4]; // luma DC, luma AC, chroma DC, chroma AC
+  uint32_t h_counts[4][257];
+  uint8_t *data; // output
+  size_t size;
+  size_t capacity;
+} Encoder;
+
+static JpegStatus encode_fail(Encoder *encoder, JpegStatus status, const char *format, ...);
+static bool reserve(Encoder *encoder, size_t n_bytes);
+static void put_u8(Encoder *encoder, uint8_t value);
+static void put_u16(Encoder *encoder, uint16_t value);
+static int check_scans(Encoder *encoder);
+static void write_frame_header(Encoder *encoder);
+static void write_scan_header(Encoder *encoder, const JpegScan *scan);
+static int scan_tables(const JpegScan *scan);
+
+static void set_q_tables(Encoder *encoder);
+static void set_divisors(Divisors *divisors, const uint8_t *q_table);
+static void build_huffman_code(HuffmanCode *h);
+static void build_optimal_huffman_code(HuffmanCode *h, const uint32_t *counts);
+
+static void convert_mcu_row(Encoder *encoder, const uint8_t *image, int mcu_y);
+static void rgb_to_ycbcr_row(const uint8_t *rgb, uint8_t *y, uint8_t *cb, uint8_t *cr, int width);
+static void downsample_rows(const uint8_t *in, int in_stride, uint8_t *out, int out_width, int out_height,
+                            int v_factor);
+static void transform_mcu_row(Encoder *encoder, int16_t *coefs);
+static void select_fdct(FDCTFunction *fdct);
+static void fdct_block_scalar(const uint8_t *in, int stride, int16_t *out);
+static void quantize_block(const int16_t *coefs, const Divisors *divisors, int16_t *zz);
+
+static void count_mcus(Encoder *encoder, const int16_t *coefs, int mcu_start, int mcu_end, int *dc_preds);
+static bool encode_mcus(Encoder *encoder, BitWriter *bw, const int16_t *coefs, int mcu_start, int mcu_end,
+                        int *dc_preds);
+static void flush_bits(BitWriter *bw);
+static bool code_scan(Encoder *encoder, const JpegScan *scan, BitWriter *bw);
+
+JpegEncoder *jpeg_encoder_create() {
+  Encoder *encoder = calloc(1, sizeof(Encoder));
+  if (encoder == NULL)
+    return NULL;
+  encoder->quality = 75;
+  encoder->subsampling = JPEG_SUBSAMPLING_420;
+  select_fdct(&encoder->fdct);
+  return encoder;
+}
+
+void jpeg_encoder_destroy(JpegEncoder *encoder) {
+  if (encoder == NULL)
+    return;
+  free(encoder->planes);
+  free(encoder->coefs);
+  free(encoder);
+}
+
+int jpeg_encoder_set_quality(JpegEncoder *encoder, int quality) {
+  if (quality < 1 || quality > 100)
+    return -1;
+  encoder->quality = quality;
+  return 0;
+}
+
+void jpeg_encoder_set_subsampling(JpegEncoder *encoder, JpegSubsampling subsampling) {
+  encoder->subsampling = subsampling;
+}
+
+void jpeg_encoder_set_optimize_huffman(JpegEncoder *encoder, int enable) { encoder->optimize_huffman = enable; }
+
+int jpeg_encoder_set_restart_interval(JpegEncoder *encoder, int n_mcus) {
+  if (n_mcus < 0 || n_mcus > 0xFFFF)
+    return -1;
+  encoder->restart_interval = n_mcus;
+  return 0;
+}
+
+void jpeg_encoder_set_progressive(JpegEncoder *encoder, int enable) { encoder->progressive = enable; }
+
+int jpeg_encoder_set_scans(JpegEncoder *encoder, const JpegScan *scans, int n_scans) {
+  if (n_scans < 0 || n_scans > MAX_SCANS)
+    return -1;
+  memcpy(encoder->scans, scans, n_scans * sizeof(JpegScan));
+  encoder->n_scans = n_scans;
+  return 0;
+}
+
+const char *jpeg_encoder_error(const JpegEncoder *encoder) { return encoder->error_message; }
+
+JpegStatus jpeg_encoder_encode(JpegEncoder *encoder, const uint8_t *image, int width, int height, int n_channels,
+                               uint8_t **data, size_t *size) {
+  *data = NULL;
+  *size = 0;
+  encoder->error_message[0] = 0;
+  if (image == NULL || width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF)
+    return encode_fail(encoder, JPEG_ERROR_INVALID_ARGUMENT, "Image size must be 1 to 65535, got %dx%d", width, height);
+  if (n_channels != 1 && n_channels != 3)
+    return encode_fail(encoder, JPEG_ERROR_INVALID_ARGUMENT, "Only 1 or 3 channels are supported, got %d", n_channels);
+
+  encoder->width = width;
+  encoder->height = height;
+  encoder->n_channels = n_channels;
+  encoder->image_scans = encoder->n_scans > 0 ? encoder->scans : NULL;
+  encoder->n_image_scans = encoder->n_scans;
+  if (encoder->n_scans == 0 && encoder->progressive) {
+    encoder->image_scans = n_channels == 3 ? PROGRESSIVE_SCANS_COLOR : PROGRESSIVE_SCANS_GRAY;
+    encoder->n_image_scans = n_channels == 3 ? 10 : 6;
+  }
+  int invalid_scan = check_scans(encoder);
+  if (invalid_scan >= 0)
+    return encode_fail(encoder, JPEG_ERROR_INVALID_ARGUMENT, "Scan %d does not fit the image or the scans before it",
+                       invalid_scan);
+  encoder->h_sampling = n_channels == 3 && encoder->subsampling != JPEG_SUBSAMPLING_444 ? 2 : 1;
+  encoder->v_sampling = n_channels == 3 && encoder->subsampling == JPEG_SUBSAMPLING_420 ? 2 : 1;
+  int mcu_width = BLOCK_SIZE * encoder->h_sampling, mcu_height = BLOCK_SIZE * encoder->v_sampling;
+  encoder->nx_mcu = CDIV(width, mcu_width);
+  encoder->ny_mcu = CDIV(height, mcu_height);
+
+  // blocks of an MCU in coding order. ITU-T.81 A.2.3
+  int n_luma_blocks = encoder->h_sampling * encoder->v_sampling;
+  encoder->blocks_per_mcu = n_luma_blocks + (n_channels == 3 ? 2 : 0);
+  for (int b = 0; b < encoder->blocks_per_mcu; b++)
+    encoder->block_components[b] = b < n_luma_blocks ? 0 : b - n_luma_blocks + 1;
+
+  // full resolution rows of each component, followed by subsampled chroma
+  size_t plane_size = (size_t)encoder->nx_mcu * mcu_width * mcu_height;
+  size_t chroma_size = (size_t)encoder->nx_mcu * BLOCK_SIZE * BLOCK_SIZE;
+  size_t planes_size = plane_size * n_channels + (n_luma_blocks > 1 ? 2 * chroma_size : 0);
+  bool whole_image = encoder->optimize_huffman || encoder->image_scans != NULL;
+  int n_coef_mcus = whole_image ? encoder->nx_mcu * encoder->ny_mcu : encoder->nx_mcu;
+  size_t coefs_size = (size_t)n_coef_mcus * encoder->blocks_per_mcu * BLOCK_SIZE * BLOCK_SIZE * sizeof(int16_t);
+  if (planes_size > encoder->planes_capacity) {
+    free(encoder->planes);
+    encoder->planes = malloc(planes_size);
+    encoder->planes_capacity = encoder->planes == NULL ? 0 : planes_size;
+  }
+  if (coefs_size > encoder->coefs_capacity) {
+    free(encoder->coefs);
+    encoder->coefs = malloc(coefs_size);
+    encoder->coefs_capacity = encoder->coefs == NULL ? 0 : coefs_size;
+  }
+  if (encoder->planes == NULL || encoder->coefs == NULL)
+    return encode_fail(encoder, JPEG_ERROR_OUT_OF_MEMORY, "Failed to allocate memory");
+  for (int c = 0; c < n_channels; c++) {
+    bool subsampled = c > 0 && n_luma_blocks > 1;
+    encoder->plane_widths[c] = encoder->nx_mcu * (subsampled ? BLOCK_SIZE : mcu_width);
+    encoder->component_planes[c] =
+        subsampled ? encoder->planes + plane_size * n_channels + chroma_size * (c - 1) : encoder->planes + plane_size * c;
+  }
+
+  // a guess of the compressed size. the buffer grows as needed
+  encoder->data = NULL;
+  encoder->size = 0;
+  encoder->capacity = 0;
+  if (!reserve(encoder, (size_t)width * height * n_channels / 8 + 4096))
+    return encode_fail(encoder, JPEG_ERROR_OUT_OF_MEMORY, "Failed to allocate memory");
+
+  set_q_tables(encoder);
+  write_frame_header(encoder);
+
+  int n_tables = n_channels == 3 ? 4 : 2;
+  int dc_preds[3] = {0};
+  size_t mcu_row_coefs = (size_t)encoder->nx_mcu * encoder->blocks_per_mcu * BLOCK_SIZE * BLOCK_SIZE;
+  const JpegScan all_components = {n_channels, {0, 1, 2}, 0, BLOCK_SIZE * BLOCK_SIZE - 1, 0, 0};
+  BitWriter bw = {NULL, 0, 64};
+  bool ok = true;
+
+  if (encoder->image_scans != NULL) {
+    // every scan codes part of the quantized coefficients of the whole image, counting its symbols first
+    for (int mcu_y = 0; mcu_y < encoder->ny_mcu; mcu_y++) {
+      convert_mcu_row(encoder, image, mcu_y);
+      transform_mcu_row(encoder, encoder->coefs + mcu_row_coefs * mcu_y);
+    }
+    for (int i = 0; ok && i < encoder->n_image_scans; i++) {
+      const JpegScan *scan = &encoder->image_scans[i];
+      memset(encoder->h_counts, 0, sizeof(encoder->h_counts));
+      code_scan(encoder, scan, NULL);
+      for (int t = 0; t < n_tables; t++)
+        if (scan_tables(scan) & (1 << t))
+          build_optimal_huffman_code(&encoder->h_codes[t], encoder->h_counts[t]);
+
+      // DHT and SOS take less than 2 KB
+      ok = reserve(encoder, 2048);
+      if (ok) {
+        write_scan_header(encoder, scan);
+        bw.ptr = encoder->data + encoder->size;
+        ok = code_scan(encoder, scan, &bw);
+      }
+      if (ok) {
+        flush_bits(&bw);
+        encoder->size = bw.ptr - encoder->data;
+      }
+    }
+  } else if (encoder->optimize_huffman) {
+    // first pass: quantized coefficients of the whole image and the symbol counts of each table
+    memset(encoder->h_counts, 0, sizeof(encoder->h_counts));
+    for (int mcu_y = 0; mcu_y < encoder->ny_mcu; mcu_y++) {
+      int16_t *coefs = encoder->coefs + mcu_row_coefs * mcu_y;
+      convert_mcu_row(encoder, image, mcu_y);
+      transform_mcu_row(encoder, coefs);
+      count_mcus(encoder, coefs, mcu_y * encoder->nx_mcu, (mcu_y + 1) * encoder->nx_mcu, dc_preds);
+    }
+    for (int t = 0; t < n_tables; t++)
+      build_optimal_huffman_code(&encoder->h_codes[t], encoder->h_counts[t]);
+
+    // second pass: entropy coding
+    write_scan_header(encoder, &all_components);
+    memset(dc_preds, 0, sizeof(dc_preds));
+    bw.ptr = encoder->data + encoder->size;
+    ok = encode_mcus(encoder, &bw, encoder->coefs, 0, encoder->nx_mcu * encoder->ny_mcu, dc_preds);
+  } else {
+    for (int t = 0; t < n_tables; t++) {
+      HuffmanCode *h = &encoder->h_codes[t];
+      memcpy(h->bits, HUFFMAN_BITS[t], sizeof(h->bits));
+      memcpy(h->values, t % 2 == 0 ? HUFFMAN_DC_VALUES : HUFFMAN_AC_VALUES[t / 2], t % 2 == 0 ? 12 : 162);
+      build_huffman_code(h);
+    }
+    write_scan_header(encoder, &all_components);
+    bw.ptr = encoder->data + encoder->size;
+    for (int mcu_y = 0; ok && mcu_y < encoder->ny_mcu; mcu_y++) {
+      convert_mcu_row(encoder, image, mcu_y);
+      transform_mcu_row(encoder, encoder->coefs);
+      ok = encode_mcus(encoder, &bw, encoder->coefs, mcu_y * encoder->nx_mcu, (mcu_y + 1) * encoder->nx_mcu, dc_preds);
+    }
+  }
+
+  if (ok) {
+    flush_bits(&bw);
+    encoder->size = bw.ptr - encoder->data;
+    ok = reserve(encoder, 2);
+  }
+  if (!ok) {
+    free(encoder->data);
+    encoder->data = NULL;
+    return encode_fail(encoder, JPEG_ERROR_OUT_OF_MEMORY, "Failed to allocate memory");
+  }
+  put_u16(encoder, 0xFF00 | EOI);
+
+  *data = encoder->data;
+  *size = encoder->size;
+  encoder->data = NULL;
+  return JPEG_OK;
+}
+
+uint8_t *encode_jpeg_mem(const uint8_t *image, int width, int height, int n_channels, int quality, size_t *size) {
+  JpegEncoder *encoder = jpeg_encoder_create();
+  if (encoder == NULL)
+    return NULL;
+  uint8_t *data = NULL;
+  if (jpeg_encoder_set_quality(encoder, quality) == 0)
+    jpeg_encoder_encode(encoder, image, width, height, n_channels, &data, size);
+  jpeg_encoder_destroy(encoder);
+  return data;
+}
+
+JpegStatus encode_fail(Encoder *encoder, JpegStatus status, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(encoder->error_message, sizeof(encoder->error_message), format, args);
+  va_end(args);
+  return status;
+}
+
+// make room for n_bytes more bytes of output. the output may move
+bool reserve(Encoder *encoder, size_t n_bytes) {
+  if (encoder->size + n_bytes <= encoder->capacity)
+    return true;
+  size_t capacity = MAX(encoder->capacity * 2, encoder->size + n_bytes);
+  uint8_t *data = realloc(encoder->data, capacity);
+  if (data == NULL)
+    return false;
+  encoder->data = data;
+  encoder->capacity = capacity;
+  return true;
+}
+
+// headers take less than 2 KB, which the first reserve() of jpeg_encoder_encode() leaves room for
+void put_u8(Encoder *encoder, uint8_t value) { encoder->data[encoder->size++] = value; }
+
+void put_u16(Encoder *encoder, uint16_t value) {
+  put_u8(encoder, value >> 8);
+  put_u8(encoder, value & 0xFF);
+}
+
+// returns the index of the first scan that breaks ITU-T.81 G.1.1.1, or -1 if the scans are fine. each coefficient of
+// each component is coded first with ah 0, then refined one bit at a time, and the AC coefficients of a component come
+// after its DC coefficient. a sequential image has each component in one scan, else the last scan is wrong
+int check_scans(Encoder *encoder) {
+  encoder->progressive_frame = false;
+  if (encoder->image_scans == NULL)
+    return -1;
+  for (int i = 0; i < encoder->n_image_scans; i++) {
+    const JpegScan *scan = &encoder->image_scans[i];
+    encoder->progressive_frame |= scan->ss != 0 || scan->se != BLOCK_SIZE * BLOCK_SIZE - 1 || scan->ah || scan->al;
+  }
+
+  int8_t bit_positions[3][BLOCK_SIZE * BLOCK_SIZE]; // of the last scan of each coefficient, -1 before the first
+  memset(bit_positions, -1, sizeof(bit_positions));
+  for (int i = 0; i < encoder->n_image_scans; i++) {
+    const JpegScan *scan = &encoder->image_scans[i];
+    if (scan->n_components < 1 || scan->n_components > encoder->n_channels)
+      return i;
+    for (int j = 0; j < scan->n_components; j++)
+      if (scan->components[j] < (j ? scan->components[j - 1] + 1 : 0) || scan->components[j] >= encoder->n_channels)
+        return i;
+    if (scan->ss < 0 || scan->ss > scan->se || scan->se >= BLOCK_SIZE * BLOCK_SIZE)
+      return i;
+    if (encoder->progressive_frame) {
+      if ((scan->ss == 0 && scan->se != 0) || (scan->ss > 0 && scan->n_components != 1))
+        return i;
+      if (scan->al < 0 || scan->ah > 13 || scan->al > 13 || (scan->ah && scan->ah != scan->al + 1))
+        return i;
+    }
+
+    for (int j = 0; j < scan->n_components; j++) {
+      int8_t *positions = bit_positions[scan->components[j]];
+      if (scan->ss > 0 && positions[0] < 0)
+        return i;
+      for (int k = scan->ss; k <= scan->se; k++) {
+        if (positions[k] != (scan->ah ? scan->ah : -1))
+          return i;
+        positions[k] = scan->al;
+      }
+    }
+  }
+  for (int c = 0; c < encoder->n_channels && !encoder->progressive_frame; c++)
+    if (bit_positions[c][0] < 0)
+      return encoder->n_image_scans - 1;
+  return -1;
+}
+
+// SOI, JFIF, DQT and SOF0 or SOF2. ITU-T.81 B.2
+void write_frame_header(Encoder *encoder) {
+  int n_tables = encoder->n_channels == 3 ? 2 : 1;
+  put_u16(encoder, 0xFF00 | SOI);
+
+  // JFIF page 5. version 1.01, no units, 1:1 pixel aspect ratio, no thumbnail
+  put_u16(encoder, 0xFF00 | APP0);
+  put_u16(encoder, 16);
+  for (int i = 0; i < 5; i++)
+    put_u8(encoder, "JFIF"[i]);
+  put_u16(encoder, 0x0101);
+  put_u8(encoder, 0);
+  put_u16(encoder, 1);
+  put_u16(encoder, 1);
+  put_u16(encoder, 0);
+
+  // B.2.4.1. 8-bit values, in zig-zag order
+  for (int t = 0; t < n_tables; t++) {
+    put_u16(encoder, 0xFF00 | DQT);
+    put_u16(encoder, 2 + 1 + BLOCK_SIZE * BLOCK_SIZE);
+    put_u8(encoder, t);
+    uint8_t zz[BLOCK_SIZE * BLOCK_SIZE];
+    for (int i = 0; i < BLOCK_SIZE; i++)
+      for (int j = 0; j < BLOCK_SIZE; j++)
+        zz[ZIG_ZAG[i][j]] = encoder->q_tables[t][i * BLOCK_SIZE + j];
+    for (int k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+      put_u8(encoder, zz[k]);
+  }
+
+  // B.2.2. components 1, 2, 3 are Y, Cb, Cr (JFIF page 3)
+  put_u16(encoder, 0xFF00 | (encoder->progressive_frame ? SOF2 : SOF0));
+  put_u16(encoder, 8 + 3 * encoder->n_channels);
+  put_u8(encoder, 8);
+  put_u16(encoder, encoder->height);
+  put_u16(encoder, encoder->width);
+  put_u8(encoder, encoder->n_channels);
+  for (int c = 0; c < encoder->n_channels; c++) {
+    put_u8(encoder, c + 1);
+    put_u8(encoder, c == 0 ? (encoder->h_sampling << 4) | encoder->v_sampling : 0x11);
+    put_u8(encoder, c == 0 ? 0 : 1);
+  }
+}
+
+// DHT of the tables the scan codes with, DRI and SOS. ITU-T.81 B.2.4.2, B.2.4.4 and B.2.3
+void write_scan_header(Encoder *encoder, const JpegScan *scan) {
+  for (int t = 0; t < 4; t++) {
+    if (!(scan_tables(scan) & (1 << t)))
+      continue;
+    const HuffmanCode *h = &encoder->h_codes[t];
+    int n_values = 0;
+    for (int i = 0; i < 16; i++)
+      n_values += h->bits[i];
+    put_u16(encoder, 0xFF00 | DHT);
+    put_u16(encoder, 2 + 1 + 16 + n_values);
+    put_u8(encoder, ((t % 2) << 4) | (t / 2)); // class (0 = DC, 1 = AC) and id
+    for (int i = 0; i < 16; i++)
+      put_u8(encoder, h->bits[i]);
+    for (int i = 0; i < n_values; i++)
+      put_u8(encoder, h->values[i]);
+  }
+
+  if (encoder->restart_interval > 0) {
+    put_u16(encoder, 0xFF00 | DRI);
+    put_u16(encoder, 4);
+    put_u16(encoder, encoder->restart_interval);
+  }
+
+  put_u16(encoder, 0xFF00 | SOS);
+  put_u16(encoder, 6 + 2 * scan->n_components);
+  put_u8(encoder, scan->n_components);
+  for (int i = 0; i < scan->n_components; i++) {
+    int c = scan->components[i];
+    put_u8(encoder, c + 1);
+    put_u8(encoder, c == 0 ? 0x00 : 0x11); // DC and AC table ids
+  }
+  put_u8(encoder, scan->ss);
+  put_u8(encoder, scan->se);
+  put_u8(encoder, (scan->ah << 4) | scan->al);
+}
+
+// a bit for each Huffman table that the scan codes with: luma DC, luma AC, chroma DC, chroma AC. DC refinement needs
+// none. G.1.2.1
+int scan_tables(const JpegScan *scan) {
+  int tables = 0;
+  for (int i = 0; i < scan->n_components; i++) {
+    int dc_table = scan->components[i] > 0 ? 2 : 0;
+    if (scan->ss == 0 && scan->ah == 0)
+      tables |= 1 << dc_table;
+    if (scan->se > 0)
+      tables |= 2 << dc_table;
+  }
+  return tables;
+}
+
+// scale the example tables of Annex K like libjpeg: 50 is the tables as they are, 100 is all ones
+void set_q_tables(Encoder *encoder) {
+  int quality = encoder->quality;
+  int scale_factor = quality < 50 ? 5000 / quality : 200 - quality * 2;
+  for (int t = 0; t < 2; t++) {
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+      encoder->q_tables[t][i] = CLAMP((Q_TABLES[t][i] * scale_factor + 50) / 100, 1, 255);
+    set_divisors(&encoder->divisors[t], encoder->q_tables[t]);
+  }
+}
+
+// the FDCT output is 8 times the coefficients, so the divisor d is 8 * q, between 8 and 2040. the quotient rounded to
+// the nearest is ((|x| + correction) * reciprocal >> 16) * scale >> 16, with 16-bit unsigned multiplications, which
+// is exact for |x| < 2^15 (same as libjpeg-turbo's compute_reciprocal())
+void set_divisors(Divisors *divisors, const uint8_t *q_table) {
+  for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++) {
+    uint32_t divisor = q_table[i] * 8;
+    int b = 0; // floor(log2(divisor))
+    while ((2u << b) <= divisor)
+      b++;
+    int shift = 16 + b;
+    uint32_t reciprocal = (1u << shift) / divisor, remainder = (1u << shift) % divisor;
+    uint32_t correction = divisor / 2;
+    if (remainder == 0) { // power of 2
+      reciprocal >>= 1;
+      shift--;
+    } else if (remainder <= divisor / 2)
+      correction++;
+    else
+      reciprocal++;
+    divisors->reciprocal[i] = reciprocal;
+    divisors->correction[i] = correction;
+    divisors->scale[i] = 1u << (32 - shift);
+  }
+}
+
+// ITU-T.81 C.2. codes of each length are consecutive, in the order of values
+void build_huffman_code(HuffmanCode *h) {
+  memset(h->lengths, 0, sizeof(h->lengths));
+  uint16_t code = 0;
+  int k = 0;
+  for (int length = 1; length <= 16; length++) {
+    for (int i = 0; i < h->bits[length - 1]; i++, k++) {
+      h->codes[h->values[k]] = code++;
+      h->lengths[h->values[k]] = length;
+    }
+    code <<= 1;
+  }
+}
+
+// ITU-T.81 K.2, same as libjpeg's jpeg_gen_optimal_table(). counts has 257 entries: symbol 256 gets a count of 1 and
+// is left out at the end, so that no code is all 1-bits
+void build_optimal_huffman_code(HuffmanCode *h, const uint32_t *counts) {
+  uint64_t freq[257];
+  int code_sizes[257], others[257];
+  for (int i = 0; i < 257; i++) {
+    freq[i] = counts[i];
+    code_sizes[i] = 0;
+    others[i] = -1;
+  }
+  freq[256] = 1;
+
+  // Figure K.1. merge the two least frequent trees until there is one. ties go to the larger symbol
+  for (;;) {
+    int c1 = -1, c2 = -1;
+    for (int i = 0; i < 257; i++)
+      if (freq[i] > 0 && (c1 < 0 || freq[i] <= freq[c1]))
+        c1 = i;
+    for (int i = 0; i < 257; i++)
+      if (freq[i] > 0 && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+        c2 = i;
+    if (c2 < 0)
+      break;
+
+    freq[c1] += freq[c2];
+    freq[c2] = 0;
+    for (code_sizes[c1]++; others[c1] >= 0; code_sizes[c1]++)
+      c1 = others[c1];
+    others[c1] = c2;
+    for (code_sizes[c2]++; others[c2] >= 0; code_sizes[c2]++)
+      c2 = others[c2];
+  }
+
+  // Figure K.2. counts are 32-bit, so trees are less than 64 deep
+  int bits[64] = {0};
+  for (int i = 0; i < 257; i++)
+    bits[code_sizes[i]]++;
+
+  // Figure K.3. limit code lengths to 16: move pairs of the longest codes up, splitting a shorter code
+  for (int i = 63; i > 16; i--)
+    while (bits[i] > 0) {
+      int j = i - 2;
+      while (bits[j] == 0)
+        j--;
+      bits[i] -= 2;
+      bits[i - 1]++;
+      bits[j + 1] += 2;
+      bits[j]--;
+    }
+  int longest = 16;
+  while (bits[longest] == 0)
+    longest--;
+  bits[longest]--; // symbol 256
+
+  // Figure K.4. symbols sorted by code length
+  for (int i = 0; i < 16; i++)
+    h->bits[i] = bits[i + 1];
+  int k = 0;
+  for (int size = 1; size < 64; size++)
+    for (int i = 0; i < 256; i++)
+      if (code_sizes[i] == size)
+        h->values[k++] = i;
+  build_huffman_code(h);
+}
+
+// color conversion and padding of one MCU row. rows and columns past the image repeat the last ones, so that the
+// padding costs few bits
+void convert_mcu_row(Encoder *encoder, const uint8_t *image, int mcu_y) {
+  int mcu_height = BLOCK_SIZE * encoder->v_sampling;
+  int width = encoder->width, n_channels = encoder->n_channels, stride = encoder->plane_widths[0];
+  size_t plane_size = (size_t)stride * mcu_height;
+
+  for (int j = 0; j < mcu_height; j++) {
+    int y = MIN(mcu_y * mcu_height + j, encoder->height - 1);
+    const uint8_t *row = image + (size_t)y * width * n_channels;
+    uint8_t *out[3] = {NULL};
+    for (int c = 0; c < n_channels; c++)
+      out[c] = encoder->planes + plane_size * c + (size_t)j * stride;
+    if (n_channels == 1)
+      memcpy(out[0], row, width);
+    else
+      rgb_to_ycbcr_row(row, out[0], out[1], out[2], width);
+    for (int c = 0; c < n_channels; c++)
+      memset(out[c] + width, out[c][width - 1], stride - width);
+  }
+
+  if (n_channels == 3 && encoder->h_sampling > 1)
+    for (int c = 1; c < 3; c++)
+      downsample_rows(encoder->planes + plane_size * c, stride, encoder->component_planes[c], encoder->plane_widths[c],
+                      BLOCK_SIZE, encoder->v_sampling);
+}
+
+// JFIF page 3, in 14-bit fixed point like the decoder's ycbcr_to_rgb_row(), so that the SIMD version can use 16-bit
+// multiplies. chroma is rounded with 0.5 - 2^-14, so that it stays below 256
+#define FIX_14(x) ((int32_t)((x)*16384 + 0.5))
+
+#ifdef JPEG_SSE2
+// 12 bytes of RGB to 4 pixels of 32-bit RGBx, the inverse of the decoder's pack_rgb(). x is not cleared
+static inline __m128i unpack_rgb(__m128i rgb) {
+  const __m128i low_rgb = _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF);
+  const __m128i low_6_bytes = _mm_set_epi32(0, 0, 0xFFFF, -1);
+  __m128i pairs = _mm_or_si128(_mm_and_si128(rgb, low_6_bytes), _mm_andnot_si128(low_6_bytes, _mm_slli_si128(rgb, 2)));
+  return _mm_or_si128(_mm_and_si128(pairs, low_rgb), _mm_andnot_si128(low_rgb, _mm_slli_epi64(pairs, 8)));
+}
+
+// one channel of 8 pixels: (r * c_rg[0] + g * c_rg[1] + b * c_b + bias) >> 14
+static inline __m128i rgb_channel(__m128i rg_lo, __m128i rg_hi, __m128i b_lo, __m128i b_hi, __m128i c_rg, __m128i c_b,
+                                  __m128i bias) {
+  __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg_lo, c_rg), _mm_madd_epi16(b_lo, c_b)), bias);
+  __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg_hi, c_rg), _mm_madd_epi16(b_hi, c_b)), bias);
+  return _mm_packs_epi32(_mm_srai_epi32(lo, 14), _mm_srai_epi32(hi, 14));
+}
+#endif
+
+void rgb_to_ycbcr_row(const uint8_t *rgb, uint8_t *y, uint8_t *cb, uint8_t *cr, int width) {
+  int i = 0;
+#ifdef JPEG_SSE2
+  const __m128i c_y_rg = _mm_set1_epi32((uint16_t)FIX_14(0.299) | ((uint32_t)FIX_14(0.587) << 16));
+  const __m128i c_y_b = _mm_set1_epi32(FIX_14(0.114));
+  const __m128i c_cb_rg = _mm_set1_epi32((uint16_t)-FIX_14(0.168736) | ((uint32_t)-FIX_14(0.331264) << 16));
+  const __m128i c_cb_b = _mm_set1_epi32(FIX_14(0.5));
+  const __m128i c_cr_rg = _mm_set1_epi32((uint16_t)FIX_14(0.5) | ((uint32_t)-FIX_14(0.418688) << 16));
+  const __m128i c_cr_b = _mm_set1_epi32((uint16_t)-FIX_14(0.081312));
+  const __m128i bias_y = _mm_set1_epi32(1 << 13);
+  const __m128i bias_c = _mm_set1_epi32((128 << 14) + (1 << 13) - 1);
+  const __m128i low_byte = _mm_set1_epi32(0xFF);
+  const __m128i zero = _mm_setzero_si128();
+
+  // the second load reads 4 bytes past the 8 pixels
+  for (; i + 10 <= width; i += 8) {
+    __m128i p0 = unpack_rgb(_mm_loadu_si128((const __m128i *)(rgb + i * 3)));
+    __m128i p1 = unpack_rgb(_mm_loadu_si128((const __m128i *)(rgb + i * 3 + 12)));
+    __m128i r = _mm_packs_epi32(_mm_and_si128(p0, low_byte), _mm_and_si128(p1, low_byte));
+    __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), low_byte),
+                                _mm_and_si128(_mm_srli_epi32(p1, 8), low_byte));
+    __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), low_byte),
+                                _mm_and_si128(_mm_srli_epi32(p1, 16), low_byte));
+    __m128i rg_lo = _mm_unpacklo_epi16(r, g), rg_hi = _mm_unpackhi_epi16(r, g);
+    __m128i b_lo = _mm_unpacklo_epi16(b, zero), b_hi = _mm_unpackhi_epi16(b, zero);
+    __m128i y16 = rgb_channel(rg_lo, rg_hi, b_lo, b_hi, c_y_rg, c_y_b, bias_y);
+    __m128i cb16 = rgb_channel(rg_lo, rg_hi, b_lo, b_hi, c_cb_rg, c_cb_b, bias_c);
+    __m128i cr16 = rgb_channel(rg_lo, rg_hi, b_lo, b_hi, c_cr_rg, c_cr_b, bias_c);
+    _mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(y16, y16));
+    _mm_storel_epi64((__m128i *)(cb + i), _mm_packus_epi16(cb16, cb16));
+    _mm_storel_epi64((__m128i *)(cr + i), _mm_packus_epi16(cr16, cr16));
+  }
+#endif
+  for (; i < width; i++) {
+    int32_t r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+    // clang-format off
+    y[i]  = ( FIX_14(0.299)    * r + FIX_14(0.587)    * g + FIX_14(0.114)    * b + (1 << 13)                 ) >> 14;
+    cb[i] = (-FIX_14(0.168736) * r - FIX_14(0.331264) * g + FIX_14(0.5)      * b + (128 << 14) + (1 << 13) - 1) >> 14;
+    cr[i] = ( FIX_14(0.5)      * r - FIX_14(0.418688) * g - FIX_14(0.081312) * b + (128 << 14) + (1 << 13) - 1) >> 14;
+    // clang-format on
+  }
+}
+
+// average of 2x1 (4:2:2) or 2x2 (4:2:0) samples. the rounding bias alternates between columns like in libjpeg's
+// jcsample.c, so that ties do not always round the same way
+void downsample_rows(const uint8_t *in, int in_stride, uint8_t *out, int out_width, int out_height, int v_factor) {
+  for (int j = 0; j < out_height; j++) {
+    const uint8_t *row0 = in + (size_t)j * v_factor * in_stride;
+    const uint8_t *row1 = row0 + in_stride;
+    uint8_t *out_row = out + (size_t)j * out_width;
+    if (v_factor == 2)
+      for (int i = 0; i < out_width; i++)
+        out_row[i] = (row0[i * 2] + row0[i * 2 + 1] + row1[i * 2] + row1[i * 2 + 1] + 1 + (i & 1)) >> 2;
+    else
+      for (int i = 0; i < out_width; i++)
+        out_row[i] = (row0[i * 2] + row0[i * 2 + 1] + (i & 1)) >> 1;
+  }
+}
+
+// FDCT and quantization of every block of an MCU row, in coding order
+void transform_mcu_row(Encoder *encoder, int16_t *coefs) {
+  int h_sampling = encoder->h_sampling;
+  for (int mcu_x = 0; mcu_x < encoder->nx_mcu; mcu_x++)
+    for (int b = 0; b < encoder->blocks_per_mcu; b++) {
+      int c = encoder->block_components[b];
+      int stride = encoder->plane_widths[c];
+      int bx = c == 0 ? mcu_x * h_sampling + b % h_sampling : mcu_x;
+      int by = c == 0 ? b / h_sampling : 0;
+      int16_t block[BLOCK_SIZE * BLOCK_SIZE];
+      encoder->fdct(encoder->component_planes[c] + (size_t)by * BLOCK_SIZE * stride + bx * BLOCK_SIZE, stride, block);
+      quantize_block(block, &encoder->divisors[c > 0], coefs);
+      coefs += BLOCK_SIZE * BLOCK_SIZE;
+    }
+}
+
+// ITU-T.81 A.3.3. integer FDCT using the LLM factorization (same as libjpeg's jfdctint.c), with 13-bit constants.
+// columns first, then rows. samples are level-shifted as they are loaded, and the output is 8 times the coefficients
+#define FIX_13(x) ((int32_t)((x)*8192 + 0.5))
+
+// out[0] and out[4] have no constants in them, the others are scaled by 8192
+static inline void fdct_1d_int(int32_t out[BLOCK_SIZE], int32_t s0, int32_t s1, int32_t s2, int32_t s3, int32_t s4,
+                               int32_t s5, int32_t s6, int32_t s7) {
+  int32_t t0 = s0 + s7, t7 = s0 - s7;
+  int32_t t1 = s1 + s6, t6 = s1 - s6;
+  int32_t t2 = s2 + s5, t5 = s2 - s5;
+  int32_t t3 = s3 + s4, t4 = s3 - s4;
+
+  // even part
+  int32_t t10 = t0 + t3, t13 = t0 - t3;
+  int32_t t11 = t1 + t2, t12 = t1 - t2;
+  int32_t p1 = (t12 + t13) * FIX_13(0.541196100);
+  out[0] = t10 + t11;
+  out[4] = t10 - t11;
+  out[2] = p1 + t13 * FIX_13(0.765366865);
+  out[6] = p1 - t12 * FIX_13(1.847759065);
+
+  // odd part
+  int32_t p5 = (t4 + t5 + t6 + t7) * FIX_13(1.175875602);
+  int32_t q1 = -(t4 + t7) * FIX_13(0.899976223);
+  int32_t q2 = -(t5 + t6) * FIX_13(2.562915447);
+  int32_t q3 = p5 - (t4 + t6) * FIX_13(1.961570560);
+  int32_t q4 = p5 - (t5 + t7) * FIX_13(0.390180644);
+  out[7] = t4 * FIX_13(0.298631336) + q1 + q3;
+  out[5] = t5 * FIX_13(2.053119869) + q2 + q4;
+  out[3] = t6 * FIX_13(3.072711026) + q2 + q3;
+  out[1] = t7 * FIX_13(1.501321110) + q1 + q4;
+}
+
+void fdct_block_scalar(const uint8_t *in, int stride, int16_t *out) {
+  int32_t temp[BLOCK_SIZE * BLOCK_SIZE];
+  int32_t values[BLOCK_SIZE];
+
+  // column-wise. keep 2 extra bits of precision
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    const uint8_t *p = in + i;
+    fdct_1d_int(values, p[0] - 128, p[stride] - 128, p[2 * stride] - 128, p[3 * stride] - 128, p[4 * stride] - 128,
+                p[5 * stride] - 128, p[6 * stride] - 128, p[7 * stride] - 128);
+    for (int j = 0; j < BLOCK_SIZE; j++)
+      temp[j * BLOCK_SIZE + i] = j % 4 == 0 ? values[j] * 4 : (values[j] + (1 << 10)) >> 11;
+  }
+
+  // row-wise. remove 13-bit constants and the 2 extra bits
+  for (int j = 0; j < BLOCK_SIZE; j++) {
+    const int32_t *t = temp + j * BLOCK_SIZE;
+    fdct_1d_int(values, t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7]);
+    for (int i = 0; i < BLOCK_SIZE; i++)
+      out[j * BLOCK_SIZE + i] = i % 4 == 0 ? (values[i] + 2) >> 2 : (values[i] + (1 << 14)) >> 15;
+  }
+}
+
+#ifdef JPEG_SSE2
+// same arithmetic as fdct_block_scalar() on 16-bit rows, so results are identical. 16 bits are enough for all sums
+// of 8-bit samples (libjpeg-turbo's jfdctint-sse2 does the same). multiply-adds use interleaved pairs:
+// out = x * c[even] + y * c[odd]
+#define FDCT_CONST(x, y) _mm_setr_epi16((x), (y), (x), (y), (x), (y), (x), (y))
+
+#define FDCT_MADD(out, x, y, c)                                                                                        \
+  __m128i out##_l = _mm_madd_epi16(_mm_unpacklo_epi16((x), (y)), c);                                                   \
+  __m128i out##_h = _mm_madd_epi16(_mm_unpackhi_epi16((x), (y)), c);
+
+#define FDCT_ADD(out, a, b)                                                                                            \
+  __m128i out##_l = _mm_add_epi32(a##_l, b##_l);                                                                       \
+  __m128i out##_h = _mm_add_epi32(a##_h, b##_h);
+
+#define FDCT_DESCALE(out, a, bias, shift)                                                                              \
+  out = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(a##_l, bias), shift),                                            \
+                        _mm_srai_epi32(_mm_add_epi32(a##_h, bias), shift));
+
+// even_scale() is applied to out[0] and out[4], and the other outputs are descaled by bias and shift
+#define FDCT_PASS(even_scale, bias, shift)                                                                             \
+  {                                                                                                                    \
+    __m128i t0 = _mm_add_epi16(row0, row7), t7 = _mm_sub_epi16(row0, row7);                                            \
+    __m128i t1 = _mm_add_epi16(row1, row6), t6 = _mm_sub_epi16(row1, row6);                                            \
+    __m128i t2 = _mm_add_epi16(row2, row5), t5 = _mm_sub_epi16(row2, row5);                                            \
+    __m128i t3 = _mm_add_epi16(row3, row4), t4 = _mm_sub_epi16(row3, row4);                                            \
+                                                                                                                       \
+    __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3);                                                  \
+    __m128i t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);                                                  \
+    row0 = even_scale(_mm_add_epi16(t10, t11));                                                                        \
+    row4 = even_scale(_mm_sub_epi16(t10, t11));                                                                        \
+    FDCT_MADD(y2, t13, t12, rot0_0)                                                                                    \
+    FDCT_MADD(y6, t13, t12, rot0_1)                                                                                    \
+    FDCT_DESCALE(row2, y2, bias, shift)                                                                                \
+    FDCT_DESCALE(row6, y6, bias, shift)                                                                                \
+                                                                                                                       \
+    __m128i t46 = _mm_add_epi16(t4, t6), t57 = _mm_add_epi16(t5, t7);                                                  \
+    FDCT_MADD(q3, t46, t57, rot1_0)                                                                                    \
+    FDCT_MADD(q4, t46, t57, rot1_1)                                                                                    \
+    FDCT_MADD(y7a, t4, t7, rot2_0)                                                                                     \
+    FDCT_MADD(y1a, t4, t7, rot2_1)                                                                                     \
+    FDCT_MADD(y5a, t5, t6, rot3_0)                                                                                     \
+    FDCT_MADD(y3a, t5, t6, rot3_1)                                                                                     \
+    FDCT_ADD(y7, y7a, q3)                                                                                              \
+    FDCT_ADD(y5, y5a, q4)                                                                                              \
+    FDCT_ADD(y3, y3a, q3)                                                                                              \
+    FDCT_ADD(y1, y1a, q4)                                                                                              \
+    FDCT_DESCALE(row7, y7, bias, shift)                                                                                \
+    FDCT_DESCALE(row5, y5, bias, shift)                                                                                \
+    FDCT_DESCALE(row3, y3, bias, shift)                                                                                \
+    FDCT_DESCALE(row1, y1, bias, shift)                                                                                \
+  }
+
+#define FDCT_SCALE_0(x) _mm_slli_epi16((x), 2)
+#define FDCT_SCALE_1(x) _mm_srai_epi16(_mm_add_epi16((x), _mm_set1_epi16(2)), 2)
+
+#define FDCT_LOAD_ROW(i)                                                                                               \
+  _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(in + (i)*stride)), _mm_setzero_si128()),          \
+                _mm_set1_epi16(128))
+
+static void fdct_block_sse2(const uint8_t *in, int stride, int16_t *out) {
+  // the constants of fdct_1d_int(), combined for each pair of inputs
+  const __m128i rot0_0 = FDCT_CONST(FIX_13(0.541196100) + FIX_13(0.765366865), FIX_13(0.541196100));
+  const __m128i rot0_1 = FDCT_CONST(FIX_13(0.541196100), FIX_13(0.541196100) - FIX_13(1.847759065));
+  const __m128i rot1_0 = FDCT_CONST(FIX_13(1.175875602) - FIX_13(1.961570560), FIX_13(1.175875602));
+  const __m128i rot1_1 = FDCT_CONST(FIX_13(1.175875602), FIX_13(1.175875602) - FIX_13(0.390180644));
+  const __m128i rot2_0 = FDCT_CONST(FIX_13(0.298631336) - FIX_13(0.899976223), -FIX_13(0.899976223));
+  const __m128i rot2_1 = FDCT_CONST(-FIX_13(0.899976223), FIX_13(1.501321110) - FIX_13(0.899976223));
+  const __m128i rot3_0 = FDCT_CONST(FIX_13(2.053119869) - FIX_13(2.562915447), -FIX_13(2.562915447));
+  const __m128i rot3_1 = FDCT_CONST(-FIX_13(2.562915447), FIX_13(3.072711026) - FIX_13(2.562915447));
+  const __m128i bias_0 = _mm_set1_epi32(1 << 10);
+  const __m128i bias_1 = _mm_set1_epi32(1 << 14);
+
+  __m128i row0 = FDCT_LOAD_ROW(0), row1 = FDCT_LOAD_ROW(1), row2 = FDCT_LOAD_ROW(2), row3 = FDCT_LOAD_ROW(3);
+  __m128i row4 = FDCT_LOAD_ROW(4), row5 = FDCT_LOAD_ROW(5), row6 = FDCT_LOAD_ROW(6), row7 = FDCT_LOAD_ROW(7);
+  FDCT_PASS(FDCT_SCALE_0, bias_0, 11) // column-wise
+  TRANSPOSE_8X8()
+  FDCT_PASS(FDCT_SCALE_1, bias_1, 15) // row-wise
+  TRANSPOSE_8X8()
+  __m128i rows[BLOCK_SIZE] = {row0, row1, row2, row3, row4, row5, row6, row7};
+  for (int j = 0; j < BLOCK_SIZE; j++)
+    _mm_storeu_si128((__m128i *)(out + j * BLOCK_SIZE), rows[j]);
+}
+#endif
+
+static void select_fdct(FDCTFunction *fdct) {
+  *fdct = fdct_block_scalar;
+#ifdef JPEG_SSE2
+  *fdct = fdct_block_sse2;
+#endif
+}
+
+// divide by 8 * q with rounding, see set_divisors(), and reorder to zig-zag
+void quantize_block(const int16_t *coefs, const Divisors *divisors, int16_t *zz) {
+  int16_t quantized[BLOCK_SIZE * BLOCK_SIZE];
+#ifdef JPEG_SSE2
+  for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(coefs + i));
+    __m128i sign = _mm_srai_epi16(x, 15);
+    __m128i magnitude = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+    magnitude = _mm_add_epi16(magnitude, _mm_loadu_si128((const __m128i *)(divisors->correction + i)));
+    magnitude = _mm_mulhi_epu16(magnitude, _mm_loadu_si128((const __m128i *)(divisors->reciprocal + i)));
+    magnitude = _mm_mulhi_epu16(magnitude, _mm_loadu_si128((const __m128i *)(divisors->scale + i)));
+    _mm_storeu_si128((__m128i *)(quantized + i), _mm_sub_epi16(_mm_xor_si128(magnitude, sign), sign));
+  }
+#else
+  for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++) {
+    uint32_t magnitude = abs(coefs[i]);
+    magnitude = ((magnitude + divisors->correction[i]) * divisors->reciprocal[i]) >> 16;
+    magnitude = (magnitude * divisors->scale[i]) >> 16;
+    quantized[i] = coefs[i] < 0 ? -(int)magnitude : (int)magnitude;
+  }
+#endif
+  for (int k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+    zz[k] = quantized[DE_ZIG_ZAG[k]];
+}
+
+// number of bits of x, 0 for 0
+static inline int bit_length(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return x == 0 ? 0 : 32 - __builtin_clz(x);
+#else
+  int n = 0;
+  for (; x > 0; x >>= 1)
+    n++;
+  return n;
+#endif
+}
+
+// x must not be 0
+static inline int count_trailing_zeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return index;
+#else
+  int n = 0;
+  for (; (x & 1) == 0; x >>= 1)
+    n++;
+  return n;
+#endif
+}
+
+// bit k is set if zz[k] is not 0
+static inline uint64_t nonzero_mask(const int16_t *zz) {
+#ifdef JPEG_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t mask = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(zz + i * 16)), zero);
+    __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(zz + i * 16 + 8)), zero);
+    mask |= (uint64_t)(uint16_t)~_mm_movemask_epi8(_mm_packs_epi16(a, b)) << (i * 16);
+  }
+  return mask;
+#else
+  uint64_t mask = 0;
+  for (int k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++)
+    mask |= (uint64_t)(zz[k] != 0) << k;
+  return mask;
+#endif
+}
+
+// ITU-T.81 F.1.2.3. a 0xFF byte in entropy-coded data is followed by a stuffed 0x00
+static inline void write_word(BitWriter *bw, uint64_t word) {
+  uint64_t inverted = ~word;
+  if (((inverted - 0x0101010101010101) & ~inverted & 0x8080808080808080) == 0) { // no 0xFF byte
+    for (int i = 0; i < 8; i++)
+      bw->ptr[i] = word >> (56 - i * 8);
+    bw->ptr += 8;
+    return;
+  }
+  for (int i = 0; i < 8; i++) {
+    uint8_t byte = word >> (56 - i * 8);
+    *bw->ptr++ = byte;
+    if (byte == 0xFF)
+      *bw->ptr++ = 0;
+  }
+}
+
+// n_bits is at most 32, and value has no bits above them
+static inline void put_bits(BitWriter *bw, uint64_t value, int n_bits) {
+  if (n_bits < bw->n_free) {
+    bw->bits = (bw->bits << n_bits) | value;
+    bw->n_free -= n_bits;
+    return;
+  }
+  n_bits -= bw->n_free;
+  write_word(bw, (bw->bits << bw->n_free) | (value >> n_bits));
+  bw->bits = value; // the bits already written are shifted out later
+  bw->n_free = 64 - n_bits;
+}
+
+// pad the last byte with 1-bits, ITU-T.81 F.1.2.3
+void flush_bits(BitWriter *bw) {
+  int n_bits = 64 - bw->n_free;
+  int n_padding = (8 - n_bits % 8) % 8;
+  uint64_t bits = (bw->bits << n_padding) | ((1u << n_padding) - 1);
+  for (int i = (n_bits + n_padding) / 8 - 1; i >= 0; i--) {
+    uint8_t byte = bits >> (i * 8);
+    *bw->ptr++ = byte;
+    if (byte == 0xFF)
+      *bw->ptr++ = 0;
+  }
+  bw->bits = 0;
+  bw->n_free = 64;
+}
+
+// the code of (run << 4) | SSSS, then the magnitude category SSSS of value and its additional bits. ITU-T.81 F.1.2.1
+static inline void put_value(BitWriter *bw, const HuffmanCode *h, int run, int value) {
+  int size = bit_length(value < 0 ? -value : value);
+  int symbol = (run << 4) | size;
+  uint32_t extra = (value < 0 ? value - 1 : value) & ((1u << size) - 1);
+  put_bits(bw, ((uint64_t)h->codes[symbol] << size) | extra, h->lengths[symbol] + size);
+}
+
+// ITU-T.81 F.1.2. runs of zeros are found with the mask of nonzero coefficients
+static inline void encode_block(BitWriter *bw, const int16_t *zz, int *dc_pred, const HuffmanCode *dc,
+                                const HuffmanCode *ac) {
+  put_value(bw, dc, 0, zz[0] - *dc_pred);
+  *dc_pred = zz[0];
+
+  uint64_t mask = nonzero_mask(zz) >> 1;
+  int k = 1;
+  while (mask != 0) {
+    int run = count_trailing_zeros(mask);
+    k += run;
+    mask >>= run + 1;
+    for (; run > 15; run -= 16)
+      put_bits(bw, ac->codes[ZRL], ac->lengths[ZRL]);
+    put_value(bw, ac, run, zz[k++]);
+  }
+  if (k < BLOCK_SIZE * BLOCK_SIZE)
+    put_bits(bw, ac->codes[EOB], ac->lengths[EOB]);
+}
+
+// encode_block() without output, counting the symbols of each table instead
+static inline void count_block(const int16_t *zz, int *dc_pred, uint32_t *dc_counts, uint32_t *ac_counts) {
+  int diff = zz[0] - *dc_pred;
+  *dc_pred = zz[0];
+  dc_counts[bit_length(diff < 0 ? -diff : diff)]++;
+
+  uint64_t mask = nonzero_mask(zz) >> 1;
+  int k = 1;
+  while (mask != 0) {
+    int run = count_trailing_zeros(mask);
+    k += run;
+    mask >>= run + 1;
+    for (; run > 15; run -= 16)
+      ac_counts[ZRL]++;
+    int value = zz[k++];
+    ac_counts[(run << 4) | bit_length(value < 0 ? -value : value)]++;
+  }
+  if (k < BLOCK_SIZE * BLOCK_SIZE)
+    ac_counts[EOB]++;
+}
+
+// coefs holds the blocks of MCUs [mcu_start, mcu_end). DC predictions are reset at restart intervals
+void count_mcus(Encoder *encoder, const int16_t *coefs, int mcu_start, int mcu_end, int *dc_preds) {
+  for (int mcu = mcu_start; mcu < mcu_end; mcu++) {
+    if (encoder->restart_interval > 0 && mcu % encoder->restart_interval == 0)
+      memset(dc_preds, 0, 3 * sizeof(int));
+    for (int b = 0; b < encoder->blocks_per_mcu; b++) {
+      int c = encoder->block_components[b], t = c > 0 ? 2 : 0;
+      count_block(coefs, &dc_preds[c], encoder->h_counts[t], encoder->h_counts[t + 1]);
+      coefs += BLOCK_SIZE * BLOCK_SIZE;
+    }
+  }
+}
+
+// coefs holds the blocks of MCUs [mcu_start, mcu_end). returns false if the output cannot grow
+bool encode_mcus(Encoder *encoder, BitWriter *bw, const int16_t *coefs, int mcu_start, int mcu_end, int *dc_preds) {
+  size_t mcu_bytes = (size_t)encoder->blocks_per_mcu * MAX_BLOCK_BYTES + 16; // with a RSTn marker
+  for (int mcu = mcu_start; mcu < mcu_end; mcu++) {
+    encoder->size = bw->ptr - encoder->data;
+    if (encoder->size + mcu_bytes > encoder->capacity) {
+      if (!reserve(encoder, mcu_bytes))
+        return false;
+      bw->ptr = encoder->data + encoder->size;
+    }
+
+    // ITU-T.81 F.1.2.3 and B.2.1
+    if (encoder->restart_interval > 0 && mcu > 0 && mcu % encoder->restart_interval == 0) {
+      flush_bits(bw);
+      *bw->ptr++ = 0xFF;
+      *bw->ptr++ = RST0 + (mcu / encoder->restart_interval - 1) % 8;
+      memset(dc_preds, 0, 3 * sizeof(int));
+    }
+
+    for (int b = 0; b < encoder->blocks_per_mcu; b++) {
+      int c = encoder->block_components[b], t = c > 0 ? 2 : 0;
+      encode_block(bw, coefs, &dc_preds[c], &encoder->h_codes[t], &encoder->h_codes[t + 1]);
+      coefs += BLOCK_SIZE * BLOCK_SIZE;
+    }
+  }
+  return true;
+}
+
+// a scan of the scan script. symbols are counted for its Huffman tables when bw is NULL, else coded. ITU-T.81 G.1.2
+typedef struct ScanCoder {
+  Encoder *encoder;
+  const JpegScan *scan;
+  BitWriter *bw;
+  int dc_preds[3];
+  int eobrun;        // blocks of an end-of-band run that is not coded yet. G.1.2.2
+  int n_corrections; // correction bits of AC refinement that go after the code of eobrun. G.1.2.3
+  uint8_t corrections[MAX_CORRECTIONS];
+} ScanCoder;
+
+static inline void emit_symbol(ScanCoder *coder, int table, int symbol) {
+  const HuffmanCode *h = &coder->encoder->h_codes[table];
+  if (coder->bw == NULL)
+    coder->encoder->h_counts[table][symbol]++;
+  else
+    put_bits(coder->bw, h->codes[symbol], h->lengths[symbol]);
+}
+
+// the low n_bits bits of value
+static inline void emit_bits(ScanCoder *coder, uint32_t value, int n_bits) {
+  if (coder->bw != NULL && n_bits > 0)
+    put_bits(coder->bw, value & ((1u << n_bits) - 1), n_bits);
+}
+
+// put_value() of a scan
+static inline void emit_value(ScanCoder *coder, int table, int run, int value) {
+  int size = bit_length(value < 0 ? -value : value);
+  emit_symbol(coder, table, (run << 4) | size);
+  emit_bits(coder, value < 0 ? value - 1 : value, size);
+}
+
+static void emit_corrections(ScanCoder *coder, const uint8_t *bits, int n_bits) {
+  for (int i = 0; i < n_bits; i++)
+    emit_bits(coder, bits[i], 1);
+}
+
+// EOBn, then the correction bits of its blocks. G.1.2.2
+static void emit_eobrun(ScanCoder *coder, int table) {
+  if (coder->eobrun == 0)
+    return;
+  int n_bits = bit_length(coder->eobrun) - 1;
+  emit_symbol(coder, table, n_bits << 4);
+  emit_bits(coder, coder->eobrun, n_bits);
+  emit_corrections(coder, coder->corrections, coder->n_corrections);
+  coder->eobrun = 0;
+  coder->n_corrections = 0;
+}
+
+// G.1.2.1. the DC coefficient without its al lowest bits, rounded down like an arithmetic shift
+static void code_dc_first(ScanCoder *coder, const int16_t *zz, int c) {
+  int value = zz[0] >= 0 ? zz[0] >> coder->scan->al : -((-zz[0] - 1) >> coder->scan->al) - 1;
+  emit_value(coder, c > 0 ? 2 : 0, 0, value - coder->dc_preds[c]);
+  coder->dc_preds[c] = value;
+}
+
+// G.1.2.2. AC coefficients are divided by 2^al, rounding towards zero
+static void code_ac_first(ScanCoder *coder, const int16_t *zz, int table) {
+  const JpegScan *scan = coder->scan;
+  int run = 0;
+  for (int k = scan->ss; k <= scan->se; k++) {
+    int value = zz[k] >= 0 ? zz[k] >> scan->al : -(-zz[k] >> scan->al);
+    if (value == 0) {
+      run++;
+      continue;
+    }
+    emit_eobrun(coder, table);
+    for (; run > 15; run -= 16)
+      emit_symbol(coder, table, ZRL);
+    emit_value(coder, table, run, value);
+    run = 0;
+  }
+  if (run > 0 && ++coder->eobrun == 0x7FFF)
+    emit_eobrun(coder, table);
+}
+
+// G.1.2.3. coefficients that become nonzero at bit al are coded like in code_ac_first(), with a magnitude of 1. those
+// that are already nonzero get their bit al as a correction bit, after the code that skips over them
+static void code_ac_refine(ScanCoder *coder, const int16_t *zz, int table) {
+  const JpegScan *scan = coder->scan;
+  int magnitudes[BLOCK_SIZE * BLOCK_SIZE];
+  int last_new = 0; // the last coefficient that becomes nonzero
+  for (int k = scan->ss; k <= scan->se; k++) {
+    magnitudes[k] = (zz[k] >= 0 ? zz[k] : -zz[k]) >> scan->al;
+    if (magnitudes[k] == 1)
+      last_new = k;
+  }
+
+  // the correction bits of this block wait after those of the blocks of eobrun, until the next code
+  uint8_t *bits = coder->corrections + coder->n_corrections;
+  int n_bits = 0, run = 0;
+  for (int k = scan->ss; k <= scan->se; k++) {
+    if (magnitudes[k] == 0) {
+      run++;
+      continue;
+    }
+    for (; run > 15 && k <= last_new; run -= 16) {
+      emit_eobrun(coder, table);
+      emit_symbol(coder, table, ZRL);
+      emit_corrections(coder, bits, n_bits);
+      bits = coder->corrections;
+      n_bits = 0;
+    }
+    if (magnitudes[k] > 1) {
+      bits[n_bits++] = magnitudes[k] & 1;
+      continue;
+    }
+    emit_eobrun(coder, table);
+    emit_symbol(coder, table, (run << 4) | 1);
+    emit_bits(coder, zz[k] > 0, 1);
+    emit_corrections(coder, bits, n_bits);
+    bits = coder->corrections;
+    n_bits = 0;
+    run = 0;
+  }
+
+  // the rest of the block joins the end-of-band run
+  if (run > 0 || n_bits > 0) {
+    coder->eobrun++;
+    coder->n_corrections += n_bits;
+    if (coder->eobrun == 0x7FFF || coder->n_corrections > MAX_CORRECTIONS - BLOCK_SIZE * BLOCK_SIZE)
+      emit_eobrun(coder, table);
+  }
+}
+
+// the blocks of MCU mcu of a scan, in coding order, and their components. a non-interleaved scan has one block per
+// MCU, in the block grid of its component, which leaves out the padding blocks of partial MCUs. ITU-T.81 A.2
+static int scan_mcu_blocks(const Encoder *encoder, const JpegScan *scan, int mcu, const int16_t **blocks,
+                           int *components) {
+  int n_luma_blocks = encoder->h_sampling * encoder->v_sampling;
+  if (scan->n_components == 1) {
+    int c = scan->components[0];
+    int h_sampling = c == 0 ? encoder->h_sampling : 1, v_sampling = c == 0 ? encoder->v_sampling : 1;
+    int blocks_per_row = CDIV(CDIV(encoder->width * h_sampling, encoder->h_sampling), BLOCK_SIZE);
+    int bx = mcu % blocks_per_row, by = mcu / blocks_per_row;
+    size_t mcu_idx = (size_t)(by / v_sampling) * encoder->nx_mcu + bx / h_sampling;
+    int b = c == 0 ? (by % v_sampling) * h_sampling + bx % h_sampling : n_luma_blocks + c - 1;
+    blocks[0] = encoder->coefs + (mcu_idx * encoder->blocks_per_mcu + b) * BLOCK_SIZE * BLOCK_SIZE;
+    components[0] = c;
+    return 1;
+  }
+
+  int n_blocks = 0;
+  for (int i = 0; i < scan->n_components; i++) {
+    int c = scan->components[i];
+    for (int b = 0; b < encoder->blocks_per_mcu; b++)
+      if (encoder->block_components[b] == c) {
+        blocks[n_blocks] = encoder->coefs + ((size_t)mcu * encoder->blocks_per_mcu + b) * BLOCK_SIZE * BLOCK_SIZE;
+        components[n_blocks++] = c;
+      }
+  }
+  return n_blocks;
+}
+
+// count the symbols of scan when bw is NULL, or code it. returns false if the output cannot grow
+bool code_scan(Encoder *encoder, const JpegScan *scan, BitWriter *bw) {
+  ScanCoder coder = {encoder, scan, bw};
+  int n_mcus = encoder->nx_mcu * encoder->ny_mcu;
+  if (scan->n_components == 1) {
+    int c = scan->components[0];
+    int h_sampling = c == 0 ? encoder->h_sampling : 1, v_sampling = c == 0 ? encoder->v_sampling : 1;
+    n_mcus = CDIV(CDIV(encoder->width * h_sampling, encoder->h_sampling), BLOCK_SIZE) *
+             CDIV(CDIV(encoder->height * v_sampling, encoder->v_sampling), BLOCK_SIZE);
+  }
+  int ac_table = scan->components[0] > 0 ? 3 : 1; // AC scans have one component
+  bool sequential = !encoder->progressive_frame;
+  // with the correction bits of a full end-of-band run, and a RSTn marker
+  size_t mcu_bytes = (size_t)encoder->blocks_per_mcu * MAX_BLOCK_BYTES + 2 * CDIV(32 + MAX_CORRECTIONS, 8) + 16;
+
+  for (int mcu = 0; mcu < n_mcus; mcu++) {
+    if (bw != NULL) {
+      encoder->size = bw->ptr - encoder->data;
+      if (encoder->size + mcu_bytes > encoder->capacity) {
+        if (!reserve(encoder, mcu_bytes))
+          return false;
+        bw->ptr = encoder->data + encoder->size;
+      }
+    }
+
+    // ITU-T.81 F.1.2.3 and B.2.1. an end-of-band run does not go past a restart marker
+    if (encoder->restart_interval > 0 && mcu > 0 && mcu % encoder->restart_interval == 0) {
+      emit_eobrun(&coder, ac_table);
+      if (bw != NULL) {
+        flush_bits(bw);
+        *bw->ptr++ = 0xFF;
+        *bw->ptr++ = RST0 + (mcu / encoder->restart_interval - 1) % 8;
+      }
+      memset(coder.dc_preds, 0, sizeof(coder.dc_preds));
+    }
+
+    const int16_t *blocks[MAX_BLOCKS_IN_MCU];
+    int components[MAX_BLOCKS_IN_MCU];
+    int n_blocks = scan_mcu_blocks(encoder, scan, mcu, blocks, components);
+    for (int b = 0; b < n_blocks; b++) {
+      const int16_t *zz = blocks[b];
+      int c = components[b], t = c > 0 ? 2 : 0;
+      if (sequential && bw == NULL)
+        count_block(zz, &coder.dc_preds[c], encoder->h_counts[t], encoder->h_counts[t + 1]);
+      else if (sequential)
+        encode_block(bw, zz, &coder.dc_preds[c], &encoder->h_codes[t], &encoder->h_codes[t + 1]);
+      else if (scan->ss == 0 && scan->ah == 0)
+        code_dc_first(&coder, zz, c);
+      else if (scan->ss == 0)
+        emit_bits(&coder, (uint32_t)zz[0] >> scan->al, 1); // G.1.2.1, bit al of the two's complement
+      else if (scan->ah == 0)
+        code_ac_first(&coder, zz, ac_table);
+      else
+        code_ac_refine(&coder, zz, ac_table);
+    }
+  }
+  emit_eobrun(&coder, ac_table);
+  return true;
+}
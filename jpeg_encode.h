@@ -0,0 +1,57 @@
+#ifndef JPEG_ENCODE_H
+#define JPEG_ENCODE_H
+#include "jpeg_decode.h" // JpegStatus
+#include <stddef.h>
+#include <stdint.h>
+
+// chroma subsampling of RGB images. grayscale images have a single component
+typedef enum JpegSubsampling {
+  JPEG_SUBSAMPLING_444, // full resolution chroma
+  JPEG_SUBSAMPLING_422, // half width
+  JPEG_SUBSAMPLING_420, // half width and height
+} JpegSubsampling;
+
+// a scan of jpeg_encoder_set_scans(). ITU-T.81 B.2.3 and G.1.1.1
+typedef struct JpegScan {
+  int n_components;  // 1 to 3. several components are interleaved
+  int components[3]; // in increasing order. 0 is Y or gray, 1 is Cb, 2 is Cr
+  int ss, se;        // spectral selection: coefficients ss to se in zig-zag order
+  int ah, al;        // successive approximation: bit position of the previous scan of these coefficients (0 for the
+                     // first one), and of this one
+} JpegScan;
+
+// baseline (SOF0) or progressive (SOF2) encoder. like a decoder, an encoder keeps its scratch memory across images, and
+// different encoders can be used on different threads at the same time
+typedef struct JpegEncoder JpegEncoder;
+
+JpegEncoder *jpeg_encoder_create(); // NULL if out of memory
+void jpeg_encoder_destroy(JpegEncoder *encoder);
+// 1 to 100. the example tables of ITU-T.81 Annex K are scaled like libjpeg does. returns -1 for other values.
+// default is 75
+int jpeg_encoder_set_quality(JpegEncoder *encoder, int quality);
+void jpeg_encoder_set_subsampling(JpegEncoder *encoder, JpegSubsampling subsampling); // default is 4:2:0
+// build Huffman tables from the symbol counts of each image instead of using the example tables of Annex K. files are
+// a few percent smaller, but the whole image is kept as quantized coefficients for a second pass. default is off
+void jpeg_encoder_set_optimize_huffman(JpegEncoder *encoder, int enable);
+// write DRI and a RSTn marker every n_mcus MCUs, so that decoders can decode intervals in parallel or skip them.
+// 0 for none, which is the default. returns -1 if n_mcus is negative or above 65535
+int jpeg_encoder_set_restart_interval(JpegEncoder *encoder, int n_mcus);
+// progressive JPEG, with the scans of libjpeg's jpeg_simple_progression(): DC first, the low and then the high AC
+// coefficients, and a refinement of the lowest bit of each. default is off
+void jpeg_encoder_set_progressive(JpegEncoder *encoder, int enable);
+// code the image in these scans instead, like libjpeg's scan scripts. the image is progressive unless every scan has
+// ss 0, se 63, ah 0 and al 0, and each component is then in one scan. scans are copied, and checked against the image
+// by jpeg_encoder_encode(). with scans, the whole image is kept as quantized coefficients, and each scan gets Huffman
+// tables from its own symbol counts. n_scans 0 goes back to the default. returns -1 if n_scans is negative or above 64
+int jpeg_encoder_set_scans(JpegEncoder *encoder, const JpegScan *scans, int n_scans);
+
+// image is width x height x n_channels bytes, gray (n_channels = 1) or RGB (n_channels = 3). on success, *data is
+// allocated with malloc() and owned by the caller. otherwise *data is NULL
+JpegStatus jpeg_encoder_encode(JpegEncoder *encoder, const uint8_t *image, int width, int height, int n_channels,
+                               uint8_t **data, size_t *size);
+const char *jpeg_encoder_error(const JpegEncoder *encoder); // message of the last failure
+
+// convenience function with a temporary encoder and default settings. returns NULL on failure
+uint8_t *encode_jpeg_mem(const uint8_t *image, int width, int height, int n_channels, int quality, size_t *size);
+
+#endif
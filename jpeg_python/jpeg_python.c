@@ -1,43 +1,418 @@
 // https://docs.python.org/3/extending/extending.html
-#include "jpeg.h"
-#include <stdint.h>
-
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
-static PyObject *jpeg_python_decode_jpeg(PyObject *self, PyObject *args) {
-  char *filename = NULL;
+#include "jpeg_decode.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// like jpeg_decode.c, decode_batch() runs on the calling thread only
+#ifdef _WIN32
+#define JPEG_NO_THREADS
+#endif
+
+#ifndef JPEG_NO_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
+
+// decoded image. owns the pixels, and exports them with the buffer protocol as a (height, width, n_channels) uint8
+// array, so numpy.asarray() and memoryview() do not copy
+typedef struct {
+  PyObject_HEAD
+  uint8_t *data; // from malloc()
+  Py_ssize_t shape[3];
+  Py_ssize_t strides[3];
+  JpegStats stats; // of the decode that produced it
+} ImageObject;
+
+static void image_dealloc(ImageObject *self) {
+  free(self->data);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int image_getbuffer(ImageObject *self, Py_buffer *view, int flags) {
+  Py_ssize_t size = self->shape[0] * self->shape[1] * self->shape[2];
+  if (PyBuffer_FillInfo(view, (PyObject *)self, self->data, size, 0, flags) < 0)
+    return -1;
+  if ((flags & PyBUF_ND) == PyBUF_ND) {
+    view->ndim = 3;
+    view->shape = self->shape;
+  }
+  if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+    view->strides = self->strides;
+  return 0;
+}
+
+static PyObject *image_repr(ImageObject *self) {
+  return PyUnicode_FromFormat("<jpeg_python.Image height=%zd width=%zd channels=%zd>", self->shape[0], self->shape[1],
+                              self->shape[2]);
+}
+
+static PyObject *image_get_shape(ImageObject *self, void *closure) {
+  return Py_BuildValue("(nnn)", self->shape[0], self->shape[1], self->shape[2]);
+}
+
+// name of a marker, e.g. SOF0 or APP1. ITU-T.81 Table B.1
+static void marker_name(int marker, char *name, size_t size) {
+  if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+    snprintf(name, size, "SOF%d", marker - 0xC0);
+  else if (marker >= 0xD0 && marker <= 0xD7)
+    snprintf(name, size, "RST%d", marker - 0xD0);
+  else if (marker >= 0xE0 && marker <= 0xEF)
+    snprintf(name, size, "APP%d", marker - 0xE0);
+  else {
+    static const char *names[] = {[0xC4] = "DHT", [0xC8] = "JPG", [0xCC] = "DAC", [0xD8] = "SOI", [0xD9] = "EOI",
+                                  [0xDA] = "SOS", [0xDB] = "DQT", [0xDC] = "DNL", [0xDD] = "DRI", [0xDE] = "DHP",
+                                  [0xDF] = "EXP", [0xFE] = "COM", [0xFF] = NULL};
+    if (names[marker] != NULL)
+      snprintf(name, size, "%s", names[marker]);
+    else
+      snprintf(name, size, "FF%02X", marker);
+  }
+}
+
+static int set_item(PyObject *dict, const char *key, PyObject *value) {
+  int result = value != NULL ? PyDict_SetItemString(dict, key, value) : -1;
+  Py_XDECREF(value);
+  return result;
+}
+
+// JpegStats as a dict. stage times are 0 unless decoded with timing=True
+static PyObject *image_get_stats(ImageObject *self, void *closure) {
+  const JpegStats *stats = &self->stats;
+  PyObject *dict = PyDict_New(), *markers = PyDict_New();
+  PyObject *idct_blocks = Py_BuildValue("{sKsKsKsK}", "dc", stats->idct_blocks[0], "2x2", stats->idct_blocks[1],
+                                        "4x4", stats->idct_blocks[2], "full", stats->idct_blocks[3]);
+  int failed = dict == NULL || markers == NULL || idct_blocks == NULL;
+  for (int m = 0; !failed && m < 256; m++)
+    if (stats->marker_bytes[m]) {
+      char name[8];
+      marker_name(m, name, sizeof(name));
+      failed = set_item(markers, name, PyLong_FromUnsignedLongLong(stats->marker_bytes[m]));
+    }
+#define STATS_ITEM(field) failed = failed || set_item(dict, #field, PyLong_FromUnsignedLongLong(stats->field));
+  STATS_ITEM(total_ns)
+  STATS_ITEM(huffman_ns)
+  STATS_ITEM(idct_ns)
+  STATS_ITEM(upsample_ns)
+  STATS_ITEM(color_ns)
+  STATS_ITEM(output_ns)
+  STATS_ITEM(scans)
+  STATS_ITEM(restart_markers)
+  STATS_ITEM(parallel_intervals)
+  STATS_ITEM(speculative_chunks)
+  STATS_ITEM(skipped_blocks)
+  STATS_ITEM(huffman_slow_path)
+#undef STATS_ITEM
+  failed = failed || PyDict_SetItemString(dict, "idct_blocks", idct_blocks) ||
+           PyDict_SetItemString(dict, "marker_bytes", markers);
+  Py_XDECREF(idct_blocks);
+  Py_XDECREF(markers);
+  if (failed)
+    Py_CLEAR(dict);
+  return dict;
+}
 
-  if (!PyArg_ParseTuple(args, "s", &filename))
+static PyBufferProcs image_as_buffer = {(getbufferproc)image_getbuffer, NULL};
+
+static PyGetSetDef image_getset[] = {
+    {"shape", (getter)image_get_shape, NULL, "(height, width, n_channels)", NULL},
+    {"stats", (getter)image_get_stats, NULL, "decoder counters and stage times (ns) of this image, as a dict", NULL},
+    {NULL}, // sentinel
+};
+
+static PyTypeObject ImageType = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "jpeg_python.Image",
+    .tp_doc = "Decoded image. Supports the buffer protocol with shape (height, width, n_channels)",
+    .tp_basicsize = sizeof(ImageObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)image_dealloc,
+    .tp_repr = (reprfunc)image_repr,
+    .tp_as_buffer = &image_as_buffer,
+    .tp_getset = image_getset,
+};
+
+// takes ownership of data
+static PyObject *new_image(uint8_t *data, int width, int height, int n_channels, const JpegStats *stats) {
+  ImageObject *image = PyObject_New(ImageObject, &ImageType);
+  if (image == NULL) {
+    free(data);
     return NULL;
+  }
+  image->data = data;
+  image->shape[0] = height;
+  image->shape[1] = width;
+  image->shape[2] = n_channels;
+  image->strides[0] = (Py_ssize_t)width * n_channels;
+  image->strides[1] = n_channels;
+  image->strides[2] = 1;
+  image->stats = *stats;
+  return (PyObject *)image;
+}
+
+// idle decoders, so that their scratch memory is reused across calls. only touched with the GIL held
+#define MAX_IDLE_DECODERS 16
+static JpegDecoder *idle_decoders[MAX_IDLE_DECODERS];
+static int n_idle_decoders = 0;
 
-  FILE *f = fopen(filename, "rb");
-  if (f == NULL) {
-    PyErr_SetString(PyExc_FileNotFoundError, filename);
+static JpegDecoder *get_decoder(int scale, int timing) {
+  JpegDecoder *decoder = n_idle_decoders > 0 ? idle_decoders[--n_idle_decoders] : jpeg_decoder_create();
+  if (decoder == NULL) {
+    PyErr_NoMemory();
     return NULL;
   }
+  if (jpeg_decoder_set_scale(decoder, scale) != 0) {
+    idle_decoders[n_idle_decoders++] = decoder;
+    PyErr_SetString(PyExc_ValueError, "scale must be 1, 2, 4 or 8");
+    return NULL;
+  }
+  jpeg_decoder_set_stats_timing(decoder, timing);
+  return decoder;
+}
+
+static void put_decoder(JpegDecoder *decoder) {
+  if (n_idle_decoders < MAX_IDLE_DECODERS)
+    idle_decoders[n_idle_decoders++] = decoder;
+  else
+    jpeg_decoder_destroy(decoder);
+}
+
+static PyObject *set_decode_error(JpegDecoder *decoder, JpegStatus status) {
+  PyObject *type = status == JPEG_ERROR_IO              ? PyExc_OSError
+                   : status == JPEG_ERROR_OUT_OF_MEMORY ? PyExc_MemoryError
+                                                        : PyExc_ValueError;
+  PyErr_SetString(type, jpeg_decoder_error(decoder));
+  return NULL;
+}
+
+static PyObject *jpeg_python_decode_jpeg(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *keywords[] = {"data", "scale", "timing", NULL};
+  PyObject *source;
+  int scale = 1;
+  int timing = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ip", keywords, &source, &scale, &timing))
+    return NULL;
+
+  JpegDecoder *decoder = get_decoder(scale, timing);
+  if (decoder == NULL)
+    return NULL;
 
   int width, height, n_channels;
-  uint8_t *image = decode_jpeg(f, &width, &height, &n_channels);
+  uint8_t *image;
+  JpegStatus status;
+  if (PyUnicode_Check(source) || PyObject_HasAttrString(source, "__fspath__")) {
+    // path of a file
+    PyObject *filename;
+    if (!PyUnicode_FSConverter(source, &filename)) {
+      put_decoder(decoder);
+      return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS;
+    status = jpeg_decoder_decode_file(decoder, PyBytes_AS_STRING(filename), &image, &width, &height, &n_channels);
+    Py_END_ALLOW_THREADS;
+    Py_DECREF(filename);
+  } else {
+    // bytes, bytearray, memoryview, numpy array...
+    Py_buffer buffer;
+    if (PyObject_GetBuffer(source, &buffer, PyBUF_SIMPLE) < 0) {
+      put_decoder(decoder);
+      return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS;
+    status = jpeg_decoder_decode(decoder, buffer.buf, buffer.len, &image, &width, &height, &n_channels);
+    Py_END_ALLOW_THREADS;
+    PyBuffer_Release(&buffer);
+  }
 
-  if (image == 0) {
-    PyErr_SetString(PyExc_RuntimeError, "Error while decode JPEG");
-    return 0;
+  if (status != JPEG_OK) {
+    set_decode_error(decoder, status);
+    put_decoder(decoder);
+    return NULL;
   }
+  JpegStats stats;
+  jpeg_decoder_get_stats(decoder, &stats);
+  put_decoder(decoder);
+  return new_image(image, width, height, n_channels, &stats);
+}
+
+typedef struct Batch {
+  Py_buffer *buffers;
+  uint8_t **images;
+  int *sizes; // width, height, n_channels of each image
+  JpegStatus *statuses;
+  JpegStats *stats;
+  char **error_messages;  // from strdup() when an image fails
+  JpegDecoder **decoders; // one per thread
+  int n_images;
+#ifndef JPEG_NO_THREADS
+  atomic_int next_image;
+  atomic_int next_thread;
+#endif
+} Batch;
+
+static void decode_batch_image(Batch *batch, JpegDecoder *decoder, int i) {
+  int *sizes = batch->sizes + (size_t)i * 3;
+  batch->statuses[i] = jpeg_decoder_decode(decoder, batch->buffers[i].buf, batch->buffers[i].len, &batch->images[i],
+                                           &sizes[0], &sizes[1], &sizes[2]);
+  if (batch->statuses[i] != JPEG_OK)
+    batch->error_messages[i] = strdup(jpeg_decoder_error(decoder));
+  jpeg_decoder_get_stats(decoder, &batch->stats[i]);
+}
 
-  // TODO: set refcount somehow for image_buffer
-  return PyMemoryView_FromMemory((char *)image, width * height * n_channels, PyBUF_READ);
+#ifndef JPEG_NO_THREADS
+static void *decode_batch_worker(void *arg) {
+  Batch *batch = arg;
+  JpegDecoder *decoder = batch->decoders[atomic_fetch_add(&batch->next_thread, 1)];
+  for (int i; (i = atomic_fetch_add(&batch->next_image, 1)) < batch->n_images;)
+    decode_batch_image(batch, decoder, i);
+  return NULL;
+}
+#endif
+
+// each image is decoded by one thread, with n_threads threads at the same time
+static PyObject *jpeg_python_decode_batch(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *keywords[] = {"data", "n_threads", "scale", "timing", NULL};
+  PyObject *sequence;
+  int n_threads = 0;
+  int scale = 1;
+  int timing = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iip", keywords, &sequence, &n_threads, &scale, &timing))
+    return NULL;
+
+  PyObject *items = PySequence_Fast(sequence, "data must be a sequence of bytes-like objects");
+  if (items == NULL)
+    return NULL;
+  // images are counted with int. each thread takes one past the last image, so there are at most INT_MAX / 2
+  Py_ssize_t n_items = PySequence_Fast_GET_SIZE(items);
+  if (n_items > INT_MAX / 2) {
+    Py_DECREF(items);
+    PyErr_Format(PyExc_ValueError, "data has %zd images, more than %d", n_items, INT_MAX / 2);
+    return NULL;
+  }
+  int n_images = (int)n_items;
+#ifdef JPEG_NO_THREADS
+  n_threads = 1;
+#else
+  if (n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  n_threads = Py_MAX(Py_MIN(n_threads, n_images), 1);
+
+  Batch batch = {0};
+  batch.n_images = n_images;
+  batch.buffers = PyMem_Calloc(n_images, sizeof(Py_buffer));
+  batch.images = PyMem_Calloc(n_images, sizeof(uint8_t *));
+  batch.sizes = PyMem_Calloc((size_t)n_images * 3, sizeof(int));
+  batch.statuses = PyMem_Calloc(n_images, sizeof(JpegStatus));
+  batch.stats = PyMem_Calloc(n_images, sizeof(JpegStats));
+  batch.error_messages = PyMem_Calloc(n_images, sizeof(char *));
+  batch.decoders = PyMem_Calloc(n_threads, sizeof(JpegDecoder *));
+  PyObject *result = NULL;
+  int n_buffers = 0, n_decoders = 0;
+  if (!batch.buffers || !batch.images || !batch.sizes || !batch.statuses || !batch.stats || !batch.error_messages ||
+      !batch.decoders) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+
+  for (; n_buffers < n_images; n_buffers++)
+    if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(items, n_buffers), &batch.buffers[n_buffers], PyBUF_SIMPLE) < 0)
+      goto cleanup;
+  for (; n_decoders < n_threads; n_decoders++)
+    if ((batch.decoders[n_decoders] = get_decoder(scale, timing)) == NULL)
+      goto cleanup;
+
+  Py_BEGIN_ALLOW_THREADS;
+#ifdef JPEG_NO_THREADS
+  for (int i = 0; i < n_images; i++)
+    decode_batch_image(&batch, batch.decoders[0], i);
+#else
+  // the calling thread is one of the n_threads. if no other thread can be started, it decodes the whole batch
+  pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+  int n_created = 0;
+  while (threads != NULL && n_created < n_threads - 1 &&
+         pthread_create(&threads[n_created], NULL, decode_batch_worker, &batch) == 0)
+    n_created++;
+  decode_batch_worker(&batch);
+  for (int i = 0; i < n_created; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+#endif
+  Py_END_ALLOW_THREADS;
+
+  // the first failure is reported
+  for (int i = 0; i < n_images; i++)
+    if (batch.statuses[i] != JPEG_OK) {
+      PyErr_Format(batch.statuses[i] == JPEG_ERROR_OUT_OF_MEMORY ? PyExc_MemoryError : PyExc_ValueError,
+                   "image %d: %s", i, batch.error_messages[i] ? batch.error_messages[i] : "out of memory");
+      goto cleanup;
+    }
+
+  result = PyList_New(n_images);
+  for (int i = 0; result != NULL && i < n_images; i++) {
+    int *sizes = batch.sizes + (size_t)i * 3;
+    PyObject *image = new_image(batch.images[i], sizes[0], sizes[1], sizes[2], &batch.stats[i]);
+    batch.images[i] = NULL; // owned by image now, or freed
+    if (image == NULL)
+      Py_CLEAR(result);
+    else
+      PyList_SET_ITEM(result, i, image);
+  }
+
+cleanup:
+  for (int i = 0; batch.images != NULL && i < n_images; i++)
+    free(batch.images[i]);
+  for (int i = 0; batch.error_messages != NULL && i < n_images; i++)
+    free(batch.error_messages[i]);
+  for (int i = 0; i < n_buffers; i++)
+    PyBuffer_Release(&batch.buffers[i]);
+  for (int i = 0; i < n_decoders; i++)
+    put_decoder(batch.decoders[i]);
+  PyMem_Free(batch.buffers);
+  PyMem_Free(batch.images);
+  PyMem_Free(batch.sizes);
+  PyMem_Free(batch.statuses);
+  PyMem_Free(batch.stats);
+  PyMem_Free(batch.error_messages);
+  PyMem_Free(batch.decoders);
+  Py_DECREF(items);
+  return result;
 }
 
 // method table
 static PyMethodDef JpegPythonMethods[] = {
-    {"decode_jpeg", jpeg_python_decode_jpeg, METH_VARARGS, "decode_jpeg docstring"}, {NULL, NULL, 0, NULL}, // sentinel
+    {"decode_jpeg", (PyCFunction)(void (*)(void))jpeg_python_decode_jpeg, METH_VARARGS | METH_KEYWORDS,
+     "decode_jpeg(data, scale=1, timing=False) -> Image\n\n"
+     "Decode a JPEG from a bytes-like object, or from a file if data is a path. The GIL is released while decoding.\n"
+     "Image.stats has the decoder counters, and with timing=True also the time of each decode stage."},
+    {"decode_batch", (PyCFunction)(void (*)(void))jpeg_python_decode_batch, METH_VARARGS | METH_KEYWORDS,
+     "decode_batch(data, n_threads=0, scale=1, timing=False) -> list[Image]\n\n"
+     "Decode a sequence of bytes-like objects on n_threads threads (<= 0 to use all CPUs), without the GIL.\n"
+     "Raises ValueError for the first image that fails."},
+    {NULL, NULL, 0, NULL}, // sentinel
 };
 
 // module definition
 static struct PyModuleDef jpeg_module = {
-    PyModuleDef_HEAD_INIT, "jpeg_python", "module docstring", -1, JpegPythonMethods,
+    PyModuleDef_HEAD_INIT, "jpeg_python", "Python interface of jpeg.c", -1, JpegPythonMethods,
 };
 
 // module initialization
-PyMODINIT_FUNC PyInit_jpeg_python(void) { return PyModule_Create(&jpeg_module); }
+PyMODINIT_FUNC PyInit_jpeg_python(void) {
+  if (PyType_Ready(&ImageType) < 0)
+    return NULL;
+  PyObject *module = PyModule_Create(&jpeg_module);
+  if (module == NULL)
+    return NULL;
+  Py_INCREF(&ImageType);
+  if (PyModule_AddObject(module, "Image", (PyObject *)&ImageType) < 0) {
+    Py_DECREF(&ImageType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  return module;
+}
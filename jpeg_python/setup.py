@@ -1,21 +1,35 @@
 # https://setuptools.pypa.io/en/latest/userguide/ext_modules.html
 from setuptools import Extension, setup
+from setuptools.command.build_ext import build_ext
 from pathlib import Path
 
 CURRENT_DIR = Path(__file__).parent
 PARENT_DIR = CURRENT_DIR.parent
 
+
+class BuildExt(build_ext):
+    # flags depend on the compiler. MSVC has no -pthread, and the decoder has no threads on Windows anyway
+    def build_extensions(self):
+        if self.compiler.compiler_type == "msvc":
+            compile_args, link_args = ["/O2"], []
+        else:
+            compile_args, link_args = ["-O3", "-pthread"], ["-pthread"]
+        for extension in self.extensions:
+            extension.extra_compile_args = compile_args
+            extension.extra_link_args = link_args
+        super().build_extensions()
+
+
 setup(
     name="jpeg_python",
     version="1.0.0",
-    description="Python interface for the fputs C library function",
-    author="<your name>",
-    author_email="your_email@gmail.com",
+    description="Python interface of jpeg.c, a JPEG decoder",
     ext_modules=[
         Extension(
             name="jpeg_python",
-            sources=[str(PARENT_DIR / "jpeg.c"), str(CURRENT_DIR / "jpeg_python.c")],
+            sources=[str(PARENT_DIR / "jpeg_decode.c"), str(CURRENT_DIR / "jpeg_python.c")],
             include_dirs=[str(PARENT_DIR)],
         )
     ],
+    cmdclass={"build_ext": BuildExt},
 )
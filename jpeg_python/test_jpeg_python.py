@@ -0,0 +1,39 @@
+# smoke test of the Python module on the given JPEG files: python jpeg_python/test_jpeg_python.py a.jpg b.jpg ...
+# `make python` builds the module in place, in the current directory
+import sys
+
+sys.path.insert(0, ".")
+import jpeg_python
+
+
+def check(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    # bytes and a path decode to the same pixels, which the buffer protocol exposes as (height, width, n_channels)
+    image = jpeg_python.decode_jpeg(data)
+    height, width, n_channels = image.shape
+    view = memoryview(image)
+    assert view.shape == (height, width, n_channels), view.shape
+    assert n_channels in (1, 3) and len(view.tobytes()) == height * width * n_channels
+    assert memoryview(jpeg_python.decode_jpeg(path)).tobytes() == view.tobytes()
+
+    # a batch on several threads gives each image the pixels of a decode on its own
+    images = jpeg_python.decode_batch([data, bytearray(data), memoryview(data)] * 3, n_threads=4)
+    assert len(images) == 9
+    assert all(memoryview(other).tobytes() == view.tobytes() for other in images)
+
+    # corrupt data raises ValueError, alone or in a batch
+    for corrupt in [b"", b"not a jpeg", data[:20], data[:2] + b"\xff\xc0" + bytes(20)]:
+        for decode in [jpeg_python.decode_jpeg, lambda d: jpeg_python.decode_batch([data, d], n_threads=2)]:
+            try:
+                decode(corrupt)
+            except ValueError:
+                continue
+            raise AssertionError("corrupt data of %d bytes was decoded" % len(corrupt))
+    print("%s: %dx%dx%d OK" % (path, width, height, n_channels))
+
+
+if __name__ == "__main__":
+    for path in sys.argv[1:]:
+        check(path)
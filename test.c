@@ -55,33 +55,49 @@ int write_tiff(FILE *f, const uint8_t *image, int width, int height, int n_chann
 
 int main(int argc, char *argv[]) {
   if (argc == 1) {
-    fprintf(stderr, "No input\n");
+    fprintf(stderr, "Usage: %s image.jpg [scale] [x y width height]\n", argv[0]);
     return 1;
   }
 
-  FILE *f = fopen(argv[1], "rb");
-  if (f == NULL) {
-    fprintf(stderr, "Failed to open %s\n", argv[1]);
+  JpegDecoder *decoder = jpeg_decoder_create();
+  jpeg_decoder_set_debug_print(decoder, 1);
+  jpeg_decoder_set_stats_timing(decoder, 1);
+  if (argc > 2 && jpeg_decoder_set_scale(decoder, atoi(argv[2])) != 0) {
+    fprintf(stderr, "Scale must be 1, 2, 4 or 8\n");
+    return 1;
+  }
+  if (argc > 6 && jpeg_decoder_set_crop(decoder, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), atoi(argv[6])) != 0) {
+    fprintf(stderr, "Crop position must not be negative\n");
     return 1;
   }
 
-  jpeg_enable_debug_print();
+  JpegInfo info;
+  if (jpeg_probe_file(argv[1], &info) == JPEG_OK)
+    printf("Probed %dx%d, %d components, %s, restart interval %d, orientation %d, %zu header bytes\n", info.width,
+           info.height, info.n_components, info.progressive ? "progressive" : "baseline", info.restart_interval,
+           info.orientation, info.header_size);
 
   int width, height, n_channels;
-  uint8_t *image = decode_jpeg(f, &width, &height, &n_channels);
-  fclose(f);
+  uint8_t *image;
+  JpegStatus status = jpeg_decoder_decode_file(decoder, argv[1], &image, &width, &height, &n_channels);
 
-  if (image == NULL) {
-    fprintf(stderr, "No image\n");
+  if (status != JPEG_OK) {
+    fprintf(stderr, "Failed to decode %s (status %d): %s\n", argv[1], status, jpeg_decoder_error(decoder));
     return 1;
   }
+  JpegStats stats;
+  if (jpeg_decoder_get_stats(decoder, &stats) == 0)
+    printf("Decoded in %.3f ms: huffman %.3f ms, idct %.3f ms, upsample %.3f ms, color %.3f ms, output %.3f ms\n",
+           stats.total_ns * 1e-6, stats.huffman_ns * 1e-6, stats.idct_ns * 1e-6, stats.upsample_ns * 1e-6,
+           stats.color_ns * 1e-6, stats.output_ns * 1e-6);
+  jpeg_decoder_destroy(decoder);
 
   size_t input_length = strlen(argv[1]);
   char *filename = malloc(input_length + 6);
   strcpy(filename, argv[1]);
   strcat(filename, ".tiff");
 
-  f = fopen(filename, "w");
+  FILE *f = fopen(filename, "w");
   if (f == NULL) {
     fprintf(stderr, "Failed to open %s to write", filename);
     return 1;
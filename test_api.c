@@ -0,0 +1,553 @@
+// check the public API end to end: encode images, decode them with each feature, and compare with a plain decode
+#include "jpeg_decode.c"
+#include "jpeg_encode.c"
+
+// random pixels, encoded at the default quality. *data is NULL if encoding fails
+static bool encode_random_image(JpegSubsampling subsampling, int n_channels, int width, int height,
+                                int restart_interval, uint8_t **data, size_t *size) {
+  uint8_t *image = malloc((size_t)width * height * n_channels);
+  for (size_t i = 0; i < (size_t)width * height * n_channels; i++)
+    image[i] = rand() % 256;
+  JpegEncoder *encoder = jpeg_encoder_create();
+  jpeg_encoder_set_subsampling(encoder, subsampling);
+  jpeg_encoder_set_restart_interval(encoder, restart_interval);
+  bool ok = jpeg_encoder_encode(encoder, image, width, height, n_channels, data, size) == JPEG_OK;
+  jpeg_encoder_destroy(encoder);
+  free(image);
+  return ok;
+}
+
+static const char *layout_name(JpegSubsampling subsampling, int n_channels) {
+  return n_channels == 1 ? "gray"
+         : subsampling == JPEG_SUBSAMPLING_444 ? "4:4:4"
+         : subsampling == JPEG_SUBSAMPLING_422 ? "4:2:2"
+                                               : "4:2:0";
+}
+
+// Huffman tables, restart intervals and progressive or non-interleaved scans change the file but not the decoded
+// pixels. the progressive scans have DC with successive approximation, AC first and refinement scans, and
+// non-interleaved chroma. the baseline ones have one scan per component, or luma and Cb together
+static int check_encode(JpegSubsampling subsampling, int n_channels, int width, int height) {
+  // the bottom half has no noise, so that blocks in a row have nothing to refine
+  uint8_t *image = malloc((size_t)width * height * n_channels);
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      for (int c = 0; c < n_channels; c++) {
+        int noise = y < height / 2 ? rand() % 9 - 4 : 0;
+        image[((size_t)y * width + x) * n_channels + c] =
+            CLAMP(128 + 100 * sin(x * 0.05 * (c + 1)) * cos(y * 0.03) + noise, 0, 255);
+      }
+
+  JpegEncoder *encoder = jpeg_encoder_create();
+  JpegDecoder *decoder = jpeg_decoder_create();
+  jpeg_encoder_set_quality(encoder, 90);
+  jpeg_encoder_set_subsampling(encoder, subsampling);
+
+  const JpegScan scans[2][3] = {
+      {{1, {0}, 0, 63, 0, 0}, {1, {1}, 0, 63, 0, 0}, {1, {2}, 0, 63, 0, 0}},
+      {{2, {0, 1}, 0, 63, 0, 0}, {1, {2}, 0, 63, 0, 0}},
+  };
+  uint8_t *first = NULL;
+  double psnr = 0;
+  long n_mismatches = 0, n_eobruns = 0;
+  bool ok = true;
+  for (int variant = 0; variant < 12; variant++) {
+    bool progressive = variant / 4 == 1, mixed = n_channels == 3 && variant & 2;
+    jpeg_encoder_set_optimize_huffman(encoder, variant & 1);
+    jpeg_encoder_set_restart_interval(encoder, variant & 2 ? 3 : 0);
+    jpeg_encoder_set_progressive(encoder, progressive);
+    if (variant >= 8)
+      jpeg_encoder_set_scans(encoder, scans[mixed], mixed ? 2 : n_channels);
+    uint8_t *data, *decoded;
+    size_t size;
+    int out_width, out_height, out_channels;
+    JpegInfo info;
+    if (jpeg_encoder_encode(encoder, image, width, height, n_channels, &data, &size) != JPEG_OK ||
+        jpeg_probe(data, size, &info) != JPEG_OK || info.progressive != progressive ||
+        jpeg_decoder_decode(decoder, data, size, &decoded, &out_width, &out_height, &out_channels) != JPEG_OK ||
+        out_width != width || out_height != height || out_channels != n_channels) {
+      ok = false;
+      free(data);
+      break;
+    }
+    free(data);
+    // the symbols of the last scan, a refinement of luma AC: end-of-band runs of more than one block
+    for (int n_bits = 1; progressive && n_bits < 15; n_bits++)
+      n_eobruns += encoder->h_counts[1][n_bits << 4];
+
+    if (first == NULL) {
+      double squared_error = 0;
+      for (size_t i = 0; i < (size_t)width * height * n_channels; i++)
+        squared_error += (decoded[i] - image[i]) * (decoded[i] - image[i]);
+      psnr = 10 * log10(255.0 * 255.0 * width * height * n_channels / MAX(squared_error, 1));
+      first = decoded;
+    } else {
+      n_mismatches += memcmp(first, decoded, (size_t)width * height * n_channels) != 0;
+      free(decoded);
+    }
+  }
+
+  ok = ok && psnr > 35 && n_mismatches == 0 && n_eobruns > 0;
+  printf("encode    %dx%d %s, psnr = %.2f dB, mismatches between variants = %ld, EOB runs in refinement = %ld %s\n",
+         width, height, layout_name(subsampling, n_channels), psnr, n_mismatches, n_eobruns, ok ? "OK" : "FAILED");
+  free(first);
+  free(image);
+  jpeg_encoder_destroy(encoder);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// the IDCT of exported coefficients gives the decoded image, for grayscale where there is no color conversion
+static int check_coefficients(JpegSubsampling subsampling, int n_channels, int width, int height) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  uint8_t *data, *decoded = NULL;
+  size_t size;
+  int out_width, out_height, out_channels;
+  JpegCoefficients coefficients;
+  bool ok = encode_random_image(subsampling, n_channels, width, height, 0, &data, &size) &&
+            jpeg_decoder_decode(decoder, data, size, &decoded, &out_width, &out_height, &out_channels) == JPEG_OK &&
+            jpeg_decoder_decode_coefficients(decoder, data, size, &coefficients) == JPEG_OK;
+
+  long n_mismatches = 0;
+  int h_sampling = n_channels == 1 || subsampling == JPEG_SUBSAMPLING_444 ? 1 : 2;
+  int v_sampling = subsampling == JPEG_SUBSAMPLING_420 && n_channels == 3 ? 2 : 1;
+  for (int c = 0; ok && c < n_channels; c++) {
+    const JpegComponentCoefficients *component = &coefficients.components[c];
+    int x_factor = c == 0 ? 1 : h_sampling, y_factor = c == 0 ? 1 : v_sampling;
+    ok = coefficients.width == width && coefficients.height == height && coefficients.n_components == n_channels &&
+         component->width == CDIV(width, x_factor) && component->height == CDIV(height, y_factor) &&
+         component->blocks_per_row == CDIV(width, BLOCK_SIZE * h_sampling) * h_sampling / x_factor &&
+         component->blocks_per_column == CDIV(height, BLOCK_SIZE * v_sampling) * v_sampling / y_factor &&
+         component->x_sampling == (c == 0 ? h_sampling : 1) && component->y_sampling == (c == 0 ? v_sampling : 1) &&
+         component->q_table[0] == (c == 0 ? 8 : 9); // K.1 and K.2 at quality 75
+  }
+  for (int by = 0; ok && n_channels == 1 && by < coefficients.components[0].blocks_per_column; by++)
+    for (int bx = 0; bx < coefficients.components[0].blocks_per_row; bx++) {
+      const JpegComponentCoefficients *component = &coefficients.components[0];
+      uint8_t out[BLOCK_SIZE * BLOCK_SIZE];
+      idct_block_scalar(component->coefs + ((size_t)by * component->blocks_per_row + bx) * BLOCK_SIZE * BLOCK_SIZE,
+                        component->q_table, out, BLOCK_SIZE);
+      for (int y = 0; y < BLOCK_SIZE && by * BLOCK_SIZE + y < height; y++)
+        for (int x = 0; x < BLOCK_SIZE && bx * BLOCK_SIZE + x < width; x++)
+          n_mismatches += out[y * BLOCK_SIZE + x] != decoded[(by * BLOCK_SIZE + y) * width + bx * BLOCK_SIZE + x];
+    }
+
+  ok = ok && n_mismatches == 0;
+  printf("coefs     %dx%d %s, mismatches vs decoded = %ld %s\n", width, height, layout_name(subsampling, n_channels),
+         n_mismatches, ok ? "OK" : "FAILED");
+  free(data);
+  free(decoded);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// other pixel formats are the native output rearranged. rows are padded to check the stride. the Y plane of planar
+// output is the same as luma-only output, and the query for buffer sizes fails without writing anything
+static int check_formats(JpegSubsampling subsampling, int n_channels, int width, int height) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  uint8_t *data, *decoded = NULL;
+  size_t size;
+  int out_width, out_height, out_channels;
+  bool ok = encode_random_image(subsampling, n_channels, width, height, 0, &data, &size) &&
+            jpeg_decoder_decode(decoder, data, size, &decoded, &out_width, &out_height, &out_channels) == JPEG_OK;
+
+  long n_mismatches = 0;
+  int padding = 5;
+  uint8_t *luma = malloc((size_t)width * height);
+  for (int format = JPEG_PIXEL_RGB; ok && format <= JPEG_PIXEL_YCBCR_PLANAR; format++) {
+    JpegOutput output = {format};
+    ok = jpeg_decoder_decode_to(decoder, data, size, &output) == JPEG_ERROR_BUFFER_TOO_SMALL &&
+         output.n_planes == (format == JPEG_PIXEL_YCBCR_PLANAR ? n_channels : 1);
+    bool bgr = format == JPEG_PIXEL_BGR || format == JPEG_PIXEL_BGRA;
+    int pixel_size = format == JPEG_PIXEL_GRAY || format == JPEG_PIXEL_YCBCR_PLANAR ? 1 : 3;
+    if (format == JPEG_PIXEL_RGBA || format == JPEG_PIXEL_BGRA)
+      pixel_size = 4;
+    for (int i = 0; ok && i < output.n_planes; i++) {
+      output.strides[i] = output.widths[i] * pixel_size + padding;
+      output.sizes[i] = (size_t)output.strides[i] * output.heights[i];
+      output.planes[i] = malloc(output.sizes[i]);
+      memset(output.planes[i], 0xAA, output.sizes[i]);
+    }
+    ok = ok && jpeg_decoder_decode_to(decoder, data, size, &output) == JPEG_OK && output.widths[0] == width &&
+         output.heights[0] == height;
+
+    for (int y = 0; ok && y < height; y++)
+      for (int x = 0; x < width; x++) {
+        const uint8_t *expected = decoded + ((size_t)y * width + x) * n_channels;
+        const uint8_t *pixel = output.planes[0] + (size_t)y * output.strides[0] + x * pixel_size;
+        if (format == JPEG_PIXEL_GRAY) {
+          luma[y * width + x] = pixel[0];
+          n_mismatches += n_channels == 1 && pixel[0] != expected[0];
+        } else if (format == JPEG_PIXEL_YCBCR_PLANAR) {
+          n_mismatches += pixel[0] != luma[y * width + x];
+        } else {
+          const uint8_t *g = expected + (n_channels == 3), *b = expected + (n_channels == 3) * 2;
+          n_mismatches += pixel[bgr ? 2 : 0] != expected[0] || pixel[1] != *g || pixel[bgr ? 0 : 2] != *b;
+          n_mismatches += pixel_size == 4 && pixel[3] != 255;
+        }
+      }
+    for (int i = 0; ok && i < output.n_planes; i++) {
+      if (format == JPEG_PIXEL_YCBCR_PLANAR && i > 0)
+        ok = output.widths[i] == CDIV(width, subsampling == JPEG_SUBSAMPLING_444 ? 1 : 2) &&
+             output.heights[i] == CDIV(height, subsampling == JPEG_SUBSAMPLING_420 ? 2 : 1);
+      for (int y = 0; y < output.heights[i]; y++)
+        for (int x = output.widths[i] * pixel_size; x < output.strides[i]; x++)
+          n_mismatches += output.planes[i][(size_t)y * output.strides[i] + x] != 0xAA;
+    }
+    for (int i = 0; i < output.n_planes; i++)
+      free(output.planes[i]);
+  }
+
+  ok = ok && n_mismatches == 0;
+  printf("formats   %dx%d %s, mismatches vs native = %ld %s\n", width, height, layout_name(subsampling, n_channels),
+         n_mismatches, ok ? "OK" : "FAILED");
+  free(luma);
+  free(data);
+  free(decoded);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// probe the header of an encoded image, with and without an Exif orientation, and decode into buffers of the sizes
+// jpeg_probe_output() returns. other SOFn than baseline and progressive fail the same way in both
+static int check_probe(JpegSubsampling subsampling, int n_channels, int width, int height, int restart_interval) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  uint8_t *data;
+  size_t size;
+  JpegInfo info;
+  int scale = 2;
+  bool ok = encode_random_image(subsampling, n_channels, width, height, restart_interval, &data, &size) &&
+            jpeg_probe(data, size, &info) == JPEG_OK;
+  ok = ok && info.width == width && info.height == height && info.n_components == n_channels && !info.progressive &&
+       info.restart_interval == restart_interval && info.orientation == 1 && data[info.header_size] == 0xFF &&
+       data[info.header_size + 1] == SOS;
+  ok = ok && jpeg_probe(data, info.header_size + 1, &info) == JPEG_ERROR_TRUNCATED &&
+       jpeg_probe(data, size, &info) == JPEG_OK;
+
+  jpeg_decoder_set_scale(decoder, scale);
+  for (int format = JPEG_PIXEL_RGB; ok && format <= JPEG_PIXEL_YCBCR_PLANAR; format++) {
+    JpegOutput output = {format};
+    ok = jpeg_probe_output(&info, scale, &output) > 0;
+    for (int i = 0; ok && i < output.n_planes; i++)
+      output.planes[i] = malloc(output.sizes[i]);
+    ok = ok && jpeg_decoder_decode_to(decoder, data, size, &output) == JPEG_OK;
+    output.sizes[output.n_planes - 1]--;
+    ok = ok && jpeg_decoder_decode_to(decoder, data, size, &output) == JPEG_ERROR_BUFFER_TOO_SMALL;
+    for (int i = 0; i < output.n_planes; i++)
+      free(output.planes[i]);
+  }
+
+  // APP1 right after SOI, with one IFD0 entry: orientation (0x0112), SHORT, count 1, value 6
+  static const uint8_t EXIF_MM[] = {0xFF, 0xE1, 0, 34,  'E', 'x', 'i', 'f', 0, 0, 'M', 'M', 0, 42, 0, 0, 0, 8,
+                                    0,    1,    1, 0x12, 0, 3,   0,   0,   0, 1, 0,   6,   0, 0,  0, 0, 0, 0};
+  static const uint8_t EXIF_II[] = {0xFF, 0xE1, 0, 34, 'E', 'x', 'i', 'f', 0, 0, 'I', 'I', 42, 0, 8, 0, 0, 0,
+                                    1,    0,    0x12, 1, 3, 0,   1,   0,   0, 0, 6,   0,   0,  0, 0, 0, 0, 0};
+  // IFD0 offset 0xFFFFFFFE, which wraps around in 32-bit bounds checks. the orientation is ignored
+  static const uint8_t EXIF_WRAP[] = {0xFF, 0xE1, 0,    34, 'E', 'x', 'i', 'f', 0, 0, 'M', 'M',
+                                      0,    42,   0xFF, 0xFF, 0xFF, 0xFE, 0, 1, 1, 0x12, 0, 3,
+                                      0,    0,    0,    1,  0,   6,   0,   0,   0, 0, 0,   0};
+  const uint8_t *exifs[] = {EXIF_MM, EXIF_II, EXIF_WRAP};
+  for (int i = 0; ok && i < 3; i++) {
+    const uint8_t *exif = exifs[i];
+    uint8_t *spliced = malloc(size + sizeof(EXIF_MM));
+    memcpy(spliced, data, 2);
+    memcpy(spliced + 2, exif, sizeof(EXIF_MM));
+    memcpy(spliced + 2 + sizeof(EXIF_MM), data + 2, size - 2);
+    JpegInfo exif_info;
+    ok = jpeg_probe(spliced, size + sizeof(EXIF_MM), &exif_info) == JPEG_OK &&
+         exif_info.orientation == (i < 2 ? 6 : 1) && exif_info.header_size == info.header_size + sizeof(EXIF_MM);
+    free(spliced);
+  }
+
+  // probe and decode agree on the other SOFn: extended sequential, lossless, hierarchical and arithmetic
+  uint8_t *sof = data + 2;
+  while (ok && sof + 4 < data + info.header_size && sof[1] != SOF0)
+    sof += 2 + read_be_16(sof + 2);
+  ok = ok && sof[1] == SOF0;
+  for (int marker = SOF1; ok && marker <= SOF15; marker++) {
+    if (marker == SOF2 || marker == DHT || marker == JPG || marker == DAC)
+      continue;
+    uint8_t *decoded = NULL;
+    int out_width, out_height, out_channels;
+    sof[1] = marker;
+    ok = jpeg_probe(data, size, &info) == JPEG_ERROR_UNSUPPORTED &&
+         jpeg_decoder_decode(decoder, data, size, &decoded, &out_width, &out_height, &out_channels) ==
+             JPEG_ERROR_UNSUPPORTED;
+    sof[1] = SOF0;
+    free(decoded);
+  }
+
+  printf("probe     %dx%d %s, restart interval %d %s\n", width, height, layout_name(subsampling, n_channels),
+         restart_interval, ok ? "OK" : "FAILED");
+  free(data);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// crops with a seek index must match crops without one, and skip fewer blocks. an index of another image is ignored
+static int check_index(JpegSubsampling subsampling, int n_channels, int width, int height, int restart_interval) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  uint8_t *data, *index = NULL;
+  size_t size, index_size = 0;
+  bool ok = encode_random_image(subsampling, n_channels, width, height, restart_interval, &data, &size) &&
+            jpeg_decoder_build_index(decoder, data, size, 5, &index, &index_size) == JPEG_OK;
+
+  const int crops[][5] = {
+      {1, 0, 0, 16, 16}, {1, 37, 21, 40, 30}, {1, width - 10, height - 10, 10, 10}, {1, 5, height / 2, width, 3},
+      {2, 11, 13, 20, 17},
+  };
+  long n_mismatches = 0;
+  uint64_t n_skipped = 0, n_indexed_skipped = 0;
+  for (int i = 0; ok && i < (int)(sizeof(crops) / sizeof(crops[0])); i++) {
+    const int *crop = crops[i];
+    jpeg_decoder_set_scale(decoder, crop[0]);
+    jpeg_decoder_set_crop(decoder, crop[1], crop[2], crop[3], crop[4]);
+    uint8_t *expected, *decoded, *ignored;
+    int out_width, out_height, out_channels;
+    JpegStats stats, indexed_stats;
+    jpeg_decoder_set_index(decoder, NULL, 0);
+    ok = jpeg_decoder_decode(decoder, data, size, &expected, &out_width, &out_height, &out_channels) == JPEG_OK;
+    jpeg_decoder_get_stats(decoder, &stats);
+    jpeg_decoder_set_index(decoder, index, index_size);
+    ok = ok && jpeg_decoder_decode(decoder, data, size, &decoded, &out_width, &out_height, &out_channels) == JPEG_OK;
+    jpeg_decoder_get_stats(decoder, &indexed_stats);
+    index[32] ^= 1; // hash of the headers
+    ok = ok && jpeg_decoder_decode(decoder, data, size, &ignored, &out_width, &out_height, &out_channels) == JPEG_OK;
+    index[32] ^= 1;
+    n_skipped += stats.skipped_blocks;
+    n_indexed_skipped += indexed_stats.skipped_blocks;
+    for (size_t j = 0; ok && j < (size_t)out_width * out_height * out_channels; j++)
+      n_mismatches += decoded[j] != expected[j] || ignored[j] != expected[j];
+    if (ok) {
+      free(expected);
+      free(decoded);
+      free(ignored);
+    }
+  }
+
+  ok = ok && n_mismatches == 0 && n_indexed_skipped < n_skipped;
+  printf("index     %dx%d %s, restart interval %d, %zu bytes, skipped blocks %lu -> %lu, mismatches = %ld %s\n", width,
+         height, layout_name(subsampling, n_channels), restart_interval, index_size, (unsigned long)n_skipped,
+         (unsigned long)n_indexed_skipped, n_mismatches, ok ? "OK" : "FAILED");
+  free(index);
+  free(data);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// without restart markers, decoding with 2 threads pipelines entropy decoding and the rest, and speculative decoding
+// splits the scan into chunks. with them, the restart intervals are decoded on all threads. the output must be the same
+// as with 1 thread, for scaling, cropping and other pixel formats too, and the stats must show that the intervals or
+// the chunks were decoded on the threads, not serially after a fallback
+static int check_threads(JpegSubsampling subsampling, int n_channels, int width, int height, int restart_interval) {
+  JpegDecoder *decoder = jpeg_decoder_create();
+  uint8_t *data;
+  size_t size;
+  bool ok = encode_random_image(subsampling, n_channels, width, height, restart_interval, &data, &size);
+
+  // scale, crop x, y, width, height, pixel format
+  const int settings[][6] = {
+      {1, 0, 0, 0, 0, JPEG_PIXEL_NATIVE}, {2, 0, 0, 0, 0, JPEG_PIXEL_NATIVE},
+      {1, 19, 33, 50, 70, JPEG_PIXEL_NATIVE}, {4, 3, 21, 9, 9, JPEG_PIXEL_NATIVE},
+      {1, 0, 0, 0, 0, JPEG_PIXEL_BGRA}, {1, 0, 0, 0, 0, JPEG_PIXEL_GRAY},
+      {1, 0, 0, 0, 0, JPEG_PIXEL_YCBCR_PLANAR},
+  };
+  long n_mismatches = 0, n_serial = 0;
+  for (int i = 0; ok && i < (int)(sizeof(settings) / sizeof(settings[0])); i++) {
+    const int *setting = settings[i];
+    jpeg_decoder_set_scale(decoder, setting[0]);
+    jpeg_decoder_set_crop(decoder, setting[1], setting[2], setting[3], setting[4]);
+    uint8_t *outputs[3][3] = {{NULL}};
+    for (int mode = 0; ok && mode < 3; mode++) { // 1 thread, pipelined, speculative
+      jpeg_decoder_set_num_threads(decoder, mode == 0 ? 1 : mode * 2);
+      jpeg_decoder_set_speculative(decoder, mode == 2);
+      JpegOutput output = {setting[5]};
+      ok = jpeg_decoder_decode_to(decoder, data, size, &output) == JPEG_ERROR_BUFFER_TOO_SMALL;
+      for (int j = 0; ok && j < output.n_planes; j++) { // 4 bytes per pixel at most
+        output.sizes[j] = (size_t)output.widths[j] * output.heights[j] * 4;
+        output.planes[j] = outputs[mode][j] = calloc(output.sizes[j], 1);
+      }
+      ok = ok && jpeg_decoder_decode_to(decoder, data, size, &output) == JPEG_OK;
+      for (int j = 0; ok && mode > 0 && j < output.n_planes; j++)
+        n_mismatches += memcmp(outputs[0][j], outputs[mode][j], output.sizes[j]) != 0;
+      JpegStats stats;
+      jpeg_decoder_get_stats(decoder, &stats);
+      uint64_t n_parallel = restart_interval ? stats.parallel_intervals : stats.speculative_chunks;
+      n_serial += ok && (restart_interval ? mode > 0 : mode == 2) && n_parallel == 0;
+    }
+    for (int j = 0; j < 9; j++)
+      free(outputs[j / 3][j % 3]);
+  }
+
+  ok = ok && n_mismatches == 0 && n_serial == 0;
+  printf("threads   %dx%d %s, restart interval %d, %zu bytes, mismatches vs 1 thread = %ld, serial = %ld %s\n", width,
+         height, layout_name(subsampling, n_channels), restart_interval, size, n_mismatches, n_serial,
+         ok ? "OK" : "FAILED");
+  free(data);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// speculative chunks start at arbitrary bytes, so mostly inside an MCU. on a tinted image no DC predictor is 0 there,
+// and each chunk must be decoded from the predictors that the chunks before it add up to
+static int check_speculative(JpegSubsampling subsampling, int width, int height) {
+  uint8_t *image = malloc((size_t)width * height * 3);
+  for (size_t i = 0; i < (size_t)width * height * 3; i++)
+    image[i] = (i % 3 == 0 ? 200 : i % 3 == 1 ? 90 : 40) + rand() % 41 - 20;
+  JpegEncoder *encoder = jpeg_encoder_create();
+  JpegDecoder *decoder = jpeg_decoder_create();
+  jpeg_encoder_set_subsampling(encoder, subsampling);
+  uint8_t *data, *outputs[2] = {NULL, NULL};
+  size_t size;
+  int out_width, out_height, out_channels;
+  JpegInfo info;
+  bool ok = jpeg_encoder_encode(encoder, image, width, height, 3, &data, &size) == JPEG_OK &&
+            jpeg_probe(data, size, &info) == JPEG_OK &&
+            jpeg_decoder_decode(decoder, data, size, &outputs[0], &out_width, &out_height, &out_channels) == JPEG_OK;
+
+  // walk the MCUs with the tables of that decode, and find the ones that the chunk boundaries of
+  // decode_scan_speculative() fall in
+  int n_threads = 4, n_chunks = 0;
+  long n_inside = 0; // boundaries inside an MCU, followed by an MCU with a nonzero DC predictor
+  if (ok) {
+    const uint8_t *payload = data + info.header_size + 4;
+    const uint8_t *scan = payload + read_be_16(data + info.header_size + 2) - 2;
+    size_t scan_size = data + size - 2 - scan; // up to EOI
+    n_chunks = MIN((size_t)n_threads * 4, scan_size / SPECULATIVE_MIN_CHUNK);
+    BitReader br = {scan, data + size};
+    int dc_preds[MAX_COMPONENTS] = {0};
+    uint64_t position = 0;
+    for (int i = 1; i < n_chunks; position = bit_position(&br, scan)) {
+      size_t start = scan_size * i / n_chunks;
+      uint64_t boundary = (start + (scan[start - 1] == 0xFF)) * 8;
+      skip_mcu(decoder, payload, &br, dc_preds);
+      if (bit_position(&br, scan) > boundary) {
+        n_inside += position < boundary && (dc_preds[0] || dc_preds[1] || dc_preds[2]);
+        i++;
+      }
+    }
+  }
+
+  jpeg_decoder_set_num_threads(decoder, n_threads);
+  jpeg_decoder_set_speculative(decoder, 1);
+  JpegStats stats = {0};
+  ok = ok && jpeg_decoder_decode(decoder, data, size, &outputs[1], &out_width, &out_height, &out_channels) == JPEG_OK &&
+       jpeg_decoder_get_stats(decoder, &stats) == 0;
+  long n_mismatches = ok && memcmp(outputs[0], outputs[1], (size_t)width * height * 3) != 0;
+  ok = ok && n_chunks >= 2 && n_inside > 0 && stats.speculative_chunks == (uint64_t)n_chunks && n_mismatches == 0;
+  printf("chunks    %dx%d %s, %d chunks, %ld start inside an MCU, %lu on threads, mismatches vs 1 thread = %ld %s\n",
+         width, height, layout_name(subsampling, 3), n_chunks, n_inside, (unsigned long)stats.speculative_chunks,
+         n_mismatches, ok ? "OK" : "FAILED");
+  free(outputs[0]);
+  free(outputs[1]);
+  free(data);
+  free(image);
+  jpeg_encoder_destroy(encoder);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+// a batch of images of all kinds, with cut ones and one whose buffer is too small, decoded 3 times by the same pool.
+// the 1280x832 one is split into tasks. each item must get the status and pixels of a decode on its own
+static int check_batch(int n_threads) {
+  // subsampling, channels, width, height, restart interval
+  const int images[][5] = {
+      {JPEG_SUBSAMPLING_444, 1, 203, 157, 0},
+      {JPEG_SUBSAMPLING_420, 3, 403, 301, 0},
+      {JPEG_SUBSAMPLING_422, 3, 77, 45, 5},
+      {JPEG_SUBSAMPLING_420, 3, 1280, 832, 8},
+  };
+  enum { N_IMAGES = sizeof(images) / sizeof(images[0]), N_ITEMS = 3 * N_IMAGES };
+  uint8_t *data[N_IMAGES] = {NULL};
+  size_t sizes[N_IMAGES];
+  bool ok = true;
+  for (int i = 0; ok && i < N_IMAGES; i++) {
+    const int *image = images[i];
+    ok = encode_random_image(image[0], image[1], image[2], image[3], image[4], &data[i], &sizes[i]);
+  }
+
+  // each image twice, then each image cut short
+  JpegBatchItem items[N_ITEMS] = {{0}};
+  JpegStatus expected_status[N_ITEMS];
+  uint8_t *expected[N_ITEMS] = {NULL};
+  JpegDecoder *decoder = jpeg_decoder_create();
+  for (int i = 0; ok && i < N_ITEMS; i++) {
+    int k = i % N_IMAGES;
+    JpegInfo info;
+    items[i].data = data[k];
+    items[i].size = i < 2 * N_IMAGES ? sizes[k] : sizes[k] / 2;
+    items[i].output.format = JPEG_PIXEL_NATIVE;
+    jpeg_probe(data[k], sizes[k], &info);
+    size_t n_bytes = jpeg_probe_output(&info, 1, &items[i].output);
+    if (i == 1)
+      items[i].output.sizes[0]--;
+    items[i].output.planes[0] = calloc(n_bytes, 1);
+    expected[i] = calloc(n_bytes, 1);
+    JpegOutput output = items[i].output;
+    output.planes[0] = expected[i];
+    expected_status[i] = jpeg_decoder_decode_to(decoder, items[i].data, items[i].size, &output);
+  }
+
+  JpegDecoderPool *pool = jpeg_decoder_pool_create(n_threads);
+  int n_failed = 0;
+  long n_mismatches = 0;
+  for (int run = 0; ok && run < 3; run++) {
+    for (int i = 0; i < N_ITEMS; i++)
+      memset(items[i].output.planes[0], 0, items[i].output.sizes[0]);
+    n_failed = jpeg_decode_batch(pool, items, N_ITEMS);
+    for (int i = 0; i < N_ITEMS; i++)
+      n_mismatches += items[i].status != expected_status[i] ||
+                      (items[i].status == JPEG_OK) == (items[i].error_message[0] != 0) ||
+                      memcmp(items[i].output.planes[0], expected[i], items[i].output.sizes[0]) != 0;
+  }
+
+  // the cut images fail, and so does the short buffer
+  ok = ok && n_mismatches == 0 && n_failed == N_IMAGES + 1;
+  printf("batch     %d items, %d threads, %d failed, mismatches vs 1 decoder = %ld %s\n", N_ITEMS,
+         jpeg_decoder_pool_num_threads(pool), n_failed, n_mismatches, ok ? "OK" : "FAILED");
+  for (int i = 0; i < N_ITEMS; i++) {
+    free(items[i].output.planes[0]);
+    free(expected[i]);
+  }
+  for (int i = 0; i < N_IMAGES; i++)
+    free(data[i]);
+  jpeg_decoder_pool_destroy(pool);
+  jpeg_decoder_destroy(decoder);
+  return !ok;
+}
+
+int main() {
+  int n_failed = 0;
+  n_failed += check_encode(JPEG_SUBSAMPLING_420, 1, 77, 45);
+  n_failed += check_encode(JPEG_SUBSAMPLING_444, 3, 77, 45);
+  n_failed += check_encode(JPEG_SUBSAMPLING_422, 3, 77, 45);
+  n_failed += check_encode(JPEG_SUBSAMPLING_420, 3, 77, 45);
+  n_failed += check_encode(JPEG_SUBSAMPLING_420, 3, 65, 33); // partial MCUs, left out of non-interleaved scans
+
+  n_failed += check_coefficients(JPEG_SUBSAMPLING_444, 1, 77, 45);
+  n_failed += check_coefficients(JPEG_SUBSAMPLING_422, 3, 77, 45);
+  n_failed += check_coefficients(JPEG_SUBSAMPLING_420, 3, 77, 45);
+
+  n_failed += check_formats(JPEG_SUBSAMPLING_444, 1, 77, 45);
+  n_failed += check_formats(JPEG_SUBSAMPLING_444, 3, 77, 45);
+  n_failed += check_formats(JPEG_SUBSAMPLING_420, 3, 77, 45);
+
+  n_failed += check_probe(JPEG_SUBSAMPLING_444, 1, 77, 45, 0);
+  n_failed += check_probe(JPEG_SUBSAMPLING_420, 3, 77, 45, 3);
+
+  n_failed += check_index(JPEG_SUBSAMPLING_444, 1, 203, 157, 0);
+  n_failed += check_index(JPEG_SUBSAMPLING_420, 3, 203, 157, 0);
+  n_failed += check_index(JPEG_SUBSAMPLING_422, 3, 203, 157, 7);
+
+  n_failed += check_threads(JPEG_SUBSAMPLING_444, 1, 403, 301, 0);
+  n_failed += check_threads(JPEG_SUBSAMPLING_420, 3, 403, 301, 0);
+  n_failed += check_threads(JPEG_SUBSAMPLING_422, 3, 403, 301, 0);
+  n_failed += check_threads(JPEG_SUBSAMPLING_444, 1, 403, 301, 64); // 51x38 MCUs
+  n_failed += check_threads(JPEG_SUBSAMPLING_420, 3, 403, 301, 7);  // 26x19 MCUs
+  n_failed += check_threads(JPEG_SUBSAMPLING_422, 3, 403, 301, 26); // one per MCU row
+  n_failed += check_speculative(JPEG_SUBSAMPLING_420, 800, 600);
+  n_failed += check_speculative(JPEG_SUBSAMPLING_444, 800, 600);
+
+  n_failed += check_batch(4);
+  return n_failed != 0;
+}
@@ -0,0 +1,290 @@
+// check the integer IDCT and FDCT kernels and quantization against a double-precision reference. the API is checked
+// by test_api.c
+#include "jpeg_decode.c"
+#include "jpeg_encode.c"
+
+static const double DCT_TABLE[] = {
+    0.5000000000000000,  0.4903926402016152,  0.4619397662556434,  0.4157348061512726,  //
+    0.3535533905932738,  0.2777851165098011,  0.1913417161825449,  0.0975451610080642,  //
+    0.0000000000000000,  -0.0975451610080641, -0.1913417161825449, -0.2777851165098010, //
+    -0.3535533905932737, -0.4157348061512727, -0.4619397662556434, -0.4903926402016152, //
+    -0.5000000000000000, -0.4903926402016152, -0.4619397662556434, -0.4157348061512726, //
+    -0.3535533905932738, -0.2777851165098011, -0.1913417161825449, -0.0975451610080642, //
+    -0.0000000000000000, 0.0975451610080641,  0.1913417161825449,  0.2777851165098010,  //
+    0.3535533905932737,  0.4157348061512727,  0.4619397662556434,  0.4903926402016152,  //
+};
+
+static void idct_1d(double *x, double *out, size_t offset, size_t stride) {
+  for (int k = 0; k < BLOCK_SIZE; k++) {
+    double result = x[offset] * 0.3535533905932738; // 1/sqrt(8)
+    for (int n = 1; n < BLOCK_SIZE; n++)
+      result += x[offset + n * stride] * DCT_TABLE[((2 * k + 1) * n) % 32];
+    out[offset + k * stride] = result;
+  }
+}
+
+static void idct_2d_(double *x) {
+  double temp[BLOCK_SIZE][BLOCK_SIZE];
+  for (int i = 0; i < BLOCK_SIZE; i++)
+    idct_1d(x, (double *)temp, i * BLOCK_SIZE, 1); // row-wise
+  for (int j = 0; j < BLOCK_SIZE; j++)
+    idct_1d((double *)temp, x, j, BLOCK_SIZE); // column-wise
+}
+
+// transpose of idct_1d()
+static void fdct_1d(double *x, double *out, size_t offset, size_t stride) {
+  for (int n = 0; n < BLOCK_SIZE; n++) {
+    double result = 0;
+    for (int k = 0; k < BLOCK_SIZE; k++)
+      result += x[offset + k * stride] * (n == 0 ? 0.3535533905932738 : DCT_TABLE[((2 * k + 1) * n) % 32]);
+    out[offset + n * stride] = result;
+  }
+}
+
+static void fdct_2d_(double *x) {
+  double temp[BLOCK_SIZE][BLOCK_SIZE];
+  for (int i = 0; i < BLOCK_SIZE; i++)
+    fdct_1d(x, (double *)temp, i * BLOCK_SIZE, 1);
+  for (int j = 0; j < BLOCK_SIZE; j++)
+    fdct_1d((double *)temp, x, j, BLOCK_SIZE);
+}
+
+// ITU-T.81 Table K.1
+static const uint16_t LUMA_Q_TABLE[BLOCK_SIZE * BLOCK_SIZE] = {
+    16, 11, 10, 16,  24,  40,  51,  61, //
+    12, 12, 14, 19,  26,  58,  60,  55, //
+    14, 13, 16, 24,  40,  57,  69,  56, //
+    14, 17, 22, 29,  51,  87,  80,  62, //
+    18, 22, 37, 56,  68, 109, 103,  77, //
+    24, 35, 55, 64,  81, 104, 113,  92, //
+    49, 64, 78, 87, 103, 121, 120, 101, //
+    72, 92, 95, 98, 112, 100, 103,  99, //
+};
+
+// random pixels in [lo, hi] -> quantized coefficients, similar to IEEE 1180 test data.
+// only the top-left sparse_size x sparse_size coefficients are kept
+static void random_block(int16_t *coefs, const uint16_t *q_table, int lo, int hi, int sparse_size) {
+  double x[BLOCK_SIZE * BLOCK_SIZE];
+  for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    x[i] = lo + rand() % (hi - lo + 1);
+  fdct_2d_(x);
+  for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    coefs[i] = i / BLOCK_SIZE < sparse_size && i % BLOCK_SIZE < sparse_size ? round(x[i] / q_table[i]) : 0;
+}
+
+static int check(const char *name, IDCTFunction idct, int sparse_size, const uint16_t *q_table, int lo, int hi) {
+  const int n_blocks = 10000;
+  int max_error = 0;
+  long total_error = 0, n_mismatches = 0;
+
+  srand(1234);
+  for (int b = 0; b < n_blocks; b++) {
+    int16_t coefs[BLOCK_SIZE * BLOCK_SIZE];
+    random_block(coefs, q_table, lo, hi, sparse_size);
+
+    double ref[BLOCK_SIZE * BLOCK_SIZE];
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+      ref[i] = coefs[i] * q_table[i];
+    idct_2d_(ref);
+
+    uint8_t out[BLOCK_SIZE * BLOCK_SIZE], expected[BLOCK_SIZE * BLOCK_SIZE];
+    idct(coefs, q_table, out, BLOCK_SIZE);
+    idct_block_scalar(coefs, q_table, expected, BLOCK_SIZE);
+
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++) {
+      // ties are exact for DC-only blocks. the kernels round them up
+      int error = abs(out[i] - (int)CLAMP(floor(ref[i] + 0.5 + 1e-9) + 128, 0, 255));
+      max_error = MAX(max_error, error);
+      total_error += error;
+      n_mismatches += out[i] != expected[i];
+    }
+  }
+
+  double mean_error = (double)total_error / (n_blocks * BLOCK_SIZE * BLOCK_SIZE);
+  bool ok = max_error <= 1 && mean_error < 0.05 && n_mismatches == 0;
+  printf("%-9s range [%4d, %3d] q=%-5s max error = %d, mean error = %.4f, mismatches vs scalar = %ld %s\n", name, lo,
+         hi, q_table == LUMA_Q_TABLE ? "K.1" : "1", max_error, mean_error, n_mismatches, ok ? "OK" : "FAILED");
+  return !ok;
+}
+
+// reduced IDCTs sample the 8x8 IDCT at the centers of pixel groups, using the lowest size x size coefficients
+static int check_scaled(const char *name, IDCTFunction idct, int size, int sparse_size, const uint16_t *q_table, int lo,
+                        int hi) {
+  const int n_blocks = 10000;
+  int step = BLOCK_SIZE / size;
+  int max_error = 0;
+  long total_error = 0;
+
+  srand(1234);
+  for (int b = 0; b < n_blocks; b++) {
+    int16_t coefs[BLOCK_SIZE * BLOCK_SIZE];
+    random_block(coefs, q_table, lo, hi, sparse_size);
+
+    uint8_t out[BLOCK_SIZE * BLOCK_SIZE];
+    idct(coefs, q_table, out, BLOCK_SIZE);
+
+    for (int y = 0; y < size; y++)
+      for (int x = 0; x < size; x++) {
+        double ref = 0;
+        for (int v = 0; v < size; v++)
+          for (int u = 0; u < size; u++) {
+            double cu = u == 0 ? 0.3535533905932738 : DCT_TABLE[((2 * x + 1) * step * u) % 32];
+            double cv = v == 0 ? 0.3535533905932738 : DCT_TABLE[((2 * y + 1) * step * v) % 32];
+            ref += coefs[v * BLOCK_SIZE + u] * q_table[v * BLOCK_SIZE + u] * cu * cv;
+          }
+        // 2x2 and 1x1 are exact, so ties are common. the kernels round them up
+        int error = abs(out[y * BLOCK_SIZE + x] - (int)CLAMP(floor(ref + 0.5 + 1e-9) + 128, 0, 255));
+        max_error = MAX(max_error, error);
+        total_error += error;
+      }
+  }
+
+  double mean_error = (double)total_error / (n_blocks * size * size);
+  bool ok = max_error <= 1 && mean_error < 0.05;
+  printf("%-9s range [%4d, %3d] q=%-5s max error = %d, mean error = %.4f %s\n", name, lo, hi,
+         q_table == LUMA_Q_TABLE ? "K.1" : "1", max_error, mean_error, ok ? "OK" : "FAILED");
+  return !ok;
+}
+
+// DC-only kernels must give the same samples as the kernel they replace, for every DC value
+static int check_dc(const char *name, IDCTFunction idct, IDCTFunction expected_idct, int size) {
+  long n_mismatches = 0;
+  for (int q = 1; q <= 16; q += 15)
+    for (int dc = -2048; dc < 2048; dc++) {
+      int16_t coefs[BLOCK_SIZE * BLOCK_SIZE] = {dc / q};
+      uint16_t q_table[BLOCK_SIZE * BLOCK_SIZE] = {q};
+      uint8_t out[BLOCK_SIZE * BLOCK_SIZE], expected[BLOCK_SIZE * BLOCK_SIZE];
+      idct(coefs, q_table, out, BLOCK_SIZE);
+      expected_idct(coefs, q_table, expected, BLOCK_SIZE);
+      for (int j = 0; j < size; j++)
+        n_mismatches += memcmp(out + j * BLOCK_SIZE, expected + j * BLOCK_SIZE, size) != 0;
+    }
+
+  printf("%-9s all DC values, mismatches = %ld %s\n", name, n_mismatches, n_mismatches == 0 ? "OK" : "FAILED");
+  return n_mismatches != 0;
+}
+
+// the FDCT kernels output 8 times the coefficients
+static int check_fdct(const char *name, FDCTFunction fdct, int lo, int hi) {
+  const int n_blocks = 10000;
+  double max_error = 0, total_error = 0;
+  long n_mismatches = 0;
+
+  srand(1234);
+  for (int b = 0; b < n_blocks; b++) {
+    uint8_t pixels[BLOCK_SIZE * BLOCK_SIZE];
+    double ref[BLOCK_SIZE * BLOCK_SIZE];
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++) {
+      pixels[i] = lo + rand() % (hi - lo + 1);
+      ref[i] = pixels[i] - 128;
+    }
+    fdct_2d_(ref);
+
+    int16_t out[BLOCK_SIZE * BLOCK_SIZE], expected[BLOCK_SIZE * BLOCK_SIZE];
+    fdct(pixels, BLOCK_SIZE, out);
+    fdct_block_scalar(pixels, BLOCK_SIZE, expected);
+
+    for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++) {
+      double error = fabs(out[i] / 8.0 - ref[i]);
+      max_error = MAX(max_error, error);
+      total_error += error;
+      n_mismatches += out[i] != expected[i];
+    }
+  }
+
+  double mean_error = total_error / (n_blocks * BLOCK_SIZE * BLOCK_SIZE);
+  bool ok = max_error <= 0.25 && mean_error < 0.05 && n_mismatches == 0;
+  printf("%-9s range [%4d, %3d]         max error = %.3f, mean error = %.4f, mismatches vs scalar = %ld %s\n", name,
+         lo, hi, max_error, mean_error, n_mismatches, ok ? "OK" : "FAILED");
+  return !ok;
+}
+
+// quantize_block() must round x / (8 * q) to the nearest, halves away from 0, for every q and FDCT output x
+static int check_quantize() {
+  long n_mismatches = 0;
+  for (int q = 1; q <= 255; q++) {
+    uint8_t q_table[BLOCK_SIZE * BLOCK_SIZE];
+    memset(q_table, q, sizeof(q_table));
+    Divisors divisors;
+    set_divisors(&divisors, q_table);
+
+    for (int x0 = -32767; x0 <= 32767; x0 += BLOCK_SIZE * BLOCK_SIZE) {
+      int16_t coefs[BLOCK_SIZE * BLOCK_SIZE], zz[BLOCK_SIZE * BLOCK_SIZE];
+      for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+        coefs[i] = MIN(x0 + i, 32767);
+      quantize_block(coefs, &divisors, zz);
+      for (int k = 0; k < BLOCK_SIZE * BLOCK_SIZE; k++) {
+        int x = coefs[DE_ZIG_ZAG[k]];
+        int expected = (abs(x) + q * 4) / (q * 8);
+        n_mismatches += zz[k] != (x < 0 ? -expected : expected);
+      }
+    }
+  }
+
+  printf("quantize  all coefficients and q, mismatches = %ld %s\n", n_mismatches, n_mismatches == 0 ? "OK" : "FAILED");
+  return n_mismatches != 0;
+}
+
+int main() {
+  uint16_t unit_q_table[BLOCK_SIZE * BLOCK_SIZE];
+  for (int i = 0; i < BLOCK_SIZE * BLOCK_SIZE; i++)
+    unit_q_table[i] = 1;
+
+  // sparse kernels get blocks with coefficients in the top-left sparse_size x sparse_size
+  bool avx2 = false;
+#ifdef JPEG_AVX2
+  avx2 = __builtin_cpu_supports("avx2");
+#endif
+  struct {
+    const char *name;
+    IDCTFunction idct;
+    int sparse_size;
+  } kernels[] = {
+      {"scalar", idct_block_scalar, 8},
+      {"dc", idct_block_dc, 1},
+      {"2x2", idct_block_sparse_2x2, 2},
+      {"4x4", idct_block_sparse_4x4, 4},
+#ifdef JPEG_SSE2
+      {"sse2", idct_block_sse2, 8},
+      {"sse2 2x2", idct_block_sse2_2x2, 2},
+      {"sse2 4x4", idct_block_sse2_4x4, 4},
+#endif
+#ifdef JPEG_AVX2
+      {"avx2", avx2 ? idct_block_avx2 : NULL, 8},
+      {"avx2 2x2", avx2 ? idct_block_avx2_2x2 : NULL, 2},
+      {"avx2 4x4", avx2 ? idct_block_avx2_4x4 : NULL, 4},
+#endif
+  };
+
+  int n_failed = 0;
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (kernels[k].idct == NULL) {
+      printf("%-9s not supported by this CPU\n", kernels[k].name);
+      continue;
+    }
+    int sparse_size = kernels[k].sparse_size;
+    n_failed += check(kernels[k].name, kernels[k].idct, sparse_size, unit_q_table, -256, 255);
+    n_failed += check(kernels[k].name, kernels[k].idct, sparse_size, unit_q_table, -5, 5);
+    n_failed += check(kernels[k].name, kernels[k].idct, sparse_size, LUMA_Q_TABLE, -128, 127);
+  }
+
+  n_failed += check_scaled("4x4", idct_block_4x4, 4, 8, unit_q_table, -256, 255);
+  n_failed += check_scaled("4x4", idct_block_4x4, 4, 8, LUMA_Q_TABLE, -128, 127);
+  n_failed += check_scaled("2x2", idct_block_2x2, 2, 8, unit_q_table, -256, 255);
+  n_failed += check_scaled("2x2", idct_block_2x2, 2, 8, LUMA_Q_TABLE, -128, 127);
+  n_failed += check_scaled("1x1", idct_block_1x1, 1, 8, unit_q_table, -256, 255);
+  n_failed += check_scaled("1x1", idct_block_1x1, 1, 8, LUMA_Q_TABLE, -128, 127);
+
+  n_failed += check_dc("dc", idct_block_dc, idct_block_scalar, 8);
+  n_failed += check_dc("4x4 dc", idct_block_4x4_dc, idct_block_4x4, 4);
+
+  FDCTFunction fdct;
+  select_fdct(&fdct);
+  n_failed += check_fdct("fdct", fdct_block_scalar, 0, 255);
+  if (fdct != fdct_block_scalar) {
+    n_failed += check_fdct("fdct simd", fdct, 0, 255);
+    n_failed += check_fdct("fdct simd", fdct, 123, 133);
+  }
+  n_failed += check_quantize();
+  return n_failed != 0;
+}